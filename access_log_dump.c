@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accesslog.h"
+
+/* main
+ *
+ * Print a binary access log of the proxy as text, one line per record:
+ * time client pid outcome status header_len bytes_in bytes_out first_byte duration request
+ *
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ */
+int main(int argc, char *argv[])
+{
+        if(argc != 2)
+        {
+                printf("Usage: %s <access log>\n", argv[0]);
+                return 1;
+        }
+
+        FILE *file = (strcmp(argv[1], "-") == 0) ? stdin : fopen(argv[1], "rb");
+        if(file == NULL)
+        {
+                perror(argv[1]);
+                return 1;
+        }
+
+        int retval = 0;
+        AccessLogFileHeader header;
+        if((fread(&header, sizeof(header), 1, file) != 1) || (header.magic != ACCESS_LOG_MAGIC))
+        {
+                fprintf(stderr, "ERROR: %s is no access log\n", argv[1]);
+                retval = 1;
+                goto end;
+        }
+        if(header.version != ACCESS_LOG_VERSION)
+        {
+                fprintf(stderr, "ERROR: Unsupported access log version %u\n", header.version);
+                retval = 1;
+                goto end;
+        }
+
+        AccessLogEntry entry;
+        char text[ACCESS_LOG_MAX_TEXT];
+
+        while(fread(&entry, sizeof(entry), 1, file) == 1)
+        {
+                if((entry.text_len > ACCESS_LOG_MAX_TEXT) ||
+                   (fread(text, 1, entry.text_len, file) != entry.text_len))
+                {
+                        fprintf(stderr, "ERROR: Truncated or corrupt record\n");
+                        retval = 1;
+                        goto end;
+                }
+
+                formatAccessLogEntry(stdout, &entry, text);
+        }
+
+end:
+        if(file != stdin)
+        {
+                fclose(file);
+        }
+        return retval;
+}
@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "accesslog.h"
+#include "bench_client.h"
+
+// Longest request header sent, like the header limit of the proxy
+#define REPLAY_MAX_HEADER 8192
+
+// Approximate size of a response header of the origin stub as forwarded by the proxy
+#define REPLAY_RESPONSE_HEADER_SIZE 80
+
+// Size of the response of the proxy to a CONNECT request
+#define REPLAY_TUNNEL_RESPONSE_SIZE 39
+
+// A request sent this much after its scheduled time is counted as late
+#define REPLAY_LATE_NS 10000000ull
+
+// Header field used to bring requests up to their recorded header length
+#define REPLAY_PADDING_FIELD "X-Replay-Padding: "
+
+
+/* ReplayResult
+ *
+ * Result of a replayed request
+ *
+ * REPLAY_PENDING -> Not finished yet
+ * REPLAY_OK      -> Response received
+ * REPLAY_BLOCKED -> Response redirected or cut off by the content filter
+ * REPLAY_ERROR   -> Request failed
+ */
+typedef enum _replay_result_
+{
+  REPLAY_PENDING,
+  REPLAY_OK,
+  REPLAY_BLOCKED,
+  REPLAY_ERROR
+} ReplayResult;
+
+
+/* ReplayConfig struct
+ *
+ * Settings of a replay, filled in from the commandline
+ *
+ * proxy_host    -> Host of the proxy
+ * proxy_port    -> Port of the proxy
+ * origin        -> host:port of the origin stub (bench_origin) all requests go to
+ * speed         -> Factor the recorded timing is sped up by (2 replays twice as fast)
+ * max_in_flight -> Maximum number of requests in flight, later requests wait for a slot
+ * proxy_pid     -> Process id of the proxy for CPU accounting, 0 to skip it
+ */
+typedef struct _replay_config_
+{
+  const char *proxy_host;
+  const char *proxy_port;
+  const char *origin;
+  double speed;
+  unsigned int max_in_flight;
+  long proxy_pid;
+} ReplayConfig;
+
+
+/* ReplayRequest struct
+ *
+ * Request of the trace and the result of replaying it
+ *
+ * time_ns          -> Wall clock time the request was recorded at
+ * method           -> Request method
+ * tunnel           -> Send the request through a CONNECT tunnel
+ * blocked_request  -> The request was blocked by the content filter
+ * blocked_response -> The response was blocked by the content filter
+ * header_len       -> Recorded length of the request header
+ * body_size        -> Estimated size of the response body
+ * delay_ms         -> Time the origin waits before it responds
+ * result           -> ReplayResult of the replay
+ * status           -> Status code of the replayed response
+ * latency_ns       -> Latency of the replayed request
+ * bytes            -> Response body bytes received
+ */
+typedef struct _replay_request_
+{
+  uint64_t time_ns;
+  char method[16];
+  int tunnel;
+  int blocked_request;
+  int blocked_response;
+  uint32_t header_len;
+  uint64_t body_size;
+  unsigned int delay_ms;
+  ReplayResult result;
+  int status;
+  uint64_t latency_ns;
+  uint64_t bytes;
+} ReplayRequest;
+
+
+static ReplayConfig replay_config;
+
+// Free slots for requests in flight
+static sem_t replay_slots;
+
+
+/* isReplayable
+ *
+ * Check if a recorded session can be reproduced against the origin stub. Sessions that
+ * failed before reaching a server or were refused by the blocklist are not replayed.
+ *
+ * @param outcome AccessOutcome of the session
+ * @ret True if the session is replayed
+ */
+static int isReplayable(uint8_t outcome)
+{
+        return (outcome == ACCESS_FORWARDED) || (outcome == ACCESS_TUNNEL) ||
+               (outcome == ACCESS_BLOCKED_REQUEST) || (outcome == ACCESS_BLOCKED_RESPONSE);
+}
+
+
+/* compareRequestTimes
+ *
+ * qsort comparison of the recorded times of two requests
+ */
+static int compareRequestTimes(const void *a, const void *b)
+{
+        uint64_t x = ((const ReplayRequest *)a)->time_ns;
+        uint64_t y = ((const ReplayRequest *)b)->time_ns;
+        return (x > y) - (x < y);
+}
+
+
+/* loadTrace
+ *
+ * Read the replayable sessions of an access log, sorted by the time they were recorded at
+ *
+ * @param path Path of the access log
+ * @ret requests_ret Allocated list of requests
+ * @ret num_requests_ret Number of requests
+ * @ret num_skipped_ret Number of sessions that are not replayed
+ * @ret 0 on success, -1 if the file could not be read
+ */
+static int loadTrace(const char *path, ReplayRequest **requests_ret, size_t *num_requests_ret,
+                     size_t *num_skipped_ret)
+{
+        FILE *file = fopen(path, "rb");
+        if(file == NULL)
+        {
+                perror(path);
+                return -1;
+        }
+
+        ReplayRequest *requests = NULL;
+        size_t num_requests = 0;
+        size_t max_requests = 0;
+        size_t num_skipped = 0;
+
+        AccessLogFileHeader header;
+        if((fread(&header, sizeof(header), 1, file) != 1) || (header.magic != ACCESS_LOG_MAGIC) ||
+           (header.version != ACCESS_LOG_VERSION))
+        {
+                fprintf(stderr, "ERROR: %s is no access log of version %u\n", path, ACCESS_LOG_VERSION);
+                goto error;
+        }
+
+        AccessLogEntry entry;
+        char text[ACCESS_LOG_MAX_TEXT + 1];
+
+        while(fread(&entry, sizeof(entry), 1, file) == 1)
+        {
+                if((entry.text_len > ACCESS_LOG_MAX_TEXT) ||
+                   (fread(text, 1, entry.text_len, file) != entry.text_len))
+                {
+                        fprintf(stderr, "ERROR: Truncated or corrupt record\n");
+                        goto error;
+                }
+                text[entry.text_len] = '\0';
+
+                if(!isReplayable(entry.outcome) || (entry.text_len == 0))
+                {
+                        ++num_skipped;
+                        continue;
+                }
+
+                if(num_requests == max_requests)
+                {
+                        max_requests = (max_requests != 0) ? 2 * max_requests : 1024;
+                        ReplayRequest *new_requests = realloc(requests, max_requests * sizeof(ReplayRequest));
+                        if(new_requests == NULL)
+                        {
+                                fprintf(stderr, "ERROR: Out of memory\n");
+                                goto error;
+                        }
+                        requests = new_requests;
+                }
+
+                ReplayRequest *request = requests + num_requests++;
+                memset(request, 0, sizeof(ReplayRequest));
+                request->time_ns = entry.time_ns;
+                sscanf(text, "%15s", request->method);
+                request->tunnel = (entry.outcome == ACCESS_TUNNEL);
+                request->blocked_request = (entry.outcome == ACCESS_BLOCKED_REQUEST);
+                request->blocked_response = (entry.outcome == ACCESS_BLOCKED_RESPONSE);
+                request->header_len = entry.header_len;
+                request->delay_ms = entry.first_byte_ns / 1000000 / replay_config.speed;
+
+                uint64_t overhead = REPLAY_RESPONSE_HEADER_SIZE +
+                                    (request->tunnel ? REPLAY_TUNNEL_RESPONSE_SIZE : 0);
+                request->body_size = (entry.bytes_out > overhead) ? entry.bytes_out - overhead : 0;
+        }
+
+        fclose(file);
+
+        if(num_requests != 0)
+        {
+                qsort(requests, num_requests, sizeof(ReplayRequest), compareRequestTimes);
+        }
+
+        *requests_ret = requests;
+        *num_requests_ret = num_requests;
+        *num_skipped_ret = num_skipped;
+        return 0;
+
+error:
+        free(requests);
+        fclose(file);
+        return -1;
+}
+
+
+/* buildRequest
+ *
+ * Build the request header for a replayed request. The origin stub is asked for a body of the
+ * recorded size and delay, and the header is padded to its recorded length.
+ *
+ * @param request Request to build the header for
+ * @param buffer Buffer of REPLAY_MAX_HEADER bytes
+ * @ret Length of the header
+ */
+static size_t buildRequest(const ReplayRequest *request, char *buffer)
+{
+        char path[256];
+        snprintf(path, sizeof(path), "/object?size=%lu&delay=%u%s%s", request->body_size, request->delay_ms,
+                 request->blocked_response ? "&blocked=1" : "",
+                 request->blocked_request ? "&q=spongebob" : "");
+
+        int len;
+        if(request->tunnel)
+        {
+                len = snprintf(buffer, REPLAY_MAX_HEADER, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n",
+                               path, replay_config.origin);
+        }
+        else
+        {
+                len = snprintf(buffer, REPLAY_MAX_HEADER, "%s http://%s%s HTTP/1.1\r\nHost: %s\r\n"
+                               "Connection: close\r\n", request->method, replay_config.origin, path,
+                               replay_config.origin);
+        }
+
+        // The recorded header length of a tunnel is the one of the CONNECT request
+        size_t padding_overhead = strlen(REPLAY_PADDING_FIELD) + 4;
+        size_t header_len = (request->header_len < REPLAY_MAX_HEADER) ? request->header_len : REPLAY_MAX_HEADER;
+        if(!request->tunnel && (len + padding_overhead < header_len))
+        {
+                size_t padding_len = header_len - len - padding_overhead;
+                memcpy(buffer + len, REPLAY_PADDING_FIELD, strlen(REPLAY_PADDING_FIELD));
+                len += strlen(REPLAY_PADDING_FIELD);
+                memset(buffer + len, 'x', padding_len);
+                len += padding_len;
+                memcpy(buffer + len, "\r\n", 2);
+                len += 2;
+        }
+
+        memcpy(buffer + len, "\r\n", 2);
+        return len + 2;
+}
+
+
+/* replayRequest
+ *
+ * Send one request of the trace through the proxy and read its response
+ *
+ * @param arg ReplayRequest to send
+ */
+static void* replayRequest(void *arg)
+{
+        ReplayRequest *request = (ReplayRequest *)arg;
+        BenchConnection *conn = malloc(sizeof(BenchConnection));
+        char *header = malloc(REPLAY_MAX_HEADER + 2);
+
+        request->result = REPLAY_ERROR;
+        if((conn == NULL) || (header == NULL))
+        {
+                goto end;
+        }
+
+        uint64_t start_ns = benchNowNs();
+        if(connectBenchProxy(conn, replay_config.proxy_host, replay_config.proxy_port,
+                             request->tunnel ? replay_config.origin : NULL) != 0)
+        {
+                goto end;
+        }
+
+        size_t header_len = buildRequest(request, header);
+        int keep_open = 0;
+        ssize_t body_len = -1;
+        if(send(conn->fd, header, header_len, MSG_NOSIGNAL) == (ssize_t)header_len)
+        {
+                body_len = readBenchResponse(conn, &(request->status), &keep_open);
+        }
+        closeBenchConnection(conn);
+
+        if(body_len < 0)
+        {
+                // With early headers a blocked response is cut off with a reset
+                request->result = (request->status == 200) ? REPLAY_BLOCKED : REPLAY_ERROR;
+        }
+        else
+        {
+                request->result = (request->status == 301) ? REPLAY_BLOCKED : REPLAY_OK;
+                request->bytes = body_len;
+                request->latency_ns = benchNowNs() - start_ns;
+        }
+
+end:
+        free(header);
+        free(conn);
+        sem_post(&replay_slots);
+        return NULL;
+}
+
+
+/* sleepUntil
+ *
+ * Sleep until a time of the monotonic clock
+ *
+ * @param time_ns Time to wake up at
+ */
+static void sleepUntil(uint64_t time_ns)
+{
+        struct timespec wake_time;
+        wake_time.tv_sec = time_ns / 1000000000ull;
+        wake_time.tv_nsec = time_ns % 1000000000ull;
+
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, NULL) == EINTR)
+        {
+        }
+}
+
+
+/* printUsage
+ *
+ * Print the commandline usage of the replay tool
+ *
+ * @param program Name of the executable
+ */
+static void printUsage(const char *program)
+{
+        printf("Usage: %s [options] <access log> <proxy host> <proxy port> <origin host:port>\n", program);
+        printf("  -s, --speed=FACTOR      Replay faster (2) or slower (0.5) than recorded (default 1)\n");
+        printf("  -c, --concurrency=N     Maximum number of requests in flight (default 256)\n");
+        printf("  -P, --proxy-pid=PID     Report CPU time of the proxy per request\n");
+        printf("  -n, --name=NAME         Name of the replay in the result line\n");
+}
+
+
+/* main
+ *
+ * Replay the traffic recorded in an access log of the proxy (-l) through a proxy against the
+ * origin stub bench_origin. Every replayable session is sent at its recorded time, scaled by
+ * the speed factor, with its recorded method, header length, response size, server delay,
+ * CONNECT tunnel and filter outcome. Prints the same report and result line as bench_load.
+ *
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ */
+int main(int argc, char *argv[])
+{
+        static const struct option long_options[] =
+                {
+                        {"speed",       required_argument, NULL, 's'},
+                        {"concurrency", required_argument, NULL, 'c'},
+                        {"proxy-pid",   required_argument, NULL, 'P'},
+                        {"name",        required_argument, NULL, 'n'},
+                        {NULL,          0,                 NULL, 0}
+                };
+
+        const char *name = "replay";
+        replay_config.speed = 1.0;
+        replay_config.max_in_flight = 256;
+        replay_config.proxy_pid = 0;
+
+        int opt;
+        while((opt = getopt_long(argc, argv, "s:c:P:n:", long_options, NULL)) != -1)
+        {
+                switch(opt)
+                {
+                case 's':
+                        replay_config.speed = strtod(optarg, NULL);
+                        break;
+                case 'c':
+                        replay_config.max_in_flight = strtoul(optarg, NULL, 10);
+                        break;
+                case 'P':
+                        replay_config.proxy_pid = strtol(optarg, NULL, 10);
+                        break;
+                case 'n':
+                        name = optarg;
+                        break;
+                default:
+                        printUsage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if((argc - optind != 4) || (replay_config.speed <= 0) || (replay_config.max_in_flight == 0))
+        {
+                printUsage(argv[0]);
+                return 1;
+        }
+        replay_config.proxy_host = argv[optind + 1];
+        replay_config.proxy_port = argv[optind + 2];
+        replay_config.origin = argv[optind + 3];
+
+        ReplayRequest *requests = NULL;
+        size_t num_requests = 0;
+        size_t num_skipped = 0;
+        if(loadTrace(argv[optind], &requests, &num_requests, &num_skipped) != 0)
+        {
+                return 1;
+        }
+        if(num_requests == 0)
+        {
+                fprintf(stderr, "ERROR: No replayable requests in %s\n", argv[optind]);
+                free(requests);
+                return 1;
+        }
+
+        sem_init(&replay_slots, 0, replay_config.max_in_flight);
+
+        uint64_t cpu_start = (replay_config.proxy_pid != 0) ? processCpuTicks(replay_config.proxy_pid) : 0;
+        uint64_t start_ns = benchNowNs();
+        uint64_t late = 0;
+
+        for(size_t i = 0; i < num_requests; ++i)
+        {
+                uint64_t send_ns = start_ns + (requests[i].time_ns - requests[0].time_ns) / replay_config.speed;
+                sleepUntil(send_ns);
+                sem_wait(&replay_slots);
+                if(benchNowNs() > send_ns + REPLAY_LATE_NS)
+                {
+                        ++late;
+                }
+
+                pthread_t thread_id;
+                if(pthread_create(&thread_id, NULL, replayRequest, requests + i) != 0)
+                {
+                        requests[i].result = REPLAY_ERROR;
+                        sem_post(&replay_slots);
+                        continue;
+                }
+                pthread_detach(thread_id);
+        }
+
+        // All slots are free again once the last request finished
+        for(unsigned int i = 0; i < replay_config.max_in_flight; ++i)
+        {
+                sem_wait(&replay_slots);
+        }
+
+        double elapsed_s = (benchNowNs() - start_ns) / 1e9;
+        double trace_s = (requests[num_requests - 1].time_ns - requests[0].time_ns) / 1e9;
+
+        // Session processes are reaped shortly after they ended
+        usleep(200000);
+        uint64_t cpu_end = (replay_config.proxy_pid != 0) ? processCpuTicks(replay_config.proxy_pid) : 0;
+
+        uint64_t *latencies_ns = malloc(num_requests * sizeof(uint64_t));
+        if(latencies_ns == NULL)
+        {
+                free(requests);
+                return 1;
+        }
+
+        size_t num_samples = 0;
+        uint64_t blocked = 0, errors = 0, tunnels = 0, bytes = 0;
+        for(size_t i = 0; i < num_requests; ++i)
+        {
+                blocked += (requests[i].result == REPLAY_BLOCKED);
+                errors += (requests[i].result == REPLAY_ERROR);
+                tunnels += requests[i].tunnel;
+                bytes += requests[i].bytes;
+                if(requests[i].latency_ns != 0)
+                {
+                        latencies_ns[num_samples++] = requests[i].latency_ns;
+                }
+        }
+        qsort(latencies_ns, num_samples, sizeof(uint64_t), compareLatencies);
+
+        double percentiles[5] = {0, 0, 0, 0, 0};
+        const double quantiles[5] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        for(int i = 0; (i < 5) && (num_samples != 0); ++i)
+        {
+                size_t index = (size_t)(quantiles[i] * (num_samples - 1));
+                percentiles[i] = latencies_ns[index] / 1e6;
+        }
+
+        uint64_t completed = num_requests - errors;
+        double cpu_us = ((replay_config.proxy_pid != 0) && (completed != 0)) ?
+                        (cpu_end - cpu_start) * 1e6 / sysconf(_SC_CLK_TCK) / completed : 0;
+
+        printf("%s: %zu requests (%lu CONNECT), %zu sessions skipped, %.1f s recorded, speed %.2f, %.1f s\n",
+               name, num_requests, tunnels, num_skipped, trace_s, replay_config.speed, elapsed_s);
+        printf("  requests %.0f/s, blocked %lu, errors %lu, sent late %lu\n", num_requests / elapsed_s,
+               blocked, errors, late);
+        printf("  throughput %.2f MB/s\n", bytes / elapsed_s / 1e6);
+        printf("  latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+               percentiles[0], percentiles[1], percentiles[2], percentiles[3], percentiles[4]);
+        if(replay_config.proxy_pid != 0)
+        {
+                printf("  proxy CPU %.1f us/request\n", cpu_us);
+        }
+        printf("RESULT\t%s\t%.0f\t%.2f\t%.3f\t%.3f\t%.3f\t%.1f\t%lu\n", name, num_requests / elapsed_s,
+               bytes / elapsed_s / 1e6, percentiles[0], percentiles[2], percentiles[3], cpu_us, errors);
+
+        sem_destroy(&replay_slots);
+        free(latencies_ns);
+        free(requests);
+
+        return 0;
+}
@@ -0,0 +1,395 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+
+#include "accesslog.h"
+#include "shm.h"
+#include "latency.h"
+
+
+/* Rings of all sessions in shared memory, created before sessions are forked.
+ * NULL while the access log is disabled, logging is a no-op then.
+ */
+static AccessLogRing *access_log_rings = NULL;
+
+// Path and file descriptor of the log file, only used by the writer thread
+static const char *access_log_path = NULL;
+static int access_log_fd = -1;
+
+// Set to have the writer reopen the log file (after it was rotated)
+static int access_log_reopen = 0;
+
+// Names of the outcomes, in the order of AccessOutcome
+static const char *access_outcome_names[ACCESS_NUM_OUTCOMES] =
+        {
+                "forwarded", "tunnel", "blocked-host", "blocked-request", "blocked-response",
+                "error-client", "error-resolve", "error-connect", "error-server", "error-internal",
+                "timeout", "breaker-open", "no-upstream"
+        };
+
+
+/* openAccessLogFile
+ *
+ * Open the log file for appending and write the file header if the file is new
+ *
+ * @param path Path of the log file
+ * @ret File descriptor, -1 on error
+ */
+static int openAccessLogFile(const char *path)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(fd == -1)
+        {
+                perror("access log");
+                return -1;
+        }
+
+        struct stat file_stat;
+        if((fstat(fd, &file_stat) == 0) && (file_stat.st_size == 0))
+        {
+                AccessLogFileHeader header;
+                header.magic = ACCESS_LOG_MAGIC;
+                header.version = ACCESS_LOG_VERSION;
+                if(write(fd, &header, sizeof(header)) != sizeof(header))
+                {
+                        perror("access log");
+                        close(fd);
+                        return -1;
+                }
+        }
+
+        return fd;
+}
+
+
+/* initAccessLog
+ *
+ * Open the access log, create the rings in shared memory and start the writer thread
+ *
+ * @param path Path of the log file
+ * @ret 0 on success
+ *      -1 if the file could not be opened, the rings could not be created or the thread
+ *      could not be started
+ */
+int initAccessLog(const char *path)
+{
+        assert(path != NULL);
+
+        access_log_fd = openAccessLogFile(path);
+        if(access_log_fd == -1)
+        {
+                return -1;
+        }
+        access_log_path = path;
+
+        access_log_rings = createSharedMemory(ACCESS_LOG_RINGS * sizeof(AccessLogRing));
+        if(access_log_rings == NULL)
+        {
+                goto error_rings;
+        }
+
+        pthread_t writer_thread_id;
+        if(pthread_create(&writer_thread_id, NULL, accessLogWriter, NULL) != 0)
+        {
+                goto error_thread;
+        }
+        pthread_detach(writer_thread_id);
+
+        return 0;
+
+error_thread:
+        destroySharedMemory(access_log_rings, ACCESS_LOG_RINGS * sizeof(AccessLogRing));
+        access_log_rings = NULL;
+error_rings:
+        close(access_log_fd);
+        access_log_fd = -1;
+        return -1;
+}
+
+
+/* reopenAccessLog
+ *
+ * Have the writer thread reopen the log file before it writes the next records
+ */
+void reopenAccessLog(void)
+{
+        __atomic_store_n(&access_log_reopen, 1, __ATOMIC_RELAXED);
+}
+
+
+/* claimAccessLogRing
+ *
+ * Claim a free ring with room for a record, starting at a ring picked by the process id
+ *
+ * @param pid Process id of the calling session
+ * @ret claim Claim the ring was taken with, needed to release it
+ * @ret Claimed ring, to be released after the record was put in
+ *      NULL if every ring is full or taken by another session
+ */
+static AccessLogRing* claimAccessLogRing(int32_t pid, uint64_t *claim)
+{
+        *claim = ((monotonicNs() / 1000000) << 32) | (uint32_t)pid;
+
+        for(unsigned int i = 0; i < ACCESS_LOG_RINGS; ++i)
+        {
+                AccessLogRing *ring = access_log_rings + (pid + i) % ACCESS_LOG_RINGS;
+                uint64_t free_claim = 0;
+
+                if(!__atomic_compare_exchange_n(&(ring->claim), &free_claim, *claim, 0,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                {
+                        continue;
+                }
+
+                if(ring->head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) < ACCESS_LOG_RING_SLOTS)
+                {
+                        return ring;
+                }
+                __atomic_store_n(&(ring->claim), 0, __ATOMIC_RELEASE);
+        }
+
+        return NULL;
+}
+
+
+/* setAccessLogClient
+ *
+ * Fill in the client address of an access log entry
+ *
+ * @param entry Entry to fill in
+ * @param client_addr Address of the client as returned by accept
+ */
+void setAccessLogClient(AccessLogEntry *entry, const struct sockaddr_storage *client_addr)
+{
+        assert(entry != NULL);
+        assert(client_addr != NULL);
+
+        entry->client_family = (uint8_t)client_addr->ss_family;
+
+        if(client_addr->ss_family == AF_INET)
+        {
+                const struct sockaddr_in *addr = (const struct sockaddr_in *)client_addr;
+                memcpy(entry->client_addr, &(addr->sin_addr), sizeof(addr->sin_addr));
+                entry->client_port = ntohs(addr->sin_port);
+        }
+        else if(client_addr->ss_family == AF_INET6)
+        {
+                const struct sockaddr_in6 *addr = (const struct sockaddr_in6 *)client_addr;
+                memcpy(entry->client_addr, &(addr->sin6_addr), sizeof(addr->sin6_addr));
+                entry->client_port = ntohs(addr->sin6_port);
+        }
+}
+
+
+/* logAccess
+ *
+ * Put an access log record into a ring, claimed by the calling session process for the copy.
+ * Never blocks, if no ring has room, or the claim was freed because the copy took longer than
+ * ACCESS_LOG_CLAIM_TIMEOUT_MS, the record is dropped and counted.
+ *
+ * @param entry Entry of the record, text_len is filled in
+ * @param text Request text of the record, truncated to ACCESS_LOG_MAX_TEXT
+ */
+void logAccess(AccessLogEntry *entry, const char *text)
+{
+        assert(entry != NULL);
+        assert(text != NULL);
+
+        if(access_log_rings == NULL)
+        {
+                return;
+        }
+
+        uint64_t claim;
+        AccessLogRing *ring = claimAccessLogRing((int32_t)getpid(), &claim);
+        if(ring == NULL)
+        {
+                addProxyCounter(STAT_ACCESS_LOG_DROPPED, 1);
+                return;
+        }
+
+        uint64_t head = ring->head;
+        size_t text_len = strlen(text);
+        entry->text_len = (text_len < ACCESS_LOG_MAX_TEXT) ? text_len : ACCESS_LOG_MAX_TEXT;
+
+        char *slot = ring->slots[head % ACCESS_LOG_RING_SLOTS];
+        memcpy(slot, entry, sizeof(AccessLogEntry));
+        memcpy(slot + sizeof(AccessLogEntry), text, entry->text_len);
+
+        // The writer frees a claim held for too long, the record is dropped then
+        if(__atomic_load_n(&(ring->claim), __ATOMIC_ACQUIRE) != claim)
+        {
+                addProxyCounter(STAT_ACCESS_LOG_DROPPED, 1);
+                return;
+        }
+
+        __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+        __atomic_compare_exchange_n(&(ring->claim), &claim, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+
+/* accessOutcomeName
+ *
+ * Get the name of a session outcome
+ *
+ * @param outcome AccessOutcome of a session
+ * @ret Name of the outcome, "unknown" for invalid values
+ */
+const char * accessOutcomeName(uint8_t outcome)
+{
+        return (outcome < ACCESS_NUM_OUTCOMES) ? access_outcome_names[outcome] : "unknown";
+}
+
+
+/* formatAccessLogEntry
+ *
+ * Print an access log record as a line of text:
+ * time client pid outcome status header_len bytes_in bytes_out first_byte duration request
+ *
+ * @param out Stream to print to
+ * @param entry Entry of the record
+ * @param text Request text of the record, entry->text_len bytes
+ */
+void formatAccessLogEntry(FILE *out, const AccessLogEntry *entry, const char *text)
+{
+        assert(entry != NULL);
+        assert(text != NULL);
+
+        char time_str[32] = "-";
+        time_t seconds = entry->time_ns / 1000000000ull;
+        struct tm time_utc;
+        if(gmtime_r(&seconds, &time_utc) != NULL)
+        {
+                strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S", &time_utc);
+        }
+
+        char client_str[INET6_ADDRSTRLEN] = "-";
+        if((entry->client_family == AF_INET) || (entry->client_family == AF_INET6))
+        {
+                inet_ntop(entry->client_family, entry->client_addr, client_str, sizeof(client_str));
+        }
+
+        fprintf(out, "%s.%06luZ %s:%u %u %s %u %u %lu %lu %.3fms %.3fms %.*s\n",
+                time_str, (unsigned long)(entry->time_ns % 1000000000ull) / 1000, client_str,
+                entry->client_port, entry->pid, accessOutcomeName(entry->outcome), entry->status,
+                entry->header_len, entry->bytes_in, entry->bytes_out, entry->first_byte_ns / 1e6,
+                entry->duration_ns / 1e6, (int)entry->text_len, text);
+}
+
+
+/* writeAccessLogBatch
+ *
+ * Write the collected records to the log file
+ *
+ * @param batch Records to write
+ * @param batch_len Number of bytes to write
+ */
+static void writeAccessLogBatch(const char *batch, size_t batch_len)
+{
+        size_t written = 0;
+
+        while(written < batch_len)
+        {
+                ssize_t n = write(access_log_fd, batch + written, batch_len - written);
+                if(n == -1)
+                {
+                        if(errno == EINTR)
+                        {
+                                continue;
+                        }
+                        perror("access log");
+                        return;
+                }
+                written += n;
+        }
+}
+
+
+/* accessLogWriter
+ *
+ * Drain the rings of all sessions into the log file. Records are collected in a buffer and
+ * written with one write call per pass over the rings. Rings claimed for longer than
+ * ACCESS_LOG_CLAIM_TIMEOUT_MS are freed up again, their session died or hangs while putting
+ * a record in, or its process id was taken over by a later process.
+ *
+ * @param arg Unused
+ */
+void* accessLogWriter(void *arg)
+{
+        (void)arg;
+
+        static char batch[ACCESS_LOG_BATCH_SIZE];
+
+        while(1)
+        {
+                size_t batch_len = 0;
+                uint64_t records = 0;
+
+                if(__atomic_exchange_n(&access_log_reopen, 0, __ATOMIC_RELAXED))
+                {
+                        int fd = openAccessLogFile(access_log_path);
+                        if(fd != -1)
+                        {
+                                close(access_log_fd);
+                                access_log_fd = fd;
+                        }
+                }
+
+                uint64_t now_ms = monotonicNs() / 1000000;
+                for(unsigned int i = 0; i < ACCESS_LOG_RINGS; ++i)
+                {
+                        AccessLogRing *ring = access_log_rings + i;
+                        uint64_t tail = ring->tail;
+                        uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+
+                        for(; tail != head; ++tail)
+                        {
+                                const char *slot = ring->slots[tail % ACCESS_LOG_RING_SLOTS];
+                                const AccessLogEntry *entry = (const AccessLogEntry *)slot;
+                                size_t record_len = sizeof(AccessLogEntry) + entry->text_len;
+
+                                if(batch_len + record_len > sizeof(batch))
+                                {
+                                        writeAccessLogBatch(batch, batch_len);
+                                        batch_len = 0;
+                                }
+                                memcpy(batch + batch_len, slot, record_len);
+                                batch_len += record_len;
+                                ++records;
+                        }
+
+                        __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+
+                        uint64_t claim = __atomic_load_n(&(ring->claim), __ATOMIC_RELAXED);
+                        if((claim != 0) &&
+                           ((uint32_t)(now_ms - (claim >> 32)) > ACCESS_LOG_CLAIM_TIMEOUT_MS))
+                        {
+                                __atomic_compare_exchange_n(&(ring->claim), &claim, 0, 0,
+                                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                        }
+                }
+
+                if(batch_len != 0)
+                {
+                        writeAccessLogBatch(batch, batch_len);
+                        addProxyCounter(STAT_ACCESS_LOG_RECORDS, records);
+                }
+                else
+                {
+                        struct timespec interval;
+                        interval.tv_sec = 0;
+                        interval.tv_nsec = ACCESS_LOG_DRAIN_INTERVAL_MS * 1000000L;
+                        nanosleep(&interval, NULL);
+                }
+        }
+
+        return NULL;
+}
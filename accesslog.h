@@ -0,0 +1,164 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "stats.h"
+
+// Magic number at the start of an access log file ("PXAL")
+#define ACCESS_LOG_MAGIC 0x4c415850
+
+// Version of the access log file format
+#define ACCESS_LOG_VERSION 2
+
+/* Number of rings. A session claims a ring only while it puts a record in, so the rings bound
+ * the sessions writing at the same instant, not the sessions running.
+ */
+#define ACCESS_LOG_RINGS 16
+
+/* Records per ring (power of two). All rings together hold the records of a drain interval,
+ * 8192 per 50ms or about 160000 records per second before records are dropped.
+ */
+#define ACCESS_LOG_RING_SLOTS 512
+
+// Size of a ring slot, holding an entry and its request text
+#define ACCESS_LOG_SLOT_SIZE 512
+
+// Longest request text of an entry, longer texts are truncated
+#define ACCESS_LOG_MAX_TEXT (ACCESS_LOG_SLOT_SIZE - sizeof(AccessLogEntry))
+
+// Size of the buffer the writer collects records in before writing them out
+#define ACCESS_LOG_BATCH_SIZE 65536
+
+// Milliseconds the writer sleeps when all rings are empty
+#define ACCESS_LOG_DRAIN_INTERVAL_MS 50
+
+// Milliseconds after which the writer frees a claimed ring, its session died or hangs
+#define ACCESS_LOG_CLAIM_TIMEOUT_MS 1000
+
+
+/* AccessOutcome
+ *
+ * How a session ended
+ *
+ * ACCESS_FORWARDED        -> Response forwarded to the client
+ * ACCESS_TUNNEL           -> CONNECT tunnel relayed until one side closed it
+ * ACCESS_BLOCKED_HOST     -> Request refused because of the blocklist
+ * ACCESS_BLOCKED_REQUEST  -> Request blocked by the content filter
+ * ACCESS_BLOCKED_RESPONSE -> Response blocked by the content filter
+ * ACCESS_ERROR_CLIENT     -> No valid request was read from the client
+ * ACCESS_ERROR_RESOLVE    -> The server name could not be resolved
+ * ACCESS_ERROR_CONNECT    -> The server could not be connected to
+ * ACCESS_ERROR_SERVER     -> Reading the response from the server failed
+ * ACCESS_ERROR_INTERNAL   -> The session failed inside the proxy
+ * ACCESS_TIMEOUT          -> The session was ended by one of its timeouts
+ * ACCESS_BREAKER_OPEN     -> Request failed fast because the circuit breaker of the host was open
+ * ACCESS_NO_UPSTREAM      -> Reverse proxy request refused because its pool had no healthy server
+ */
+typedef enum _access_outcome_
+{
+  ACCESS_FORWARDED,
+  ACCESS_TUNNEL,
+  ACCESS_BLOCKED_HOST,
+  ACCESS_BLOCKED_REQUEST,
+  ACCESS_BLOCKED_RESPONSE,
+  ACCESS_ERROR_CLIENT,
+  ACCESS_ERROR_RESOLVE,
+  ACCESS_ERROR_CONNECT,
+  ACCESS_ERROR_SERVER,
+  ACCESS_ERROR_INTERNAL,
+  ACCESS_TIMEOUT,
+  ACCESS_BREAKER_OPEN,
+  ACCESS_NO_UPSTREAM,
+  ACCESS_NUM_OUTCOMES
+} AccessOutcome;
+
+
+/* AccessLogFileHeader struct
+ *
+ * Start of an access log file. Entries follow in the byte order of the proxy host.
+ *
+ * magic   -> ACCESS_LOG_MAGIC
+ * version -> ACCESS_LOG_VERSION
+ */
+typedef struct _access_log_file_header_
+{
+  uint32_t magic;
+  uint32_t version;
+} AccessLogFileHeader;
+
+
+/* AccessLogEntry struct
+ *
+ * Access log record of a session. In the file every entry is directly followed by its
+ * request text "METHOD host:port resource", which is empty if no request was read.
+ * The records double as a trace of the traffic for the replay tool.
+ *
+ * time_ns       -> Wall clock time the connection was accepted at (ns since the epoch)
+ * duration_ns   -> Duration of the session
+ * first_byte_ns -> Time from connecting to the server to its first response byte, 0 if none
+ * bytes_in      -> Bytes received from the client
+ * bytes_out     -> Bytes sent to the client
+ * pid           -> Process id of the session
+ * status        -> Status code of the response, 0 if there was none
+ * outcome       -> AccessOutcome of the session
+ * client_family -> Address family of the client (AF_INET or AF_INET6)
+ * client_addr   -> Address of the client, IPv4 addresses use the first 4 bytes
+ * client_port   -> Port of the client
+ * text_len      -> Length of the request text
+ * header_len    -> Length of the request header as received, 0 if no request was read
+ */
+typedef struct _access_log_entry_
+{
+  uint64_t time_ns;
+  uint64_t duration_ns;
+  uint64_t first_byte_ns;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint32_t pid;
+  uint16_t status;
+  uint8_t outcome;
+  uint8_t client_family;
+  uint8_t client_addr[16];
+  uint16_t client_port;
+  uint16_t text_len;
+  uint32_t header_len;
+} AccessLogEntry;
+
+
+/* AccessLogRing struct
+ *
+ * Ring of access log records in shared memory with one producer at a time. The producer is
+ * the session process that claimed the ring to put a record in, the consumer is the writer
+ * thread of the proxy process. Head and tail are on their own cache lines, so both sides only
+ * share a line when a record is handed over.
+ *
+ * claim -> Claim of the session putting a record in, 0 if the ring is free: the process id in
+ *          the low and the monotonic milliseconds of the claim in the high 32 bits
+ * head  -> Number of records written, only changed by the claiming session
+ * tail  -> Number of records consumed, only changed by the writer
+ * slots -> Records, each an entry followed by its request text
+ */
+typedef struct _access_log_ring_
+{
+  uint64_t claim __attribute__((aligned(STATS_CACHE_LINE)));
+  uint64_t head;
+  uint64_t tail __attribute__((aligned(STATS_CACHE_LINE)));
+  char slots[ACCESS_LOG_RING_SLOTS][ACCESS_LOG_SLOT_SIZE] __attribute__((aligned(STATS_CACHE_LINE)));
+} AccessLogRing;
+
+
+int initAccessLog(const char *path);
+void reopenAccessLog(void);
+
+void setAccessLogClient(AccessLogEntry *entry, const struct sockaddr_storage *client_addr);
+void logAccess(AccessLogEntry *entry, const char *text);
+
+const char * accessOutcomeName(uint8_t outcome);
+void formatAccessLogEntry(FILE *out, const AccessLogEntry *entry, const char *text);
+
+void* accessLogWriter(void *arg);
+
+#endif
@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "admin.h"
+#include "stats.h"
+#include "verdict.h"
+#include "latency.h"
+#include "admission.h"
+#include "upstream.h"
+#include "hostlimit.h"
+#include "handoff.h"
+
+
+/* printStatsReport
+ *
+ * Print all statistics of the proxy: counters, admission, verdict cache and phase latencies
+ *
+ * @param out Stream to print to
+ */
+void printStatsReport(FILE *out)
+{
+        printProxyStats(out);
+        printAdmissionStats(out);
+        printUpstreamStats(out);
+        printHostLimitStats(out);
+        printVerdictCacheStats(out);
+        printLatencyStats(out);
+}
+
+
+/* serveStatsReport
+ *
+ * Answer a request on the admin port with the statistics report. Whatever was requested,
+ * the report is the only resource. Receiving and sending time out after ADMIN_IO_TIMEOUT_MS,
+ * so a client that stays silent can not hold up the admin thread.
+ *
+ * @param client_socket Accepted admin connection
+ * @ret 0 on success
+ *      -1 if the report could not be created or sent
+ */
+int serveStatsReport(Socket *client_socket)
+{
+        assert(client_socket != NULL);
+
+        int retval = 0;
+        char request[ADMIN_REQUEST_SIZE];
+        char *report = NULL;
+        size_t report_len = 0;
+
+        struct timeval timeout;
+        timeout.tv_sec = ADMIN_IO_TIMEOUT_MS / 1000;
+        timeout.tv_usec = (ADMIN_IO_TIMEOUT_MS % 1000) * 1000;
+        setsockopt(client_socket->fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_socket->fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Wait for the request so the client does not see a reset, its content does not matter
+        if(recv(client_socket->fd_, request, sizeof(request), 0) < 0)
+        {
+                return -1;
+        }
+
+        FILE *report_stream = open_memstream(&report, &report_len);
+        if(report_stream == NULL)
+        {
+                return -1;
+        }
+        printStatsReport(report_stream);
+        fclose(report_stream);
+
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                                  "Connection: close\r\n\r\n", report_len);
+
+        // MSG_NOSIGNAL, a client that went away must not take down the proxy process
+        if((send(client_socket->fd_, header, header_len, MSG_NOSIGNAL) != header_len) ||
+           (send(client_socket->fd_, report, report_len, MSG_NOSIGNAL) != (ssize_t)report_len))
+        {
+                retval = -1;
+        }
+
+        free(report);
+        return retval;
+}
+
+
+/* adminThread
+ *
+ * Serve statistics reports on the admin port, one connection at a time, until the admin
+ * port is handed to the next proxy process
+ *
+ * @param arg Listening admin socket
+ */
+void* adminThread(void *arg)
+{
+        assert(arg != NULL);
+        Socket *listen_socket = (Socket *)arg;
+
+        struct pollfd fds[2];
+        fds[0].fd = listen_socket->fd_;
+        fds[0].events = POLLIN;
+        fds[1].fd = handoffStopFd();
+        fds[1].events = POLLIN;
+
+        while(1)
+        {
+                // Without a handoff socket the stop entry is ignored and poll only waits for a connection
+                if((poll(fds, 2, -1) > 0) && (fds[1].revents != 0))
+                {
+                        break;
+                }
+
+                Socket client_socket;
+                initSocket(&client_socket);
+
+                if(acceptConnection(listen_socket, &client_socket, NULL) != 0)
+                {
+                        continue;
+                }
+
+                serveStatsReport(&client_socket);
+                destroySocket(&client_socket);
+        }
+
+        destroySocket(listen_socket);
+        return NULL;
+}
+
+
+/* startAdminThread
+ *
+ * Open the admin port on the loopback interface and start the thread serving it
+ *
+ * @param port Local port for the statistics endpoint
+ * @ret 0 on success
+ *      -1 if the port could not be opened or the thread could not be started
+ */
+int startAdminThread(const char *port)
+{
+        assert(port != NULL);
+
+        static Socket listen_socket;
+        initSocket(&listen_socket);
+
+        if(openHandoffListeningSocket("127.0.0.1", port, &listen_socket) != 0)
+        {
+                return -1;
+        }
+
+        pthread_t admin_thread_id;
+        if(pthread_create(&admin_thread_id, NULL, adminThread, &listen_socket) != 0)
+        {
+                destroySocket(&listen_socket);
+                return -1;
+        }
+
+        pthread_detach(admin_thread_id);
+        printf("Statistics served on 127.0.0.1:%s\n", port);
+
+        return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdio.h>
+
+#include "util_socket.h"
+
+// Longest admin request that is read, the rest is ignored
+#define ADMIN_REQUEST_SIZE 1024
+
+// Time an admin client gets for sending its request and receiving the report
+#define ADMIN_IO_TIMEOUT_MS 1000
+
+
+void printStatsReport(FILE *out);
+int serveStatsReport(Socket *client_socket);
+
+void* adminThread(void *arg);
+int startAdminThread(const char *port);
+
+#endif
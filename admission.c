@@ -0,0 +1,240 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "config.h"
+#include "stats.h"
+
+
+// Listening socket whose accept queue is measured, -1 before initAdmission
+static int admission_listen_fd = -1;
+
+// Sessions forked and not yet reaped, decremented by the SIGCHLD handler
+static int active_sessions = 0;
+
+/* Moving average of the time between two admitted sessions while connections were waiting,
+ * the rate the accept queue drains at
+ */
+static uint64_t admission_interval_ns = 0;
+
+// Time of the last admitted session and whether connections were waiting behind it
+static uint64_t last_admission_ns = 0;
+static uint32_t last_admission_queue = 0;
+
+// Response for shed connections, built once so shedding costs no more than a send
+static char shed_response[160];
+static size_t shed_response_len = 0;
+
+
+/* initAdmission
+ *
+ * Set up admission control for the sessions of a listening socket
+ *
+ * @param listen_socket Listening socket of the proxy
+ */
+void initAdmission(const Socket *listen_socket)
+{
+        assert(listen_socket != NULL);
+
+        admission_listen_fd = listen_socket->fd_;
+        int len = snprintf(shed_response, sizeof(shed_response),
+                           "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\n"
+                           "Connection: close\r\n\r\n", ADMISSION_RETRY_AFTER);
+        shed_response_len = ((len > 0) && ((size_t)len < sizeof(shed_response))) ? (size_t)len : 0;
+}
+
+
+/* acceptQueueLength
+ *
+ * Get the number of connections waiting in the accept queue of the listening socket.
+ * For listening sockets Linux reports the length of the accept queue as unacked segments.
+ *
+ * @ret Number of waiting connections, 0 if it is unknown
+ */
+static uint32_t acceptQueueLength(void)
+{
+        struct tcp_info info;
+        socklen_t info_len = sizeof(info);
+
+        if((admission_listen_fd == -1) ||
+           (getsockopt(admission_listen_fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) != 0))
+        {
+                return 0;
+        }
+
+        return info.tcpi_unacked;
+}
+
+
+/* estimateQueueDelay
+ *
+ * Estimate how long a connection arriving now waits in the accept queue: the waiting
+ * connections times the interval at which sessions were admitted while the queue was not empty
+ *
+ * @ret Estimated queue delay in nanoseconds
+ */
+uint64_t estimateQueueDelay(void)
+{
+        return acceptQueueLength() * __atomic_load_n(&admission_interval_ns, __ATOMIC_RELAXED);
+}
+
+
+/* sessionsFull
+ *
+ * Check if the maximum number of sessions is running
+ *
+ * @ret True if no further session may be started
+ */
+static int sessionsFull(void)
+{
+        return (proxy_config.max_sessions != 0) &&
+               (__atomic_load_n(&active_sessions, __ATOMIC_RELAXED) >= (int)proxy_config.max_sessions);
+}
+
+
+/* queueDelayExceeded
+ *
+ * Check if the estimated accept queue delay is beyond the configured maximum
+ *
+ * @ret True if connections should be shed to drain the queue
+ */
+static int queueDelayExceeded(void)
+{
+        return (proxy_config.max_queue_delay != 0) &&
+               (estimateQueueDelay() > proxy_config.max_queue_delay * 1000000ull);
+}
+
+
+/* waitForAdmission
+ *
+ * In defer mode, leave connections in the accept queue while the maximum number of sessions
+ * is running. Returns as soon as a session ended or the queue delay grew beyond its maximum,
+ * in the latter case the next connection is shed.
+ */
+void waitForAdmission(void)
+{
+        if(!proxy_config.defer_overload || !sessionsFull())
+        {
+                return;
+        }
+
+        addProxyCounter(STAT_ADMISSION_DEFERRED, 1);
+        while(sessionsFull() && !queueDelayExceeded())
+        {
+                struct timespec wait_time;
+                wait_time.tv_sec = 0;
+                wait_time.tv_nsec = ADMISSION_WAIT_US * 1000L;
+                nanosleep(&wait_time, NULL);
+        }
+}
+
+
+/* admitConnection
+ *
+ * Decide if an accepted connection gets a session. An admitted connection counts as an
+ * active session until admissionSessionEnded or cancelAdmission is called for it.
+ *
+ * @param accept_ns Monotonic time the connection was accepted at
+ * @ret AdmissionDecision for the connection
+ */
+AdmissionDecision admitConnection(uint64_t accept_ns)
+{
+        // In defer mode connections are only accepted while full once the queue delay is exceeded
+        if(sessionsFull() && proxy_config.defer_overload)
+        {
+                addProxyCounter(STAT_ADMISSION_SHED_QUEUE, 1);
+                return ADMISSION_SHED_QUEUE;
+        }
+        if(sessionsFull())
+        {
+                addProxyCounter(STAT_ADMISSION_SHED_FULL, 1);
+                return ADMISSION_SHED_FULL;
+        }
+
+        uint32_t queue_length = acceptQueueLength();
+        if((proxy_config.max_queue_delay != 0) &&
+           (queue_length * admission_interval_ns > proxy_config.max_queue_delay * 1000000ull))
+        {
+                addProxyCounter(STAT_ADMISSION_SHED_QUEUE, 1);
+                return ADMISSION_SHED_QUEUE;
+        }
+
+        // Only intervals with waiting connections show how fast the queue drains
+        if(last_admission_queue != 0)
+        {
+                uint64_t interval = accept_ns - last_admission_ns;
+                int64_t delta = (int64_t)interval - (int64_t)admission_interval_ns;
+                __atomic_store_n(&admission_interval_ns, admission_interval_ns + (delta >> ADMISSION_EWMA_SHIFT),
+                                 __ATOMIC_RELAXED);
+        }
+        last_admission_ns = accept_ns;
+        last_admission_queue = queue_length;
+
+        __atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+        return ADMISSION_ADMIT;
+}
+
+
+/* cancelAdmission
+ *
+ * Take back the admission of a connection whose session could not be started
+ */
+void cancelAdmission(void)
+{
+        __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+}
+
+
+/* admissionSessionEnded
+ *
+ * Count a reaped session process. Async-signal-safe, called by the SIGCHLD handler.
+ */
+void admissionSessionEnded(void)
+{
+        __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+}
+
+
+/* activeSessions
+ *
+ * @ret Sessions forked and not yet reaped
+ */
+int activeSessions(void)
+{
+        return __atomic_load_n(&active_sessions, __ATOMIC_RELAXED);
+}
+
+
+/* shedConnection
+ *
+ * Answer a connection with 503 and Retry-After without starting a session, and close it
+ *
+ * @param client_socket Accepted connection to shed
+ */
+void shedConnection(Socket *client_socket)
+{
+        assert(client_socket != NULL);
+
+        sendResponseAndClose(client_socket, shed_response, shed_response_len);
+}
+
+
+/* printAdmissionStats
+ *
+ * Print the running sessions and the state of the accept queue
+ *
+ * @param out Stream to print to
+ */
+void printAdmissionStats(FILE *out)
+{
+        assert(out != NULL);
+
+        fprintf(out, "Admission: %d sessions active (max %u), %u connections queued, estimated queue delay %.3fms\n",
+                __atomic_load_n(&active_sessions, __ATOMIC_RELAXED), proxy_config.max_sessions,
+                acceptQueueLength(), estimateQueueDelay() / 1e6);
+}
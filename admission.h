@@ -0,0 +1,46 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util_socket.h"
+
+// Seconds a shed client is asked to wait before retrying
+#define ADMISSION_RETRY_AFTER 1
+
+// Microseconds between checks for a free session while connections are deferred
+#define ADMISSION_WAIT_US 1000
+
+// Weight of a new sample in the moving average of the admission interval (1 / 2^shift)
+#define ADMISSION_EWMA_SHIFT 3
+
+
+/* AdmissionDecision
+ *
+ * What to do with an accepted connection
+ *
+ * ADMISSION_ADMIT      -> Start a session for the connection
+ * ADMISSION_SHED_FULL  -> Answer 503, the maximum number of sessions is running
+ * ADMISSION_SHED_QUEUE -> Answer 503, the estimated accept queue delay is too long
+ */
+typedef enum _admission_decision_
+{
+  ADMISSION_ADMIT,
+  ADMISSION_SHED_FULL,
+  ADMISSION_SHED_QUEUE
+} AdmissionDecision;
+
+
+void initAdmission(const Socket *listen_socket);
+void waitForAdmission(void);
+AdmissionDecision admitConnection(uint64_t accept_ns);
+void cancelAdmission(void);
+void admissionSessionEnded(void);
+int activeSessions(void);
+void shedConnection(Socket *client_socket);
+
+uint64_t estimateQueueDelay(void);
+void printAdmissionStats(FILE *out);
+
+#endif
@@ -0,0 +1,32 @@
+#!/bin/sh
+# End-to-end benchmark of the proxy against the local origin server.
+# Every scenario prints a summary and a tab separated RESULT line:
+# name, requests/s, MB/s, p50 ms, p99 ms, p999 ms, proxy CPU us/request, errors
+#
+# BENCH_DURATION   Seconds per scenario (default 5)
+# BENCH_PROXY_ARGS Additional options for the proxy (e.g. "-e -P replace")
+
+DURATION=${BENCH_DURATION:-5}
+ORIGIN_PORT=${BENCH_ORIGIN_PORT:-18190}
+PROXY_PORT=${BENCH_PROXY_PORT:-18191}
+ORIGIN=127.0.0.1:$ORIGIN_PORT
+
+./bench_origin $ORIGIN_PORT &
+ORIGIN_PID=$!
+./proxy $BENCH_PROXY_ARGS $PROXY_PORT > /dev/null 2>&1 &
+PROXY_PID=$!
+trap 'kill $PROXY_PID $ORIGIN_PID 2>/dev/null' EXIT INT TERM
+sleep 0.5
+
+load()
+{
+        ./bench_load -d $DURATION -P $PROXY_PID "$@" 127.0.0.1 $PROXY_PORT $ORIGIN
+}
+
+load -n small-rps -c 32 -p "/object?size=1024"
+load -n large-throughput -c 4 -p "/object?size=8388608&binary=1"
+load -n filtered-clean -c 16 -p "/object?size=262144"
+load -n filtered-blocked -c 16 -p "/object?size=262144&blocked=1"
+load -n filtered-chunked -c 16 -p "/object?size=262144&chunked=1"
+load -n idle-connections -c 32 -i 500 -p "/object?size=1024"
+load -n connect-keepalive -c 16 -T -k -p "/object?size=1024"
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bench_client.h"
+#include "util_socket.h"
+
+
+/* benchNowNs
+ *
+ * Get the current time of the monotonic clock
+ *
+ * @ret Time in nanoseconds
+ */
+uint64_t benchNowNs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* processCpuTicks
+ *
+ * Get the CPU time used by a process and its reaped child processes
+ *
+ * @param pid Process id of the process
+ * @ret CPU time in clock ticks, 0 if it could not be read
+ */
+uint64_t processCpuTicks(long pid)
+{
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+        FILE *file = fopen(path, "r");
+        if(file == NULL)
+        {
+                return 0;
+        }
+
+        char stat[1024];
+        size_t len = fread(stat, 1, sizeof(stat) - 1, file);
+        fclose(file);
+        stat[len] = '\0';
+
+        // Fields after the command name, which may contain spaces: utime is field 14
+        const char *fields = strrchr(stat, ')');
+        unsigned long long utime = 0, stime = 0;
+        long long cutime = 0, cstime = 0;
+        if((fields == NULL) ||
+           (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld %lld",
+                   &utime, &stime, &cutime, &cstime) != 4))
+        {
+                return 0;
+        }
+
+        return utime + stime + cutime + cstime;
+}
+
+
+/* connectBenchProxy
+ *
+ * Open a connection to the proxy, optionally through a CONNECT tunnel to an origin
+ *
+ * @param conn Connection to open
+ * @param proxy_host Host of the proxy
+ * @param proxy_port Port of the proxy
+ * @param tunnel_origin host:port to open a CONNECT tunnel to, NULL to use the proxy directly
+ * @ret 0 on success, -1 on failure
+ */
+int connectBenchProxy(BenchConnection *conn, const char *proxy_host, const char *proxy_port,
+                      const char *tunnel_origin)
+{
+        Socket proxy_socket;
+        if(initServerConnection(proxy_host, proxy_port, &proxy_socket) != 0)
+        {
+                return -1;
+        }
+
+        conn->fd = proxy_socket.fd_;
+        conn->start = 0;
+        conn->end = 0;
+        conn->buffer[0] = '\0';
+
+        if(tunnel_origin != NULL)
+        {
+                char request[512];
+                int len = snprintf(request, sizeof(request), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                   tunnel_origin, tunnel_origin);
+                if(send(conn->fd, request, len, MSG_NOSIGNAL) != len)
+                {
+                        goto error;
+                }
+
+                // Wait for the end of the "200 Connection Established" response
+                char *header_end = NULL;
+                while(header_end == NULL)
+                {
+                        ssize_t n = recv(conn->fd, conn->buffer + conn->end, BENCH_BUFFER_SIZE - 1 - conn->end, 0);
+                        if(n <= 0)
+                        {
+                                goto error;
+                        }
+                        conn->end += n;
+                        conn->buffer[conn->end] = '\0';
+                        header_end = strstr(conn->buffer, "\r\n\r\n");
+                }
+                if(strncmp(conn->buffer + 9, "200", 3) != 0)
+                {
+                        goto error;
+                }
+                conn->start = header_end + 4 - conn->buffer;
+        }
+
+        return 0;
+
+error:
+        closeBenchConnection(conn);
+        return -1;
+}
+
+
+/* closeBenchConnection
+ *
+ * Close a connection if it is open
+ *
+ * @param conn Connection to close
+ */
+void closeBenchConnection(BenchConnection *conn)
+{
+        if(conn->fd != -1)
+        {
+                close(conn->fd);
+                conn->fd = -1;
+        }
+}
+
+
+/* fillBuffer
+ *
+ * Receive more data into the buffer of a connection, moving unconsumed data to the front
+ *
+ * @param conn Connection to receive from
+ * @ret Number of bytes received, 0 at the end of the connection, -1 on error
+ */
+static ssize_t fillBuffer(BenchConnection *conn)
+{
+        if(conn->start != 0)
+        {
+                memmove(conn->buffer, conn->buffer + conn->start, conn->end - conn->start);
+                conn->end -= conn->start;
+                conn->start = 0;
+        }
+        if(conn->end == BENCH_BUFFER_SIZE - 1)
+        {
+                return -1;
+        }
+
+        ssize_t n = recv(conn->fd, conn->buffer + conn->end, BENCH_BUFFER_SIZE - 1 - conn->end, 0);
+        if(n > 0)
+        {
+                conn->end += n;
+                conn->buffer[conn->end] = '\0';
+        }
+        return n;
+}
+
+
+/* skipBody
+ *
+ * Consume a number of body bytes of a connection
+ *
+ * @param conn Connection to read from
+ * @param len Number of bytes, -1 to read until the connection ends
+ * @ret Number of consumed bytes, -1 if the connection ended early
+ */
+static ssize_t skipBody(BenchConnection *conn, long long len)
+{
+        ssize_t skipped = 0;
+
+        while((len < 0) || (skipped < len))
+        {
+                size_t available = conn->end - conn->start;
+                if(available == 0)
+                {
+                        ssize_t n = fillBuffer(conn);
+                        if(n <= 0)
+                        {
+                                return ((n == 0) && (len < 0)) ? skipped : -1;
+                        }
+                        continue;
+                }
+
+                size_t take = ((len < 0) || ((long long)available < len - skipped)) ? available :
+                                                                                    (size_t)(len - skipped);
+                conn->start += take;
+                skipped += take;
+        }
+
+        return skipped;
+}
+
+
+/* readLine
+ *
+ * Get the next line of a connection
+ *
+ * @param conn Connection to read from
+ * @ret Start of the line in the buffer, null terminated without CRLF; NULL on error
+ */
+static char * readLine(BenchConnection *conn)
+{
+        char *line_end;
+
+        while((line_end = strstr(conn->buffer + conn->start, "\r\n")) == NULL)
+        {
+                if(fillBuffer(conn) <= 0)
+                {
+                        return NULL;
+                }
+        }
+
+        char *line = conn->buffer + conn->start;
+        *line_end = '\0';
+        conn->start = line_end + 2 - conn->buffer;
+        return line;
+}
+
+
+/* readBenchResponse
+ *
+ * Read one response from a connection
+ *
+ * @param conn Connection to read from
+ * @ret status Status code of the response
+ * @ret keep_open Whether the server keeps the connection open for the next request
+ * @ret Number of body bytes, -1 on error
+ */
+ssize_t readBenchResponse(BenchConnection *conn, int *status, int *keep_open)
+{
+        char *line = readLine(conn);
+        if((line == NULL) || (strlen(line) < 12))
+        {
+                return -1;
+        }
+        *status = atoi(line + 9);
+        *keep_open = (strncmp(line, "HTTP/1.1", 8) == 0);
+
+        long long content_length = -1;
+        int chunked = 0;
+        while(1)
+        {
+                line = readLine(conn);
+                if(line == NULL)
+                {
+                        return -1;
+                }
+                if(*line == '\0')
+                {
+                        break;
+                }
+                if(strncasecmp(line, "Content-Length:", 15) == 0)
+                {
+                        content_length = atoll(line + 15);
+                }
+                else if((strncasecmp(line, "Transfer-Encoding:", 18) == 0) && (strstr(line, "chunked") != NULL))
+                {
+                        chunked = 1;
+                }
+                else if((strncasecmp(line, "Connection:", 11) == 0) && (strstr(line, "close") != NULL))
+                {
+                        *keep_open = 0;
+                }
+        }
+
+        if(!chunked)
+        {
+                if(content_length < 0)
+                {
+                        *keep_open = 0;
+                }
+                return skipBody(conn, content_length);
+        }
+
+        ssize_t body_len = 0;
+        while(1)
+        {
+                line = readLine(conn);
+                if(line == NULL)
+                {
+                        return -1;
+                }
+                long long chunk_len = strtoll(line, NULL, 16);
+                if(chunk_len == 0)
+                {
+                        // Trailer ends with an empty line
+                        while(((line = readLine(conn)) != NULL) && (*line != '\0'))
+                        {
+                        }
+                        return (line != NULL) ? body_len : -1;
+                }
+                if((skipBody(conn, chunk_len) != chunk_len) || ((line = readLine(conn)) == NULL))
+                {
+                        return -1;
+                }
+                body_len += chunk_len;
+        }
+}
+
+
+/* compareLatencies
+ *
+ * qsort comparison of two latencies
+ */
+int compareLatencies(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+        return (x > y) - (x < y);
+}
@@ -0,0 +1,39 @@
+#ifndef BENCH_CLIENT_H
+#define BENCH_CLIENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Size of the receive buffer of a connection
+#define BENCH_BUFFER_SIZE 65536
+
+
+/* BenchConnection struct
+ *
+ * Connection of a benchmark client to the proxy with its receive buffer
+ *
+ * fd     -> Socket, -1 if not connected
+ * buffer -> Received data not consumed yet
+ * start  -> Offset of the first unconsumed byte
+ * end    -> Offset after the last received byte
+ */
+typedef struct _bench_connection_
+{
+  int fd;
+  char buffer[BENCH_BUFFER_SIZE];
+  size_t start;
+  size_t end;
+} BenchConnection;
+
+
+uint64_t benchNowNs(void);
+uint64_t processCpuTicks(long pid);
+
+int connectBenchProxy(BenchConnection *conn, const char *proxy_host, const char *proxy_port,
+                      const char *tunnel_origin);
+void closeBenchConnection(BenchConnection *conn);
+ssize_t readBenchResponse(BenchConnection *conn, int *status, int *keep_open);
+
+int compareLatencies(const void *a, const void *b);
+
+#endif
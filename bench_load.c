@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bench_client.h"
+#include "util_socket.h"
+
+// Initial capacity of the latency list of a connection
+#define LOAD_INITIAL_SAMPLES 4096
+
+
+/* LoadConfig struct
+ *
+ * Settings of a load run, filled in from the commandline
+ *
+ * proxy_host  -> Host of the proxy
+ * proxy_port  -> Port of the proxy
+ * origin      -> host:port of the origin server the requests are for
+ * path        -> Requested path on the origin
+ * connections -> Number of concurrently loaded connections
+ * duration_s  -> Length of the run in seconds
+ * keep_alive  -> Reuse connections the server keeps open
+ * tunnel      -> Send the requests through a CONNECT tunnel per connection
+ * idle        -> Number of additional connections opened and left idle during the run
+ * proxy_pid   -> Process id of the proxy for CPU accounting, 0 to skip it
+ */
+typedef struct _load_config_
+{
+  const char *proxy_host;
+  const char *proxy_port;
+  const char *origin;
+  const char *path;
+  unsigned int connections;
+  unsigned int duration_s;
+  int keep_alive;
+  int tunnel;
+  unsigned int idle;
+  long proxy_pid;
+} LoadConfig;
+
+
+/* LoadWorker struct
+ *
+ * State and results of one loaded connection
+ *
+ * thread_id     -> Thread driving the connection
+ * latencies_ns  -> Latency of every completed request
+ * num_samples   -> Number of completed requests
+ * max_samples   -> Capacity of the latency list
+ * errors        -> Requests that failed
+ * bytes         -> Response bytes received
+ * blocked       -> Responses that were redirected or cut off by the content filter
+ * resets        -> Blocked responses that were cut off, they have no latency sample
+ * connects      -> Connections opened to the proxy
+ */
+typedef struct _load_worker_
+{
+  pthread_t thread_id;
+  uint64_t *latencies_ns;
+  size_t num_samples;
+  size_t max_samples;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t blocked;
+  uint64_t resets;
+  uint64_t connects;
+} LoadWorker;
+
+
+static LoadConfig load_config;
+
+// Monotonic time the run ends at
+static uint64_t load_end_ns;
+
+
+/* addSample
+ *
+ * Record the latency of a completed request
+ *
+ * @param worker Worker of the connection
+ * @param latency_ns Latency of the request
+ */
+static void addSample(LoadWorker *worker, uint64_t latency_ns)
+{
+        if(worker->num_samples == worker->max_samples)
+        {
+                size_t max_samples = (worker->max_samples != 0) ? 2 * worker->max_samples : LOAD_INITIAL_SAMPLES;
+                uint64_t *latencies_ns = realloc(worker->latencies_ns, max_samples * sizeof(uint64_t));
+                if(latencies_ns == NULL)
+                {
+                        return;
+                }
+                worker->latencies_ns = latencies_ns;
+                worker->max_samples = max_samples;
+        }
+
+        worker->latencies_ns[worker->num_samples++] = latency_ns;
+}
+
+
+/* loadWorker
+ *
+ * Send requests over one connection until the run ends. A request that needs a new
+ * connection includes the connect time in its latency.
+ *
+ * @param arg LoadWorker of the connection
+ */
+static void* loadWorker(void *arg)
+{
+        LoadWorker *worker = (LoadWorker *)arg;
+        BenchConnection *conn = malloc(sizeof(BenchConnection));
+        if(conn == NULL)
+        {
+                return NULL;
+        }
+        conn->fd = -1;
+
+        char request[1024];
+        int request_len;
+        if(load_config.tunnel)
+        {
+                request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                                       load_config.path, load_config.origin,
+                                       load_config.keep_alive ? "" : "Connection: close\r\n");
+        }
+        else
+        {
+                request_len = snprintf(request, sizeof(request), "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                                       load_config.origin, load_config.path, load_config.origin,
+                                       load_config.keep_alive ? "" : "Connection: close\r\n");
+        }
+
+        while(benchNowNs() < load_end_ns)
+        {
+                uint64_t start_ns = benchNowNs();
+
+                if(conn->fd == -1)
+                {
+                        if(connectBenchProxy(conn, load_config.proxy_host, load_config.proxy_port,
+                                             load_config.tunnel ? load_config.origin : NULL) != 0)
+                        {
+                                ++worker->errors;
+                                continue;
+                        }
+                        ++worker->connects;
+                }
+
+                int status = 0;
+                int keep_open = 0;
+                ssize_t body_len = -1;
+                if(send(conn->fd, request, request_len, MSG_NOSIGNAL) == request_len)
+                {
+                        body_len = readBenchResponse(conn, &status, &keep_open);
+                        keep_open = keep_open && load_config.keep_alive;
+                }
+
+                if(body_len < 0)
+                {
+                        // With early headers a blocked response is cut off with a reset
+                        if(status == 200)
+                        {
+                                ++worker->blocked;
+                                ++worker->resets;
+                        }
+                        else
+                        {
+                                ++worker->errors;
+                        }
+                        keep_open = 0;
+                }
+                else
+                {
+                        worker->bytes += body_len;
+                        if(status == 301)
+                        {
+                                ++worker->blocked;
+                        }
+                        addSample(worker, benchNowNs() - start_ns);
+                }
+
+                if(!keep_open)
+                {
+                        closeBenchConnection(conn);
+                }
+        }
+
+        closeBenchConnection(conn);
+        free(conn);
+        return NULL;
+}
+
+
+/* openIdleConnections
+ *
+ * Open connections to the proxy that send an incomplete request and then stay idle
+ *
+ * @param num_idle Number of connections
+ * @ret Sockets of the connections, -1 for the ones that could not be opened
+ */
+static int * openIdleConnections(unsigned int num_idle)
+{
+        int *fds = malloc((num_idle + 1) * sizeof(int));
+        if(fds == NULL)
+        {
+                return NULL;
+        }
+
+        for(unsigned int i = 0; i < num_idle; ++i)
+        {
+                Socket idle_socket;
+                fds[i] = -1;
+                if(initServerConnection(load_config.proxy_host, load_config.proxy_port, &idle_socket) == 0)
+                {
+                        send(idle_socket.fd_, "GET ", 4, MSG_NOSIGNAL);
+                        fds[i] = idle_socket.fd_;
+                }
+        }
+
+        return fds;
+}
+
+
+/* printUsage
+ *
+ * Print the commandline usage of the load generator
+ *
+ * @param program Name of the executable
+ */
+static void printUsage(const char *program)
+{
+        printf("Usage: %s [options] <proxy host> <proxy port> <origin host:port>\n", program);
+        printf("  -p, --path=PATH         Requested path (default /object?size=1024)\n");
+        printf("  -c, --connections=N     Concurrent connections (default 16)\n");
+        printf("  -d, --duration=SECONDS  Length of the run (default 5)\n");
+        printf("  -k, --keep-alive        Reuse connections the server keeps open\n");
+        printf("  -T, --tunnel            Send requests through a CONNECT tunnel per connection\n");
+        printf("  -i, --idle=N            Keep N additional idle connections open during the run\n");
+        printf("  -P, --proxy-pid=PID     Report CPU time of the proxy per request\n");
+        printf("  -n, --name=NAME         Name of the scenario in the result line\n");
+}
+
+
+/* main
+ *
+ * Load generator for the proxy. Drives a number of connections with back to back requests
+ * for a fixed time and reports throughput, latency percentiles and proxy CPU time per request.
+ * The last line of the output is a tab separated result line for scripts.
+ *
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ */
+int main(int argc, char *argv[])
+{
+        static const struct option long_options[] =
+                {
+                        {"path",        required_argument, NULL, 'p'},
+                        {"connections", required_argument, NULL, 'c'},
+                        {"duration",    required_argument, NULL, 'd'},
+                        {"keep-alive",  no_argument,       NULL, 'k'},
+                        {"tunnel",      no_argument,       NULL, 'T'},
+                        {"idle",        required_argument, NULL, 'i'},
+                        {"proxy-pid",   required_argument, NULL, 'P'},
+                        {"name",        required_argument, NULL, 'n'},
+                        {NULL,          0,                 NULL, 0}
+                };
+
+        const char *name = "load";
+        load_config.path = "/object?size=1024";
+        load_config.connections = 16;
+        load_config.duration_s = 5;
+        load_config.keep_alive = 0;
+        load_config.tunnel = 0;
+        load_config.idle = 0;
+        load_config.proxy_pid = 0;
+
+        int opt;
+        while((opt = getopt_long(argc, argv, "p:c:d:kTi:P:n:", long_options, NULL)) != -1)
+        {
+                switch(opt)
+                {
+                case 'p':
+                        load_config.path = optarg;
+                        break;
+                case 'c':
+                        load_config.connections = strtoul(optarg, NULL, 10);
+                        break;
+                case 'd':
+                        load_config.duration_s = strtoul(optarg, NULL, 10);
+                        break;
+                case 'k':
+                        load_config.keep_alive = 1;
+                        break;
+                case 'T':
+                        load_config.tunnel = 1;
+                        break;
+                case 'i':
+                        load_config.idle = strtoul(optarg, NULL, 10);
+                        break;
+                case 'P':
+                        load_config.proxy_pid = strtol(optarg, NULL, 10);
+                        break;
+                case 'n':
+                        name = optarg;
+                        break;
+                default:
+                        printUsage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if((argc - optind != 3) || (load_config.connections == 0))
+        {
+                printUsage(argv[0]);
+                return 1;
+        }
+        load_config.proxy_host = argv[optind];
+        load_config.proxy_port = argv[optind + 1];
+        load_config.origin = argv[optind + 2];
+
+        int *idle_fds = openIdleConnections(load_config.idle);
+
+        LoadWorker *workers = calloc(load_config.connections, sizeof(LoadWorker));
+        if(workers == NULL)
+        {
+                return 1;
+        }
+
+        uint64_t cpu_start = (load_config.proxy_pid != 0) ? processCpuTicks(load_config.proxy_pid) : 0;
+        uint64_t start_ns = benchNowNs();
+        load_end_ns = start_ns + load_config.duration_s * 1000000000ull;
+
+        for(unsigned int i = 0; i < load_config.connections; ++i)
+        {
+                pthread_create(&(workers[i].thread_id), NULL, loadWorker, workers + i);
+        }
+
+        LoadWorker total;
+        memset(&total, 0, sizeof(total));
+        for(unsigned int i = 0; i < load_config.connections; ++i)
+        {
+                pthread_join(workers[i].thread_id, NULL);
+                total.num_samples += workers[i].num_samples;
+                total.errors += workers[i].errors;
+                total.bytes += workers[i].bytes;
+                total.blocked += workers[i].blocked;
+                total.resets += workers[i].resets;
+                total.connects += workers[i].connects;
+        }
+
+        double elapsed_s = (benchNowNs() - start_ns) / 1e9;
+
+        // Session processes are reaped shortly after they ended
+        usleep(200000);
+        uint64_t cpu_end = (load_config.proxy_pid != 0) ? processCpuTicks(load_config.proxy_pid) : 0;
+
+        total.latencies_ns = malloc((total.num_samples + 1) * sizeof(uint64_t));
+        if(total.latencies_ns == NULL)
+        {
+                return 1;
+        }
+        for(unsigned int i = 0; i < load_config.connections; ++i)
+        {
+                memcpy(total.latencies_ns + total.max_samples, workers[i].latencies_ns,
+                       workers[i].num_samples * sizeof(uint64_t));
+                total.max_samples += workers[i].num_samples;
+                free(workers[i].latencies_ns);
+        }
+        qsort(total.latencies_ns, total.num_samples, sizeof(uint64_t), compareLatencies);
+
+        double percentiles[5] = {0, 0, 0, 0, 0};
+        const double quantiles[5] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        for(int i = 0; (i < 5) && (total.num_samples != 0); ++i)
+        {
+                size_t index = (size_t)(quantiles[i] * (total.num_samples - 1));
+                percentiles[i] = total.latencies_ns[index] / 1e6;
+        }
+
+        uint64_t requests = total.num_samples + total.resets;
+        double cpu_us = ((load_config.proxy_pid != 0) && (requests != 0)) ?
+                        (cpu_end - cpu_start) * 1e6 / sysconf(_SC_CLK_TCK) / requests : 0;
+
+        printf("%s: %u connections (%s%s), %u idle, %.1f s\n", name, load_config.connections,
+               load_config.tunnel ? "CONNECT tunnel" : "proxy GET", load_config.keep_alive ? ", keep-alive" : "",
+               load_config.idle, elapsed_s);
+        printf("  requests %lu (%.0f/s), blocked %lu, errors %lu, connections opened %lu\n",
+               total.num_samples, total.num_samples / elapsed_s, total.blocked, total.errors, total.connects);
+        printf("  throughput %.2f MB/s\n", total.bytes / elapsed_s / 1e6);
+        printf("  latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+               percentiles[0], percentiles[1], percentiles[2], percentiles[3], percentiles[4]);
+        if(load_config.proxy_pid != 0)
+        {
+                printf("  proxy CPU %.1f us/request\n", cpu_us);
+        }
+        printf("RESULT\t%s\t%.0f\t%.2f\t%.3f\t%.3f\t%.3f\t%.1f\t%lu\n", name, total.num_samples / elapsed_s,
+               total.bytes / elapsed_s / 1e6, percentiles[0], percentiles[2], percentiles[3], cpu_us, total.errors);
+
+        for(unsigned int i = 0; (idle_fds != NULL) && (i < load_config.idle); ++i)
+        {
+                if(idle_fds[i] != -1)
+                {
+                        close(idle_fds[i]);
+                }
+        }
+        free(idle_fds);
+        free(total.latencies_ns);
+        free(workers);
+
+        return 0;
+}
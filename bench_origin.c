@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "util_socket.h"
+
+// Size of the pattern response bodies are cut from
+#define BENCH_PATTERN_SIZE 65536
+
+// Longest request header the origin reads
+#define BENCH_REQUEST_SIZE 16384
+
+// Word the content filter blocks, put at the end of bodies requested with blocked=1
+#define BENCH_BLOCKED_WORD " spongebob "
+
+
+/* BenchObject struct
+ *
+ * Response requested with the query parameters of the request path
+ *
+ * size     -> Size of the body (size=N, default 1024)
+ * delay_ms -> Delay before the response is sent (delay=MS, default 0)
+ * chunked  -> Send the body with chunked transfer encoding (chunked=1)
+ * blocked  -> End the body with a word blocked by the content filter (blocked=1)
+ * binary   -> Send the body as application/octet-stream instead of text/html (binary=1)
+ */
+typedef struct _bench_object_
+{
+  size_t size;
+  unsigned int delay_ms;
+  int chunked;
+  int blocked;
+  int binary;
+} BenchObject;
+
+
+// Text the bodies are made of, filled in once at startup
+static char body_pattern[BENCH_PATTERN_SIZE];
+
+
+/* queryValue
+ *
+ * Get the numeric value of a query parameter of a request path
+ *
+ * @param path Request path, up to the end of the request line
+ * @param name Name of the parameter followed by '='
+ * @param default_value Value if the parameter is not set
+ * @ret Value of the parameter
+ */
+static unsigned long queryValue(const char *path, const char *name, unsigned long default_value)
+{
+        const char *query = strchr(path, '?');
+        size_t name_len = strlen(name);
+
+        while(query != NULL)
+        {
+                ++query;
+                if(strncmp(query, name, name_len) == 0)
+                {
+                        return strtoul(query + name_len, NULL, 10);
+                }
+                query = strpbrk(query, "& ");
+                if((query != NULL) && (*query == ' '))
+                {
+                        break;
+                }
+        }
+
+        return default_value;
+}
+
+
+/* parseBenchObject
+ *
+ * Get the requested response from a request header
+ *
+ * @param request Request header, null terminated
+ * @ret object Requested response
+ */
+static void parseBenchObject(const char *request, BenchObject *object)
+{
+        const char *path = strchr(request, ' ');
+        path = (path != NULL) ? path + 1 : "";
+
+        object->size = queryValue(path, "size=", 1024);
+        object->delay_ms = queryValue(path, "delay=", 0);
+        object->chunked = queryValue(path, "chunked=", 0) != 0;
+        object->blocked = queryValue(path, "blocked=", 0) != 0;
+        object->binary = queryValue(path, "binary=", 0) != 0;
+}
+
+
+/* sendAll
+ *
+ * Send a whole buffer
+ *
+ * @param fd Socket to send to
+ * @param buffer Data to send
+ * @param len Length of the data
+ * @ret 0 on success, -1 if the connection failed
+ */
+static int sendAll(int fd, const char *buffer, size_t len)
+{
+        while(len > 0)
+        {
+                ssize_t n = send(fd, buffer, len, MSG_NOSIGNAL);
+                if(n <= 0)
+                {
+                        if((n == -1) && (errno == EINTR))
+                        {
+                                continue;
+                        }
+                        return -1;
+                }
+                buffer += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+
+/* sendBody
+ *
+ * Send a response body cut from the pattern, ending with the blocked word if requested
+ *
+ * @param fd Socket to send to
+ * @param object Requested response
+ * @ret 0 on success, -1 if the connection failed
+ */
+static int sendBody(int fd, const BenchObject *object)
+{
+        size_t word_len = strlen(BENCH_BLOCKED_WORD);
+        size_t pattern_len = (object->blocked && (object->size >= word_len)) ? object->size - word_len :
+                                                                                object->size;
+        size_t sent = 0;
+
+        while(sent < pattern_len)
+        {
+                size_t len = pattern_len - sent;
+                len = (len < BENCH_PATTERN_SIZE) ? len : BENCH_PATTERN_SIZE;
+
+                if(object->chunked)
+                {
+                        char chunk_size[32];
+                        int chunk_size_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", len);
+                        if(sendAll(fd, chunk_size, chunk_size_len) != 0)
+                        {
+                                return -1;
+                        }
+                }
+                if((sendAll(fd, body_pattern, len) != 0) ||
+                   (object->chunked && (sendAll(fd, "\r\n", 2) != 0)))
+                {
+                        return -1;
+                }
+                sent += len;
+        }
+
+        if(pattern_len != object->size)
+        {
+                char chunk_size[32];
+                int chunk_size_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", word_len);
+                if((object->chunked && (sendAll(fd, chunk_size, chunk_size_len) != 0)) ||
+                   (sendAll(fd, BENCH_BLOCKED_WORD, word_len) != 0) ||
+                   (object->chunked && (sendAll(fd, "\r\n", 2) != 0)))
+                {
+                        return -1;
+                }
+        }
+
+        return object->chunked ? sendAll(fd, "0\r\n\r\n", 5) : 0;
+}
+
+
+/* originConnection
+ *
+ * Serve the requests of one connection until the client closes it or asks for
+ * Connection: close
+ *
+ * @param arg Socket of the connection (intptr_t)
+ */
+static void* originConnection(void *arg)
+{
+        int fd = (int)(intptr_t)arg;
+        char request[BENCH_REQUEST_SIZE + 1];
+        size_t request_len = 0;
+
+        while(1)
+        {
+                char *header_end;
+                request[request_len] = '\0';
+                while((header_end = strstr(request, "\r\n\r\n")) == NULL)
+                {
+                        if(request_len == BENCH_REQUEST_SIZE)
+                        {
+                                goto end;
+                        }
+                        ssize_t n = recv(fd, request + request_len, BENCH_REQUEST_SIZE - request_len, 0);
+                        if(n <= 0)
+                        {
+                                goto end;
+                        }
+                        request_len += n;
+                        request[request_len] = '\0';
+                }
+
+                BenchObject object;
+                parseBenchObject(request, &object);
+                int close_connection = (strstr(request, "Connection: close") != NULL) ||
+                                       (strstr(request, "connection: close") != NULL);
+
+                if(object.delay_ms > 0)
+                {
+                        struct timespec delay;
+                        delay.tv_sec = object.delay_ms / 1000;
+                        delay.tv_nsec = (object.delay_ms % 1000) * 1000000L;
+                        nanosleep(&delay, NULL);
+                }
+
+                char header[256];
+                int header_len;
+                const char *content_type = object.binary ? "application/octet-stream" : "text/html";
+                if(object.chunked)
+                {
+                        header_len = snprintf(header, sizeof(header),
+                                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                                              "Transfer-Encoding: chunked\r\n%s\r\n",
+                                              content_type, close_connection ? "Connection: close\r\n" : "");
+                }
+                else
+                {
+                        header_len = snprintf(header, sizeof(header),
+                                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                                              "Content-Length: %zu\r\n%s\r\n",
+                                              content_type, object.size,
+                                              close_connection ? "Connection: close\r\n" : "");
+                }
+
+                if((sendAll(fd, header, header_len) != 0) || (sendBody(fd, &object) != 0) || close_connection)
+                {
+                        goto end;
+                }
+
+                // Keep what was received after this request
+                size_t consumed = header_end + 4 - request;
+                memmove(request, request + consumed, request_len - consumed);
+                request_len -= consumed;
+        }
+
+end:
+        close(fd);
+        return NULL;
+}
+
+
+/* main
+ *
+ * Local origin server for benchmarking the proxy. Every request is answered with a
+ * generated body, shaped by the query parameters of the path:
+ * size=N, delay=MS, chunked=1, blocked=1, binary=1 (e.g. /object?size=65536&chunked=1)
+ *
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ */
+int main(int argc, char *argv[])
+{
+        if(argc != 2)
+        {
+                printf("Usage: %s <port>\n", argv[0]);
+                return 1;
+        }
+
+        const char *words = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod ";
+        size_t words_len = strlen(words);
+        for(size_t i = 0; i < BENCH_PATTERN_SIZE; ++i)
+        {
+                body_pattern[i] = words[i % words_len];
+        }
+
+        Socket listen_socket;
+        initSocket(&listen_socket);
+        if(openListeningSocket("127.0.0.1", argv[1], &listen_socket) != 0)
+        {
+                return 1;
+        }
+
+        while(1)
+        {
+                Socket client_socket;
+                initSocket(&client_socket);
+                if(acceptConnection(&listen_socket, &client_socket, NULL) != 0)
+                {
+                        continue;
+                }
+
+                pthread_t thread_id;
+                if(pthread_create(&thread_id, NULL, originConnection, (void *)(intptr_t)client_socket.fd_) != 0)
+                {
+                        close(client_socket.fd_);
+                        continue;
+                }
+                pthread_detach(thread_id);
+        }
+
+        return 0;
+}
@@ -0,0 +1,540 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "blocklist.h"
+#include "filter.h"
+
+
+/* Currently published blocklist and the one it replaced, freed one reload later
+ * (see publishFilterMatcher)
+ */
+static Blocklist *current_blocklist = NULL;
+static Blocklist *retired_blocklist = NULL;
+
+
+/* Hash of a trie edge: FNV-1a over the folded label, seeded with the parent node,
+ * finished with a final mix so the low bits select the slot
+ */
+#define EDGE_HASH_INIT(parent) (2166136261u ^ ((parent) * 0x9E3779B1u))
+#define EDGE_HASH_STEP(hash, c) (((hash) ^ (uint8_t)(c)) * 16777619u)
+
+static inline uint32_t finishEdgeHash(uint32_t hash)
+{
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6bu;
+        hash ^= hash >> 13;
+        return hash;
+}
+
+
+/* parseEntry
+ *
+ * Find the host name of a blocklist line and its kind. Hosts file lines ("0.0.0.0 example.com")
+ * use the last field of the line.
+ *
+ * @param entry Blocklist line
+ * @ret host_len Length of the host name
+ * @ret flags BLOCKLIST_WILDCARD for "*.example.com" or ".example.com", BLOCKLIST_EXACT otherwise
+ * @ret Start of the host name, NULL if the entry is no valid host name
+ */
+static const char * parseEntry(const char *entry, size_t *host_len_ret, uint8_t *flags)
+{
+        const char *host = entry;
+        size_t host_len = 0;
+
+        // Last whitespace separated field
+        for(const char *c = entry; *c != '\0'; ++c)
+        {
+                if(!isspace((unsigned char)*c) && ((c == entry) || isspace((unsigned char)c[-1])))
+                {
+                        host = c;
+                }
+        }
+        while((host[host_len] != '\0') && !isspace((unsigned char)host[host_len]))
+        {
+                ++host_len;
+        }
+
+        *flags = BLOCKLIST_EXACT;
+        if((host_len >= 2) && (host[0] == '*') && (host[1] == '.'))
+        {
+                *flags = BLOCKLIST_WILDCARD;
+                host += 2;
+                host_len -= 2;
+        }
+        else if((host_len >= 1) && (host[0] == '.'))
+        {
+                *flags = BLOCKLIST_WILDCARD;
+                host += 1;
+                host_len -= 1;
+        }
+
+        if((host_len > 0) && (host[host_len - 1] == '.'))
+        {
+                --host_len;
+        }
+        if(host_len == 0)
+        {
+                return NULL;
+        }
+
+        // Every label must be 1 - 63 characters
+        size_t label_len = 0;
+        for(size_t i = 0; i <= host_len; ++i)
+        {
+                if((i == host_len) || (host[i] == '.'))
+                {
+                        if((label_len == 0) || (label_len > BLOCKLIST_MAX_LABEL))
+                        {
+                                return NULL;
+                        }
+                        label_len = 0;
+                }
+                else
+                {
+                        ++label_len;
+                }
+        }
+
+        *host_len_ret = host_len;
+        return host;
+}
+
+
+/* findChild
+ *
+ * Look up the child of a node for a label
+ *
+ * @param blocklist Blocklist to search
+ * @param parent Parent node
+ * @param label Label in any case
+ * @param label_len Length of the label
+ * @ret slot_ret Slot of the child, or the empty slot where it would be inserted
+ * @ret Index of the child, 0 if there is none
+ */
+static inline uint32_t findChild(const Blocklist *blocklist, uint32_t parent, const char *label, size_t label_len,
+                                 uint32_t *slot_ret)
+{
+        uint8_t folded[BLOCKLIST_MAX_LABEL];
+        uint32_t hash = EDGE_HASH_INIT(parent);
+
+        if(label_len > BLOCKLIST_MAX_LABEL)
+        {
+                *slot_ret = UINT32_MAX;
+                return 0;
+        }
+
+        for(size_t i = 0; i < label_len; ++i)
+        {
+                uint8_t c = (uint8_t)label[i];
+                folded[i] = ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+                hash = EDGE_HASH_STEP(hash, folded[i]);
+        }
+        hash = finishEdgeHash(hash);
+
+        uint32_t slot = hash & blocklist->slot_mask;
+        while(blocklist->slots[slot].node != 0)
+        {
+                if(blocklist->slots[slot].tag == hash)
+                {
+                        const BlocklistNode *node = blocklist->nodes + blocklist->slots[slot].node;
+                        if((node->parent == parent) && (node->label_len == label_len) &&
+                           (memcmp(blocklist->label_pool + node->label_offset, folded, label_len) == 0))
+                        {
+                                *slot_ret = slot;
+                                return blocklist->slots[slot].node;
+                        }
+                }
+                slot = (slot + 1) & blocklist->slot_mask;
+        }
+
+        *slot_ret = slot;
+        return 0;
+}
+
+
+/* addChild
+ *
+ * Add a child node for a label to the blocklist under construction
+ *
+ * @param blocklist Blocklist being built, with room for the node and its label
+ * @param parent Parent node
+ * @param label Label in any case
+ * @param label_len Length of the label
+ * @param slot Empty slot returned by findChild
+ * @ret Index of the new node
+ */
+static uint32_t addChild(Blocklist *blocklist, uint32_t parent, const char *label, size_t label_len, uint32_t slot)
+{
+        uint32_t hash = EDGE_HASH_INIT(parent);
+        BlocklistNode *node = blocklist->nodes + blocklist->num_nodes;
+        char *pool_label = blocklist->label_pool + blocklist->pool_size;
+
+        for(size_t i = 0; i < label_len; ++i)
+        {
+                uint8_t c = (uint8_t)label[i];
+                pool_label[i] = ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+                hash = EDGE_HASH_STEP(hash, pool_label[i]);
+        }
+
+        node->parent = parent;
+        node->label_offset = blocklist->pool_size;
+        node->label_len = label_len;
+        node->flags = 0;
+        blocklist->pool_size += label_len;
+
+        blocklist->slots[slot].tag = finishEdgeHash(hash);
+        blocklist->slots[slot].node = blocklist->num_nodes;
+
+        return blocklist->num_nodes++;
+}
+
+
+/* buildBlocklist
+ *
+ * Build the reversed label trie for a list of blocked hosts. Every entry is inserted from its
+ * top level domain downwards into a table sized for the total number of labels, which is
+ * shrunk to the distinct labels once at the end.
+ *
+ * @param entries Host names or wildcards, invalid entries are skipped
+ * @param num_entries Number of entries
+ * @ret Allocated blocklist, NULL if allocation failed or the list is too large
+ */
+Blocklist * buildBlocklist(const char **entries, size_t num_entries)
+{
+        size_t max_nodes = 1;
+        size_t max_pool = 0;
+
+        // Upper bounds for the number of nodes and the pool size
+        for(size_t i = 0; i < num_entries; ++i)
+        {
+                for(const char *c = entries[i]; *c != '\0'; ++c)
+                {
+                        max_nodes += (*c == '.');
+                        ++max_pool;
+                }
+                ++max_nodes;
+        }
+
+        size_t num_slots = 1024;
+        while(num_slots < max_nodes + max_nodes / 2)
+        {
+                num_slots *= 2;
+        }
+
+        if((max_nodes >= UINT32_MAX) || (max_pool >= UINT32_MAX) || (num_slots > UINT32_MAX))
+        {
+                fprintf(stderr, "ERROR: Blocklist too large\n");
+                return NULL;
+        }
+
+        Blocklist *blocklist = malloc(sizeof(Blocklist));
+        if(blocklist == NULL)
+        {
+                goto error_alloc;
+        }
+
+        blocklist->nodes = malloc(max_nodes * sizeof(BlocklistNode));
+        blocklist->slots = calloc(num_slots, sizeof(BlocklistSlot));
+        blocklist->label_pool = malloc(max_pool + 1);
+        if((blocklist->nodes == NULL) || (blocklist->slots == NULL) || (blocklist->label_pool == NULL))
+        {
+                goto error_alloc;
+        }
+
+        blocklist->slot_mask = num_slots - 1;
+        blocklist->num_nodes = 1;
+        blocklist->pool_size = 0;
+        blocklist->num_entries = 0;
+        memset(blocklist->nodes, 0, sizeof(BlocklistNode));
+
+        for(size_t i = 0; i < num_entries; ++i)
+        {
+                size_t host_len = 0;
+                uint8_t flags = 0;
+                const char *host = parseEntry(entries[i], &host_len, &flags);
+                if(host == NULL)
+                {
+                        fprintf(stderr, "WARNING: Skipping invalid blocklist entry '%s'\n", entries[i]);
+                        continue;
+                }
+
+                uint32_t node = 0;
+                size_t label_end = host_len;
+                while(1)
+                {
+                        size_t label_start = label_end;
+                        while((label_start > 0) && (host[label_start - 1] != '.'))
+                        {
+                                --label_start;
+                        }
+
+                        uint32_t slot;
+                        size_t label_len = label_end - label_start;
+                        uint32_t child = findChild(blocklist, node, host + label_start, label_len, &slot);
+                        if(child == 0)
+                        {
+                                child = addChild(blocklist, node, host + label_start, label_len, slot);
+                        }
+                        node = child;
+
+                        if(label_start == 0)
+                        {
+                                break;
+                        }
+                        label_end = label_start - 1;
+                }
+
+                blocklist->num_entries += (blocklist->nodes[node].flags & flags) == 0;
+                blocklist->nodes[node].flags |= flags;
+        }
+
+        // The table was sized for every label, shrink it to the labels that are actually distinct
+        size_t compact_slots = 1024;
+        while(compact_slots < (size_t)blocklist->num_nodes + blocklist->num_nodes / 2)
+        {
+                compact_slots *= 2;
+        }
+        BlocklistSlot *compact = (compact_slots < num_slots) ? calloc(compact_slots, sizeof(BlocklistSlot)) : NULL;
+        if(compact != NULL)
+        {
+                for(size_t i = 0; i < num_slots; ++i)
+                {
+                        if(blocklist->slots[i].node != 0)
+                        {
+                                size_t slot = blocklist->slots[i].tag & (compact_slots - 1);
+                                while(compact[slot].node != 0)
+                                {
+                                        slot = (slot + 1) & (compact_slots - 1);
+                                }
+                                compact[slot] = blocklist->slots[i];
+                        }
+                }
+                free(blocklist->slots);
+                blocklist->slots = compact;
+                blocklist->slot_mask = compact_slots - 1;
+        }
+
+        // Give back unused space, the trie is only read from now on
+        BlocklistNode *final_nodes = realloc(blocklist->nodes, blocklist->num_nodes * sizeof(BlocklistNode));
+        if(final_nodes != NULL)
+        {
+                blocklist->nodes = final_nodes;
+        }
+        char *final_pool = realloc(blocklist->label_pool, blocklist->pool_size + 1);
+        if(final_pool != NULL)
+        {
+                blocklist->label_pool = final_pool;
+        }
+
+        return blocklist;
+
+
+        // Cleanup
+error_alloc:
+        fprintf(stderr, "ERROR: Could not build blocklist\n");
+        if(blocklist != NULL)
+        {
+                free(blocklist->nodes);
+                free(blocklist->slots);
+                free(blocklist->label_pool);
+                free(blocklist);
+        }
+        return NULL;
+}
+
+
+/* loadBlocklist
+ *
+ * Build a blocklist from a file with one host name or wildcard per line. Empty lines and lines
+ * starting with '#' are skipped.
+ *
+ * @param path Path of the blocklist file
+ * @ret Allocated blocklist, NULL on error
+ */
+Blocklist * loadBlocklist(const char *path)
+{
+        assert(path != NULL);
+
+        char **entries = NULL;
+        size_t num_entries = 0;
+
+        if(readWordList(path, &entries, &num_entries) != 0)
+        {
+                return NULL;
+        }
+
+        Blocklist *blocklist = buildBlocklist((const char **)entries, num_entries);
+        freeWordList(entries, num_entries);
+
+        return blocklist;
+}
+
+
+/* freeBlocklist
+ *
+ * Free a blocklist
+ *
+ * @param blocklist Blocklist to free (can be NULL)
+ */
+void freeBlocklist(Blocklist *blocklist)
+{
+        if(blocklist == NULL)
+        {
+                return;
+        }
+
+        free(blocklist->nodes);
+        free(blocklist->slots);
+        free(blocklist->label_pool);
+        free(blocklist);
+}
+
+
+/* isHostBlocked
+ *
+ * Check if a host is on the blocklist. The labels of the host are looked up from the top
+ * level domain downwards, stopping at the first label that is not in the trie or at a wildcard.
+ *
+ * @param blocklist Blocklist to check against (can be NULL)
+ * @param host Host name without port, any case
+ * @ret True if the host is blocked
+ */
+int isHostBlocked(const Blocklist *blocklist, const char *host)
+{
+        assert(host != NULL);
+
+        if(blocklist == NULL)
+        {
+                return 0;
+        }
+
+        size_t label_end = strlen(host);
+        if((label_end > 0) && (host[label_end - 1] == '.'))
+        {
+                --label_end;
+        }
+        if(label_end == 0)
+        {
+                return 0;
+        }
+
+        uint32_t node = 0;
+        while(1)
+        {
+                size_t label_start = label_end;
+                while((label_start > 0) && (host[label_start - 1] != '.'))
+                {
+                        --label_start;
+                }
+
+                uint32_t slot;
+                node = findChild(blocklist, node, host + label_start, label_end - label_start, &slot);
+                if(node == 0)
+                {
+                        return 0;
+                }
+
+                uint8_t flags = blocklist->nodes[node].flags;
+                if(flags & BLOCKLIST_WILDCARD)
+                {
+                        return 1;
+                }
+                if(label_start == 0)
+                {
+                        return (flags & BLOCKLIST_EXACT) != 0;
+                }
+
+                label_end = label_start - 1;
+        }
+}
+
+
+/* acquireBlocklist
+ *
+ * Get the currently published blocklist
+ *
+ * @ret Current blocklist, NULL if no blocklist is configured
+ */
+const Blocklist * acquireBlocklist(void)
+{
+        return __atomic_load_n(&current_blocklist, __ATOMIC_ACQUIRE);
+}
+
+
+/* loadAndPublishBlocklist
+ *
+ * Load the blocklist file and publish it, replacing the current blocklist
+ *
+ * @param path Path of the blocklist file
+ * @ret 0 on success
+ *      -1 if the blocklist could not be loaded, the current blocklist stays in place
+ */
+static int loadAndPublishBlocklist(const char *path)
+{
+        struct timespec start;
+        struct timespec end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Blocklist *blocklist = loadBlocklist(path);
+        if(blocklist == NULL)
+        {
+                fprintf(stderr, "ERROR: Could not load blocklist\n");
+                return -1;
+        }
+
+        Blocklist *previous = __atomic_exchange_n(&current_blocklist, blocklist, __ATOMIC_ACQ_REL);
+        freeBlocklist(retired_blocklist);
+        retired_blocklist = previous;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double load_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        printf("Blocklist loaded: %u entries, %u nodes, %zu bytes, %.2f ms\n",
+               blocklist->num_entries, blocklist->num_nodes,
+               blocklist->num_nodes * sizeof(BlocklistNode) +
+               (blocklist->slot_mask + 1) * sizeof(BlocklistSlot) + blocklist->pool_size, load_ms);
+
+        return 0;
+}
+
+
+/* initBlocklist
+ *
+ * Load and publish the initial blocklist
+ *
+ * @param path Path of the blocklist file, NULL if no hosts are blocked
+ * @ret 0 on success, -1 on error
+ */
+int initBlocklist(const char *path)
+{
+        if(path == NULL)
+        {
+                return 0;
+        }
+
+        return loadAndPublishBlocklist(path);
+}
+
+
+/* reloadBlocklist
+ *
+ * Reload the blocklist file. On failure the current blocklist stays in place.
+ *
+ * @param path Path of the blocklist file, NULL if no hosts are blocked
+ * @ret 0 on success, -1 on error
+ */
+int reloadBlocklist(const char *path)
+{
+        if(path == NULL)
+        {
+                return 0;
+        }
+
+        printf("Reloading blocklist\n");
+        return loadAndPublishBlocklist(path);
+}
@@ -0,0 +1,87 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Node flag: the host of the node itself is blocked
+#define BLOCKLIST_EXACT 0x1
+
+// Node flag: the host of the node and all hosts below it are blocked
+#define BLOCKLIST_WILDCARD 0x2
+
+// Longest label of a host name (RFC 1035)
+#define BLOCKLIST_MAX_LABEL 63
+
+
+/* BlocklistNode struct
+ *
+ * Node of the reversed label trie. The root (node 0) is the empty name, its children are top
+ * level domains and so on.
+ *
+ * parent       -> Index of the parent node
+ * label_offset -> Offset of the (lower case) label in the label pool
+ * label_len    -> Length of the label
+ * flags        -> BLOCKLIST_* flags
+ */
+typedef struct _blocklist_node_
+{
+  uint32_t parent;
+  uint32_t label_offset;
+  uint8_t label_len;
+  uint8_t flags;
+} BlocklistNode;
+
+
+/* BlocklistSlot struct
+ *
+ * Slot of the hash table holding the trie edges, keyed by parent node and label. The tag is the
+ * full hash, so probing a foreign slot rarely touches its node.
+ *
+ * tag  -> Hash of the edge
+ * node -> Child node of the edge, 0 for an empty slot (the root is no child)
+ */
+typedef struct _blocklist_slot_
+{
+  uint32_t tag;
+  uint32_t node;
+} BlocklistSlot;
+
+
+/* Blocklist struct
+ *
+ * Set of blocked hosts. Entries are host names ("ads.example.com") or wildcards
+ * ("*.example.com" or ".example.com", blocking example.com and every host below it).
+ * Every label of a host costs one hash probe, independent of the number of siblings.
+ *
+ * nodes       -> Trie nodes, node 0 is the root
+ * num_nodes   -> Number of nodes
+ * slots       -> Hash table of the trie edges
+ * slot_mask   -> Number of slots - 1 (power of two)
+ * label_pool  -> Labels of all nodes, not null terminated
+ * pool_size   -> Size of the label pool
+ * num_entries -> Number of distinct entries
+ */
+typedef struct _blocklist_
+{
+  BlocklistNode *nodes;
+  uint32_t num_nodes;
+  BlocklistSlot *slots;
+  uint32_t slot_mask;
+  char *label_pool;
+  uint32_t pool_size;
+  uint32_t num_entries;
+} Blocklist;
+
+
+Blocklist * buildBlocklist(const char **entries, size_t num_entries);
+Blocklist * loadBlocklist(const char *path);
+void freeBlocklist(Blocklist *blocklist);
+
+int isHostBlocked(const Blocklist *blocklist, const char *host);
+
+const Blocklist * acquireBlocklist(void);
+int initBlocklist(const char *path);
+int reloadBlocklist(const char *path);
+
+#endif
@@ -0,0 +1,212 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "breaker.h"
+#include "config.h"
+#include "latency.h"
+#include "shm.h"
+#include "stats.h"
+
+
+/* Breakers in shared memory, created before sessions are forked.
+ * NULL while the circuit breakers are disabled.
+ */
+static BreakerEntry *breakers = NULL;
+
+// Fields of the state word
+#define BREAKER_STATE_MASK 3ull
+#define BREAKER_TIMED_OUT 4ull
+#define BREAKER_COUNT_SHIFT 3
+#define BREAKER_COUNT_MAX 0x1fffull
+#define BREAKER_UNTIL_SHIFT 16
+
+
+/* initCircuitBreakers
+ *
+ * Create the breaker table in shared memory. Does nothing if the breakers are disabled.
+ *
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initCircuitBreakers(void)
+{
+        if(proxy_config.breaker_failures == 0)
+        {
+                return 0;
+        }
+
+        breakers = createSharedMemory(BREAKER_SLOTS * sizeof(BreakerEntry));
+
+        return (breakers != NULL) ? 0 : -1;
+}
+
+
+/* packState
+ *
+ * Build a state word
+ */
+static uint64_t packState(BreakerState state, int timed_out, uint64_t count, uint64_t until_ms)
+{
+        if(count > BREAKER_COUNT_MAX)
+        {
+                count = BREAKER_COUNT_MAX;
+        }
+
+        return (uint64_t)state | (timed_out ? BREAKER_TIMED_OUT : 0) | (count << BREAKER_COUNT_SHIFT) |
+               (until_ms << BREAKER_UNTIL_SHIFT);
+}
+
+
+/* allowBreakerRequest
+ *
+ * Check if a request to a host may resolve and connect. While the breaker of the host is open
+ * the request fails fast. Once the open period is over a single request goes through as probe,
+ * another one only when the probe did not report within its lease.
+ *
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @ret timed_out True if the last failure of the host was a timeout
+ * @ret True if the request may go through, false if it has to fail fast
+ */
+int allowBreakerRequest(const char *hostname, const char *port, int *timed_out)
+{
+        assert(hostname != NULL);
+        assert(port != NULL);
+        assert(timed_out != NULL);
+
+        *timed_out = 0;
+        if(breakers == NULL)
+        {
+                return 1;
+        }
+
+        uint64_t key = hashHostPort(hostname, port);
+        BreakerEntry *entry = breakers + (key & (BREAKER_SLOTS - 1));
+        if(__atomic_load_n(&(entry->key), __ATOMIC_ACQUIRE) != key)
+        {
+                return 1;
+        }
+
+        uint64_t now_ms = monotonicNs() / 1000000;
+        uint64_t state = __atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE);
+        while((state & BREAKER_STATE_MASK) != BREAKER_CLOSED)
+        {
+                if(now_ms < (state >> BREAKER_UNTIL_SHIFT))
+                {
+                        *timed_out = (state & BREAKER_TIMED_OUT) != 0;
+                        addProxyCounter(STAT_BREAKER_REJECTED, 1);
+                        return 0;
+                }
+
+                // Open period or probe lease is over, this request probes the host
+                uint64_t probe_state = packState(BREAKER_HALF_OPEN, state & BREAKER_TIMED_OUT,
+                                                 (state >> BREAKER_COUNT_SHIFT) & BREAKER_COUNT_MAX,
+                                                 now_ms + BREAKER_PROBE_LEASE_MS);
+                if(__atomic_compare_exchange_n(&(entry->state), &state, probe_state, 1,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                        addProxyCounter(STAT_BREAKER_HALF_OPENED, 1);
+                        return 1;
+                }
+        }
+
+        return 1;
+}
+
+
+/* reportBreakerResult
+ *
+ * Report the result of resolving and connecting to a host to its breaker. A success closes the
+ * breaker. Failures open a closed breaker once the configured number happened in a row; a
+ * failed probe opens it again for twice the previous period, up to 2^BREAKER_MAX_BACKOFF_SHIFT
+ * times the configured period.
+ *
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @param result BreakerResult of the request
+ */
+void reportBreakerResult(const char *hostname, const char *port, BreakerResult result)
+{
+        assert(hostname != NULL);
+        assert(port != NULL);
+
+        if(breakers == NULL)
+        {
+                return;
+        }
+
+        uint64_t key = hashHostPort(hostname, port);
+        BreakerEntry *entry = breakers + (key & (BREAKER_SLOTS - 1));
+        uint64_t state = __atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&(entry->key), __ATOMIC_ACQUIRE) != key)
+        {
+                // Only failing hosts need a breaker, and only a closed one is taken over
+                if((result == BREAKER_SUCCESS) || ((state & BREAKER_STATE_MASK) != BREAKER_CLOSED))
+                {
+                        return;
+                }
+                __atomic_store_n(&(entry->state), 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&(entry->key), key, __ATOMIC_RELEASE);
+                state = 0;
+        }
+
+        uint64_t now_ms = monotonicNs() / 1000000;
+        int timed_out = (result == BREAKER_FAILURE_TIMEOUT);
+
+        while(1)
+        {
+                BreakerState current = state & BREAKER_STATE_MASK;
+                uint64_t count = (state >> BREAKER_COUNT_SHIFT) & BREAKER_COUNT_MAX;
+                uint64_t new_state;
+                ProxyCounter transition = STAT_NUM_COUNTERS;
+
+                if(result == BREAKER_SUCCESS)
+                {
+                        if(state == 0)
+                        {
+                                return;
+                        }
+                        new_state = 0;
+                        if(current != BREAKER_CLOSED)
+                        {
+                                transition = STAT_BREAKER_CLOSED;
+                        }
+                }
+                else if(current == BREAKER_CLOSED)
+                {
+                        if(count + 1 >= proxy_config.breaker_failures)
+                        {
+                                new_state = packState(BREAKER_OPEN, timed_out, 0,
+                                                      now_ms + proxy_config.breaker_open_time * 1000ull);
+                                transition = STAT_BREAKER_OPENED;
+                        }
+                        else
+                        {
+                                new_state = packState(BREAKER_CLOSED, timed_out, count + 1, 0);
+                        }
+                }
+                else if(current == BREAKER_HALF_OPEN)
+                {
+                        unsigned int shift = (count + 1 < BREAKER_MAX_BACKOFF_SHIFT) ? count + 1 : BREAKER_MAX_BACKOFF_SHIFT;
+                        new_state = packState(BREAKER_OPEN, timed_out, count + 1,
+                                              now_ms + (proxy_config.breaker_open_time * 1000ull << shift));
+                        transition = STAT_BREAKER_OPENED;
+                }
+                else
+                {
+                        // Started before the breaker opened, the failure is known already
+                        return;
+                }
+
+                if(__atomic_compare_exchange_n(&(entry->state), &state, new_state, 1,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                        if(transition != STAT_NUM_COUNTERS)
+                        {
+                                addProxyCounter(transition, 1);
+                        }
+                        return;
+                }
+        }
+}
@@ -0,0 +1,73 @@
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stdint.h>
+
+// Entries of the breaker table (power of two)
+#define BREAKER_SLOTS 8192
+
+// Longest open period as a power of two of the configured one, reached after repeated failed probes
+#define BREAKER_MAX_BACKOFF_SHIFT 5
+
+// Milliseconds a half-open probe may take before another session may probe
+#define BREAKER_PROBE_LEASE_MS 30000
+
+
+/* BreakerState
+ *
+ * State of the circuit breaker of a host
+ *
+ * BREAKER_CLOSED    -> Requests go through, consecutive failures are counted
+ * BREAKER_OPEN      -> Requests fail fast until the open period is over
+ * BREAKER_HALF_OPEN -> One probe request goes through, the others fail fast
+ */
+typedef enum _breaker_state_
+{
+  BREAKER_CLOSED,
+  BREAKER_OPEN,
+  BREAKER_HALF_OPEN
+} BreakerState;
+
+
+/* BreakerResult
+ *
+ * Result of resolving and connecting to a host, reported to its breaker
+ *
+ * BREAKER_SUCCESS         -> The host was connected to
+ * BREAKER_FAILURE         -> The host could not be resolved or refused the connection
+ * BREAKER_FAILURE_TIMEOUT -> Connecting to the host timed out
+ */
+typedef enum _breaker_result_
+{
+  BREAKER_SUCCESS,
+  BREAKER_FAILURE,
+  BREAKER_FAILURE_TIMEOUT
+} BreakerResult;
+
+
+/* BreakerEntry struct
+ *
+ * Circuit breaker of a host in shared memory. A failing host takes over the entry of its slot
+ * if the breaker of the previous host there is closed. The state is a single word changed with CAS:
+ *
+ * bits 0-1   -> BreakerState
+ * bit 2      -> The last failure was a timeout
+ * bits 3-15  -> Consecutive failures while closed, failed probes while open or half-open
+ * bits 16-63 -> Monotonic time in milliseconds the open period or the probe lease ends
+ *
+ * key   -> Hash of the host and port, 0 if the entry is unused
+ * state -> Packed state word
+ */
+typedef struct _breaker_entry_
+{
+  uint64_t key;
+  uint64_t state;
+} BreakerEntry;
+
+
+int initCircuitBreakers(void);
+
+int allowBreakerRequest(const char *hostname, const char *port, int *timed_out);
+void reportBreakerResult(const char *hostname, const char *port, BreakerResult result);
+
+#endif
@@ -0,0 +1,417 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "clientlimit.h"
+#include "config.h"
+#include "shm.h"
+#include "stats.h"
+
+
+/* Client table in shared memory, created before sessions are forked.
+ * NULL while no client limit is configured.
+ */
+static ClientLimitEntry *client_entries = NULL;
+
+/* Entry + 1 of every running session, indexed by process id. The SIGCHLD handler swaps the
+ * value of a reaped session for 0, or for -1 if the session ended before it was registered.
+ */
+static int32_t *session_client_entries = NULL;
+static size_t max_session_pid = 0;
+
+// Marks a session that is registered without a client entry
+#define CLIENT_LIMIT_NO_ENTRY INT32_MAX
+
+// Time between two tokens of the bucket of a client
+static uint64_t refill_interval_ns = 0;
+
+// Response for refused connections, the client has to back off for either limit
+static const char too_many_requests_response[] =
+        "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+
+/* initClientLimits
+ *
+ * Create the client table in shared memory and the map from sessions to client entries.
+ * Does nothing if no client limit is configured.
+ *
+ * @ret 0 on success
+ *      -1 if the memory could not be created
+ */
+int initClientLimits(void)
+{
+        if((proxy_config.client_connections == 0) && (proxy_config.client_rate == 0))
+        {
+                return 0;
+        }
+
+        if(proxy_config.client_rate != 0)
+        {
+                refill_interval_ns = 1000000000ull / proxy_config.client_rate;
+        }
+
+        // Only the pages of process ids in use are ever touched
+        max_session_pid = readPidMax();
+        session_client_entries = mmap(NULL, max_session_pid * sizeof(int32_t), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(session_client_entries == MAP_FAILED)
+        {
+                perror("mmap session client entries");
+                session_client_entries = NULL;
+                return -1;
+        }
+
+        client_entries = createSharedMemory(CLIENT_LIMIT_SHARDS * CLIENT_LIMIT_SHARD_ENTRIES *
+                                            sizeof(ClientLimitEntry));
+        if(client_entries == NULL)
+        {
+                munmap(session_client_entries, max_session_pid * sizeof(int32_t));
+                session_client_entries = NULL;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/* clientAddressKey
+ *
+ * Get the key of a client address, IPv4 addresses are mapped into IPv6
+ *
+ * @param client_addr Address of the client
+ * @ret key Address as two 64 bit words
+ */
+static void clientAddressKey(const struct sockaddr_storage *client_addr, uint64_t key[2])
+{
+        uint8_t address[16];
+
+        if(client_addr->ss_family == AF_INET6)
+        {
+                memcpy(address, &(((const struct sockaddr_in6 *)client_addr)->sin6_addr), 16);
+        }
+        else
+        {
+                memset(address, 0, 10);
+                address[10] = 0xff;
+                address[11] = 0xff;
+                memcpy(address + 12, &(((const struct sockaddr_in *)client_addr)->sin_addr), 4);
+        }
+
+        memcpy(key, address, 16);
+}
+
+
+/* hashClientKey
+ *
+ * Mix the words of a client key into a hash, the high bits select the shard
+ */
+static uint64_t hashClientKey(const uint64_t key[2])
+{
+        uint64_t hash = (key[0] ^ (key[1] * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+        return hash ^ (hash >> 29);
+}
+
+
+/* referenceEntry
+ *
+ * Take a reference to a used entry by counting a connection for it
+ *
+ * @param entry Entry to reference
+ * @ret True if the entry was used and is referenced now
+ */
+static int referenceEntry(ClientLimitEntry *entry)
+{
+        uint32_t state = __atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE);
+
+        while(state & CLIENT_ENTRY_USED)
+        {
+                if(__atomic_compare_exchange_n(&(entry->state), &state, state + 1, 1,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+
+/* matchesKey
+ *
+ * Check if an entry holds a client key
+ */
+static int matchesKey(const ClientLimitEntry *entry, const uint64_t key[2])
+{
+        return (__atomic_load_n(&(entry->address[0]), __ATOMIC_RELAXED) == key[0]) &&
+               (__atomic_load_n(&(entry->address[1]), __ATOMIC_RELAXED) == key[1]);
+}
+
+
+/* isStale
+ *
+ * Check if an entry can be evicted: no connections and a full bucket
+ */
+static int isStale(const ClientLimitEntry *entry, uint64_t now_ns)
+{
+        return (__atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE) == CLIENT_ENTRY_USED) &&
+               (__atomic_load_n(&(entry->full_ns), __ATOMIC_RELAXED) <= now_ns);
+}
+
+
+/* claimEntry
+ *
+ * Take over an empty or stale entry for a client, holding one reference to it
+ *
+ * @param entry Entry to take over
+ * @param expected State the entry has to be in, 0 or CLIENT_ENTRY_USED
+ * @param key Key of the client
+ * @ret True if the entry was taken over
+ */
+static int claimEntry(ClientLimitEntry *entry, uint32_t expected, const uint64_t key[2])
+{
+        if(!__atomic_compare_exchange_n(&(entry->state), &expected, CLIENT_ENTRY_CLAIMED, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+                return 0;
+        }
+
+        __atomic_store_n(&(entry->address[0]), key[0], __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->address[1]), key[1], __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->full_ns), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->state), CLIENT_ENTRY_USED + 1, __ATOMIC_RELEASE);
+
+        return 1;
+}
+
+
+/* findClientEntry
+ *
+ * Find the entry of a client or create it, evicting a stale entry if the probed entries are
+ * all in use. The returned entry holds a reference for the caller.
+ *
+ * @param key Key of the client
+ * @param now_ns Current monotonic time
+ * @ret Index of the entry, CLIENT_LIMIT_UNTRACKED if all probed entries are in use
+ */
+static int findClientEntry(const uint64_t key[2], uint64_t now_ns)
+{
+        uint64_t hash = hashClientKey(key);
+        uint32_t shard = (hash >> 58) % CLIENT_LIMIT_SHARDS;
+        ClientLimitEntry *entries = client_entries + shard * CLIENT_LIMIT_SHARD_ENTRIES;
+
+        int free_index = -1;
+        int stale_index = -1;
+
+        for(uint32_t probe = 0; probe < CLIENT_LIMIT_PROBES; ++probe)
+        {
+                uint32_t index = (hash + probe) & (CLIENT_LIMIT_SHARD_ENTRIES - 1);
+                ClientLimitEntry *entry = entries + index;
+
+                uint32_t state = __atomic_load_n(&(entry->state), __ATOMIC_ACQUIRE);
+                if(state == 0)
+                {
+                        free_index = index;
+                        break;
+                }
+
+                if(matchesKey(entry, key) && referenceEntry(entry))
+                {
+                        // The entry may have been evicted between the check and the reference
+                        if(matchesKey(entry, key))
+                        {
+                                return shard * CLIENT_LIMIT_SHARD_ENTRIES + index;
+                        }
+                        __atomic_sub_fetch(&(entry->state), 1, __ATOMIC_ACQ_REL);
+                }
+                else if((stale_index == -1) && isStale(entry, now_ns))
+                {
+                        stale_index = index;
+                }
+        }
+
+        if((free_index != -1) && claimEntry(entries + free_index, 0, key))
+        {
+                return shard * CLIENT_LIMIT_SHARD_ENTRIES + free_index;
+        }
+        if((stale_index != -1) && claimEntry(entries + stale_index, CLIENT_ENTRY_USED, key))
+        {
+                return shard * CLIENT_LIMIT_SHARD_ENTRIES + stale_index;
+        }
+
+        return CLIENT_LIMIT_UNTRACKED;
+}
+
+
+/* takeClientToken
+ *
+ * Take a token from the bucket of a client. The bucket refills lazily: it only stores when it
+ * is full again, the tokens in it follow from the time left until then.
+ *
+ * @param entry Referenced entry of the client
+ * @param now_ns Current monotonic time
+ * @ret True if a token was available
+ */
+static int takeClientToken(ClientLimitEntry *entry, uint64_t now_ns)
+{
+        uint32_t burst = (proxy_config.client_burst != 0) ? proxy_config.client_burst : 1;
+        uint64_t full_ns = __atomic_load_n(&(entry->full_ns), __ATOMIC_RELAXED);
+
+        while(1)
+        {
+                uint64_t new_full_ns = ((full_ns > now_ns) ? full_ns : now_ns) + refill_interval_ns;
+                if(new_full_ns - now_ns > burst * refill_interval_ns)
+                {
+                        return 0;
+                }
+
+                if(__atomic_compare_exchange_n(&(entry->full_ns), &full_ns, new_full_ns, 1,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                        return 1;
+                }
+        }
+}
+
+
+/* acquireClientLimit
+ *
+ * Check a new connection against the limits of its client, before anything is read from it.
+ * An allowed connection counts for its client until releaseClientLimit is called for it.
+ *
+ * @param client_addr Address of the client
+ * @param now_ns Current monotonic time
+ * @ret entry Entry of the client to release, CLIENT_LIMIT_UNTRACKED if the connection is not
+ *            counted because the limits are disabled or the table is full
+ * @ret ClientLimitResult of the check
+ */
+ClientLimitResult acquireClientLimit(const struct sockaddr_storage *client_addr, uint64_t now_ns,
+                                     int *entry)
+{
+        assert(client_addr != NULL);
+        assert(entry != NULL);
+
+        *entry = CLIENT_LIMIT_UNTRACKED;
+        if(client_entries == NULL)
+        {
+                return CLIENT_LIMIT_ALLOWED;
+        }
+
+        uint64_t key[2];
+        clientAddressKey(client_addr, key);
+
+        int index = findClientEntry(key, now_ns);
+        if(index == CLIENT_LIMIT_UNTRACKED)
+        {
+                addProxyCounter(STAT_CLIENT_LIMIT_UNTRACKED, 1);
+                return CLIENT_LIMIT_ALLOWED;
+        }
+
+        ClientLimitEntry *client = client_entries + index;
+        uint32_t connections = __atomic_load_n(&(client->state), __ATOMIC_RELAXED) & CLIENT_ENTRY_CONNECTIONS;
+        if((proxy_config.client_connections != 0) && (connections > proxy_config.client_connections))
+        {
+                releaseClientLimit(index);
+                addProxyCounter(STAT_CLIENT_LIMIT_CONNECTIONS, 1);
+                return CLIENT_LIMIT_CONNECTIONS;
+        }
+
+        if((refill_interval_ns != 0) && !takeClientToken(client, now_ns))
+        {
+                releaseClientLimit(index);
+                addProxyCounter(STAT_CLIENT_LIMIT_RATE, 1);
+                return CLIENT_LIMIT_RATE;
+        }
+
+        *entry = index;
+        return CLIENT_LIMIT_ALLOWED;
+}
+
+
+/* releaseClientLimit
+ *
+ * Stop counting a connection for its client. Async-signal-safe.
+ *
+ * @param entry Entry returned by acquireClientLimit
+ */
+void releaseClientLimit(int entry)
+{
+        if((client_entries != NULL) && (entry != CLIENT_LIMIT_UNTRACKED))
+        {
+                __atomic_sub_fetch(&(client_entries[entry].state), 1, __ATOMIC_ACQ_REL);
+        }
+}
+
+
+/* registerClientLimitSession
+ *
+ * Remember the client entry of a forked session, so it is released when the session is reaped.
+ * Every forked session has to be registered, with or without an entry.
+ *
+ * @param pid Process id of the session
+ * @param entry Entry returned by acquireClientLimit
+ */
+void registerClientLimitSession(pid_t pid, int entry)
+{
+        if((session_client_entries == NULL) || ((size_t)pid >= max_session_pid))
+        {
+                releaseClientLimit(entry);
+                return;
+        }
+
+        int32_t expected = 0;
+        int32_t value = (entry == CLIENT_LIMIT_UNTRACKED) ? CLIENT_LIMIT_NO_ENTRY : entry + 1;
+        if(!__atomic_compare_exchange_n(session_client_entries + pid, &expected, value, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+                // Already reaped
+                __atomic_store_n(session_client_entries + pid, 0, __ATOMIC_RELEASE);
+                releaseClientLimit(entry);
+        }
+}
+
+
+/* clientLimitSessionEnded
+ *
+ * Release the client entry of a reaped session. Async-signal-safe, called by the SIGCHLD handler.
+ *
+ * @param pid Process id of the session
+ */
+void clientLimitSessionEnded(pid_t pid)
+{
+        if((session_client_entries == NULL) || ((size_t)pid >= max_session_pid))
+        {
+                return;
+        }
+
+        int32_t value = __atomic_load_n(session_client_entries + pid, __ATOMIC_ACQUIRE);
+        while(1)
+        {
+                int32_t replacement = (value == 0) ? -1 : 0;
+                if(__atomic_compare_exchange_n(session_client_entries + pid, &value, replacement, 1,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                        break;
+                }
+        }
+
+        if((value > 0) && (value != CLIENT_LIMIT_NO_ENTRY))
+        {
+                releaseClientLimit(value - 1);
+        }
+}
+
+
+/* rejectClientConnection
+ *
+ * Answer a connection refused by the client limits with 429 and close it
+ *
+ * @param client_socket Refused connection
+ */
+void rejectClientConnection(Socket *client_socket)
+{
+        assert(client_socket != NULL);
+
+        sendResponseAndClose(client_socket, too_many_requests_response, sizeof(too_many_requests_response) - 1);
+}
@@ -0,0 +1,74 @@
+#ifndef CLIENTLIMIT_H
+#define CLIENTLIMIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "util_socket.h"
+
+// Shards of the client table, an address is only ever probed within its shard
+#define CLIENT_LIMIT_SHARDS 64
+
+// Entries per shard (power of two)
+#define CLIENT_LIMIT_SHARD_ENTRIES 1024
+
+// Entries probed for an address before the table counts as full
+#define CLIENT_LIMIT_PROBES 16
+
+// Bits of the state word of an entry, the bits below count the connections of the client
+#define CLIENT_ENTRY_USED (1u << 30)
+#define CLIENT_ENTRY_CLAIMED (1u << 31)
+#define CLIENT_ENTRY_CONNECTIONS (CLIENT_ENTRY_USED - 1)
+
+// Returned for connections that are not tracked in the client table
+#define CLIENT_LIMIT_UNTRACKED -1
+
+
+/* ClientLimitEntry struct
+ *
+ * Limits of one client address. The address and the bucket only change while the state word
+ * holds a reference, so a client can not be evicted while it has connections.
+ *
+ * address -> Client address, IPv4 addresses are stored IPv4-mapped
+ * state   -> CLIENT_ENTRY_USED or CLIENT_ENTRY_CLAIMED plus the number of connections,
+ *            0 if the entry is empty
+ * full_ns -> Monotonic time the token bucket of the client is full again. A request takes
+ *            one token by moving it forward one refill interval.
+ */
+typedef struct _client_limit_entry_
+{
+  uint64_t address[2];
+  uint32_t state;
+  uint64_t full_ns;
+} __attribute__((aligned(32))) ClientLimitEntry;
+
+
+/* ClientLimitResult
+ *
+ * Outcome of checking a new connection against the limits of its client
+ *
+ * CLIENT_LIMIT_ALLOWED     -> The connection may start a session
+ * CLIENT_LIMIT_CONNECTIONS -> The client has the maximum number of connections open
+ * CLIENT_LIMIT_RATE        -> The client sent requests faster than its rate allows
+ */
+typedef enum _client_limit_result_
+{
+  CLIENT_LIMIT_ALLOWED,
+  CLIENT_LIMIT_CONNECTIONS,
+  CLIENT_LIMIT_RATE
+} ClientLimitResult;
+
+
+int initClientLimits(void);
+
+ClientLimitResult acquireClientLimit(const struct sockaddr_storage *client_addr, uint64_t now_ns,
+                                     int *entry);
+void releaseClientLimit(int entry);
+void registerClientLimitSession(pid_t pid, int entry);
+void clientLimitSessionEnded(pid_t pid);
+
+void rejectClientConnection(Socket *client_socket);
+
+#endif
@@ -0,0 +1,368 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+
+#include "config.h"
+
+/* Global proxy configuration, set up once in main before the proxy is started
+ */
+ProxyConfig proxy_config;
+
+
+/* initProxyConfig
+ *
+ * Initialize a configuration struct with the default settings
+ *
+ * @param config Configuration to initialize
+ */
+void initProxyConfig(ProxyConfig *config)
+{
+        assert(config != NULL);
+
+        config->port = NULL;
+        config->forward_headers_early = 0;
+        config->filter_policy = FILTER_POLICY_ABORT;
+        config->max_held_body = 1024 * 1024;
+        config->filter_file = NULL;
+        config->filter_watch_interval = 2;
+        config->fold_diacritics = 0;
+        config->blocklist_file = NULL;
+        config->verdict_cache_entries = 65536;
+        config->admin_port = NULL;
+        config->access_log_file = NULL;
+        config->header_timeout = 30;
+        config->connect_timeout = 10;
+        config->idle_timeout = 120;
+        config->request_timeout = 0;
+        config->connect_attempt_delay = 250;
+        config->connect_attempt_timeout = 3000;
+        config->breaker_failures = 5;
+        config->breaker_open_time = 10;
+        config->max_sessions = 0;
+        config->max_queue_delay = 0;
+        config->defer_overload = 0;
+        config->client_connections = 0;
+        config->client_rate = 0;
+        config->client_burst = 0;
+        config->host_connections = 0;
+        config->hedge_percentile = 0;
+        config->hedge_budget = 0;
+        config->upstream_file = NULL;
+        config->handoff_socket = NULL;
+        config->drain_time = 30;
+        config->verbose = 0;
+}
+
+
+/* isNumber
+ *
+ * Check if a string only consists of digits
+ *
+ * @param str String to check
+ * @ret True if the string is non-empty and only contains digits
+ */
+static int isNumber(const char *str)
+{
+        if(*str == '\0')
+        {
+                return 0;
+        }
+
+        for(size_t i = 0; i < strlen(str); ++i)
+        {
+                if(!isdigit((unsigned char)str[i]))
+                {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+
+/* parseProxyConfig
+ *
+ * Fill in the configuration from the commandline parameters
+ *
+ * @param config Configuration to fill in
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ * @ret 0 on success
+ *      -1 if the parameters are invalid
+ */
+int parseProxyConfig(ProxyConfig *config, int argc, char *argv[])
+{
+        assert(config != NULL);
+
+        static const struct option long_options[] =
+                {
+                        {"early-headers",   no_argument,       NULL, 'e'},
+                        {"filter-policy",   required_argument, NULL, 'P'},
+                        {"max-held-body",   required_argument, NULL, 'M'},
+                        {"filter-file",     required_argument, NULL, 'f'},
+                        {"filter-watch",    required_argument, NULL, 'w'},
+                        {"fold-diacritics", no_argument,       NULL, 'd'},
+                        {"blocklist",       required_argument, NULL, 'b'},
+                        {"verdict-cache",   required_argument, NULL, 'c'},
+                        {"admin-port",      required_argument, NULL, 'a'},
+                        {"access-log",      required_argument, NULL, 'l'},
+                        {"timeouts",        required_argument, NULL, 't'},
+                        {"connect-race",    required_argument, NULL, 'R'},
+                        {"breaker",         required_argument, NULL, 'B'},
+                        {"max-sessions",    required_argument, NULL, 'm'},
+                        {"max-queue-delay", required_argument, NULL, 'q'},
+                        {"defer-overload",  no_argument,       NULL, 'D'},
+                        {"client-limits",   required_argument, NULL, 'C'},
+                        {"host-limit",      required_argument, NULL, 'L'},
+                        {"hedge",           required_argument, NULL, 'H'},
+                        {"upstreams",       required_argument, NULL, 'U'},
+                        {"handoff-socket",  required_argument, NULL, 's'},
+                        {"drain-time",      required_argument, NULL, 'g'},
+                        {"verbose",         no_argument,       NULL, 'v'},
+                        {NULL,              0,                 NULL, 0}
+                };
+
+        int opt;
+        while((opt = getopt_long(argc, argv, "eP:M:f:w:db:c:a:l:t:R:B:m:q:DC:L:H:U:s:g:v", long_options, NULL)) != -1)
+        {
+                switch(opt)
+                {
+                case 'e':
+                        config->forward_headers_early = 1;
+                        break;
+                case 'P':
+                        if(strcmp(optarg, "abort") == 0)
+                        {
+                                config->filter_policy = FILTER_POLICY_ABORT;
+                        }
+                        else if(strcmp(optarg, "replace") == 0)
+                        {
+                                config->filter_policy = FILTER_POLICY_REPLACE;
+                        }
+                        else
+                        {
+                                fprintf(stderr, "ERROR: Unknown filter policy '%s'\n", optarg);
+                                return -1;
+                        }
+                        break;
+                case 'M':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Held back body size may only contain digits\n");
+                                return -1;
+                        }
+                        config->max_held_body = strtoul(optarg, NULL, 10) * 1024;
+                        break;
+                case 'f':
+                        config->filter_file = optarg;
+                        break;
+                case 'w':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Filter watch interval may only contain digits\n");
+                                return -1;
+                        }
+                        config->filter_watch_interval = atoi(optarg);
+                        break;
+                case 'd':
+                        config->fold_diacritics = 1;
+                        break;
+                case 'b':
+                        config->blocklist_file = optarg;
+                        break;
+                case 'c':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Verdict cache size may only contain digits\n");
+                                return -1;
+                        }
+                        config->verdict_cache_entries = strtoul(optarg, NULL, 10);
+                        break;
+                case 'a':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Admin port may only contain digits\n");
+                                return -1;
+                        }
+                        config->admin_port = optarg;
+                        break;
+                case 'l':
+                        config->access_log_file = optarg;
+                        break;
+                case 't':
+                {
+                        char extra;
+                        if(sscanf(optarg, "%u,%u,%u,%u%c", &(config->header_timeout), &(config->connect_timeout),
+                                  &(config->idle_timeout), &(config->request_timeout), &extra) != 4)
+                        {
+                                fprintf(stderr, "ERROR: Timeouts must be given as HEADER,CONNECT,IDLE,TOTAL\n");
+                                return -1;
+                        }
+                        break;
+                }
+                case 'R':
+                {
+                        char extra;
+                        if((sscanf(optarg, "%u,%u%c", &(config->connect_attempt_delay),
+                                   &(config->connect_attempt_timeout), &extra) != 2) ||
+                           (config->connect_attempt_timeout == 0))
+                        {
+                                fprintf(stderr, "ERROR: Connect race must be given as DELAY,TIMEOUT in milliseconds\n");
+                                return -1;
+                        }
+                        break;
+                }
+                case 'B':
+                {
+                        char extra;
+                        if(sscanf(optarg, "%u,%u%c", &(config->breaker_failures), &(config->breaker_open_time),
+                                  &extra) != 2)
+                        {
+                                fprintf(stderr, "ERROR: Breaker must be given as FAILURES,SECONDS\n");
+                                return -1;
+                        }
+                        break;
+                }
+                case 'm':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Maximum sessions may only contain digits\n");
+                                return -1;
+                        }
+                        config->max_sessions = strtoul(optarg, NULL, 10);
+                        break;
+                case 'q':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Maximum queue delay may only contain digits\n");
+                                return -1;
+                        }
+                        config->max_queue_delay = strtoul(optarg, NULL, 10);
+                        break;
+                case 'D':
+                        config->defer_overload = 1;
+                        break;
+                case 'C':
+                {
+                        char extra;
+                        if(sscanf(optarg, "%u,%u,%u%c", &(config->client_connections), &(config->client_rate),
+                                  &(config->client_burst), &extra) != 3)
+                        {
+                                fprintf(stderr, "ERROR: Client limits must be given as CONNECTIONS,RATE,BURST\n");
+                                return -1;
+                        }
+                        break;
+                }
+                case 'L':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Host limit may only contain digits\n");
+                                return -1;
+                        }
+                        config->host_connections = strtoul(optarg, NULL, 10);
+                        break;
+                case 'H':
+                {
+                        char extra;
+                        if((sscanf(optarg, "%u,%u%c", &(config->hedge_percentile), &(config->hedge_budget),
+                                   &extra) != 2) ||
+                           (config->hedge_percentile > 99) || (config->hedge_budget > 100))
+                        {
+                                fprintf(stderr, "ERROR: Hedging must be given as PERCENTILE,BUDGET (0-99,0-100)\n");
+                                return -1;
+                        }
+                        break;
+                }
+                case 'U':
+                        config->upstream_file = optarg;
+                        break;
+                case 's':
+                        config->handoff_socket = optarg;
+                        break;
+                case 'g':
+                        if(!isNumber(optarg))
+                        {
+                                fprintf(stderr, "ERROR: Drain time may only contain digits\n");
+                                return -1;
+                        }
+                        config->drain_time = strtoul(optarg, NULL, 10);
+                        break;
+                case 'v':
+                        config->verbose = 1;
+                        break;
+                default:
+                        return -1;
+                }
+        }
+
+        if(optind >= argc)
+        {
+                return -1;
+        }
+
+        config->port = argv[optind];
+        if(!isNumber(config->port))
+        {
+                fprintf(stderr, "ERROR: Provided port may only contain digits\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/* printUsage
+ *
+ * Print the commandline usage of the proxy
+ *
+ * @param program Name of the proxy executable
+ */
+void printUsage(const char *program)
+{
+        printf("Usage: %s [options] <port>\n", program);
+        printf("  -e, --early-headers         Forward response headers before the body is filtered\n");
+        printf("  -P, --filter-policy=POLICY  Blocked response after early headers: abort|replace\n");
+        printf("  -M, --max-held-body=KB      Filtered body held back at most, a longer body is forwarded as it\n"
+               "                              is scanned, like after early headers (default 1024, 0 = no limit)\n");
+        printf("  -f, --filter-file=FILE      Word list (one word per line) or compiled filter file\n");
+        printf("  -w, --filter-watch=SECONDS  Interval for checking the word list for changes (default 2,\n"
+               "                              0 = reload on SIGHUP only)\n");
+        printf("  -d, --fold-diacritics       Match accented letters like their base letters (o for ö)\n");
+        printf("  -b, --blocklist=FILE        Blocked hosts, one per line (*.example.com blocks the domain\n"
+               "                              and all its subdomains), reloaded on SIGHUP\n");
+        printf("  -c, --verdict-cache=ENTRIES Clean verdicts remembered per URL and validator (default 65536,\n"
+               "                              0 = off), statistics are printed on SIGUSR1\n");
+        printf("  -a, --admin-port=PORT       Serve the statistics on 127.0.0.1:PORT\n");
+        printf("  -l, --access-log=FILE       Append a binary access log (access_log_dump prints it),\n"
+               "                              reopened on SIGHUP\n");
+        printf("  -t, --timeouts=H,C,I,T      Seconds for the request header, connecting, idle relaying and\n"
+               "                              the whole session (default 30,10,120,0, 0 = no timeout)\n");
+        printf("  -R, --connect-race=D,T      Milliseconds before the next server address is tried and until\n"
+               "                              an attempt is given up (default 250,3000)\n");
+        printf("  -B, --breaker=F,S           Fail requests to a host fast for S seconds after F failures in a\n"
+               "                              row to resolve or connect to it (default 5,10, 0,0 = off)\n");
+        printf("  -m, --max-sessions=N        Sessions running at the same time, further connections are\n"
+               "                              answered with 503 and Retry-After (default 0 = no limit)\n");
+        printf("  -q, --max-queue-delay=MS    Shed connections while the estimated accept queue delay is\n"
+               "                              longer (default 0 = no limit)\n");
+        printf("  -D, --defer-overload        Keep connections queued while max-sessions are running and\n"
+               "                              only shed them once max-queue-delay is exceeded\n");
+        printf("  -C, --client-limits=C,R,B   Per client address: open connections, requests per second and\n"
+               "                              burst, further connections get 429 (default 0,0,0 = no limit)\n");
+        printf("  -L, --host-limit=N          Connections to one server host at the same time, further\n"
+               "                              requests wait in line for a free one (default 0 = no limit)\n");
+        printf("  -H, --hedge=P,B             Send a GET again on a second connection once it took longer than\n"
+               "                              the Pth percentile of its host, for at most B%% of the GETs\n"
+               "                              (default 0,0 = off)\n");
+        printf("  -U, --upstreams=FILE        Upstream pools and the ports they are reverse proxied on, lines\n"
+               "                              'pool NAME round-robin|least-conn|hash [/HEALTH-PATH [SECONDS]]',\n"
+               "                              'server POOL HOST:PORT' and 'listen PORT POOL'\n");
+        printf("  -s, --handoff-socket=PATH   Unix socket a new proxy process started with the same socket takes\n"
+               "                              the listening sockets over on, this process then stops accepting\n");
+        printf("  -g, --drain-time=SECONDS    Seconds sessions get to end after the listening sockets were handed\n"
+               "                              over before they are killed (default 30)\n");
+        printf("  -v, --verbose               Print status lines for every connection\n");
+}
@@ -0,0 +1,114 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* FilterPolicy
+ *
+ * What to do with a response whose content matches the filter after its header
+ * has already been forwarded to the client
+ *
+ * FILTER_POLICY_ABORT   -> Reset the client connection so the response is visibly truncated
+ * FILTER_POLICY_REPLACE -> Finish the response with a short replacement body
+ */
+typedef enum _filter_policy_
+{
+  FILTER_POLICY_ABORT,
+  FILTER_POLICY_REPLACE
+} FilterPolicy;
+
+
+/* ProxyConfig struct
+ *
+ * Runtime configuration of the proxy, filled in from the commandline
+ *
+ * port                  -> Local port the proxy listens on
+ * forward_headers_early -> Forward response headers immediately and only hold back the
+ *                          body while the content filter is applied
+ * filter_policy         -> Policy for blocked responses whose header is already forwarded
+ * max_held_body         -> Bytes of a filtered body held back at most, beyond it the body is
+ *                          forwarded as it is scanned, 0 for no limit
+ * filter_file           -> Word list or compiled filter file for the content filter, NULL for
+ *                          the built-in words
+ * filter_watch_interval -> Seconds between checks of the word list file for changes, 0 to
+ *                          only reload on SIGHUP
+ * fold_diacritics       -> Match accented Latin letters like their ASCII base letters
+ * blocklist_file        -> File with blocked hosts, NULL if no hosts are blocked
+ * verdict_cache_entries -> Number of entries of the verdict cache, 0 to disable it
+ * admin_port            -> Local port of the statistics endpoint, NULL to disable it
+ * access_log_file       -> File the binary access log is appended to, NULL to disable it
+ * header_timeout        -> Seconds a client gets to send the complete request header, 0 = none
+ * connect_timeout       -> Seconds for resolving and connecting to the server, 0 = none
+ * idle_timeout          -> Seconds a relayed connection may go without data, 0 = none
+ * request_timeout       -> Seconds a whole session may take, 0 = none
+ * connect_attempt_delay -> Milliseconds before the next server address is tried while the
+ *                          previous connection attempts are still in flight
+ * connect_attempt_timeout -> Milliseconds a connection attempt to one server address may take
+ * breaker_failures      -> Failures in a row to resolve or connect to a host that open its
+ *                          circuit breaker, 0 to disable the breakers
+ * breaker_open_time     -> Seconds requests to a host with an open breaker fail fast
+ * max_sessions          -> Sessions running at the same time, 0 for no limit
+ * max_queue_delay       -> Milliseconds a connection may be expected to wait for accept before
+ *                          connections are shed, 0 for no limit
+ * defer_overload        -> Leave connections queued while max_sessions are running instead
+ *                          of shedding them right away
+ * client_connections    -> Connections a client address may have open, 0 for no limit
+ * client_rate           -> Requests per second a client address may send, 0 for no limit
+ * client_burst          -> Requests a client address may send at once beyond its rate
+ * host_connections      -> Connections to one server host at the same time, 0 for no limit
+ * hedge_percentile      -> Percentile of the first byte times of a host after which a GET is
+ *                          sent again on a second connection, 0 to disable hedging
+ * hedge_budget          -> Hedges as percentage of the hedgeable requests
+ * upstream_file         -> Upstream pools and their reverse proxy listeners, NULL for none
+ * handoff_socket        -> Unix socket the listening sockets are handed to a new proxy process
+ *                          on, NULL to disable graceful restarts
+ * drain_time            -> Seconds sessions get to end after the listening sockets were handed over
+ * verbose               -> Print status lines for every connection
+ */
+typedef struct _proxy_config_
+{
+  const char *port;
+  int forward_headers_early;
+  FilterPolicy filter_policy;
+  size_t max_held_body;
+  const char *filter_file;
+  unsigned int filter_watch_interval;
+  int fold_diacritics;
+  const char *blocklist_file;
+  size_t verdict_cache_entries;
+  const char *admin_port;
+  const char *access_log_file;
+  unsigned int header_timeout;
+  unsigned int connect_timeout;
+  unsigned int idle_timeout;
+  unsigned int request_timeout;
+  unsigned int connect_attempt_delay;
+  unsigned int connect_attempt_timeout;
+  unsigned int breaker_failures;
+  unsigned int breaker_open_time;
+  unsigned int max_sessions;
+  unsigned int max_queue_delay;
+  int defer_overload;
+  unsigned int client_connections;
+  unsigned int client_rate;
+  unsigned int client_burst;
+  unsigned int host_connections;
+  unsigned int hedge_percentile;
+  unsigned int hedge_budget;
+  const char *upstream_file;
+  const char *handoff_socket;
+  unsigned int drain_time;
+  int verbose;
+} ProxyConfig;
+
+extern ProxyConfig proxy_config;
+
+// Print a status line of a connection, only in verbose mode
+#define verbosePrintf(...) do { if(proxy_config.verbose) { printf(__VA_ARGS__); } } while(0)
+
+void initProxyConfig(ProxyConfig *config);
+int parseProxyConfig(ProxyConfig *config, int argc, char *argv[]);
+void printUsage(const char *program);
+
+#endif
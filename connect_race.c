@@ -0,0 +1,251 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eyeballs.h"
+#include "config.h"
+#include "latency.h"
+#include "stats.h"
+
+// Connections queued on a dropping listener, enough to fill a backlog of 0
+#define RACE_DROP_FILL 4
+
+
+/* acceptAndClose
+ *
+ * Accept connections of a listener that answers and close them right away
+ *
+ * @param arg File descriptor of the listener
+ */
+static void* acceptAndClose(void *arg)
+{
+        int listen_fd = (int)(intptr_t)arg;
+
+        while(1)
+        {
+                int fd = accept(listen_fd, NULL, NULL);
+                if(fd != -1)
+                {
+                        close(fd);
+                }
+        }
+
+        return NULL;
+}
+
+
+/* openStubListener
+ *
+ * Open a listener on a local address that behaves like a server for the race
+ *
+ * accept -> Accepts connections
+ * drop   -> Never accepts, its accept queue is filled so further SYNs are dropped like by a
+ *           blackholed address
+ * refuse -> No listener, connections are refused
+ *
+ * @param address Numeric local address
+ * @param port Port to listen on
+ * @param mode Behaviour of the listener
+ * @ret 0 on success, -1 on failure
+ */
+static int openStubListener(const char *address, const char *port, const char *mode)
+{
+        if(strcmp(mode, "refuse") == 0)
+        {
+                return 0;
+        }
+
+        Socket listen_socket;
+        initSocket(&listen_socket);
+        if(openListeningSocket(address, port, &listen_socket) != 0)
+        {
+                return -1;
+        }
+
+        if(strcmp(mode, "accept") == 0)
+        {
+                pthread_t thread_id;
+                if(pthread_create(&thread_id, NULL, acceptAndClose, (void *)(intptr_t)listen_socket.fd_) != 0)
+                {
+                        return -1;
+                }
+                pthread_detach(thread_id);
+                return 0;
+        }
+
+        if(strcmp(mode, "drop") != 0)
+        {
+                fprintf(stderr, "Unknown mode '%s'\n", mode);
+                return -1;
+        }
+
+        struct addrinfo hints;
+        struct addrinfo *target;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        if(getaddrinfo(address, port, &hints, &target) != 0)
+        {
+                return -1;
+        }
+
+        listen(listen_socket.fd_, 0);
+        for(int i = 0; i < RACE_DROP_FILL; ++i)
+        {
+                int fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+                connect(fd, target->ai_addr, target->ai_addrlen);
+        }
+        freeaddrinfo(target);
+
+        // Let the handshakes of the filling connections complete
+        struct timespec fill_time = {0, 100000000L};
+        nanosleep(&fill_time, NULL);
+
+        return 0;
+}
+
+
+/* printRaceUsage
+ *
+ * Print the commandline usage of the tool
+ */
+static void printRaceUsage(const char *program)
+{
+        printf("Usage: %s [options] <port> <address>=<accept|drop|refuse>...\n", program);
+        printf("Opens stub listeners on the local addresses and races connections to them in the order\n"
+               "given, as if the addresses were the resolved addresses of one server\n");
+        printf("  -r, --rounds=N          Connections to race (default 3)\n");
+        printf("  -R, --connect-race=D,T  Attempt delay and attempt timeout in milliseconds (default 250,3000)\n");
+}
+
+
+/* main
+ *
+ * Race connections to local stub listeners and print which address won and how long it took
+ *
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ */
+int main(int argc, char *argv[])
+{
+        static const struct option long_options[] =
+                {
+                        {"rounds",       required_argument, NULL, 'r'},
+                        {"connect-race", required_argument, NULL, 'R'},
+                        {NULL,           0,                 NULL, 0}
+                };
+
+        initProxyConfig(&proxy_config);
+        unsigned int rounds = 3;
+
+        int opt;
+        while((opt = getopt_long(argc, argv, "r:R:", long_options, NULL)) != -1)
+        {
+                switch(opt)
+                {
+                case 'r':
+                        rounds = strtoul(optarg, NULL, 10);
+                        break;
+                case 'R':
+                        if(sscanf(optarg, "%u,%u", &(proxy_config.connect_attempt_delay),
+                                  &(proxy_config.connect_attempt_timeout)) != 2)
+                        {
+                                printRaceUsage(argv[0]);
+                                return 1;
+                        }
+                        break;
+                default:
+                        printRaceUsage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if(argc - optind < 2)
+        {
+                printRaceUsage(argv[0]);
+                return 1;
+        }
+
+        const char *port = argv[optind];
+        size_t num_addresses = argc - optind - 1;
+        if(num_addresses > EYEBALLS_MAX_ADDRESSES)
+        {
+                fprintf(stderr, "At most %d addresses\n", EYEBALLS_MAX_ADDRESSES);
+                return 1;
+        }
+
+        if((initProxyStats() != 0) || (initConnectFailures() != 0))
+        {
+                return 1;
+        }
+
+        // Chain the addresses into one list like getaddrinfo returns for a server
+        struct addrinfo *resolved[EYEBALLS_MAX_ADDRESSES];
+        for(size_t i = 0; i < num_addresses; ++i)
+        {
+                char *address = argv[optind + 1 + i];
+                char *mode = strrchr(address, '=');
+                if(mode == NULL)
+                {
+                        printRaceUsage(argv[0]);
+                        return 1;
+                }
+                *mode++ = '\0';
+
+                if(openStubListener(address, port, mode) != 0)
+                {
+                        fprintf(stderr, "Could not open %s listener on %s\n", mode, address);
+                        return 1;
+                }
+
+                struct addrinfo hints;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_socktype = SOCK_STREAM;
+                hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+                if(getaddrinfo(address, port, &hints, resolved + i) != 0)
+                {
+                        fprintf(stderr, "Invalid address %s\n", address);
+                        return 1;
+                }
+                if(i > 0)
+                {
+                        resolved[i - 1]->ai_next = resolved[i];
+                }
+        }
+
+        for(unsigned int round = 1; round <= rounds; ++round)
+        {
+                Socket server_socket;
+                uint64_t start_ns = monotonicNs();
+                int con_stat = connectHappyEyeballs(resolved[0], &server_socket);
+                double elapsed_ms = (monotonicNs() - start_ns) / 1e6;
+
+                if(con_stat != 0)
+                {
+                        printf("round %u: failed after %.1fms\n", round, elapsed_ms);
+                        continue;
+                }
+
+                struct sockaddr_storage peer;
+                socklen_t peer_len = sizeof(peer);
+                char peer_str[INET6_ADDRSTRLEN] = "?";
+                if(getpeername(server_socket.fd_, (struct sockaddr *)&peer, &peer_len) == 0)
+                {
+                        inet_ntop(peer.ss_family, get_in_addr((struct sockaddr *)&peer), peer_str, sizeof(peer_str));
+                }
+                printf("round %u: connected to %s after %.1fms\n", round, peer_str, elapsed_ms);
+                destroySocket(&server_socket);
+        }
+
+        printf("attempts %lu, failed %lu, fallbacks %lu\n", readProxyCounter(STAT_CONNECT_ATTEMPTS),
+               readProxyCounter(STAT_CONNECT_ATTEMPTS_FAILED), readProxyCounter(STAT_CONNECT_FALLBACKS));
+
+        return 0;
+}
@@ -0,0 +1,506 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "decoder.h"
+
+// States of the chunked transfer decoding
+#define CHUNK_STATE_SIZE 0
+#define CHUNK_STATE_SIZE_EXT 1
+#define CHUNK_STATE_DATA 2
+#define CHUNK_STATE_DATA_END 3
+#define CHUNK_STATE_TRAILER_START 4
+#define CHUNK_STATE_TRAILER 5
+#define CHUNK_STATE_DONE 6
+
+// zlib window bits: 15 bit window, +32 for automatic zlib/gzip header detection
+#define ZLIB_WINDOW_BITS 15
+#define ZLIB_WINDOW_BITS_AUTO (ZLIB_WINDOW_BITS + 32)
+
+
+
+/* parseContentEncoding
+ *
+ * Map the value of a Content-Encoding header field to the content coding
+ *
+ * @param content_encoding_value Value of the Content-Encoding field, NULL if the field is missing
+ * @ret Content coding of the body, CONTENT_ENCODING_UNSUPPORTED for codings the proxy cannot decode
+ */
+ContentEncoding parseContentEncoding(const char *content_encoding_value)
+{
+        if(content_encoding_value == NULL)
+        {
+                return CONTENT_ENCODING_IDENTITY;
+        }
+
+        // Skip leading whitespace
+        while(isspace((unsigned char)*content_encoding_value))
+        {
+                ++content_encoding_value;
+        }
+
+        if((*content_encoding_value == '\0') || (strcasecmp(content_encoding_value, "identity") == 0))
+        {
+                return CONTENT_ENCODING_IDENTITY;
+        }
+
+        if((strcasecmp(content_encoding_value, "gzip") == 0) ||
+           (strcasecmp(content_encoding_value, "x-gzip") == 0))
+        {
+                return CONTENT_ENCODING_GZIP;
+        }
+
+        if(strcasecmp(content_encoding_value, "deflate") == 0)
+        {
+                return CONTENT_ENCODING_DEFLATE;
+        }
+
+        // Stacked codings and codings without decoder (br, compress, ...)
+        return CONTENT_ENCODING_UNSUPPORTED;
+}
+
+
+/* initContentDecoder
+ *
+ * Initialize a decoder for a response body
+ *
+ * @param decoder Decoder to initialize
+ * @param encoding Content coding of the body
+ * @param chunked Whether the body uses chunked transfer coding
+ * @ret 0 on success
+ *      -1 if the coding is not supported or the zlib state could not be allocated
+ */
+int initContentDecoder(ContentDecoder *decoder, ContentEncoding encoding, int chunked)
+{
+        assert(decoder != NULL);
+
+        decoder->encoding = encoding;
+        decoder->chunked = chunked;
+        decoder->raw_fallback = 0;
+        decoder->finished = 0;
+        decoder->error = 0;
+        decoder->decoded_bytes = 0;
+        initChunkedDecoder(&(decoder->chunk_decoder));
+
+        memset(&(decoder->zstream), 0, sizeof(z_stream));
+
+        if(encoding == CONTENT_ENCODING_UNSUPPORTED)
+        {
+                return -1;
+        }
+
+        if(encoding == CONTENT_ENCODING_IDENTITY)
+        {
+                return 0;
+        }
+
+        // "deflate" should be zlib wrapped, but some servers send raw deflate data
+        decoder->raw_fallback = (encoding == CONTENT_ENCODING_DEFLATE);
+
+        if(inflateInit2(&(decoder->zstream), ZLIB_WINDOW_BITS_AUTO) != Z_OK)
+        {
+                fprintf(stderr, "ERROR: Could not initialize inflate stream\n");
+                decoder->encoding = CONTENT_ENCODING_UNSUPPORTED;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/* destroyContentDecoder
+ *
+ * Free the resources held by a decoder
+ *
+ * @param decoder Decoder to destroy
+ */
+void destroyContentDecoder(ContentDecoder *decoder)
+{
+        assert(decoder != NULL);
+
+        if((decoder->encoding == CONTENT_ENCODING_GZIP) ||
+           (decoder->encoding == CONTENT_ENCODING_DEFLATE))
+        {
+                inflateEnd(&(decoder->zstream));
+        }
+
+        decoder->encoding = CONTENT_ENCODING_UNSUPPORTED;
+}
+
+
+/* Sink and environment of the current feedContentDecoder call, used by inflateToSink
+ */
+typedef struct _inflate_env_
+{
+  ContentDecoder *decoder;
+  DecoderSink sink;
+  void *sink_env;
+} InflateEnv;
+
+
+/* startNextMember
+ *
+ * Prepare the decoder for input that follows the end of the compressed stream. A gzip body may
+ * consist of several members (RFC 1952) that all belong to the content, anything else after
+ * the end of the stream is trailing garbage and counted as decoding error, so the body is
+ * never taken as completely scanned.
+ *
+ * @param decoder Decoder whose compressed stream ended
+ * @ret 0 if the input starts a new gzip member
+ *      -1 if no more input is allowed after the stream
+ */
+static int startNextMember(ContentDecoder *decoder)
+{
+        if(decoder->encoding != CONTENT_ENCODING_GZIP)
+        {
+                fprintf(stderr, "ERROR: Trailing garbage after compressed response body\n");
+                decoder->error = 1;
+                return -1;
+        }
+
+        // Only a gzip header may follow, zlib streams are not valid members
+        if(inflateReset2(&(decoder->zstream), ZLIB_WINDOW_BITS + 16) != Z_OK)
+        {
+                decoder->error = 1;
+                return -1;
+        }
+
+        decoder->finished = 0;
+        return 0;
+}
+
+
+/* inflateToSink
+ *
+ * Inflate a piece of compressed content and hand the output on to the sink.
+ * Used as sink of the chunked decoder when the body is both chunked and compressed.
+ *
+ * @param data Compressed data
+ * @param data_len Length of the compressed data
+ * @param env InflateEnv of the decoder (void* to be usable as DecoderSink)
+ * @ret 0 if all data was consumed
+ *      1 if the sink stopped the decoding
+ *      -1 on decoding error
+ */
+static int inflateToSink(const char *data, size_t data_len, void *env)
+{
+        InflateEnv *inflate_env = (InflateEnv *)env;
+        ContentDecoder *decoder = inflate_env->decoder;
+        z_stream *zstream = &(decoder->zstream);
+
+        if(decoder->finished && (startNextMember(decoder) != 0))
+        {
+                return -1;
+        }
+
+        zstream->next_in = (Bytef *)data;
+        zstream->avail_in = data_len;
+
+        while(1)
+        {
+                zstream->next_out = decoder->out_buffer;
+                zstream->avail_out = DECODER_OUTPUT_BUFFER_SIZE;
+
+                int z_stat = inflate(zstream, Z_NO_FLUSH);
+
+                if((z_stat == Z_DATA_ERROR) && decoder->raw_fallback && (zstream->total_out == 0))
+                {
+                        // Not zlib wrapped, retry input as raw deflate stream
+                        decoder->raw_fallback = 0;
+                        if(inflateReset2(zstream, -ZLIB_WINDOW_BITS) != Z_OK)
+                        {
+                                decoder->error = 1;
+                                return -1;
+                        }
+
+                        zstream->next_in = (Bytef *)data;
+                        zstream->avail_in = data_len;
+                        continue;
+                }
+
+                if((z_stat != Z_OK) && (z_stat != Z_STREAM_END) && (z_stat != Z_BUF_ERROR))
+                {
+                        fprintf(stderr, "ERROR: Failed to inflate response body (%d)\n", z_stat);
+                        decoder->error = 1;
+                        return -1;
+                }
+
+                decoder->raw_fallback = 0;
+
+                size_t out_len = DECODER_OUTPUT_BUFFER_SIZE - zstream->avail_out;
+                if(out_len > 0)
+                {
+                        decoder->decoded_bytes += out_len;
+                        if(inflate_env->sink((const char *)decoder->out_buffer, out_len,
+                                             inflate_env->sink_env) != 0)
+                        {
+                                return 1;
+                        }
+                }
+
+                if(z_stat == Z_STREAM_END)
+                {
+                        decoder->finished = 1;
+                        if(zstream->avail_in == 0)
+                        {
+                                return 0;
+                        }
+
+                        // More input follows the end of the stream in the same piece
+                        if(startNextMember(decoder) != 0)
+                        {
+                                return -1;
+                        }
+                        continue;
+                }
+
+                if((zstream->avail_in == 0) && (zstream->avail_out != 0))
+                {
+                        // Input consumed and no pending output left
+                        break;
+                }
+
+                if((z_stat == Z_BUF_ERROR) && (out_len == 0))
+                {
+                        // No progress possible without more input
+                        break;
+                }
+        }
+
+        return 0;
+}
+
+
+/* feedContentDecoder
+ *
+ * Decode the next piece of a response body and pass the decoded content on to a sink.
+ * The body may be split at any byte.
+ *
+ * @param decoder Decoder of the response body
+ * @param data Next piece of the body as received from the server
+ * @param data_len Length of the piece
+ * @param sink Callback receiving the decoded content
+ * @param sink_env Environment passed to the sink
+ * @ret 0 if the piece was decoded
+ *      1 if the sink stopped the decoding
+ *      -1 if the body could not be decoded
+ */
+int feedContentDecoder(ContentDecoder *decoder, const char *data, size_t data_len, DecoderSink sink, void *sink_env)
+{
+        assert(decoder != NULL);
+        assert(sink != NULL);
+
+        if(decoder->error)
+        {
+                return -1;
+        }
+
+        if(data_len == 0)
+        {
+                return 0;
+        }
+
+        if(decoder->encoding == CONTENT_ENCODING_IDENTITY)
+        {
+                if(decoder->chunked)
+                {
+                        return feedChunkedDecoder(&(decoder->chunk_decoder), data, data_len, sink, sink_env);
+                }
+
+                decoder->decoded_bytes += data_len;
+                return (sink(data, data_len, sink_env) != 0) ? 1 : 0;
+        }
+
+        InflateEnv inflate_env;
+        inflate_env.decoder = decoder;
+        inflate_env.sink = sink;
+        inflate_env.sink_env = sink_env;
+
+        if(decoder->chunked)
+        {
+                return feedChunkedDecoder(&(decoder->chunk_decoder), data, data_len,
+                                          inflateToSink, &inflate_env);
+        }
+
+        return inflateToSink(data, data_len, &inflate_env);
+}
+
+
+/* contentDecoderComplete
+ *
+ * Check whether the decoder has seen the end of the body: the last chunk of a chunked body,
+ * otherwise the end of the compressed stream
+ *
+ * @param decoder Decoder of the response body
+ * @ret 1 if the body ended without a decoding error, 0 otherwise
+ */
+int contentDecoderComplete(const ContentDecoder *decoder)
+{
+        assert(decoder != NULL);
+
+        if(decoder->error)
+        {
+                return 0;
+        }
+
+        if(decoder->chunked)
+        {
+                return chunkedDecoderDone(&(decoder->chunk_decoder));
+        }
+
+        return decoder->finished;
+}
+
+
+/* initChunkedDecoder
+ *
+ * Initialize the state for removing chunked transfer coding
+ *
+ * @param decoder State to initialize
+ */
+void initChunkedDecoder(ChunkedDecoder *decoder)
+{
+        assert(decoder != NULL);
+
+        decoder->state = CHUNK_STATE_SIZE;
+        decoder->chunk_remaining = 0;
+}
+
+
+/* feedChunkedDecoder
+ *
+ * Remove the chunk framing from the next piece of a chunked body and pass the chunk
+ * data on to a sink
+ *
+ * @param decoder State of the chunked decoding
+ * @param data Next piece of the chunked body
+ * @param data_len Length of the piece
+ * @param sink Callback receiving the chunk data
+ * @param sink_env Environment passed to the sink
+ * @ret 0 if the piece was decoded
+ *      1 if the sink stopped the decoding
+ *      -1 on malformed framing or if the sink failed
+ */
+int feedChunkedDecoder(ChunkedDecoder *decoder, const char *data, size_t data_len, DecoderSink sink, void *sink_env)
+{
+        assert(decoder != NULL);
+        assert(sink != NULL);
+
+        size_t pos = 0;
+
+        while(pos < data_len)
+        {
+                char c = data[pos];
+
+                switch(decoder->state)
+                {
+                case CHUNK_STATE_SIZE:
+                        if(isxdigit((unsigned char)c))
+                        {
+                                int digit = isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10);
+                                if(decoder->chunk_remaining > (((size_t)-1) >> 4))
+                                {
+                                        // Chunk size overflow
+                                        return -1;
+                                }
+                                decoder->chunk_remaining = (decoder->chunk_remaining << 4) | digit;
+                        }
+                        else if(c == '\n')
+                        {
+                                decoder->state = (decoder->chunk_remaining == 0) ? CHUNK_STATE_TRAILER_START
+                                                                                  : CHUNK_STATE_DATA;
+                        }
+                        else
+                        {
+                                // Chunk extension or CR
+                                decoder->state = CHUNK_STATE_SIZE_EXT;
+                        }
+                        ++pos;
+                        break;
+
+                case CHUNK_STATE_SIZE_EXT:
+                        if(c == '\n')
+                        {
+                                decoder->state = (decoder->chunk_remaining == 0) ? CHUNK_STATE_TRAILER_START
+                                                                                  : CHUNK_STATE_DATA;
+                        }
+                        ++pos;
+                        break;
+
+                case CHUNK_STATE_DATA:
+                {
+                        size_t data_part = data_len - pos;
+                        if(data_part > decoder->chunk_remaining)
+                        {
+                                data_part = decoder->chunk_remaining;
+                        }
+
+                        int sink_stat = sink(data + pos, data_part, sink_env);
+                        if(sink_stat != 0)
+                        {
+                                return sink_stat;
+                        }
+
+                        pos += data_part;
+                        decoder->chunk_remaining -= data_part;
+                        if(decoder->chunk_remaining == 0)
+                        {
+                                decoder->state = CHUNK_STATE_DATA_END;
+                        }
+                        break;
+                }
+
+                case CHUNK_STATE_DATA_END:
+                        // Skip CRLF after chunk data
+                        if(c == '\n')
+                        {
+                                decoder->state = CHUNK_STATE_SIZE;
+                        }
+                        ++pos;
+                        break;
+
+                case CHUNK_STATE_TRAILER_START:
+                        if(c == '\n')
+                        {
+                                decoder->state = CHUNK_STATE_DONE;
+                        }
+                        else if(c != '\r')
+                        {
+                                decoder->state = CHUNK_STATE_TRAILER;
+                        }
+                        ++pos;
+                        break;
+
+                case CHUNK_STATE_TRAILER:
+                        if(c == '\n')
+                        {
+                                decoder->state = CHUNK_STATE_TRAILER_START;
+                        }
+                        ++pos;
+                        break;
+
+                default:
+                        // End of body reached, ignore remaining data
+                        return 0;
+                }
+        }
+
+        return 0;
+}
+
+
+/* chunkedDecoderDone
+ *
+ * Check whether the last chunk of a chunked body and its trailer have been seen
+ *
+ * @param decoder State of the chunked decoding
+ * @ret 1 if the end of the chunked body was reached, 0 otherwise
+ */
+int chunkedDecoderDone(const ChunkedDecoder *decoder)
+{
+        assert(decoder != NULL);
+
+        return decoder->state == CHUNK_STATE_DONE;
+}
@@ -0,0 +1,84 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdlib.h>
+#include <zlib.h>
+
+// Size of the buffer decoded data is written to before it is handed on
+#define DECODER_OUTPUT_BUFFER_SIZE 16384
+
+
+/* ContentEncoding
+ *
+ * Content codings of a HTTP response body as far as the proxy is concerned
+ */
+typedef enum _content_encoding_
+{
+  CONTENT_ENCODING_IDENTITY,
+  CONTENT_ENCODING_GZIP,
+  CONTENT_ENCODING_DEFLATE,
+  CONTENT_ENCODING_UNSUPPORTED
+} ContentEncoding;
+
+
+/* ChunkedDecoder struct
+ *
+ * State for removing the chunked transfer coding from a body that arrives in pieces
+ *
+ * state          -> Position in the chunk framing
+ * chunk_remaining -> Number of data bytes left in the current chunk
+ */
+typedef struct _chunked_decoder_
+{
+  int state;
+  size_t chunk_remaining;
+} ChunkedDecoder;
+
+
+/* ContentDecoder struct
+ *
+ * Streaming decoder that turns a (chunked and/or compressed) response body into the
+ * plain content. Memory use is fixed: the zlib state with its 32KB window and one output buffer.
+ *
+ * encoding       -> Content coding of the body
+ * chunked        -> Whether the body uses chunked transfer coding
+ * chunk_decoder  -> State of the chunked transfer decoding
+ * zstream        -> zlib inflate state (gzip and deflate only)
+ * raw_fallback   -> Whether a failed zlib deflate stream may still be retried as raw deflate
+ * finished       -> The compressed stream ended, further input has to start a new gzip member
+ * error          -> A decoding error occured, the remaining body could not be decoded
+ * decoded_bytes  -> Number of decoded content bytes handed on so far
+ * out_buffer     -> Buffer for inflated data
+ */
+typedef struct _content_decoder_
+{
+  ContentEncoding encoding;
+  int chunked;
+  ChunkedDecoder chunk_decoder;
+  z_stream zstream;
+  int raw_fallback;
+  int finished;
+  int error;
+  size_t decoded_bytes;
+  unsigned char out_buffer[DECODER_OUTPUT_BUFFER_SIZE];
+} ContentDecoder;
+
+
+/* Callback receiving decoded content. Returning != 0 stops the decoding.
+ */
+typedef int (*DecoderSink)(const char *_data_, size_t _data_len_, void *_sink_env_);
+
+
+ContentEncoding parseContentEncoding(const char *content_encoding_value);
+
+int initContentDecoder(ContentDecoder *decoder, ContentEncoding encoding, int chunked);
+void destroyContentDecoder(ContentDecoder *decoder);
+
+int feedContentDecoder(ContentDecoder *decoder, const char *data, size_t data_len, DecoderSink sink, void *sink_env);
+int contentDecoderComplete(const ContentDecoder *decoder);
+
+void initChunkedDecoder(ChunkedDecoder *decoder);
+int feedChunkedDecoder(ChunkedDecoder *decoder, const char *data, size_t data_len, DecoderSink sink, void *sink_env);
+int chunkedDecoderDone(const ChunkedDecoder *decoder);
+
+#endif
@@ -0,0 +1,412 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "eyeballs.h"
+#include "config.h"
+#include "latency.h"
+#include "shm.h"
+#include "stats.h"
+
+
+/* Failure memory in shared memory, created before sessions are forked.
+ * NULL if it could not be created, addresses are tried in resolver order then.
+ */
+static EyeballsFailure *connect_failures = NULL;
+
+
+/* initConnectFailures
+ *
+ * Create the failure memory of server addresses
+ *
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initConnectFailures(void)
+{
+        connect_failures = createSharedMemory(EYEBALLS_FAILURE_SLOTS * sizeof(EyeballsFailure));
+
+        return (connect_failures != NULL) ? 0 : -1;
+}
+
+
+/* addressKey
+ *
+ * Hash a server address including its port
+ *
+ * @param address Address to hash
+ * @ret Hash of the address, never 0
+ */
+static uint64_t addressKey(const struct addrinfo *address)
+{
+        const uint8_t *bytes = (const uint8_t *)address->ai_addr;
+        uint64_t hash = 14695981039346656037ull;
+
+        for(socklen_t i = 0; i < address->ai_addrlen; ++i)
+        {
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+
+        return (hash != 0) ? hash : 1;
+}
+
+
+/* isKnownFailed
+ *
+ * Check if connecting to an address failed recently
+ *
+ * @param address Address to check
+ * @param now_ms Current monotonic time in milliseconds
+ * @ret True if the address should be tried after the others
+ */
+static int isKnownFailed(const struct addrinfo *address, uint64_t now_ms)
+{
+        if(connect_failures == NULL)
+        {
+                return 0;
+        }
+
+        uint64_t key = addressKey(address);
+        EyeballsFailure *failure = connect_failures + (key & (EYEBALLS_FAILURE_SLOTS - 1));
+
+        return (__atomic_load_n(&(failure->key), __ATOMIC_RELAXED) == key) &&
+               (__atomic_load_n(&(failure->failed_until), __ATOMIC_RELAXED) > now_ms);
+}
+
+
+/* rememberConnectResult
+ *
+ * Remember a failed address for EYEBALLS_FAILURE_MEMORY_MS, or forget it after a success
+ *
+ * @param address Address that was connected to
+ * @param failed True if the attempt failed
+ * @param now_ms Current monotonic time in milliseconds
+ */
+static void rememberConnectResult(const struct addrinfo *address, int failed, uint64_t now_ms)
+{
+        if(connect_failures == NULL)
+        {
+                return;
+        }
+
+        uint64_t key = addressKey(address);
+        EyeballsFailure *failure = connect_failures + (key & (EYEBALLS_FAILURE_SLOTS - 1));
+
+        if(failed)
+        {
+                __atomic_store_n(&(failure->key), key, __ATOMIC_RELAXED);
+                __atomic_store_n(&(failure->failed_until), now_ms + EYEBALLS_FAILURE_MEMORY_MS, __ATOMIC_RELAXED);
+        }
+        else if(__atomic_load_n(&(failure->key), __ATOMIC_RELAXED) == key)
+        {
+                __atomic_store_n(&(failure->failed_until), 0, __ATOMIC_RELAXED);
+        }
+}
+
+
+/* interleaveFamilies
+ *
+ * Append addresses to the ordered list, alternating between address families starting with
+ * the family of the first address (RFC 8305 section 4)
+ *
+ * @param addresses Addresses in resolver order
+ * @param num_addresses Number of addresses
+ * @param ordered List to append to
+ * @param num_ordered Number of addresses in the list
+ * @ret New number of addresses in the list
+ */
+static size_t interleaveFamilies(const struct addrinfo **addresses, size_t num_addresses,
+                                 const struct addrinfo **ordered, size_t num_ordered)
+{
+        if(num_addresses == 0)
+        {
+                return num_ordered;
+        }
+
+        int first_family = addresses[0]->ai_family;
+        size_t next_first = 0;
+        size_t next_other = 0;
+        int take_first = 1;
+
+        for(size_t i = 0; i < num_addresses; ++i)
+        {
+                // Find the next address of the wanted family, or of any family if it ran out
+                while((next_first < num_addresses) && (addresses[next_first]->ai_family != first_family))
+                {
+                        ++next_first;
+                }
+                while((next_other < num_addresses) && (addresses[next_other]->ai_family == first_family))
+                {
+                        ++next_other;
+                }
+
+                if((take_first && (next_first < num_addresses)) || (next_other >= num_addresses))
+                {
+                        ordered[num_ordered++] = addresses[next_first++];
+                }
+                else
+                {
+                        ordered[num_ordered++] = addresses[next_other++];
+                }
+                take_first = !take_first;
+        }
+
+        return num_ordered;
+}
+
+
+/* orderServerAddresses
+ *
+ * Order the addresses of a server for connecting: families interleaved, recently failed
+ * addresses last
+ *
+ * @param addresses Addresses as returned by resolveServerAddress
+ * @ret ordered Array of at least EYEBALLS_MAX_ADDRESSES entries to hold the ordered addresses
+ * @ret Number of ordered addresses
+ */
+size_t orderServerAddresses(const struct addrinfo *addresses, const struct addrinfo **ordered)
+{
+        assert(ordered != NULL);
+
+        const struct addrinfo *good[EYEBALLS_MAX_ADDRESSES];
+        const struct addrinfo *failed[EYEBALLS_MAX_ADDRESSES];
+        size_t num_good = 0;
+        size_t num_failed = 0;
+        uint64_t now_ms = monotonicNs() / 1000000;
+
+        for(const struct addrinfo *address = addresses;
+            (address != NULL) && (num_good + num_failed < EYEBALLS_MAX_ADDRESSES); address = address->ai_next)
+        {
+                if(isKnownFailed(address, now_ms))
+                {
+                        failed[num_failed++] = address;
+                }
+                else
+                {
+                        good[num_good++] = address;
+                }
+        }
+
+        size_t num_ordered = interleaveFamilies(good, num_good, ordered, 0);
+        return interleaveFamilies(failed, num_failed, ordered, num_ordered);
+}
+
+
+/* startAttempt
+ *
+ * Start a non-blocking connect to an address
+ *
+ * @param address Address to connect to
+ * @param now_ms Current monotonic time in milliseconds
+ * @ret attempt Attempt in flight
+ * @ret 1 if the connection is established already
+ *      0 if the connect is in progress
+ *      -1 if it failed
+ */
+static int startAttempt(const struct addrinfo *address, uint64_t now_ms, EyeballsAttempt *attempt)
+{
+        addProxyCounter(STAT_CONNECT_ATTEMPTS, 1);
+
+        int fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+        if(fd == -1)
+        {
+                return -1;
+        }
+
+        attempt->fd = fd;
+        attempt->started = now_ms;
+        attempt->address = address;
+
+        if(connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+                return 1;
+        }
+        if(errno == EINPROGRESS)
+        {
+                return 0;
+        }
+
+        close(fd);
+        return -1;
+}
+
+
+/* failAttempt
+ *
+ * Close a failed attempt and remember its address as failed
+ */
+static void failAttempt(EyeballsAttempt *attempt, uint64_t now_ms)
+{
+        addProxyCounter(STAT_CONNECT_ATTEMPTS_FAILED, 1);
+        rememberConnectResult(attempt->address, 1, now_ms);
+        close(attempt->fd);
+}
+
+
+/* connectHappyEyeballs
+ *
+ * Connect to the first address of a server that answers, racing the addresses in the staggered
+ * way of Happy Eyeballs (RFC 8305). The next address is tried when the previous attempts did not
+ * succeed within the attempt delay, or right away when one of them failed. Every attempt is given
+ * up after the attempt timeout. All attempts in flight are waited on with a single poll, the
+ * losing ones are closed. Addresses that failed, or stayed silent for an attempt delay while
+ * another one answered, are tried last by the following connects.
+ *
+ * @param addresses Addresses of the server as returned by resolveServerAddress
+ * @ret ret_socket Blocking socket of the established connection
+ * @ret 0 on success, -1 if no address could be connected to or the connect was interrupted
+ */
+int connectHappyEyeballs(const struct addrinfo *addresses, Socket *ret_socket)
+{
+        assert(ret_socket != NULL);
+
+        const struct addrinfo *ordered[EYEBALLS_MAX_ADDRESSES];
+        size_t num_addresses = orderServerAddresses(addresses, ordered);
+
+        EyeballsAttempt attempts[EYEBALLS_MAX_ADDRESSES];
+        struct pollfd poll_fds[EYEBALLS_MAX_ADDRESSES];
+        size_t num_attempts = 0;
+        size_t next_address = 0;
+        int winner = -1;
+        EyeballsAttempt won;
+
+        uint64_t now_ms = monotonicNs() / 1000000;
+        uint64_t next_start_ms = now_ms;
+
+        while((winner == -1) && ((next_address < num_addresses) || (num_attempts > 0)))
+        {
+                if((next_address < num_addresses) && ((num_attempts == 0) || (now_ms >= next_start_ms)))
+                {
+                        int start_stat = startAttempt(ordered[next_address], now_ms, attempts + num_attempts);
+                        if(start_stat == 1)
+                        {
+                                won = attempts[num_attempts];
+                                winner = next_address;
+                        }
+                        else if(start_stat == 0)
+                        {
+                                ++num_attempts;
+                        }
+                        else
+                        {
+                                addProxyCounter(STAT_CONNECT_ATTEMPTS_FAILED, 1);
+                                rememberConnectResult(ordered[next_address], 1, now_ms);
+                        }
+                        ++next_address;
+                        next_start_ms = now_ms + proxy_config.connect_attempt_delay;
+                        continue;
+                }
+
+                // Wait for an attempt to finish, the next attempt to start or the first to time out
+                uint64_t wake_ms = UINT64_MAX;
+                if(next_address < num_addresses)
+                {
+                        wake_ms = next_start_ms;
+                }
+                for(size_t i = 0; i < num_attempts; ++i)
+                {
+                        poll_fds[i].fd = attempts[i].fd;
+                        poll_fds[i].events = POLLOUT;
+                        poll_fds[i].revents = 0;
+                        if(attempts[i].started + proxy_config.connect_attempt_timeout < wake_ms)
+                        {
+                                wake_ms = attempts[i].started + proxy_config.connect_attempt_timeout;
+                        }
+                }
+
+                int poll_timeout = (wake_ms > now_ms) ? (int)(wake_ms - now_ms) : 0;
+                if(poll(poll_fds, num_attempts, poll_timeout) == -1)
+                {
+                        // Interrupted by the connect timeout of the session
+                        break;
+                }
+                now_ms = monotonicNs() / 1000000;
+
+                // Collect finished and timed out attempts, keeping the others in order
+                size_t num_running = 0;
+                int any_failed = 0;
+                for(size_t i = 0; i < num_attempts; ++i)
+                {
+                        int finished = 0;
+                        int failed = 0;
+
+                        if(poll_fds[i].revents != 0)
+                        {
+                                int error = 0;
+                                socklen_t error_len = sizeof(error);
+                                finished = 1;
+                                failed = (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0) ||
+                                         (error != 0);
+                        }
+                        else if(now_ms >= attempts[i].started + proxy_config.connect_attempt_timeout)
+                        {
+                                finished = 1;
+                                failed = 1;
+                        }
+
+                        if(finished && !failed && (winner == -1))
+                        {
+                                won = attempts[i];
+                                winner = i;
+                        }
+                        else if(finished && failed)
+                        {
+                                failAttempt(attempts + i, now_ms);
+                                any_failed = 1;
+                        }
+                        else if(finished)
+                        {
+                                // A second attempt finished in the same poll
+                                close(attempts[i].fd);
+                        }
+                        else
+                        {
+                                attempts[num_running++] = attempts[i];
+                        }
+                }
+
+                // An attempt failed, start the next one right away
+                if(any_failed)
+                {
+                        next_start_ms = now_ms;
+                }
+                num_attempts = num_running;
+        }
+
+        for(size_t i = 0; i < num_attempts; ++i)
+        {
+                // Silent for a whole attempt delay while another address answered
+                if((winner != -1) && (now_ms >= attempts[i].started + proxy_config.connect_attempt_delay))
+                {
+                        rememberConnectResult(attempts[i].address, 1, now_ms);
+                }
+                close(attempts[i].fd);
+        }
+
+        if(winner == -1)
+        {
+                return -1;
+        }
+
+        if(won.address != ordered[0])
+        {
+                addProxyCounter(STAT_CONNECT_FALLBACKS, 1);
+        }
+        rememberConnectResult(won.address, 0, now_ms);
+
+        // The sessions use blocking sockets
+        int flags = fcntl(won.fd, F_GETFL);
+        fcntl(won.fd, F_SETFL, flags & ~O_NONBLOCK);
+
+        Socket server_socket;
+        initSocket(&server_socket);
+        server_socket.fd_ = won.fd;
+        server_socket.open_ = 1;
+        *ret_socket = server_socket;
+
+        return 0;
+}
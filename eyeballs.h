@@ -0,0 +1,55 @@
+#ifndef EYEBALLS_H
+#define EYEBALLS_H
+
+#include <stdint.h>
+#include <netdb.h>
+
+#include "util_socket.h"
+
+// Addresses of a server that are tried, further ones are ignored
+#define EYEBALLS_MAX_ADDRESSES 16
+
+// Entries of the failure memory (power of two)
+#define EYEBALLS_FAILURE_SLOTS 4096
+
+// Milliseconds an address that failed is tried after the others
+#define EYEBALLS_FAILURE_MEMORY_MS 60000
+
+
+/* EyeballsFailure struct
+ *
+ * Entry of the failure memory, shared by all sessions. Entries are read and written without
+ * locks, a torn entry only changes the order addresses are tried in.
+ *
+ * key          -> Hash of the address, 0 if the entry is empty
+ * failed_until -> Monotonic time in milliseconds until which the address counts as failed
+ */
+typedef struct _eyeballs_failure_
+{
+  uint64_t key;
+  uint64_t failed_until;
+} EyeballsFailure;
+
+
+/* EyeballsAttempt struct
+ *
+ * Connection attempt in flight
+ *
+ * fd       -> Non-blocking socket of the attempt
+ * started  -> Monotonic time in milliseconds the attempt was started at
+ * address  -> Address the attempt connects to
+ */
+typedef struct _eyeballs_attempt_
+{
+  int fd;
+  uint64_t started;
+  const struct addrinfo *address;
+} EyeballsAttempt;
+
+
+int initConnectFailures(void);
+
+size_t orderServerAddresses(const struct addrinfo *addresses, const struct addrinfo **ordered);
+int connectHappyEyeballs(const struct addrinfo *addresses, Socket *ret_socket);
+
+#endif
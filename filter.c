@@ -0,0 +1,1036 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "filter.h"
+#include "normalize.h"
+#include "util.h"
+
+
+/* Default keywords that lead to blocking of a request/response when no word list file is given
+ * Words and scanned text are normalized alike (see normalize.c), so percent-encoded and upper
+ * case variants of a word need no entries of their own
+ */
+#define NUM_DEFAULT_FILTERED_WORDS 6
+static const char *default_filtered_words[NUM_DEFAULT_FILTERED_WORDS] =
+        {
+                "spongebob",
+                "britney spears",
+                "paris hilton",
+                "norrkoping",
+                "norrköping",
+                "norrkoeping"
+        };
+
+// Transition lists up to this length are searched linearly, longer ones binary
+#define FILTER_LINEAR_SEARCH_EDGES 8
+
+/* Currently published matcher and the one it replaced. Sessions only ever load
+ * current_matcher; the replaced matcher is freed one reload later, when no
+ * session started before the previous swap can still be using it.
+ */
+static FilterMatcher *current_matcher = NULL;
+static FilterMatcher *retired_matcher = NULL;
+
+// File status of the word list at the last (re)load, to detect changes
+static struct stat filter_file_stat;
+
+// Normalization flags word lists are compiled with
+static uint32_t filter_flags = 0;
+
+
+/* TrieNode struct
+ *
+ * Node of the temporary trie the automaton is built from. Index 0 is the root,
+ * which is never a child, so 0 marks a missing child/sibling.
+ *
+ * first_child  -> First child of the node
+ * last_child   -> Last child of the node
+ * next_sibling -> Next child of the parent
+ * word         -> Index of the word ending in this node, FILTER_NO_MATCH if none
+ * byte         -> Byte on the transition from the parent to the node
+ */
+typedef struct _trie_node_
+{
+  uint32_t first_child;
+  uint32_t last_child;
+  uint32_t next_sibling;
+  int32_t word;
+  uint8_t byte;
+} TrieNode;
+
+
+/* compareWords
+ *
+ * qsort comparison for word pointers
+ */
+static int compareWords(const void *a, const void *b)
+{
+        return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/* alignOffset
+ *
+ * Round an offset in the matcher block up to 4 byte alignment
+ */
+static inline size_t alignOffset(size_t offset)
+{
+        return (offset + 3) & ~((size_t)3);
+}
+
+
+/* matcherChecksum
+ *
+ * Calculate the checksum of a matcher block, covering everything after the checksum field
+ *
+ * @param blob Matcher block
+ * @param blob_size Size of the block
+ * @ret CRC-32 of the block
+ */
+static uint32_t matcherChecksum(const void *blob, size_t blob_size)
+{
+        size_t start = offsetof(FilterMatcherHeader, checksum) + sizeof(uint32_t);
+
+        return crc32(crc32(0L, Z_NULL, 0), (const Bytef *)blob + start, blob_size - start);
+}
+
+
+/* validateFilterMatcher
+ *
+ * Check the checksum of a matcher block and that every index in it stays in range,
+ * so scanning can never read outside the block. Failure transitions must lead to a state
+ * numbered lower, as breadth first construction gives them, so following them always ends
+ * at the root.
+ *
+ * @param matcher Matcher to check
+ * @ret 0 if the block is valid
+ *      -1 otherwise
+ */
+static int validateFilterMatcher(const FilterMatcher *matcher)
+{
+        const FilterMatcherHeader *header = matcher->header;
+
+        if(matcherChecksum(matcher->blob, header->blob_size) != header->checksum)
+        {
+                fprintf(stderr, "ERROR: Filter matcher checksum mismatch\n");
+                return -1;
+        }
+
+        for(size_t c = 0; c < 256; ++c)
+        {
+                if(matcher->root_next[c] >= header->num_states)
+                {
+                        return -1;
+                }
+        }
+
+        for(uint32_t state = 0; state < header->num_states; ++state)
+        {
+                const FilterState *fs = matcher->states + state;
+                if((fs->edge_start > fs[1].edge_start) ||
+                   ((state != 0) && (fs->fail >= state)) ||
+                   ((state == 0) && (fs->fail != 0)) ||
+                   ((fs->word != FILTER_NO_MATCH) && ((fs->word < 0) || ((uint32_t)fs->word >= header->num_words))))
+                {
+                        return -1;
+                }
+        }
+
+        if((matcher->states[0].edge_start != 0) ||
+           (matcher->states[header->num_states].edge_start != header->num_edges))
+        {
+                return -1;
+        }
+
+        for(uint32_t word = 0; word < header->num_words; ++word)
+        {
+                if(matcher->word_offsets[word] >= header->pool_size)
+                {
+                        return -1;
+                }
+        }
+
+        if((header->pool_size > 0) && (matcher->word_pool[header->pool_size - 1] != '\0'))
+        {
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/* attachFilterMatcher
+ *
+ * Create a handle for a filter matcher block after checking that its header is consistent.
+ * With validate set, the checksum and all indices in the block are checked as well, for blocks
+ * that come from a file.
+ *
+ * @param blob Matcher block
+ * @param blob_size Size of the matcher block
+ * @param validate Whether to check the checksum and contents of the block
+ * @ret Allocated handle, NULL if the block is invalid or allocation failed
+ */
+static FilterMatcher * attachFilterMatcher(void *blob, size_t blob_size, int validate)
+{
+        const FilterMatcherHeader *header = (const FilterMatcherHeader *)blob;
+
+        if((blob_size < sizeof(FilterMatcherHeader)) ||
+           (header->magic != FILTER_MATCHER_MAGIC) ||
+           (header->version != FILTER_MATCHER_VERSION) ||
+           (header->blob_size != blob_size) ||
+           (header->num_states == 0) ||
+           (header->num_edges != header->num_states - 1))
+        {
+                return NULL;
+        }
+
+        // All sections must lie inside the block
+        if(((size_t)header->root_offset + 256 * sizeof(uint32_t) > blob_size) ||
+           ((size_t)header->states_offset + ((size_t)header->num_states + 1) * sizeof(FilterState) > blob_size) ||
+           ((size_t)header->edge_bytes_offset + header->num_edges > blob_size) ||
+           ((size_t)header->word_offsets_offset + (size_t)header->num_words * sizeof(uint32_t) > blob_size) ||
+           ((size_t)header->pool_offset + header->pool_size > blob_size) ||
+           ((header->root_offset | header->states_offset | header->word_offsets_offset) & 3))
+        {
+                return NULL;
+        }
+
+        FilterMatcher *matcher = malloc(sizeof(FilterMatcher));
+        if(matcher == NULL)
+        {
+                return NULL;
+        }
+
+        const char *base = (const char *)blob;
+        matcher->header = header;
+        matcher->root_next = (const uint32_t *)(base + header->root_offset);
+        matcher->states = (const FilterState *)(base + header->states_offset);
+        matcher->edge_bytes = (const uint8_t *)(base + header->edge_bytes_offset);
+        matcher->word_offsets = (const uint32_t *)(base + header->word_offsets_offset);
+        matcher->word_pool = base + header->pool_offset;
+        matcher->blob = blob;
+        matcher->mapped_size = 0;
+
+        if(validate && (validateFilterMatcher(matcher) != 0))
+        {
+                free(matcher);
+                return NULL;
+        }
+
+        return matcher;
+}
+
+
+/* findTransition
+ *
+ * Look up the transition of a non-root state for a byte
+ *
+ * @param matcher Matcher to search
+ * @param state State to leave
+ * @param c Normalized byte of the transition
+ * @ret Target state, 0 if the state has no transition for the byte
+ */
+static inline uint32_t findTransition(const FilterMatcher *matcher, uint32_t state, uint8_t c)
+{
+        uint32_t low = matcher->states[state].edge_start;
+        uint32_t high = matcher->states[state + 1].edge_start;
+
+        if(high - low <= FILTER_LINEAR_SEARCH_EDGES)
+        {
+                for(uint32_t e = low; e < high; ++e)
+                {
+                        if(matcher->edge_bytes[e] == c)
+                        {
+                                // Edges are numbered like their target states minus the root
+                                return e + 1;
+                        }
+                }
+
+                return 0;
+        }
+
+        while(low < high)
+        {
+                uint32_t mid = low + (high - low) / 2;
+                if(matcher->edge_bytes[mid] < c)
+                {
+                        low = mid + 1;
+                }
+                else
+                {
+                        high = mid;
+                }
+        }
+
+        if((low < matcher->states[state + 1].edge_start) && (matcher->edge_bytes[low] == c))
+        {
+                return low + 1;
+        }
+
+        return 0;
+}
+
+
+/* nextState
+ *
+ * Advance the automaton by one byte, following failure transitions if needed
+ *
+ * @param matcher Matcher to use
+ * @param state Current state
+ * @param c Normalized input byte
+ * @ret Next state
+ */
+static inline uint32_t nextState(const FilterMatcher *matcher, uint32_t state, uint8_t c)
+{
+        while(state != 0)
+        {
+                uint32_t target = findTransition(matcher, state, c);
+                if(target != 0)
+                {
+                        return target;
+                }
+
+                state = matcher->states[state].fail;
+        }
+
+        return matcher->root_next[c];
+}
+
+
+/* buildFilterMatcher
+ *
+ * Build an Aho-Corasick automaton for a list of words in a single relocatable block.
+ * The words are normalized with the given flags, text has to be normalized the same way
+ * before it is scanned.
+ *
+ * States are numbered in breadth first order, so the transitions of every state are
+ * contiguous and the target of transition e is state e + 1.
+ *
+ * @param words Words to match
+ * @param num_words Number of words
+ * @param flags NORMALIZE_* flags
+ * @ret Allocated matcher, NULL if allocation failed or the automaton is too large
+ */
+FilterMatcher * buildFilterMatcher(const char **words, size_t num_words, uint32_t flags)
+{
+        FilterMatcher *matcher = NULL;
+        char **sorted_words = NULL;
+        TrieNode *nodes = NULL;
+        uint32_t *bfs_order = NULL;
+        char *blob = NULL;
+        size_t num_sorted = 0;
+        size_t num_nodes = 1;
+        size_t nodes_capacity = 1024;
+        size_t pool_size = 0;
+
+        // Normalize and sort words, drop duplicates and empty words
+        sorted_words = malloc((num_words + 1) * sizeof(char *));
+        if(sorted_words == NULL)
+        {
+                goto error_alloc;
+        }
+
+        for(size_t i = 0; i < num_words; ++i)
+        {
+                TextNormalizer normalizer;
+                size_t len = strlen(words[i]);
+                size_t consumed = 0;
+
+                // Normalized text is never longer than the input
+                char *normalized = malloc(len + 2 * NORMALIZE_MAX_EXPANSION);
+                if(normalized == NULL)
+                {
+                        goto error_alloc;
+                }
+
+                initTextNormalizer(&normalizer, flags);
+                size_t normalized_len = normalizeText(&normalizer, words[i], len, &consumed,
+                                                      normalized, len + NORMALIZE_MAX_EXPANSION);
+                assert(consumed == len);
+                normalized_len += finishTextNormalizer(&normalizer, normalized + normalized_len);
+                normalized[normalized_len] = '\0';
+
+                if(normalized_len == 0)
+                {
+                        free(normalized);
+                        continue;
+                }
+                sorted_words[num_sorted++] = normalized;
+        }
+
+        qsort(sorted_words, num_sorted, sizeof(char *), compareWords);
+
+        size_t num_unique = 0;
+        for(size_t i = 0; i < num_sorted; ++i)
+        {
+                if((num_unique > 0) && (strcmp(sorted_words[num_unique - 1], sorted_words[i]) == 0))
+                {
+                        free(sorted_words[i]);
+                        continue;
+                }
+                sorted_words[num_unique++] = sorted_words[i];
+                pool_size += strlen(sorted_words[i]) + 1;
+        }
+        num_sorted = num_unique;
+
+
+        // Build trie. With sorted input, an existing child for the next byte is always the last child.
+        nodes = malloc(nodes_capacity * sizeof(TrieNode));
+        if(nodes == NULL)
+        {
+                goto error_alloc;
+        }
+        memset(nodes, 0, sizeof(TrieNode));
+        nodes[0].word = FILTER_NO_MATCH;
+
+        for(size_t w = 0; w < num_sorted; ++w)
+        {
+                uint32_t node = 0;
+                for(const uint8_t *c = (const uint8_t *)sorted_words[w]; *c != '\0'; ++c)
+                {
+                        uint32_t child = nodes[node].last_child;
+                        if((child == 0) || (nodes[child].byte != *c))
+                        {
+                                if(num_nodes == nodes_capacity)
+                                {
+                                        if(nodes_capacity >= UINT32_MAX / 2)
+                                        {
+                                                goto error_alloc;
+                                        }
+                                        TrieNode *temp = realloc(nodes, 2 * nodes_capacity * sizeof(TrieNode));
+                                        if(temp == NULL)
+                                        {
+                                                goto error_alloc;
+                                        }
+                                        nodes = temp;
+                                        nodes_capacity *= 2;
+                                }
+
+                                child = num_nodes++;
+                                nodes[child].first_child = 0;
+                                nodes[child].last_child = 0;
+                                nodes[child].next_sibling = 0;
+                                nodes[child].word = FILTER_NO_MATCH;
+                                nodes[child].byte = *c;
+
+                                if(nodes[node].first_child == 0)
+                                {
+                                        nodes[node].first_child = child;
+                                }
+                                else
+                                {
+                                        nodes[nodes[node].last_child].next_sibling = child;
+                                }
+                                nodes[node].last_child = child;
+                        }
+                        node = child;
+                }
+                nodes[node].word = w;
+        }
+
+
+        // Lay out the matcher block
+        size_t num_states = num_nodes;
+        size_t num_edges = num_nodes - 1;
+
+        size_t root_offset = alignOffset(sizeof(FilterMatcherHeader));
+        size_t states_offset = alignOffset(root_offset + 256 * sizeof(uint32_t));
+        size_t edge_bytes_offset = alignOffset(states_offset + (num_states + 1) * sizeof(FilterState));
+        size_t word_offsets_offset = alignOffset(edge_bytes_offset + num_edges);
+        size_t pool_offset = alignOffset(word_offsets_offset + num_sorted * sizeof(uint32_t));
+        size_t blob_size = alignOffset(pool_offset + pool_size);
+
+        if(blob_size > UINT32_MAX)
+        {
+                fprintf(stderr, "ERROR: Filter word list too large\n");
+                goto error_alloc;
+        }
+
+        blob = calloc(1, blob_size);
+        bfs_order = malloc(num_nodes * sizeof(uint32_t));
+        if((blob == NULL) || (bfs_order == NULL))
+        {
+                goto error_alloc;
+        }
+
+        FilterMatcherHeader *header = (FilterMatcherHeader *)blob;
+        header->magic = FILTER_MATCHER_MAGIC;
+        header->version = FILTER_MATCHER_VERSION;
+        header->blob_size = blob_size;
+        header->num_states = num_states;
+        header->num_edges = num_edges;
+        header->num_words = num_sorted;
+        header->pool_size = pool_size;
+        header->root_offset = root_offset;
+        header->states_offset = states_offset;
+        header->edge_bytes_offset = edge_bytes_offset;
+        header->word_offsets_offset = word_offsets_offset;
+        header->pool_offset = pool_offset;
+
+        uint32_t *root_next = (uint32_t *)(blob + root_offset);
+        FilterState *states = (FilterState *)(blob + states_offset);
+        uint8_t *edge_bytes = (uint8_t *)(blob + edge_bytes_offset);
+        uint32_t *word_offsets = (uint32_t *)(blob + word_offsets_offset);
+        char *pool = blob + pool_offset;
+
+        // Number states breadth first and store transitions
+        size_t bfs_head = 0;
+        size_t bfs_tail = 1;
+        bfs_order[0] = 0;
+        while(bfs_head < bfs_tail)
+        {
+                uint32_t state = bfs_head;
+                uint32_t node = bfs_order[bfs_head++];
+
+                states[state].edge_start = bfs_tail - 1;
+                states[state].word = nodes[node].word;
+
+                for(uint32_t child = nodes[node].first_child; child != 0; child = nodes[child].next_sibling)
+                {
+                        edge_bytes[bfs_tail - 1] = nodes[child].byte;
+                        if(state == 0)
+                        {
+                                root_next[nodes[child].byte] = bfs_tail;
+                        }
+                        bfs_order[bfs_tail++] = child;
+                }
+        }
+        states[num_states].edge_start = num_edges;
+
+        FilterMatcher *building = attachFilterMatcher(blob, blob_size, 0);
+        if(building == NULL)
+        {
+                goto error_alloc;
+        }
+
+        // Failure transitions in breadth first order, shallower states are always done first
+        states[0].fail = 0;
+        for(uint32_t state = 0; state < num_states; ++state)
+        {
+                for(uint32_t e = states[state].edge_start; e < states[state + 1].edge_start; ++e)
+                {
+                        uint32_t child = e + 1;
+                        uint32_t fail = 0;
+
+                        if(state != 0)
+                        {
+                                fail = nextState(building, states[state].fail, edge_bytes[e]);
+                        }
+
+                        states[child].fail = fail;
+                        if(states[child].word == FILTER_NO_MATCH)
+                        {
+                                // Report words that end in a suffix of this state as well
+                                states[child].word = states[fail].word;
+                        }
+                }
+        }
+
+        // Word pool
+        size_t pool_pos = 0;
+        for(size_t w = 0; w < num_sorted; ++w)
+        {
+                size_t len = strlen(sorted_words[w]);
+                word_offsets[w] = pool_pos;
+                memcpy(pool + pool_pos, sorted_words[w], len + 1);
+                pool_pos += len + 1;
+        }
+
+        header->flags = flags;
+        header->checksum = matcherChecksum(blob, blob_size);
+
+        matcher = building;
+        blob = NULL;
+
+
+        // Cleanup
+error_alloc:
+        if(matcher == NULL)
+        {
+                fprintf(stderr, "ERROR: Could not build filter matcher\n");
+        }
+        free(blob);
+        free(bfs_order);
+        free(nodes);
+        if(sorted_words != NULL)
+        {
+                for(size_t i = 0; i < num_sorted; ++i)
+                {
+                        free(sorted_words[i]);
+                }
+                free(sorted_words);
+        }
+        return matcher;
+}
+
+
+/* freeFilterMatcher
+ *
+ * Free a matcher and its block
+ *
+ * @param matcher Matcher to free (can be NULL)
+ */
+void freeFilterMatcher(FilterMatcher *matcher)
+{
+        if(matcher == NULL)
+        {
+                return;
+        }
+
+        if(matcher->mapped_size != 0)
+        {
+                munmap(matcher->blob, matcher->mapped_size);
+        }
+        else
+        {
+                free(matcher->blob);
+        }
+        free(matcher);
+}
+
+
+/* findFilteredWord
+ *
+ * Scan normalized data for filtered words. The automaton state is kept between calls, so a
+ * stream can be scanned piece by piece and words split between pieces are found.
+ *
+ * @param matcher Matcher to use
+ * @param state Automaton state, 0 at the start of a stream. Updated on return.
+ * @param data Data to scan, normalized with the flags of the matcher
+ * @param data_len Length of the data
+ * @ret Index of the first filtered word found, FILTER_NO_MATCH if none
+ */
+int findFilteredWord(const FilterMatcher *matcher, uint32_t *state, const char *data, size_t data_len)
+{
+        assert(matcher != NULL);
+        assert(state != NULL);
+
+        uint32_t current = *state;
+        const uint8_t *bytes = (const uint8_t *)data;
+
+        for(size_t i = 0; i < data_len; ++i)
+        {
+                current = nextState(matcher, current, bytes[i]);
+
+                if(matcher->states[current].word != FILTER_NO_MATCH)
+                {
+                        *state = current;
+                        return matcher->states[current].word;
+                }
+        }
+
+        *state = current;
+        return FILTER_NO_MATCH;
+}
+
+
+/* filteredWord
+ *
+ * Get a filtered word by its index
+ *
+ * @param matcher Matcher holding the word
+ * @param word Index of the word
+ * @ret The (normalized) word
+ */
+const char * filteredWord(const FilterMatcher *matcher, int word)
+{
+        assert(matcher != NULL);
+        assert((word >= 0) && ((uint32_t)word < matcher->header->num_words));
+
+        return matcher->word_pool + matcher->word_offsets[word];
+}
+
+
+/* readWordList
+ *
+ * Read a word list file with one word per line. Empty lines and lines starting with '#' are skipped.
+ *
+ * @param path Path of the word list file
+ * @ret words_ret Allocated array of allocated words
+ * @ret num_words_ret Number of words read
+ * @ret 0 on success
+ *      -1 if the file could not be read or allocation failed
+ */
+int readWordList(const char *path, char ***words_ret, size_t *num_words_ret)
+{
+        assert(path != NULL);
+        assert(words_ret != NULL);
+        assert(num_words_ret != NULL);
+
+        int retval = 0;
+        char **words = NULL;
+        size_t num_words = 0;
+        size_t words_capacity = 0;
+        char *line = NULL;
+        size_t line_capacity = 0;
+        ssize_t line_len;
+
+        FILE *file = fopen(path, "r");
+        if(file == NULL)
+        {
+                perror("fopen word list");
+                return -1;
+        }
+
+        while((line_len = getline(&line, &line_capacity, file)) != -1)
+        {
+                while((line_len > 0) && ((line[line_len - 1] == '\n') || (line[line_len - 1] == '\r')))
+                {
+                        line[--line_len] = '\0';
+                }
+
+                if((line_len == 0) || (line[0] == '#'))
+                {
+                        continue;
+                }
+
+                if(num_words == words_capacity)
+                {
+                        size_t new_capacity = (words_capacity == 0) ? 64 : 2 * words_capacity;
+                        char **temp = realloc(words, new_capacity * sizeof(char *));
+                        if(temp == NULL)
+                        {
+                                retval = -1;
+                                goto error_alloc;
+                        }
+                        words = temp;
+                        words_capacity = new_capacity;
+                }
+
+                words[num_words] = NULL;
+                if(setStringN(&(words[num_words]), line, line_len) != 0)
+                {
+                        retval = -1;
+                        goto error_alloc;
+                }
+                ++num_words;
+        }
+
+        *words_ret = words;
+        *num_words_ret = num_words;
+        words = NULL;
+
+error_alloc:
+        freeWordList(words, num_words);
+        free(line);
+        fclose(file);
+        return retval;
+}
+
+
+/* freeWordList
+ *
+ * Free a word list read by readWordList
+ *
+ * @param words Array of words (can be NULL)
+ * @param num_words Number of words in the array
+ */
+void freeWordList(char **words, size_t num_words)
+{
+        if(words == NULL)
+        {
+                return;
+        }
+
+        for(size_t i = 0; i < num_words; ++i)
+        {
+                free(words[i]);
+        }
+        free(words);
+}
+
+
+/* loadFilterMatcher
+ *
+ * Get a matcher for a filter file. Compiled filter files (see filter_compile) are mapped
+ * without any construction work, word list files are compiled on the fly.
+ *
+ * @param path Path of the compiled filter file or word list file
+ * @ret Allocated matcher, NULL on error
+ */
+FilterMatcher * loadFilterMatcher(const char *path)
+{
+        assert(path != NULL);
+
+        char **words = NULL;
+        size_t num_words = 0;
+        uint32_t magic = 0;
+
+        FILE *file = fopen(path, "r");
+        if(file == NULL)
+        {
+                perror("fopen filter file");
+                return NULL;
+        }
+        size_t magic_len = fread(&magic, 1, sizeof(magic), file);
+        fclose(file);
+
+        if((magic_len == sizeof(magic)) && (magic == FILTER_MATCHER_MAGIC))
+        {
+                return mapFilterMatcher(path);
+        }
+
+        if(readWordList(path, &words, &num_words) != 0)
+        {
+                return NULL;
+        }
+
+        FilterMatcher *matcher = buildFilterMatcher((const char **)words, num_words, filter_flags);
+        freeWordList(words, num_words);
+
+        return matcher;
+}
+
+
+/* mapFilterMatcher
+ *
+ * Map a compiled filter file read-only. All processes mapping the same file share its pages.
+ *
+ * @param path Path of the compiled filter file
+ * @ret Allocated matcher handle, NULL if the file could not be mapped or is invalid
+ */
+FilterMatcher * mapFilterMatcher(const char *path)
+{
+        assert(path != NULL);
+
+        FilterMatcher *matcher = NULL;
+        struct stat file_stat;
+
+        int fd = open(path, O_RDONLY);
+        if(fd == -1)
+        {
+                perror("open compiled filter");
+                return NULL;
+        }
+
+        if((fstat(fd, &file_stat) != 0) || (file_stat.st_size < (off_t)sizeof(FilterMatcherHeader)) ||
+           (file_stat.st_size > UINT32_MAX))
+        {
+                fprintf(stderr, "ERROR: Invalid compiled filter file size\n");
+                goto error_stat;
+        }
+
+        void *blob = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(blob == MAP_FAILED)
+        {
+                perror("mmap compiled filter");
+                goto error_mmap;
+        }
+
+        matcher = attachFilterMatcher(blob, file_stat.st_size, 1);
+        if(matcher == NULL)
+        {
+                fprintf(stderr, "ERROR: Compiled filter file is invalid or has an unsupported version\n");
+                munmap(blob, file_stat.st_size);
+                goto error_attach;
+        }
+
+        matcher->mapped_size = file_stat.st_size;
+
+error_attach:
+error_mmap:
+error_stat:
+        close(fd);
+        return matcher;
+}
+
+
+/* writeFilterMatcher
+ *
+ * Write a matcher block to a compiled filter file. The file is written under a temporary name
+ * and renamed, so a running proxy never sees a partially written file.
+ *
+ * @param matcher Matcher to write
+ * @param path Path of the compiled filter file
+ * @ret 0 on success
+ *      -1 if the file could not be written
+ */
+int writeFilterMatcher(const FilterMatcher *matcher, const char *path)
+{
+        assert(matcher != NULL);
+        assert(path != NULL);
+
+        int retval = 0;
+        size_t temp_path_len = strlen(path) + strlen(".tmp") + 1;
+        char *temp_path = malloc(temp_path_len);
+        if(temp_path == NULL)
+        {
+                return -1;
+        }
+        snprintf(temp_path, temp_path_len, "%s.tmp", path);
+
+        FILE *file = fopen(temp_path, "wb");
+        if(file == NULL)
+        {
+                perror("fopen compiled filter");
+                retval = -1;
+                goto error_open;
+        }
+
+        size_t written = fwrite(matcher->blob, 1, matcher->header->blob_size, file);
+        if((fclose(file) != 0) || (written != matcher->header->blob_size))
+        {
+                perror("write compiled filter");
+                unlink(temp_path);
+                retval = -1;
+                goto error_write;
+        }
+
+        if(rename(temp_path, path) != 0)
+        {
+                perror("rename compiled filter");
+                unlink(temp_path);
+                retval = -1;
+        }
+
+error_write:
+error_open:
+        free(temp_path);
+        return retval;
+}
+
+
+/* acquireFilterMatcher
+ *
+ * Get the currently published matcher. A session should acquire the matcher once and
+ * keep using it, a reload does not affect sessions that are already running.
+ *
+ * @ret Current matcher
+ */
+const FilterMatcher * acquireFilterMatcher(void)
+{
+        return __atomic_load_n(&current_matcher, __ATOMIC_ACQUIRE);
+}
+
+
+/* publishFilterMatcher
+ *
+ * Replace the current matcher. Only called from one thread at a time (startup or the
+ * control thread), readers never block.
+ *
+ * @param matcher New matcher
+ */
+static void publishFilterMatcher(FilterMatcher *matcher)
+{
+        FilterMatcher *previous = __atomic_exchange_n(&current_matcher, matcher, __ATOMIC_ACQ_REL);
+
+        freeFilterMatcher(retired_matcher);
+        retired_matcher = previous;
+}
+
+
+/* loadAndPublishFilter
+ *
+ * Build a matcher from the word list file (or the default words) and publish it
+ *
+ * @param path Path of the word list file, NULL for the default words
+ * @ret 0 on success
+ *      -1 if the matcher could not be built, the current matcher stays in place
+ */
+static int loadAndPublishFilter(const char *path)
+{
+        struct timespec start;
+        struct timespec end;
+        FilterMatcher *matcher = NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if(path == NULL)
+        {
+                matcher = buildFilterMatcher(default_filtered_words, NUM_DEFAULT_FILTERED_WORDS, filter_flags);
+        }
+        else
+        {
+                // Remember file status before reading, so changes while reading trigger another reload
+                if(stat(path, &filter_file_stat) != 0)
+                {
+                        perror("stat word list");
+                        return -1;
+                }
+                matcher = loadFilterMatcher(path);
+        }
+
+        if(matcher == NULL)
+        {
+                fprintf(stderr, "ERROR: Could not load filter\n");
+                return -1;
+        }
+
+        publishFilterMatcher(matcher);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double load_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        printf("Filter loaded: %u words, %u states, %u bytes%s, %.2f ms\n",
+               matcher->header->num_words, matcher->header->num_states,
+               matcher->header->blob_size, (matcher->mapped_size != 0) ? " (mapped)" : "", load_ms);
+
+        return 0;
+}
+
+
+/* initFilter
+ *
+ * Load and publish the initial matcher
+ *
+ * @param path Path of the word list file, NULL for the default words
+ * @param flags NORMALIZE_* flags for word lists, compiled filter files bring their own
+ * @ret 0 on success, -1 on error
+ */
+int initFilter(const char *path, uint32_t flags)
+{
+        filter_flags = flags;
+        return loadAndPublishFilter(path);
+}
+
+
+/* reloadFilter
+ *
+ * Rebuild the matcher from the word list file and publish it. On failure the current matcher
+ * stays in place.
+ *
+ * @param path Path of the word list file, NULL for the default words
+ * @ret 0 on success, -1 on error
+ */
+int reloadFilter(const char *path)
+{
+        printf("Reloading filter word list\n");
+        return loadAndPublishFilter(path);
+}
+
+
+/* filterFileChanged
+ *
+ * Check if the word list file was modified or replaced since it was last loaded
+ *
+ * @param path Path of the word list file, NULL for the default words
+ * @ret True if the file changed
+ */
+int filterFileChanged(const char *path)
+{
+        struct stat file_stat;
+
+        if(path == NULL)
+        {
+                return 0;
+        }
+
+        if(stat(path, &file_stat) != 0)
+        {
+                // File is being replaced or was removed, keep the current matcher
+                return 0;
+        }
+
+        return (file_stat.st_ino != filter_file_stat.st_ino) ||
+               (file_stat.st_size != filter_file_stat.st_size) ||
+               (file_stat.st_mtim.tv_sec != filter_file_stat.st_mtim.tv_sec) ||
+               (file_stat.st_mtim.tv_nsec != filter_file_stat.st_mtim.tv_nsec);
+}
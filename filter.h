@@ -0,0 +1,122 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "normalize.h"
+
+// Identifies a filter matcher block ("PXFM")
+#define FILTER_MATCHER_MAGIC 0x4d465850
+
+// Layout version of the filter matcher block
+#define FILTER_MATCHER_VERSION 2
+
+// Word index returned when no filtered word was found
+#define FILTER_NO_MATCH -1
+
+
+/* FilterMatcherHeader struct
+ *
+ * Header at the start of a filter matcher block. The block holds an Aho-Corasick automaton
+ * for the filtered words. All references inside the block are offsets/indices, so the block
+ * can be used at any address. A compiled filter file is the block as it is in memory
+ * (native byte order; a foreign byte order fails the magic check).
+ *
+ * magic               -> FILTER_MATCHER_MAGIC
+ * version             -> FILTER_MATCHER_VERSION
+ * blob_size           -> Size of the whole block including this header
+ * checksum            -> CRC-32 of the block from the field after the checksum to the end
+ * flags               -> NORMALIZE_* flags the words were normalized with, scanned text has
+ *                        to be normalized the same way
+ * num_states          -> Number of automaton states, state 0 is the root
+ * num_edges           -> Number of (non-root) transitions
+ * num_words           -> Number of filtered words
+ * pool_size           -> Size of the pool holding the null terminated words
+ * root_offset         -> Offset of the dense root transition table (256 x uint32_t)
+ * states_offset       -> Offset of the state array (num_states + 1 x FilterState)
+ * edge_bytes_offset   -> Offset of the transition bytes (num_edges x uint8_t), the target
+ *                        of transition e is state e + 1
+ * word_offsets_offset -> Offset of the word start offsets into the pool (num_words x uint32_t)
+ * pool_offset         -> Offset of the word pool
+ */
+typedef struct _filter_matcher_header_
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t blob_size;
+  uint32_t checksum;
+  uint32_t flags;
+  uint32_t num_states;
+  uint32_t num_edges;
+  uint32_t num_words;
+  uint32_t pool_size;
+  uint32_t root_offset;
+  uint32_t states_offset;
+  uint32_t edge_bytes_offset;
+  uint32_t word_offsets_offset;
+  uint32_t pool_offset;
+} FilterMatcherHeader;
+
+
+/* FilterState struct
+ *
+ * One state of the filter automaton. The transitions of a state are stored sorted by byte
+ * from edge_start up to the edge_start of the following state.
+ *
+ * edge_start -> Index of the first transition of the state
+ * fail       -> State to continue with when no transition matches
+ * word       -> Index of a filtered word ending in this state, FILTER_NO_MATCH if none
+ */
+typedef struct _filter_state_
+{
+  uint32_t edge_start;
+  uint32_t fail;
+  int32_t word;
+} FilterState;
+
+
+/* FilterMatcher struct
+ *
+ * Handle to a filter matcher block with pointers to its sections
+ *
+ * header       -> Header of the block
+ * root_next    -> Dense transition table of the root state
+ * states       -> Automaton states
+ * edge_bytes   -> Transition bytes
+ * word_offsets -> Start of every word in the pool
+ * word_pool    -> Null terminated filtered words
+ * blob         -> The block itself
+ * mapped_size  -> Size of the mapping if the block is a mapped compiled filter file, 0 if allocated
+ */
+typedef struct _filter_matcher_
+{
+  const FilterMatcherHeader *header;
+  const uint32_t *root_next;
+  const FilterState *states;
+  const uint8_t *edge_bytes;
+  const uint32_t *word_offsets;
+  const char *word_pool;
+  void *blob;
+  size_t mapped_size;
+} FilterMatcher;
+
+
+FilterMatcher * buildFilterMatcher(const char **words, size_t num_words, uint32_t flags);
+FilterMatcher * loadFilterMatcher(const char *path);
+FilterMatcher * mapFilterMatcher(const char *path);
+int writeFilterMatcher(const FilterMatcher *matcher, const char *path);
+void freeFilterMatcher(FilterMatcher *matcher);
+
+int findFilteredWord(const FilterMatcher *matcher, uint32_t *state, const char *data, size_t data_len);
+const char * filteredWord(const FilterMatcher *matcher, int word);
+
+int readWordList(const char *path, char ***words_ret, size_t *num_words_ret);
+void freeWordList(char **words, size_t num_words);
+
+const FilterMatcher * acquireFilterMatcher(void);
+int initFilter(const char *path, uint32_t flags);
+int reloadFilter(const char *path);
+int filterFileChanged(const char *path);
+
+#endif
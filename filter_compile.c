@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+
+/* main
+ *
+ * Offline compiler turning a filter word list into a compiled filter file,
+ * which the proxy maps read-only at startup instead of building the matcher
+ *
+ * @param argc Number of commandline parameters
+ * @param argv Array containing commandline parameters
+ */
+int main(int argc, char *argv[])
+{
+        uint32_t flags = 0;
+        int arg = 1;
+
+        if((argc > 1) && ((strcmp(argv[1], "-d") == 0) || (strcmp(argv[1], "--fold-diacritics") == 0)))
+        {
+                flags |= NORMALIZE_FOLD_DIACRITICS;
+                ++arg;
+        }
+
+        if(argc - arg != 2)
+        {
+                printf("Usage: %s [-d|--fold-diacritics] <word list> <compiled filter>\n", argv[0]);
+                return 1;
+        }
+
+        const char *list_path = argv[arg];
+        const char *compiled_path = argv[arg + 1];
+
+        char **words = NULL;
+        size_t num_words = 0;
+        struct timespec start;
+        struct timespec end;
+
+        if(readWordList(list_path, &words, &num_words) != 0)
+        {
+                fprintf(stderr, "Could not read word list %s\n", list_path);
+                return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        FilterMatcher *matcher = buildFilterMatcher((const char **)words, num_words, flags);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        freeWordList(words, num_words);
+
+        if(matcher == NULL)
+        {
+                return 1;
+        }
+
+        if(writeFilterMatcher(matcher, compiled_path) != 0)
+        {
+                freeFilterMatcher(matcher);
+                return 1;
+        }
+
+        double build_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("%s: %u words, %u states, %u bytes, version %u, flags %x, checksum %08x, built in %.2f ms\n",
+               compiled_path, matcher->header->num_words, matcher->header->num_states,
+               matcher->header->blob_size, matcher->header->version, matcher->header->flags,
+               matcher->header->checksum, build_ms);
+
+        freeFilterMatcher(matcher);
+        return 0;
+}
@@ -0,0 +1,470 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "config.h"
+#include "admission.h"
+#include "latency.h"
+#include "timeout.h"
+
+
+// Listening sockets taken over from the previous proxy process and not used yet
+static HandoffListener inherited_listeners[HANDOFF_MAX_LISTENERS];
+static size_t num_inherited_listeners = 0;
+
+// Listening sockets of this process, handed to the next one
+static HandoffListener handoff_listeners[HANDOFF_MAX_LISTENERS];
+static size_t num_handoff_listeners = 0;
+
+// Connection to the previous proxy process until this one is ready, -1 if there is none
+static int predecessor_fd = -1;
+
+// Handoff socket the next proxy process connects to
+static int handoff_listen_fd = -1;
+
+// Pipe that becomes readable once the listening sockets were handed over
+static int handoff_stop_pipe[2] = {-1, -1};
+
+
+/* handoffAddress
+ *
+ * Fill in the address of the handoff socket
+ *
+ * @param path Path of the handoff socket
+ * @ret address Address of the socket
+ * @ret 0 on success
+ *      -1 if the path is too long
+ */
+static int handoffAddress(const char *path, struct sockaddr_un *address)
+{
+        memset(address, 0, sizeof(*address));
+        address->sun_family = AF_UNIX;
+
+        if(strlen(path) >= sizeof(address->sun_path))
+        {
+                fprintf(stderr, "ERROR: Handoff socket path is too long\n");
+                return -1;
+        }
+        strcpy(address->sun_path, path);
+
+        return 0;
+}
+
+
+/* receiveListener
+ *
+ * Receive one listening socket from the previous proxy process
+ *
+ * @param fd Connection to the previous process
+ * @ret listener Address, port and socket, an empty port ends the list
+ * @ret 0 on success
+ *      -1 if the connection failed or the message is broken
+ */
+static int receiveListener(int fd, HandoffListener *listener)
+{
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr message;
+
+        iov.iov_base = listener;
+        iov.iov_len = sizeof(*listener);
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if(recvmsg(fd, &message, 0) != sizeof(*listener))
+        {
+                return -1;
+        }
+
+        listener->address[HANDOFF_NAME_SIZE - 1] = '\0';
+        listener->port[HANDOFF_NAME_SIZE - 1] = '\0';
+        listener->fd = -1;
+
+        struct cmsghdr *control_header = CMSG_FIRSTHDR(&message);
+        if((control_header != NULL) && (control_header->cmsg_level == SOL_SOCKET) &&
+           (control_header->cmsg_type == SCM_RIGHTS))
+        {
+                memcpy(&(listener->fd), CMSG_DATA(control_header), sizeof(int));
+        }
+
+        return ((listener->port[0] == '\0') || (listener->fd != -1)) ? 0 : -1;
+}
+
+
+/* takeOverListeners
+ *
+ * Connect to the proxy process running with the same handoff socket and take over its
+ * listening sockets. The previous process keeps accepting connections until startHandoffThread
+ * tells it that this process is ready, then it stops and drains its sessions.
+ * Called before any listening socket is opened, also sets up the stop pipe of this process.
+ *
+ * @param path Path of the handoff socket
+ * @ret 0 on success, also if no proxy process is running
+ *      -1 if the listening sockets could not be taken over
+ */
+int takeOverListeners(const char *path)
+{
+        assert(path != NULL);
+
+        struct sockaddr_un address;
+        if(handoffAddress(path, &address) != 0)
+        {
+                return -1;
+        }
+
+        if(pipe(handoff_stop_pipe) == -1)
+        {
+                perror("handoff: pipe");
+                return -1;
+        }
+
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if(fd == -1)
+        {
+                perror("handoff: socket");
+                return -1;
+        }
+
+        if(connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        {
+                close(fd);
+
+                // No socket or a stale one of a proxy that is gone, start from scratch
+                if((errno == ENOENT) || (errno == ECONNREFUSED))
+                {
+                        return 0;
+                }
+                perror("handoff: connect");
+                return -1;
+        }
+
+        while(1)
+        {
+                HandoffListener listener;
+                if(receiveListener(fd, &listener) != 0)
+                {
+                        fprintf(stderr, "ERROR: Running proxy did not hand over its listening sockets\n");
+                        goto error_receive;
+                }
+                if(listener.port[0] == '\0')
+                {
+                        break;
+                }
+                if(num_inherited_listeners == HANDOFF_MAX_LISTENERS)
+                {
+                        close(listener.fd);
+                        fprintf(stderr, "ERROR: Running proxy handed over too many listening sockets\n");
+                        goto error_receive;
+                }
+                inherited_listeners[num_inherited_listeners++] = listener;
+        }
+
+        predecessor_fd = fd;
+        printf("Took over %zu listening sockets from the running proxy\n", num_inherited_listeners);
+
+        return 0;
+
+error_receive:
+        for(size_t i = 0; i < num_inherited_listeners; ++i)
+        {
+                close(inherited_listeners[i].fd);
+        }
+        num_inherited_listeners = 0;
+        close(fd);
+
+        return -1;
+}
+
+
+/* openHandoffListeningSocket
+ *
+ * Open a listening socket that can be handed to the next proxy process, or take the one the
+ * previous process listened on with the same address and port. With a handoff socket the
+ * listening sockets are non-blocking, both processes accept from them during the handoff.
+ *
+ * @param address Local address to listen on, NULL for all addresses
+ * @param port Local port that should be opened for listening
+ * @ret socket_ret Socket that will hold the listening socket
+ * @ret 0 on success
+ *      -1 if the socket could not be opened
+ */
+int openHandoffListeningSocket(const char *address, const char *port, Socket *socket_ret)
+{
+        assert(port != NULL);
+        assert(socket_ret != NULL);
+
+        const char *name = (address != NULL) ? address : "";
+        int taken_over = 0;
+
+        for(size_t i = 0; i < num_inherited_listeners; ++i)
+        {
+                HandoffListener *listener = inherited_listeners + i;
+                if((listener->fd != -1) && (strcmp(listener->address, name) == 0) &&
+                   (strcmp(listener->port, port) == 0))
+                {
+                        socket_ret->fd_ = listener->fd;
+                        socket_ret->open_ = 1;
+                        listener->fd = -1;
+                        taken_over = 1;
+                        break;
+                }
+        }
+
+        if(!taken_over && (openListeningSocket(address, port, socket_ret) != 0))
+        {
+                return -1;
+        }
+
+        if(proxy_config.handoff_socket == NULL)
+        {
+                return 0;
+        }
+
+        if((strlen(name) >= HANDOFF_NAME_SIZE) || (strlen(port) >= HANDOFF_NAME_SIZE) ||
+           (num_handoff_listeners == HANDOFF_MAX_LISTENERS))
+        {
+                fprintf(stderr, "ERROR: Listening socket %s:%s can not be handed over\n", name, port);
+                return -1;
+        }
+
+        int flags = fcntl(socket_ret->fd_, F_GETFL);
+        if((flags == -1) || (fcntl(socket_ret->fd_, F_SETFL, flags | O_NONBLOCK) == -1))
+        {
+                perror("handoff: fcntl");
+                return -1;
+        }
+
+        HandoffListener *listener = handoff_listeners + num_handoff_listeners++;
+        strcpy(listener->address, name);
+        strcpy(listener->port, port);
+        listener->fd = socket_ret->fd_;
+
+        return 0;
+}
+
+
+/* sendListeners
+ *
+ * Send the listening sockets of this process to the next one, followed by an empty entry
+ *
+ * @param fd Connection to the next process
+ * @ret 0 on success
+ *      -1 if the connection failed
+ */
+static int sendListeners(int fd)
+{
+        for(size_t i = 0; i <= num_handoff_listeners; ++i)
+        {
+                HandoffListener listener;
+                memset(&listener, 0, sizeof(listener));
+                listener.fd = -1;
+                if(i < num_handoff_listeners)
+                {
+                        listener = handoff_listeners[i];
+                }
+
+                char control[CMSG_SPACE(sizeof(int))];
+                struct iovec iov;
+                struct msghdr message;
+
+                iov.iov_base = &listener;
+                iov.iov_len = sizeof(listener);
+                memset(&message, 0, sizeof(message));
+                message.msg_iov = &iov;
+                message.msg_iovlen = 1;
+
+                if(listener.fd != -1)
+                {
+                        memset(control, 0, sizeof(control));
+                        message.msg_control = control;
+                        message.msg_controllen = sizeof(control);
+
+                        struct cmsghdr *control_header = CMSG_FIRSTHDR(&message);
+                        control_header->cmsg_level = SOL_SOCKET;
+                        control_header->cmsg_type = SCM_RIGHTS;
+                        control_header->cmsg_len = CMSG_LEN(sizeof(int));
+                        memcpy(CMSG_DATA(control_header), &(listener.fd), sizeof(int));
+                }
+
+                if(sendmsg(fd, &message, MSG_NOSIGNAL) != sizeof(listener))
+                {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+
+/* handoffThread
+ *
+ * Hand the listening sockets to the next proxy process that connects to the handoff socket.
+ * Once the next process reports that it accepts connections, the stop pipe tells the accept
+ * loops of this process to stop. A process that disconnects without being ready leaves the
+ * listening sockets to this one.
+ *
+ * @param arg Unused
+ */
+static void* handoffThread(void *arg)
+{
+        (void)arg;
+
+        while(1)
+        {
+                int fd = accept(handoff_listen_fd, NULL, NULL);
+                if(fd == -1)
+                {
+                        continue;
+                }
+
+                char ready;
+                if((sendListeners(fd) == 0) && (recv(fd, &ready, 1, 0) == 1))
+                {
+                        close(fd);
+                        break;
+                }
+
+                close(fd);
+                printf("Next proxy process did not take over, keep accepting connections\n");
+                fflush(stdout);
+        }
+
+        // The socket path belongs to the next process now
+        close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+
+        printf("Listening sockets handed over, stop accepting connections\n");
+        fflush(stdout);
+        if(write(handoff_stop_pipe[1], "", 1) != 1)
+        {
+                perror("handoff: write");
+        }
+
+        return NULL;
+}
+
+
+/* startHandoffThread
+ *
+ * Listen on the handoff socket for the next proxy process and tell the previous one that
+ * this process accepts connections now. Listening sockets of the previous process that
+ * this one does not use are closed. Called right before the accept loop starts.
+ *
+ * @param path Path of the handoff socket
+ * @ret 0 on success
+ *      -1 if the handoff socket could not be opened or the thread could not be started
+ */
+int startHandoffThread(const char *path)
+{
+        assert(path != NULL);
+
+        for(size_t i = 0; i < num_inherited_listeners; ++i)
+        {
+                if(inherited_listeners[i].fd != -1)
+                {
+                        close(inherited_listeners[i].fd);
+                        inherited_listeners[i].fd = -1;
+                }
+        }
+        num_inherited_listeners = 0;
+
+        struct sockaddr_un address;
+        if(handoffAddress(path, &address) != 0)
+        {
+                return -1;
+        }
+
+        handoff_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if(handoff_listen_fd == -1)
+        {
+                perror("handoff: socket");
+                return -1;
+        }
+
+        // Replaces the socket of the previous process, which stays connected to this one
+        unlink(path);
+        if((bind(handoff_listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) ||
+           (listen(handoff_listen_fd, 1) == -1))
+        {
+                perror("handoff: bind");
+                return -1;
+        }
+
+        pthread_t handoff_thread_id;
+        if(pthread_create(&handoff_thread_id, NULL, handoffThread, NULL) != 0)
+        {
+                return -1;
+        }
+        pthread_detach(handoff_thread_id);
+
+        if(predecessor_fd != -1)
+        {
+                if(send(predecessor_fd, "", 1, MSG_NOSIGNAL) != 1)
+                {
+                        perror("handoff: send");
+                }
+                close(predecessor_fd);
+                predecessor_fd = -1;
+        }
+
+        return 0;
+}
+
+
+/* handoffStopFd
+ *
+ * @ret File descriptor that becomes readable once the listening sockets were handed over,
+ *      -1 if there is no handoff socket
+ */
+int handoffStopFd(void)
+{
+        return handoff_stop_pipe[0];
+}
+
+
+/* drainSessions
+ *
+ * Wait until the running sessions ended after the listening sockets were handed over.
+ * Sessions still running after the drain time are killed.
+ *
+ * @param drain_time Seconds the sessions get to end
+ */
+void drainSessions(unsigned int drain_time)
+{
+        uint64_t deadline_ns = monotonicNs() + drain_time * 1000000000ull;
+        int sessions = activeSessions();
+
+        printf("Draining %d sessions\n", sessions);
+        fflush(stdout);
+
+        while((sessions > 0) && (monotonicNs() < deadline_ns))
+        {
+                struct timespec wait_time;
+                wait_time.tv_sec = 0;
+                wait_time.tv_nsec = HANDOFF_DRAIN_CHECK_MS * 1000000L;
+                nanosleep(&wait_time, NULL);
+                sessions = activeSessions();
+        }
+
+        if(sessions > 0)
+        {
+                printf("Drain time is over, killing %d sessions\n", sessions);
+                killSessions();
+        }
+        else
+        {
+                printf("Sessions drained\n");
+        }
+        fflush(stdout);
+}
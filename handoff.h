@@ -0,0 +1,41 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "util_socket.h"
+#include "upstream.h"
+
+// Listening sockets a process hands over: the proxy port, the admin port and the upstream ports
+#define HANDOFF_MAX_LISTENERS (2 + UPSTREAM_MAX_LISTENERS)
+
+// Longest address or port of a handed over listening socket
+#define HANDOFF_NAME_SIZE 64
+
+// Milliseconds between checks whether the draining sessions ended
+#define HANDOFF_DRAIN_CHECK_MS 100
+
+
+/* HandoffListener struct
+ *
+ * Listening socket that can be handed to the next proxy process. The address and port are
+ * sent along with the socket, the next process takes the socket over for the same ones.
+ *
+ * address -> Local address given when the socket was opened, empty for all addresses
+ * port    -> Local port given when the socket was opened
+ * fd      -> Listening socket, -1 once it was taken or closed
+ */
+typedef struct _handoff_listener_
+{
+  char address[HANDOFF_NAME_SIZE];
+  char port[HANDOFF_NAME_SIZE];
+  int fd;
+} HandoffListener;
+
+
+int takeOverListeners(const char *path);
+int openHandoffListeningSocket(const char *address, const char *port, Socket *socket_ret);
+int startHandoffThread(const char *path);
+int handoffStopFd(void);
+
+void drainSessions(unsigned int drain_time);
+
+#endif
@@ -0,0 +1,337 @@
+#include <assert.h>
+#include <poll.h>
+
+#include "hedge.h"
+#include "config.h"
+#include "eyeballs.h"
+#include "shm.h"
+#include "stats.h"
+#include "timeout.h"
+
+
+/* Hedging state in shared memory, created before sessions are forked.
+ * NULL while hedging is disabled.
+ */
+static HedgeTable *hedge_table = NULL;
+
+
+/* initHedging
+ *
+ * Create the hedging state in shared memory. Does nothing if hedging is disabled.
+ *
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initHedging(void)
+{
+        if(proxy_config.hedge_percentile == 0)
+        {
+                return 0;
+        }
+
+        hedge_table = createSharedMemory(sizeof(HedgeTable));
+        if(hedge_table == NULL)
+        {
+                return -1;
+        }
+
+        hedge_table->budget = HEDGE_BUDGET_BURST * HEDGE_BUDGET_UNIT;
+
+        return 0;
+}
+
+
+/* hedgingEnabled
+ *
+ * @ret True if idempotent requests are hedged
+ */
+int hedgingEnabled(void)
+{
+        return hedge_table != NULL;
+}
+
+
+/* hedgeDelay
+ *
+ * Get the configured percentile of the first byte times of a host
+ *
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @ret Delay in microseconds after which a request to the host is hedged,
+ *      0 if too few responses of the host are known
+ */
+static uint64_t hedgeDelay(const char *hostname, const char *port)
+{
+        uint64_t key = hashHostPort(hostname, port);
+        const HedgeHost *host = hedge_table->hosts + (key & (HEDGE_HOSTS - 1));
+        if(__atomic_load_n(&(host->key), __ATOMIC_ACQUIRE) != key)
+        {
+                return 0;
+        }
+
+        uint16_t buckets[HEDGE_BUCKETS];
+        uint64_t total = 0;
+        for(unsigned int i = 0; i < HEDGE_BUCKETS; ++i)
+        {
+                buckets[i] = __atomic_load_n(host->buckets + i, __ATOMIC_RELAXED);
+                total += buckets[i];
+        }
+
+        if(total < HEDGE_MIN_SAMPLES)
+        {
+                return 0;
+        }
+
+        uint64_t rank = (total * proxy_config.hedge_percentile + 99) / 100;
+        uint64_t seen = 0;
+        unsigned int bucket = 0;
+        while((bucket < HEDGE_BUCKETS - 1) && ((seen += buckets[bucket]) < rank))
+        {
+                ++bucket;
+        }
+
+        uint64_t delay_us = latencyBucketLimit(bucket);
+        return (delay_us > HEDGE_MIN_DELAY_US) ? delay_us : HEDGE_MIN_DELAY_US;
+}
+
+
+/* takeHedgeBudget
+ *
+ * Credit the budget for a hedgeable request and take a hedge out of it if enough is saved up
+ *
+ * @ret True if the request may be hedged
+ */
+static int takeHedgeBudget(void)
+{
+        int64_t budget = __atomic_load_n(&(hedge_table->budget), __ATOMIC_RELAXED);
+        while(1)
+        {
+                int64_t new_budget = budget + proxy_config.hedge_budget;
+                if(new_budget > HEDGE_BUDGET_BURST * HEDGE_BUDGET_UNIT)
+                {
+                        new_budget = HEDGE_BUDGET_BURST * HEDGE_BUDGET_UNIT;
+                }
+
+                int hedge = (new_budget >= HEDGE_BUDGET_UNIT);
+                if(hedge)
+                {
+                        new_budget -= HEDGE_BUDGET_UNIT;
+                }
+
+                if(__atomic_compare_exchange_n(&(hedge_table->budget), &budget, new_budget, 1,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                        return hedge;
+                }
+        }
+}
+
+
+/* creditHedgeBudget
+ *
+ * Credit the budget for a hedgeable request that did not need a hedge
+ */
+static void creditHedgeBudget(void)
+{
+        int64_t budget = __atomic_load_n(&(hedge_table->budget), __ATOMIC_RELAXED);
+        while(budget < HEDGE_BUDGET_BURST * HEDGE_BUDGET_UNIT)
+        {
+                int64_t new_budget = budget + proxy_config.hedge_budget;
+                if(new_budget > HEDGE_BUDGET_BURST * HEDGE_BUDGET_UNIT)
+                {
+                        new_budget = HEDGE_BUDGET_BURST * HEDGE_BUDGET_UNIT;
+                }
+
+                if(__atomic_compare_exchange_n(&(hedge_table->budget), &budget, new_budget, 1,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                        return;
+                }
+        }
+}
+
+
+/* awaitFirstResponse
+ *
+ * Wait until the first of two connections has response data. A connection that fails
+ * without data leaves the race to the other one.
+ *
+ * @param fds Poll entries of the first and the hedge connection
+ * @ret 1 if the hedge connection answered first, 0 otherwise or if the wait was interrupted
+ */
+static int awaitFirstResponse(struct pollfd *fds)
+{
+        while((fds[0].fd != -1) || (fds[1].fd != -1))
+        {
+                if(poll(fds, 2, -1) == -1)
+                {
+                        // Interrupted by a session timeout, which shut down the first connection
+                        return 0;
+                }
+
+                if(fds[0].revents & POLLIN)
+                {
+                        return 0;
+                }
+                if(fds[1].revents & POLLIN)
+                {
+                        return 1;
+                }
+
+                for(int i = 0; i < 2; ++i)
+                {
+                        if(fds[i].revents != 0)
+                        {
+                                fds[i].fd = -1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+
+/* sendHedgedRequest
+ *
+ * Send an idempotent request to the server. If no response data arrived once the configured
+ * percentile of the first byte times of the host has passed, and the hedge budget allows it,
+ * the request is sent again on a second connection. The connection that answers first is
+ * left in server_socket, the other one is closed.
+ * A failed send shows up when the response is read, like for requests that are not hedged.
+ *
+ * @param server_socket Connected server socket, replaced if the hedge connection wins
+ * @param addresses Resolved addresses of the server, the hedge connection races them again
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @param request Serialized request
+ * @param request_len Length of the request
+ */
+void sendHedgedRequest(Socket *server_socket, const struct addrinfo *addresses, const char *hostname,
+                       const char *port, const char *request, size_t request_len)
+{
+        assert(server_socket != NULL);
+        assert(addresses != NULL);
+        assert(request != NULL);
+
+        ssize_t sent = sendData(server_socket, request, request_len);
+        if(sent <= 0)
+        {
+                return;
+        }
+        addProxyCounter(STAT_SERVER_BYTES_OUT, sent);
+
+        if(hedge_table == NULL)
+        {
+                return;
+        }
+
+        addProxyCounter(STAT_HEDGE_ELIGIBLE, 1);
+        uint64_t delay_us = hedgeDelay(hostname, port);
+        if(delay_us == 0)
+        {
+                creditHedgeBudget();
+                return;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = server_socket->fd_;
+        fds[0].events = POLLIN;
+        fds[1].fd = -1;
+        fds[1].events = POLLIN;
+        if(poll(fds, 1, (delay_us + 999) / 1000) != 0)
+        {
+                // Answered, failed or interrupted by a session timeout
+                creditHedgeBudget();
+                return;
+        }
+
+        if(!takeHedgeBudget())
+        {
+                addProxyCounter(STAT_HEDGE_OVER_BUDGET, 1);
+                return;
+        }
+
+        Socket hedge_socket;
+        if(connectHappyEyeballs(addresses, &hedge_socket) != 0)
+        {
+                return;
+        }
+
+        sent = sendData(&hedge_socket, request, request_len);
+        if(sent <= 0)
+        {
+                destroySocket(&hedge_socket);
+                return;
+        }
+        addProxyCounter(STAT_SERVER_BYTES_OUT, sent);
+        addProxyCounter(STAT_HEDGES, 1);
+
+        fds[1].fd = hedge_socket.fd_;
+        if(!awaitFirstResponse(fds))
+        {
+                destroySocket(&hedge_socket);
+                return;
+        }
+
+        addProxyCounter(STAT_HEDGE_WINS, 1);
+        destroySocket(server_socket);
+        *server_socket = hedge_socket;
+        setSessionServerSocket(server_socket->fd_);
+}
+
+
+/* recordFirstByteTime
+ *
+ * Add the time a GET request to a host took until the first response byte to the
+ * histogram of the host
+ *
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @param first_byte_ns Time from connecting until the first response byte
+ */
+void recordFirstByteTime(const char *hostname, const char *port, uint64_t first_byte_ns)
+{
+        assert(hostname != NULL);
+        assert(port != NULL);
+
+        if(hedge_table == NULL)
+        {
+                return;
+        }
+
+        uint64_t key = hashHostPort(hostname, port);
+        HedgeHost *host = hedge_table->hosts + (key & (HEDGE_HOSTS - 1));
+        uint64_t previous_key = __atomic_load_n(&(host->key), __ATOMIC_ACQUIRE);
+        if(previous_key != key)
+        {
+                // Take the entry over, a racing session of the previous host may add a stray sample
+                if(!__atomic_compare_exchange_n(&(host->key), &previous_key, key, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                        return;
+                }
+                for(unsigned int i = 0; i < HEDGE_BUCKETS; ++i)
+                {
+                        __atomic_store_n(host->buckets + i, 0, __ATOMIC_RELAXED);
+                }
+                __atomic_store_n(&(host->samples), 0, __ATOMIC_RELAXED);
+        }
+
+        uint64_t value = first_byte_ns / 1000;
+        if(value > HEDGE_MAX_US)
+        {
+                value = HEDGE_MAX_US;
+        }
+        __atomic_fetch_add(host->buckets + latencyBucket(value), 1, __ATOMIC_RELAXED);
+
+        // Halve the histogram once per window, older samples fade out
+        if(__atomic_add_fetch(&(host->samples), 1, __ATOMIC_RELAXED) == HEDGE_WINDOW)
+        {
+                for(unsigned int i = 0; i < HEDGE_BUCKETS; ++i)
+                {
+                        uint16_t count = __atomic_load_n(host->buckets + i, __ATOMIC_RELAXED);
+                        __atomic_store_n(host->buckets + i, count / 2, __ATOMIC_RELAXED);
+                }
+                __atomic_store_n(&(host->samples), 0, __ATOMIC_RELAXED);
+        }
+}
@@ -0,0 +1,73 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdint.h>
+#include <netdb.h>
+
+#include "latency.h"
+#include "util_socket.h"
+
+// Entries of the first byte time table (power of two)
+#define HEDGE_HOSTS 1024
+
+// Longest first byte time told apart, longer ones count as this (about 67 s)
+#define HEDGE_MAX_US ((1ull << 26) - 1)
+
+// Histogram buckets of a host, latency buckets up to HEDGE_MAX_US
+#define HEDGE_BUCKETS (((26 - LATENCY_SUB_BUCKET_BITS) + 1) * LATENCY_SUB_BUCKETS)
+
+// Samples a host needs before its requests are hedged
+#define HEDGE_MIN_SAMPLES 20
+
+// Samples at which the histogram of a host is halved, so it follows recent first byte times
+#define HEDGE_WINDOW 1024
+
+// Shortest hedge delay, faster hosts are not worth a second request
+#define HEDGE_MIN_DELAY_US 1000
+
+// Hedges the budget can save up while no request is hedged
+#define HEDGE_BUDGET_BURST 10
+
+// Units of the hedge budget per hedge, the budget grows by the configured percentage per request
+#define HEDGE_BUDGET_UNIT 100
+
+
+/* HedgeHost struct
+ *
+ * Time to first byte of the GET responses of a host in shared memory, a histogram of the
+ * latency buckets. A host takes over the entry of its slot on its first recorded response.
+ *
+ * key     -> Hash of the host and port, 0 if the entry is unused
+ * samples -> Responses recorded since the histogram was last halved
+ * buckets -> Number of responses per latency bucket
+ */
+typedef struct _hedge_host_
+{
+  uint64_t key;
+  uint32_t samples;
+  uint16_t buckets[HEDGE_BUCKETS];
+} HedgeHost;
+
+
+/* HedgeTable struct
+ *
+ * Shared state of request hedging
+ *
+ * budget -> Hedges that may be sent, in HEDGE_BUDGET_UNIT per hedge
+ * hosts  -> First byte times of the hosts
+ */
+typedef struct _hedge_table_
+{
+  int64_t budget;
+  HedgeHost hosts[HEDGE_HOSTS];
+} HedgeTable;
+
+
+int initHedging(void);
+int hedgingEnabled(void);
+
+void sendHedgedRequest(Socket *server_socket, const struct addrinfo *addresses, const char *hostname,
+                       const char *port, const char *request, size_t request_len);
+void recordFirstByteTime(const char *hostname, const char *port, uint64_t first_byte_ns);
+
+#endif
@@ -0,0 +1,326 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "hostlimit.h"
+#include "config.h"
+#include "latency.h"
+#include "shm.h"
+#include "stats.h"
+#include "timeout.h"
+
+
+/* Host table in shared memory, created before sessions are forked.
+ * NULL while no host limit is configured.
+ */
+static HostLimit *host_limits = NULL;
+
+/* Entry + 1 of the host a session holds a ticket of, indexed by process id, in shared memory.
+ * Sessions set and clear their own value, the SIGCHLD handler releases what a killed session
+ * left behind. Only the pages of process ids in use are ever touched.
+ */
+static int32_t *session_host_entries = NULL;
+static size_t max_session_pid = 0;
+
+// Set in the session value while the session holds a slot instead of waiting for one
+#define HOST_LIMIT_HOLDING (1 << 30)
+
+
+/* initHostLimits
+ *
+ * Create the host table and the map from sessions to hosts in shared memory.
+ * Does nothing if no host limit is configured.
+ *
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initHostLimits(void)
+{
+        if(proxy_config.host_connections == 0)
+        {
+                return 0;
+        }
+
+        max_session_pid = readPidMax();
+        session_host_entries = createSharedMemory(max_session_pid * sizeof(int32_t));
+        if(session_host_entries == NULL)
+        {
+                return -1;
+        }
+
+        host_limits = createSharedMemory(HOST_LIMIT_HOSTS * sizeof(HostLimit));
+        if(host_limits == NULL)
+        {
+                destroySharedMemory(session_host_entries, max_session_pid * sizeof(int32_t));
+                session_host_entries = NULL;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/* findHost
+ *
+ * Find the entry of a host, claiming an empty one if the host has none yet
+ *
+ * @ret Index of the entry, -1 if the probed entries all belong to other hosts
+ */
+static int findHost(const char *hostname, const char *port)
+{
+        uint64_t key = hashHostPort(hostname, port);
+
+        for(unsigned int probe = 0; probe < HOST_LIMIT_PROBES; ++probe)
+        {
+                int index = (key + probe) & (HOST_LIMIT_HOSTS - 1);
+                HostLimit *host = host_limits + index;
+                uint64_t current = __atomic_load_n(&(host->key), __ATOMIC_ACQUIRE);
+
+                if((current == 0) &&
+                   __atomic_compare_exchange_n(&(host->key), &current, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                {
+                        snprintf(host->name, sizeof(host->name), "%s:%s", hostname, port);
+                        return index;
+                }
+                if(current == key)
+                {
+                        return index;
+                }
+        }
+
+        return -1;
+}
+
+
+/* setSessionHost
+ *
+ * Remember the host entry of the running session for the SIGCHLD handler
+ *
+ * @param value Entry + 1, with HOST_LIMIT_HOLDING once a slot is held, 0 for none
+ */
+static void setSessionHost(int32_t value)
+{
+        pid_t pid = getpid();
+        if((size_t)pid < max_session_pid)
+        {
+                __atomic_store_n(session_host_entries + pid, value, __ATOMIC_RELEASE);
+        }
+}
+
+
+/* ticketGranted
+ *
+ * @ret True if the ticket may hold a slot of the host
+ */
+static int ticketGranted(const HostLimit *host, uint32_t ticket)
+{
+        uint32_t releases = __atomic_load_n(&(host->releases), __ATOMIC_SEQ_CST);
+        return (int32_t)(ticket - releases) < (int32_t)proxy_config.host_connections;
+}
+
+
+/* grantNextTicket
+ *
+ * Release a slot of a host to the next ticket and wake the session waiting with it.
+ * Async-signal-safe.
+ *
+ * @param host Entry of the host
+ */
+static void grantNextTicket(HostLimit *host)
+{
+        uint32_t released = __atomic_fetch_add(&(host->releases), 1, __ATOMIC_SEQ_CST);
+
+        // A session starting to wait afterwards sees the release
+        if(__atomic_load_n(&(host->waiting), __ATOMIC_SEQ_CST) == 0)
+        {
+                return;
+        }
+
+        uint32_t *turn = host->turns + (released + proxy_config.host_connections) % HOST_LIMIT_TURNS;
+        __atomic_fetch_add(turn, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, turn, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/* recordHostWait
+ *
+ * Add the time a session waited for a slot to the statistics of the host
+ */
+static void recordHostWait(HostLimit *host, uint64_t wait_us)
+{
+        __atomic_fetch_add(&(host->waits), 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(host->wait_us), wait_us, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n(&(host->max_wait_us), __ATOMIC_RELAXED);
+        while((wait_us > max) &&
+              !__atomic_compare_exchange_n(&(host->max_wait_us), &max, wait_us, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+}
+
+
+/* acquireHostLimit
+ *
+ * Get a connection slot of a server host, waiting in line behind the sessions that asked
+ * for one earlier while all slots are held. The wait is part of connecting to the server,
+ * the connect timeout ends it.
+ *
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @ret entry Entry to pass to releaseHostLimit, HOST_LIMIT_UNTRACKED if the host is not limited
+ * @ret 0 if the session may connect
+ *      -1 if the session timed out while waiting
+ */
+int acquireHostLimit(const char *hostname, const char *port, int *entry)
+{
+        assert(hostname != NULL);
+        assert(port != NULL);
+        assert(entry != NULL);
+
+        *entry = HOST_LIMIT_UNTRACKED;
+        if(host_limits == NULL)
+        {
+                return 0;
+        }
+
+        int index = findHost(hostname, port);
+        if(index == -1)
+        {
+                addProxyCounter(STAT_HOST_LIMIT_UNTRACKED, 1);
+                return 0;
+        }
+
+        // The session counts as waiting from its ticket on, until it holds a slot
+        HostLimit *host = host_limits + index;
+        __atomic_fetch_add(&(host->waiting), 1, __ATOMIC_SEQ_CST);
+        setSessionHost(index + 1);
+        uint32_t ticket = __atomic_fetch_add(&(host->tickets), 1, __ATOMIC_SEQ_CST);
+
+        if(!ticketGranted(host, ticket))
+        {
+                addProxyCounter(STAT_HOST_LIMIT_QUEUED, 1);
+                uint64_t start_ns = monotonicNs();
+                uint32_t *turn = host->turns + ticket % HOST_LIMIT_TURNS;
+
+                while(1)
+                {
+                        uint32_t turn_value = __atomic_load_n(turn, __ATOMIC_SEQ_CST);
+                        if(ticketGranted(host, ticket))
+                        {
+                                break;
+                        }
+
+                        if((syscall(SYS_futex, turn, FUTEX_WAIT, turn_value, NULL, NULL, 0) == -1) &&
+                           (errno == EINTR) && (sessionTimeout() != SESSION_TIMEOUT_NONE))
+                        {
+                                /* Give the ticket up. Nobody will use the slot it is granted later,
+                                   so one is released right away instead. */
+                                __atomic_fetch_sub(&(host->waiting), 1, __ATOMIC_SEQ_CST);
+                                grantNextTicket(host);
+                                setSessionHost(0);
+                                addProxyCounter(STAT_HOST_LIMIT_ABANDONED, 1);
+                                return -1;
+                        }
+                }
+
+                recordHostWait(host, (monotonicNs() - start_ns) / 1000);
+        }
+
+        __atomic_fetch_add(&(host->active), 1, __ATOMIC_RELAXED);
+        setSessionHost((index + 1) | HOST_LIMIT_HOLDING);
+        __atomic_fetch_sub(&(host->waiting), 1, __ATOMIC_SEQ_CST);
+        *entry = index;
+
+        return 0;
+}
+
+
+/* releaseHostLimit
+ *
+ * Release the connection slot of a session to the next waiting session
+ *
+ * @param entry Entry returned by acquireHostLimit
+ */
+void releaseHostLimit(int entry)
+{
+        if(entry == HOST_LIMIT_UNTRACKED)
+        {
+                return;
+        }
+
+        HostLimit *host = host_limits + entry;
+        __atomic_fetch_sub(&(host->active), 1, __ATOMIC_RELAXED);
+        grantNextTicket(host);
+        setSessionHost(0);
+}
+
+
+/* hostLimitSessionEnded
+ *
+ * Release the slot or ticket a reaped session left behind because it was killed.
+ * Async-signal-safe, called by the SIGCHLD handler.
+ *
+ * @param pid Process id of the session
+ */
+void hostLimitSessionEnded(pid_t pid)
+{
+        if((session_host_entries == NULL) || ((size_t)pid >= max_session_pid))
+        {
+                return;
+        }
+
+        int32_t value = __atomic_exchange_n(session_host_entries + pid, 0, __ATOMIC_ACQ_REL);
+        if(value == 0)
+        {
+                return;
+        }
+
+        HostLimit *host = host_limits + ((value & ~HOST_LIMIT_HOLDING) - 1);
+        __atomic_fetch_sub((value & HOST_LIMIT_HOLDING) ? &(host->active) : &(host->waiting), 1, __ATOMIC_SEQ_CST);
+        grantNextTicket(host);
+        addProxyCounter(STAT_HOST_LIMIT_RECLAIMED, 1);
+}
+
+
+/* printHostLimitStats
+ *
+ * Print the slots in use, the queue and the waiting times of every host that had to wait
+ * or holds slots
+ *
+ * @param out Stream to print to
+ */
+void printHostLimitStats(FILE *out)
+{
+        assert(out != NULL);
+
+        if(host_limits == NULL)
+        {
+                return;
+        }
+
+        for(unsigned int i = 0; i < HOST_LIMIT_HOSTS; ++i)
+        {
+                const HostLimit *host = host_limits + i;
+                if(__atomic_load_n(&(host->key), __ATOMIC_ACQUIRE) == 0)
+                {
+                        continue;
+                }
+
+                uint32_t active = __atomic_load_n(&(host->active), __ATOMIC_RELAXED);
+                uint32_t waiting = __atomic_load_n(&(host->waiting), __ATOMIC_RELAXED);
+                uint64_t waits = __atomic_load_n(&(host->waits), __ATOMIC_RELAXED);
+                if((active == 0) && (waiting == 0) && (waits == 0))
+                {
+                        continue;
+                }
+
+                fprintf(out, "Host limit %s: %u active (max %u), %u waiting, %lu waited, mean wait %.3fms, "
+                        "max wait %.3fms\n", host->name, active, proxy_config.host_connections, waiting, waits,
+                        waits ? __atomic_load_n(&(host->wait_us), __ATOMIC_RELAXED) / 1e3 / waits : 0.0,
+                        __atomic_load_n(&(host->max_wait_us), __ATOMIC_RELAXED) / 1e3);
+        }
+}
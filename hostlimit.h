@@ -0,0 +1,66 @@
+#ifndef HOSTLIMIT_H
+#define HOSTLIMIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Entries of the host table (power of two)
+#define HOST_LIMIT_HOSTS 4096
+
+// Entries probed for a host before it counts as untracked
+#define HOST_LIMIT_PROBES 8
+
+// Futex words a host spreads its waiting sessions over, a release only wakes the word of the
+// ticket it grants
+#define HOST_LIMIT_TURNS 64
+
+// Longest host name and port kept for the statistics
+#define HOST_LIMIT_NAME_SIZE 64
+
+// Returned for sessions whose host is not limited
+#define HOST_LIMIT_UNTRACKED -1
+
+
+/* HostLimit struct
+ *
+ * Connection slots of one server host in shared memory, handed out first come first served.
+ * Every session takes the next ticket and may connect once its ticket is below releases plus
+ * the limit, so a released slot goes to the longest waiting session. Entries are claimed by
+ * their host for the lifetime of the proxy.
+ *
+ * key         -> Hash of the host and port, 0 if the entry is unused
+ * tickets     -> Tickets handed out
+ * releases    -> Slots released (and tickets given up while waiting)
+ * active      -> Sessions holding a slot
+ * waiting     -> Sessions waiting for a slot
+ * turns       -> Futex words, a ticket waits on turns[ticket % HOST_LIMIT_TURNS]
+ * waits       -> Sessions that had to wait for a slot
+ * wait_us     -> Time sessions waited for a slot, summed up
+ * max_wait_us -> Longest time a session waited for a slot
+ * name        -> Host and port, possibly cut off
+ */
+typedef struct _host_limit_
+{
+  uint64_t key;
+  uint32_t tickets;
+  uint32_t releases;
+  uint32_t active;
+  uint32_t waiting;
+  uint32_t turns[HOST_LIMIT_TURNS];
+  uint64_t waits;
+  uint64_t wait_us;
+  uint64_t max_wait_us;
+  char name[HOST_LIMIT_NAME_SIZE];
+} HostLimit;
+
+
+int initHostLimits(void);
+
+int acquireHostLimit(const char *hostname, const char *port, int *entry);
+void releaseHostLimit(int entry);
+void hostLimitSessionEnded(pid_t pid);
+
+void printHostLimitStats(FILE *out);
+
+#endif
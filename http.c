@@ -151,6 +151,117 @@ end:
 
 
 
+/* serializeResponseHeader
+ *
+ * Serialize a response header struct into a string
+ *
+ * @param response_header Header to serialize
+ * @param target_buffer Buffer the string should be written to
+ * @param written_length Pointer to variable the length of the written string should be written to
+ * @ret 0 on success
+ *      -1 when memory allocation failed
+ */
+int serializeResponseHeader(const HTTPResponseHeader *response_header, char **target_buffer, size_t *written_length)
+{
+        assert(response_header != NULL);
+        assert(target_buffer != NULL);
+        assert(written_length != NULL);
+
+        size_t serbuffer_len = responseHeaderLength(response_header);
+
+        char *serbuffer = malloc(serbuffer_len + 1); // +1 to allow for '\0' char
+        if(serbuffer == NULL)
+        {
+                fprintf(stderr, "Buffer for serialization of response header could not be allocated\n");
+                return -1;
+        }
+
+        serbuffer[0] = '\0';
+
+        strcat(serbuffer, "HTTP/");
+        strcat(serbuffer, response_header->response_info.http_version);
+        strcat(serbuffer, " ");
+        strcat(serbuffer, response_header->response_info.status_code);
+        strcat(serbuffer, " ");
+        strcat(serbuffer, response_header->response_info.reason);
+        strcat(serbuffer, "\r\n");
+
+        for(size_t i = 0; i < response_header->fields.size; ++i)
+        {
+                strcat(serbuffer, response_header->fields.data[i].key);
+                strcat(serbuffer, ": ");
+                strcat(serbuffer, response_header->fields.data[i].value);
+                strcat(serbuffer, "\r\n");
+        }
+
+        strcat(serbuffer, "\r\n");
+
+        *written_length = serbuffer_len;
+        *target_buffer = serbuffer;
+
+        return 0;
+}
+
+
+/* responseHeaderLength
+ *
+ * Get the length of a HTTP response header if it would be serialized
+ *
+ * @param response_header Header of which the length should be calculated
+ * @ret Length of the string if the header was serialized
+ */
+size_t responseHeaderLength(const HTTPResponseHeader *response_header)
+{
+        assert(response_header != NULL);
+
+        size_t serbuffer_len = 0;
+
+        serbuffer_len += strlen("HTTP/");
+        serbuffer_len += strlen(response_header->response_info.http_version);
+        serbuffer_len += strlen(" ");
+        serbuffer_len += strlen(response_header->response_info.status_code);
+        serbuffer_len += strlen(" ");
+        serbuffer_len += strlen(response_header->response_info.reason);
+        serbuffer_len += strlen("\r\n");
+
+        for(size_t i = 0; i < response_header->fields.size; ++i)
+        {
+                serbuffer_len += strlen(response_header->fields.data[i].key);
+                serbuffer_len += strlen(": ");
+                serbuffer_len += strlen(response_header->fields.data[i].value);
+                serbuffer_len += strlen("\r\n");
+        }
+
+        serbuffer_len += strlen("\r\n");
+
+        return serbuffer_len;
+}
+
+
+/* headerEndOffset
+ *
+ * Find the end of a HTTP header (the first empty line) in a buffer
+ *
+ * @param buffer Null terminated buffer starting with a HTTP header
+ * @ret Length of the header including the terminating empty line
+ *      0 if the buffer does not contain a complete header
+ */
+size_t headerEndOffset(const char *buffer)
+{
+        assert(buffer != NULL);
+
+        const char *header_end = strstr(buffer, "\r\n\r\n");
+        if(header_end == NULL)
+        {
+                return 0;
+        }
+
+        return header_end + 4 - buffer;
+}
+
+
+
+
 //#############################
 // Request
 
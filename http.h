@@ -89,6 +89,10 @@ void freeResponseHeader(HTTPResponseHeader *header);
 
 int parseResponseHeader(HTTPResponseHeader *target, const char *buffer);
 int parseResponseLine(HTTPResponseInfo *resp_info, const char *buffer);
+int serializeResponseHeader(const HTTPResponseHeader *response_header, char **target_buffer, size_t *written_length);
+size_t responseHeaderLength(const HTTPResponseHeader *response_header);
+
+size_t headerEndOffset(const char *buffer);
 
 
 //#############################
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "latency.h"
+#include "shm.h"
+#include "stats.h"
+
+
+/* Histograms of all phases in shared memory, created before sessions are forked. Every counter
+ * shard has its own set of histograms. NULL until initLatencyStats was called, recording is
+ * a no-op then.
+ */
+static LatencyHistogram *latency_histograms = NULL;
+
+// Names of the phases for printing, in the order of LatencyPhase
+static const char *latency_phase_names[LATENCY_NUM_PHASES] =
+        {
+                "accept", "header", "resolve", "connect", "first byte", "filter", "relay", "session"
+        };
+
+
+/* initLatencyStats
+ *
+ * Create the shared latency histograms of the proxy
+ *
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initLatencyStats(void)
+{
+        latency_histograms = createSharedMemory(PROXY_STATS_SHARDS * LATENCY_NUM_PHASES *
+                                                sizeof(LatencyHistogram));
+
+        return (latency_histograms != NULL) ? 0 : -1;
+}
+
+
+/* monotonicNs
+ *
+ * Get the current time of the monotonic clock
+ *
+ * @ret Time in nanoseconds
+ */
+uint64_t monotonicNs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* recordLatencyNs
+ *
+ * Add the duration of a phase to its histogram
+ *
+ * @param phase Phase of the session
+ * @param duration_ns Duration in nanoseconds
+ */
+void recordLatencyNs(LatencyPhase phase, uint64_t duration_ns)
+{
+        if(latency_histograms == NULL)
+        {
+                return;
+        }
+
+        LatencyHistogram *histogram = latency_histograms + currentStatsShard() * LATENCY_NUM_PHASES + phase;
+        uint64_t value = duration_ns / 1000;
+
+        __atomic_fetch_add(&(histogram->buckets[latencyBucket(value)]), 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(histogram->count), 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(histogram->sum_us), value, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n(&(histogram->max_us), __ATOMIC_RELAXED);
+        while((value > max) &&
+              !__atomic_compare_exchange_n(&(histogram->max_us), &max, value, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+}
+
+
+/* recordLatency
+ *
+ * Add the duration of a phase to its histogram
+ *
+ * @param phase Phase of the session
+ * @param start_ns Monotonic time the phase started at
+ * @param end_ns Monotonic time the phase ended at
+ */
+void recordLatency(LatencyPhase phase, uint64_t start_ns, uint64_t end_ns)
+{
+        recordLatencyNs(phase, (end_ns > start_ns) ? end_ns - start_ns : 0);
+}
+
+
+/* readLatencyBucket
+ *
+ * Get the number of durations in a histogram bucket of a phase, summed over all shards
+ *
+ * @param phase Phase of the session
+ * @param bucket Index of the bucket, LATENCY_BUCKETS for the number of all durations
+ * @ret Number of durations
+ */
+static uint64_t readLatencyBucket(int phase, unsigned int bucket)
+{
+        uint64_t value = 0;
+
+        for(unsigned int shard = 0; shard < PROXY_STATS_SHARDS; ++shard)
+        {
+                const LatencyHistogram *histogram = latency_histograms + shard * LATENCY_NUM_PHASES + phase;
+                const uint64_t *counter = (bucket < LATENCY_BUCKETS) ? histogram->buckets + bucket :
+                                                                       &(histogram->count);
+                value += __atomic_load_n(counter, __ATOMIC_RELAXED);
+        }
+
+        return value;
+}
+
+
+/* printLatencyStats
+ *
+ * Print the mean, median, 99th and 99.9th percentile and maximum of every phase. Percentiles
+ * are the upper limit of their bucket (at most the maximum), so they overestimate by less
+ * than 1/32.
+ *
+ * @param out Stream to print to
+ */
+void printLatencyStats(FILE *out)
+{
+        if(latency_histograms == NULL)
+        {
+                return;
+        }
+
+        for(int phase = 0; phase < LATENCY_NUM_PHASES; ++phase)
+        {
+                uint64_t count = readLatencyBucket(phase, LATENCY_BUCKETS);
+                if(count == 0)
+                {
+                        continue;
+                }
+
+                uint64_t sum = 0;
+                uint64_t max = 0;
+                for(unsigned int shard = 0; shard < PROXY_STATS_SHARDS; ++shard)
+                {
+                        const LatencyHistogram *histogram = latency_histograms + shard * LATENCY_NUM_PHASES + phase;
+                        uint64_t shard_max = __atomic_load_n(&(histogram->max_us), __ATOMIC_RELAXED);
+                        sum += __atomic_load_n(&(histogram->sum_us), __ATOMIC_RELAXED);
+                        max = (shard_max > max) ? shard_max : max;
+                }
+
+                // Samples added while walking the buckets are not part of the count
+                const double quantiles[3] = {0.5, 0.99, 0.999};
+                uint64_t percentiles[3] = {max, max, max};
+                uint64_t seen = 0;
+                int next = 0;
+
+                for(unsigned int bucket = 0; (bucket < LATENCY_BUCKETS) && (next < 3); ++bucket)
+                {
+                        seen += readLatencyBucket(phase, bucket);
+                        while((next < 3) && (seen >= quantiles[next] * count))
+                        {
+                                uint64_t limit = latencyBucketLimit(bucket);
+                                percentiles[next++] = (limit < max) ? limit : max;
+                        }
+                }
+
+                fprintf(out, "Latency %-10s: %lu samples, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, "
+                        "p999 %.3f ms, max %.3f ms\n",
+                        latency_phase_names[phase], count, sum / 1e3 / count,
+                        percentiles[0] / 1e3, percentiles[1] / 1e3, percentiles[2] / 1e3, max / 1e3);
+        }
+}
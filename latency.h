@@ -0,0 +1,108 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Sub-buckets per power of two of a latency histogram, bounds the relative error to 1/32
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+// Number of buckets of a latency histogram, enough for any 64 bit value
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+
+/* LatencyPhase
+ *
+ * Phases of a session whose duration is recorded
+ *
+ * LATENCY_ACCEPT     -> Connection accepted until its session process runs
+ * LATENCY_HEADER     -> Session start until the request header is complete
+ * LATENCY_RESOLVE    -> Name resolution of the server (getaddrinfo)
+ * LATENCY_CONNECT    -> Connecting to the server
+ * LATENCY_FIRST_BYTE -> Connection established until the first response byte
+ * LATENCY_FILTER     -> CPU time spent filtering a response
+ * LATENCY_RELAY      -> First response byte until the response is relayed completely
+ * LATENCY_SESSION    -> Connection accepted until the session ends
+ */
+typedef enum _latency_phase_
+{
+  LATENCY_ACCEPT,
+  LATENCY_HEADER,
+  LATENCY_RESOLVE,
+  LATENCY_CONNECT,
+  LATENCY_FIRST_BYTE,
+  LATENCY_FILTER,
+  LATENCY_RELAY,
+  LATENCY_SESSION,
+  LATENCY_NUM_PHASES
+} LatencyPhase;
+
+
+/* LatencyHistogram struct
+ *
+ * Log-linear histogram of durations in microseconds of one counter shard. Values below
+ * LATENCY_SUB_BUCKETS have a bucket each, above that every power of two is split into
+ * LATENCY_SUB_BUCKETS buckets of equal width.
+ *
+ * count   -> Number of recorded durations
+ * sum_us  -> Sum of the recorded durations
+ * max_us  -> Longest recorded duration
+ * buckets -> Number of durations per bucket
+ */
+typedef struct _latency_histogram_
+{
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+
+/* latencyBucket
+ *
+ * Get the histogram bucket of a value
+ *
+ * @param value Value in microseconds
+ * @ret Index of the bucket
+ */
+static inline unsigned int latencyBucket(uint64_t value)
+{
+        if(value < 2 * LATENCY_SUB_BUCKETS)
+        {
+                return (unsigned int)value;
+        }
+
+        unsigned int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+        return shift * LATENCY_SUB_BUCKETS + (unsigned int)(value >> shift);
+}
+
+
+/* latencyBucketLimit
+ *
+ * Get the largest value that falls into a histogram bucket
+ *
+ * @param bucket Index of the bucket
+ * @ret Value in microseconds
+ */
+static inline uint64_t latencyBucketLimit(unsigned int bucket)
+{
+        if(bucket < 2 * LATENCY_SUB_BUCKETS)
+        {
+                return bucket;
+        }
+
+        unsigned int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+        uint64_t mantissa = bucket - shift * LATENCY_SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+}
+
+
+int initLatencyStats(void);
+
+uint64_t monotonicNs(void);
+void recordLatency(LatencyPhase phase, uint64_t start_ns, uint64_t end_ns);
+void recordLatencyNs(LatencyPhase phase, uint64_t duration_ns);
+void printLatencyStats(FILE *out);
+
+#endif
@@ -5,12 +5,17 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
-#include <ctype.h>
 
 #include "proxy.h"
+#include "config.h"
 #include "util.h"
 #include "proxy_clientside.h"
 #include "midlayer.h"
+#include "admission.h"
+#include "clientlimit.h"
+#include "hostlimit.h"
+#include "timeout.h"
+#include "upstream.h"
 
 /* sigChldHandler
  *
@@ -20,7 +25,24 @@ void sigChldHandler(int s)
 {
         // waitpid() might overwrite errno, so we save and restore it:
         int saved_errno = errno;
-        while(waitpid(-1, NULL, WNOHANG) > 0);
+        siginfo_t info;
+        while(1)
+        {
+                // Find an ended session without reaping it, its process id stays taken until it is reaped
+                info.si_pid = 0;
+                if((waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) != 0) || (info.si_pid == 0))
+                {
+                        break;
+                }
+                pid_t pid = info.si_pid;
+                timeoutSessionEnded(pid);
+                waitpid(pid, NULL, 0);
+
+                admissionSessionEnded();
+                clientLimitSessionEnded(pid);
+                hostLimitSessionEnded(pid);
+                upstreamSessionEnded(pid);
+        }
         errno = saved_errno;
 }
 
@@ -54,23 +76,14 @@ int initSigHandlers(void)
  */
 int main(int argc, char *argv[])
 {
-        if(argc >= 2)
-        {
+        initProxyConfig(&proxy_config);
 
-                for(size_t i = 0; i < strlen(argv[1]); ++i)
-                {
-                        if(!isdigit(argv[1][i]))
-                        {
-                                printf("ERROR: Provided port may only contain digits\n");
-                                return -1;
-                        }
-                }
-
-                initSigHandlers();
-                startProxy(argv[1]);
-        }
-        else
+        if(parseProxyConfig(&proxy_config, argc, argv) != 0)
         {
-                printf("Usage: %s <port>\n", argv[0]);
+                printUsage(argv[0]);
+                return -1;
         }
+
+        initSigHandlers();
+        return startProxy(proxy_config.port);
 }
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Compare two results files of "microbench -o" and flag regressions.
+#
+# Usage: microbench_compare.sh <old.tsv> <new.tsv> [threshold percent, default 10]
+#
+# A benchmark regresses when its time per operation grows by more than the threshold
+# or when it makes more allocations per operation. Exits with 1 if any benchmark regressed.
+
+if [ $# -lt 2 ]; then
+        echo "Usage: $0 <old.tsv> <new.tsv> [threshold percent]" >&2
+        exit 2
+fi
+
+awk -F '\t' -v threshold="${3:-10}" '
+FNR == 1 { next }
+NR == FNR { old_ns[$1] = $2; old_allocs[$1] = $3; next }
+{
+        if(!($1 in old_ns))
+        {
+                printf "%-24s %12s %12.1f %8s %9s %9.2f  new\n", $1, "-", $2, "-", "-", $3
+                next
+        }
+        delta = (old_ns[$1] > 0) ? ($2 - old_ns[$1]) * 100 / old_ns[$1] : 0
+        status = ""
+        if(delta > threshold)
+        {
+                status = "REGRESSION"
+        }
+        if((old_allocs[$1] >= 0) && ($3 > old_allocs[$1] + 0.1))
+        {
+                status = "REGRESSION (allocs)"
+        }
+        if(status != "")
+        {
+                ++regressions
+        }
+        printf "%-24s %12.1f %12.1f %+7.1f%% %9.2f %9.2f  %s\n", $1, old_ns[$1], $2, delta,
+               old_allocs[$1], $3, status
+}
+BEGIN {
+        printf "%-24s %12s %12s %8s %9s %9s\n", "benchmark", "old ns/op", "new ns/op", "delta",
+               "old alloc", "new alloc"
+}
+END { exit (regressions > 0) }
+' "$1" "$2"
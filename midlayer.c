@@ -1,48 +1,64 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "proxy.h"
+#include "config.h"
 #include "midlayer.h"
+#include "decoder.h"
+#include "filter.h"
 #include "serverside.h"
 #include "proxy_clientside.h"
 #include "util_socket.h"
+#include "verdict.h"
+#include "stats.h"
+#include "latency.h"
 
 
 
-/* Define the keywords that should lead to blocking of a request/response
- * The word filter is case insensitive
- */
-#define NUM_FILTERED_WORDS 8
-const char *filtered_words[NUM_FILTERED_WORDS] =
-        {
-                "spongebob",
-                "britney spears",
-                "paris hilton",
-                "norrkoping",
-                "norrköping",
-                "norrk%C3%B6ping",
-                "norrk%C3%96ping",
-                "norrkoeping"
-        };
-
 /* HTTP response string to return when a server response is blocked based on its content
  */
 const char *filtered_redirect_content = "HTTP/1.1 301 Moved Permanently\r\nLocation: http://www.ida.liu.se/~TDTS04/labs/2011/ass2/error2.html\r\nConnection: close\r\n\r\n";
 
+// Size of the stack buffer scanned text is normalized into
+#define FILTER_SCAN_BUFFER_SIZE 4096
+
+/* Body to finish a response with when it is blocked after its header was already forwarded
+ */
+const char *filtered_replacement_body = "<html><body><p>This content was blocked by the proxy filter.</p><p><a href=\"http://www.ida.liu.se/~TDTS04/labs/2011/ass2/error2.html\">More information</a></p></body></html>\n";
+
 
 
-/* strcasestr
+/* threadCpuNs
  *
- * Forward declaration for the GNU extenstion strcasestr for case insensitive substring search
+ * Get the CPU time used by the calling thread so far
  *
- * @param haystack String buffer to search in
- * @param needle Substring to search for
- * @ret Pointer to first occurrence of substring in the buffer, or NULL if substring not found
+ * @ret CPU time in nanoseconds
  */
-char *strcasestr(const char *haystack, const char *needle);
+static uint64_t threadCpuNs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
 
+/* sendToClient
+ *
+ * Queue data for the client of a response, the relay counts the bytes once they are sent
+ *
+ * @param mid_env Callback environment of the response
+ * @param buffer Data to send
+ * @param len Length of the data
+ * @ret Length of queued data, -1 on error
+ */
+static ssize_t sendToClient(MidlayerCallbackEnv *mid_env, const char *buffer, size_t len)
+{
+        return relayToClient(mid_env->relay, buffer, len);
+}
+
 
 /* forwardToServer
  *
@@ -69,6 +85,11 @@ int forwardToServer(const char *buffer, size_t buffer_len, Socket *server_sockfd
  * Partial data is buffered first until HTTP header is found to decide if the content filter should be applied
  * to the response, or until more than MAX_HEADER_SIZE bytes have been read without finding a complete HTTP header,
  * in which case the response is discarded.
+ * When early header forwarding is enabled, the header of a filtered response is sent to the client as soon as
+ * it is found and only the body is held back until the filter has been applied.
+ * The body is scanned as it arrives. Once a filtered word is found the response is blocked right away and
+ * the rest of it is never downloaded. A body held back beyond max_held_body is forwarded as it is scanned
+ * from then on, like after early headers.
  *
  * @param recv_buffer Buffer containing (partial) received data from the server
  * @param recv_buffer_len Length of the received data
@@ -85,7 +106,24 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
         size_t str_len = 0;
         int flush_buffer = 0;
 
-        if(mid_env->apply_filter)
+        if((mid_env->first_byte_ns == 0) && (recv_buffer_len != 0))
+        {
+                mid_env->first_byte_ns = monotonicNs();
+                recordLatency(LATENCY_FIRST_BYTE, mid_env->connected_ns, mid_env->first_byte_ns);
+        }
+
+        if(mid_env->apply_filter && mid_env->stream_body)
+        {
+                // The body is too long to hold back, every piece goes on once it is scanned
+                scanResponseBody(mid_env, recv_buffer, recv_buffer_len);
+                if(!mid_env->block_response)
+                {
+                        str_to_send = recv_buffer;
+                        str_len = recv_buffer_len;
+                        mid_env->body_streamed += recv_buffer_len;
+                }
+        }
+        else if(mid_env->apply_filter)
         {
                 // If filter should be applied, keep buffering data until we have the whole response
                 char *buffer_start =  extendBuffer(&(mid_env->cache_buffer), 
@@ -95,6 +133,7 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
                         // Buffer extension failed
                         fprintf(stderr, "ERROR: Could not extend buffer for server response\n");
                         free(mid_env->cache_buffer);
+                        mid_env->cache_buffer = NULL;
                         mid_env->cache_buffer_size = 0;
                         return -1;
                 }
@@ -115,7 +154,25 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
                         {
                                 // HTTP header found, check if it should be filtered
                                 mid_env->have_header = 1;
+                                if(resp_header.response_info.status_code != NULL)
+                                {
+                                        mid_env->response_status = atoi(resp_header.response_info.status_code);
+                                }
                                 mid_env->apply_filter = shouldApplyContentFilterHeader(&resp_header);
+
+                                if(mid_env->apply_filter)
+                                {
+                                        checkVerdictCache(mid_env, &resp_header);
+                                }
+
+                                if(mid_env->apply_filter)
+                                {
+                                        if(prepareBodyFilter(mid_env, &resp_header) != 0)
+                                        {
+                                                freeResponseHeader(&resp_header);
+                                                return -1;
+                                        }
+                                }
                         }
 
                         freeResponseHeader(&resp_header);
@@ -126,10 +183,26 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
                             && (mid_env->have_header == 0))
                         {
                                 free(mid_env->cache_buffer);
+                                mid_env->cache_buffer = NULL;
                                 mid_env->cache_buffer_size = 0;
                                 return -1;
                         }
                 }
+                else
+                {
+                        // Scan the new body data as it arrives
+                        scanResponseBody(mid_env, recv_buffer, recv_buffer_len);
+                }
+
+                if(mid_env->apply_filter && mid_env->have_header && !mid_env->block_response &&
+                   (proxy_config.max_held_body != 0) &&
+                   (mid_env->cache_buffer_size - mid_env->body_offset > proxy_config.max_held_body))
+                {
+                        if(streamHeldBody(mid_env) != 0)
+                        {
+                                return -1;
+                        }
+                }
         }
 
         if(mid_env->apply_filter == 0)
@@ -146,21 +219,70 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
                 {
                         str_to_send = recv_buffer;
                         str_len = recv_buffer_len;
+
+                        if(mid_env->verdict_hit)
+                        {
+                                recordBypassedBody(recv_buffer_len);
+                        }
                 }
         }
-        else if(recv_buffer_len == 0)
+        else if((recv_buffer_len == 0) || mid_env->block_response)
         {
-                // End of response and filter should be applied
-                mid_env->block_response = applyFilter(mid_env->cache_buffer);
+                // End of response or filtered word found, and filter should be applied
+                if(!mid_env->block_response)
+                {
+                        uint64_t filter_start_ns = threadCpuNs();
+
+                        if(mid_env->scanner != NULL)
+                        {
+                                mid_env->block_response = finishFilterStream(mid_env->scanner);
+                        }
+                        else if(mid_env->cache_buffer_size != 0)
+                        {
+                                // Response ended without a complete header
+                                mid_env->block_response = applyFilterN(mid_env->cache_buffer,
+                                                                       mid_env->cache_buffer_size);
+                        }
+
+                        mid_env->filter_cpu_ns += threadCpuNs() - filter_start_ns;
+                }
+
+                if(mid_env->scanner != NULL)
+                {
+                        recordFilteredBody(mid_env->body_streamed + mid_env->cache_buffer_size - mid_env->body_offset,
+                                           mid_env->filter_cpu_ns);
+                }
+
+                // Only a completely received and scanned clean body gives a verdict worth caching
+                if((!mid_env->block_response) && (mid_env->verdict_key != 0) &&
+                   responseBodyComplete(mid_env))
+                {
+                        storeCleanVerdict(mid_env->verdict_key);
+                }
 
                 if(mid_env->block_response)
+                {
+                        addProxyCounter(STAT_BLOCKED_RESPONSES, 1);
+                        if(recv_buffer_len != 0)
+                        {
+                                recordResponseAbort(mid_env);
+                        }
+                }
+
+                if(mid_env->block_response && mid_env->headers_sent)
+                {
+                        // Header is already on its way to the client, apply blocking policy
+                        verbosePrintf("Response body from server blocked because of filtered words in content\n");
+                        blockForwardedResponse(mid_env);
+                }
+                else if(mid_env->block_response)
                 {
                         // Block response
-                        printf("Response from server blocked because of filtered words in content\n");
+                        verbosePrintf("Response from server blocked because of filtered words in content\n");
                         str_to_send = filtered_redirect_content;
                         str_len = strlen(filtered_redirect_content);
                 }
-                else
+                else if(mid_env->cache_buffer_size != 0)
                 {
                         // Forward response
                         str_to_send = mid_env->cache_buffer;
@@ -172,7 +294,7 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
         // Forward data to client
         if(str_to_send != NULL)
         {
-                sendData(mid_env->client_sockfd, str_to_send, str_len);
+                sendToClient(mid_env, str_to_send, str_len);
         }
 
         // If the allocated buffer was flushed while returning data, clear it now
@@ -193,6 +315,459 @@ int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env)
 }
 
 
+/* checkVerdictCache
+ *
+ * Look up a response that is about to be filtered in the verdict cache. A response known to be
+ * clean is forwarded unfiltered from here on, otherwise its key is kept so a clean verdict can
+ * be stored once the whole body has been scanned. Only 200 responses to GET requests without
+ * Range header that have an ETag or Last-Modified validator are cached, a partial response
+ * shares the validator of the whole resource.
+ *
+ * @param mid_env Callback environment of the response
+ * @param resp_header Parsed header of the response
+ */
+void checkVerdictCache(MidlayerCallbackEnv *mid_env, const HTTPResponseHeader *resp_header)
+{
+        assert(mid_env != NULL);
+        assert(resp_header != NULL);
+
+        if((mid_env->request_url == NULL) || (mid_env->response_status != 200))
+        {
+                return;
+        }
+
+        const char *validator = getValue(&(resp_header->fields), "ETag");
+        if(validator == NULL)
+        {
+                validator = getValue(&(resp_header->fields), "Last-Modified");
+        }
+        if(validator == NULL)
+        {
+                return;
+        }
+
+        uint64_t key = verdictKey(mid_env->request_url, validator, acquireFilterMatcher()->header->checksum);
+        if(lookupCleanVerdict(key))
+        {
+                verbosePrintf("Cached clean verdict for %s, forwarding unfiltered\n", mid_env->request_url);
+                mid_env->apply_filter = 0;
+                mid_env->verdict_hit = 1;
+                recordBypassedBody(mid_env->cache_buffer_size - headerEndOffset(mid_env->cache_buffer));
+        }
+        else
+        {
+                mid_env->verdict_key = key;
+        }
+}
+
+
+/* prepareBodyFilter
+ *
+ * Set up filtering of the body of a response once its header has been found.
+ * Encoded bodies get a streaming decoder whose output is scanned as it arrives,
+ * so only the original encoded bytes have to be buffered.
+ *
+ * @param mid_env Callback environment holding the buffered response
+ * @param resp_header Parsed header of the buffered response
+ * @ret 0 on success
+ *      -1 if the header could not be forwarded to the client
+ */
+int prepareBodyFilter(MidlayerCallbackEnv *mid_env, HTTPResponseHeader *resp_header)
+{
+        assert(mid_env != NULL);
+        assert(resp_header != NULL);
+
+        const char *transfer_encoding = getValue(&(resp_header->fields), "Transfer-Encoding");
+        const char *content_length = getValue(&(resp_header->fields), "Content-Length");
+        mid_env->chunked = (transfer_encoding != NULL) && (strstr(transfer_encoding, "chunked") != NULL);
+        mid_env->content_length = ((content_length != NULL) && !mid_env->chunked) ? atoll(content_length) : -1;
+        mid_env->body_offset = headerEndOffset(mid_env->cache_buffer);
+        mid_env->header_time_ns = monotonicNs();
+
+        mid_env->scanner = malloc(sizeof(FilterScanner));
+        if(mid_env->scanner == NULL)
+        {
+                fprintf(stderr, "ERROR: Could not allocate filter state for response body\n");
+                return -1;
+        }
+
+        ContentEncoding encoding = parseContentEncoding(getValue(&(resp_header->fields), "Content-Encoding"));
+        if(encoding != CONTENT_ENCODING_IDENTITY)
+        {
+                mid_env->decoder = malloc(sizeof(ContentDecoder));
+                if((mid_env->decoder == NULL) ||
+                   (initContentDecoder(mid_env->decoder, encoding, mid_env->chunked) != 0))
+                {
+                        // Body can not be decoded, forward it unfiltered
+                        fprintf(stderr, "ERROR: Could not set up decoder for response body\n");
+                        free(mid_env->decoder);
+                        free(mid_env->scanner);
+                        mid_env->decoder = NULL;
+                        mid_env->scanner = NULL;
+                        mid_env->apply_filter = 0;
+                        return 0;
+                }
+        }
+
+        initFilterScanner(mid_env->scanner);
+
+        // Check the header on its own first, a blocked header is never forwarded
+        uint64_t filter_start_ns = threadCpuNs();
+        mid_env->block_response = applyFilterN(mid_env->cache_buffer, mid_env->body_offset);
+        mid_env->filter_cpu_ns += threadCpuNs() - filter_start_ns;
+        if(mid_env->block_response)
+        {
+                return 0;
+        }
+
+        if(proxy_config.forward_headers_early)
+        {
+                // Only the body has to wait for the filter
+                if(forwardResponseHeader(mid_env, resp_header) != 0)
+                {
+                        return -1;
+                }
+        }
+
+        // Scan the part of the body that arrived together with the header
+        scanResponseBody(mid_env, mid_env->cache_buffer + mid_env->body_offset,
+                         mid_env->cache_buffer_size - mid_env->body_offset);
+
+        return 0;
+}
+
+
+/* skipChunkData
+ *
+ * Chunked decoder sink for tracking the framing of an identity coded body that is scanned as received
+ *
+ * @ret 0 to continue with the next chunk
+ */
+static int skipChunkData(const char *data, size_t data_len, void *env)
+{
+        (void)data;
+        (void)data_len;
+        (void)env;
+        return 0;
+}
+
+
+/* scanResponseBody
+ *
+ * Scan the next piece of a response body for filtered words, decoding it first if it is
+ * encoded. Sets block_response as soon as a filtered word is found.
+ *
+ * @param mid_env Callback environment of the response
+ * @param data Next piece of the body as received from the server
+ * @param data_len Length of the piece
+ */
+void scanResponseBody(MidlayerCallbackEnv *mid_env, const char *data, size_t data_len)
+{
+        assert(mid_env != NULL);
+        assert(mid_env->scanner != NULL);
+
+        if((data_len == 0) || mid_env->block_response)
+        {
+                return;
+        }
+
+        uint64_t start_ns = threadCpuNs();
+
+        if(mid_env->decoder != NULL)
+        {
+                scanEncodedBody(mid_env, data, data_len);
+        }
+        else
+        {
+                scanFilterStream(mid_env->scanner, data, data_len);
+
+                if(mid_env->chunked && (mid_env->verdict_key != 0))
+                {
+                        feedChunkedDecoder(&(mid_env->chunk_framing), data, data_len, skipChunkData, NULL);
+                }
+        }
+
+        mid_env->filter_cpu_ns += threadCpuNs() - start_ns;
+        mid_env->block_response = mid_env->scanner->matched;
+}
+
+
+/* recordResponseAbort
+ *
+ * Account for a response that was blocked before it was completely downloaded. The time saved
+ * is estimated from the rate the body arrived at so far.
+ *
+ * @param mid_env Callback environment of the blocked response
+ */
+void recordResponseAbort(MidlayerCallbackEnv *mid_env)
+{
+        assert(mid_env != NULL);
+
+        size_t body_received = mid_env->body_streamed + mid_env->cache_buffer_size - mid_env->body_offset;
+        ssize_t bytes_saved = -1;
+        uint64_t ns_saved = 0;
+
+        if((mid_env->content_length >= 0) && (mid_env->scanner != NULL))
+        {
+                bytes_saved = ((size_t)mid_env->content_length > body_received) ?
+                              mid_env->content_length - body_received : 0;
+
+                uint64_t elapsed_ns = monotonicNs() - mid_env->header_time_ns;
+                if(body_received > 0)
+                {
+                        ns_saved = (uint64_t)((double)elapsed_ns * bytes_saved / body_received);
+                }
+        }
+
+        verbosePrintf("Stopped download of blocked response after %zu body bytes\n", body_received);
+        recordEarlyAbort(bytes_saved, ns_saved);
+}
+
+
+/* responseBodyComplete
+ *
+ * Check whether the whole body of a filtered response was received: the Content-Length was
+ * reached, or the last chunk or the end of the compressed stream was seen. A body that ended
+ * early, e.g. because the server closed the connection, must not be taken as clean.
+ *
+ * @param mid_env Callback environment of the response at its end
+ * @ret 1 if the body is complete, 0 otherwise
+ */
+int responseBodyComplete(MidlayerCallbackEnv *mid_env)
+{
+        assert(mid_env != NULL);
+
+        if((mid_env->scanner == NULL) || ((mid_env->decoder != NULL) && mid_env->decoder->error))
+        {
+                return 0;
+        }
+
+        if(mid_env->content_length >= 0)
+        {
+                size_t body_received = mid_env->body_streamed + mid_env->cache_buffer_size - mid_env->body_offset;
+                return body_received == (size_t)mid_env->content_length;
+        }
+
+        if(mid_env->decoder != NULL)
+        {
+                return contentDecoderComplete(mid_env->decoder);
+        }
+
+        return mid_env->chunked && chunkedDecoderDone(&(mid_env->chunk_framing));
+}
+
+
+/* scanFilterSink
+ *
+ * Decoder sink feeding the decoded body into the streaming filter
+ *
+ * @param data Decoded body data
+ * @param data_len Length of the decoded data
+ * @param env FilterScanner of the response (void* to be usable as DecoderSink)
+ * @ret 1 if a filtered word was found, which stops the decoding
+ */
+static int scanFilterSink(const char *data, size_t data_len, void *env)
+{
+        return scanFilterStream((FilterScanner *)env, data, data_len);
+}
+
+
+/* scanEncodedBody
+ *
+ * Decode the next piece of an encoded response body and scan it for filtered words.
+ * Decoding stops once a filtered word has been found or the body turns out to be corrupt.
+ *
+ * @param mid_env Callback environment of the response
+ * @param data Next piece of the encoded body
+ * @param data_len Length of the piece
+ */
+void scanEncodedBody(MidlayerCallbackEnv *mid_env, const char *data, size_t data_len)
+{
+        assert(mid_env != NULL);
+        assert(mid_env->decoder != NULL);
+
+        if(mid_env->scanner->matched || mid_env->decoder->error)
+        {
+                return;
+        }
+
+        feedContentDecoder(mid_env->decoder, data, data_len, scanFilterSink, mid_env->scanner);
+}
+
+
+/* forwardResponseHeader
+ *
+ * Send the header of a response that is being filtered to the client right away and keep
+ * only the body bytes in the cache buffer.
+ * With the replace policy, the header is rewritten so the body is delimited by the end of the
+ * connection, which allows a replacement body of any length to be sent later on.
+ *
+ * @param mid_env Callback environment holding the buffered response
+ * @param resp_header Parsed header of the buffered response
+ * @ret 0 on success
+ *      -1 if the header could not be sent
+ */
+int forwardResponseHeader(MidlayerCallbackEnv *mid_env, HTTPResponseHeader *resp_header)
+{
+        assert(mid_env != NULL);
+        assert(resp_header != NULL);
+
+        size_t header_len = headerEndOffset(mid_env->cache_buffer);
+        char *serialized_header = NULL;
+        size_t serialized_header_len = 0;
+
+        // An encoded body can not be finished with a plain replacement body
+        if((proxy_config.filter_policy == FILTER_POLICY_REPLACE) && (mid_env->decoder == NULL))
+        {
+                removeField(&(resp_header->fields), "Content-Length");
+                if(setValue(&(resp_header->fields), "Connection", "close", strlen("close")) == -1)
+                {
+                        addField(&(resp_header->fields), "Connection", strlen("Connection"),
+                                 "close", strlen("close"));
+                }
+
+                if(serializeResponseHeader(resp_header, &serialized_header, &serialized_header_len) == 0)
+                {
+                        mid_env->can_replace_body = 1;
+                }
+        }
+
+        ssize_t sent = -1;
+        if(serialized_header != NULL)
+        {
+                sent = sendToClient(mid_env, serialized_header, serialized_header_len);
+                free(serialized_header);
+        }
+        else
+        {
+                // Forward the header as it was received
+                sent = sendToClient(mid_env, mid_env->cache_buffer, header_len);
+        }
+
+        if(sent == -1)
+        {
+                fprintf(stderr, "ERROR: Failed to forward response header to client\n");
+                return -1;
+        }
+
+        mid_env->headers_sent = 1;
+        mid_env->body_offset = 0;
+
+        // Keep only the body in the cache buffer
+        mid_env->cache_buffer_size -= header_len;
+        if(mid_env->cache_buffer_size == 0)
+        {
+                free(mid_env->cache_buffer);
+                mid_env->cache_buffer = NULL;
+        }
+        else
+        {
+                memmove(mid_env->cache_buffer, mid_env->cache_buffer + header_len,
+                        mid_env->cache_buffer_size + 1);
+        }
+
+        return 0;
+}
+
+
+/* streamHeldBody
+ *
+ * Stop holding back the body of a filtered response because it grew beyond max_held_body.
+ * The header is forwarded if it was not yet, then the body received so far, and the rest of
+ * the body is forwarded as it is scanned. A filtered word found later blocks the response
+ * with the filter policy, like after early headers.
+ *
+ * @param mid_env Callback environment holding the buffered response
+ * @ret 0 on success
+ *      -1 if the header could not be forwarded
+ */
+int streamHeldBody(MidlayerCallbackEnv *mid_env)
+{
+        assert(mid_env != NULL);
+
+        verbosePrintf("Response body exceeds %zu bytes, forwarding it as it is scanned\n",
+                      proxy_config.max_held_body);
+        addProxyCounter(STAT_STREAMED_RESPONSES, 1);
+        mid_env->stream_body = 1;
+
+        if(!mid_env->headers_sent)
+        {
+                HTTPResponseHeader resp_header;
+                initResponseHeader(&resp_header);
+
+                int ret_val = -1;
+                if(parseResponseHeader(&resp_header, mid_env->cache_buffer) == 0)
+                {
+                        ret_val = forwardResponseHeader(mid_env, &resp_header);
+                }
+                freeResponseHeader(&resp_header);
+
+                if(ret_val != 0)
+                {
+                        return -1;
+                }
+        }
+
+        // Chunks of the forwarded body are cut anywhere, a replacement chunk would break the framing
+        if(mid_env->chunked)
+        {
+                mid_env->can_replace_body = 0;
+        }
+
+        if(mid_env->cache_buffer_size > mid_env->body_offset)
+        {
+                sendToClient(mid_env, mid_env->cache_buffer + mid_env->body_offset,
+                             mid_env->cache_buffer_size - mid_env->body_offset);
+                mid_env->body_streamed += mid_env->cache_buffer_size - mid_env->body_offset;
+        }
+
+        free(mid_env->cache_buffer);
+        mid_env->cache_buffer = NULL;
+        mid_env->cache_buffer_size = 0;
+        mid_env->body_offset = 0;
+
+        return 0;
+}
+
+
+/* blockForwardedResponse
+ *
+ * Block a response whose header has already been forwarded to the client, according
+ * to the configured filter policy. Either the client connection is reset, or the
+ * response is finished with a replacement body.
+ *
+ * @param mid_env Callback environment of the blocked response
+ */
+void blockForwardedResponse(MidlayerCallbackEnv *mid_env)
+{
+        assert(mid_env != NULL);
+
+        if(proxy_config.filter_policy == FILTER_POLICY_REPLACE && mid_env->can_replace_body)
+        {
+                size_t body_len = strlen(filtered_replacement_body);
+
+                if(mid_env->chunked)
+                {
+                        // Send replacement as the only chunk, followed by the last chunk
+                        char chunk_size[32];
+                        int chunk_size_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", body_len);
+                        sendToClient(mid_env, chunk_size, chunk_size_len);
+                        sendToClient(mid_env, filtered_replacement_body, body_len);
+                        sendToClient(mid_env, "\r\n0\r\n\r\n", strlen("\r\n0\r\n\r\n"));
+                }
+                else
+                {
+                        sendToClient(mid_env, filtered_replacement_body, body_len);
+                }
+        }
+        else
+        {
+                // Reset the connection, so the client does not mistake the response as complete
+                abortRelayClient(mid_env->relay);
+        }
+}
+
+
 /* extendBuffer
  *
  * Extend a buffer by a number of bytes while preserving the original content
@@ -238,7 +813,8 @@ char * extendBuffer(char **buffer, size_t buffer_size, size_t extend_by)
 /* shouldApplyContentFilterHeader
  *
  * Check if the content filter should be applied to a HTTP response by
- * checking if the returned data is text and not encoded
+ * checking if the returned data is text and either not encoded or encoded
+ * with a coding the proxy can decode (gzip, deflate)
  *
  * @param resp_header HTTP response header of the response to check
  * @ret True if the response should be checked for blocked words
@@ -247,7 +823,7 @@ char * extendBuffer(char **buffer, size_t buffer_size, size_t extend_by)
 int shouldApplyContentFilterHeader(const HTTPResponseHeader *resp_header)
 {
         int is_text = 0;
-        int is_encoded = 0;
+        int is_decodable = 0;
 
         const char* content_type_key = "Content-Type";
         const char* content_encoding_key = "Content-Encoding";
@@ -259,12 +835,9 @@ int shouldApplyContentFilterHeader(const HTTPResponseHeader *resp_header)
         }
 
         const char *content_encoding_value = getValue(&(resp_header->fields), content_encoding_key);
-        if(content_encoding_value != NULL)
-        {
-                is_text = (strstr(content_type_value, "identity") != NULL ? 1 : 0);
-        }
+        is_decodable = (parseContentEncoding(content_encoding_value) != CONTENT_ENCODING_UNSUPPORTED);
 
-        return is_text && (!is_encoded);
+        return is_text && is_decodable;
 }
 
 
@@ -279,31 +852,124 @@ int shouldApplyContentFilterHeader(const HTTPResponseHeader *resp_header)
  */
 int applyFilter(const char *buffer)
 {
-        for(size_t i = 0; i < NUM_FILTERED_WORDS; ++i)
+        return applyFilterN(buffer, strlen(buffer));
+}
+
+
+/* applyFilterN
+ *
+ * Check if the first bytes of a buffer contain blocked words
+ *
+ * @param buffer Buffer that should be searched for blocked words
+ * @param buffer_len Number of bytes to search
+ * @ret True when the searched bytes contain blocked words
+ *
+ */
+int applyFilterN(const char *buffer, size_t buffer_len)
+{
+        FilterScanner scanner;
+        initFilterScanner(&scanner);
+
+        scanFilterStream(&scanner, buffer, buffer_len);
+        return finishFilterStream(&scanner);
+}
+
+
+/* initFilterScanner
+ *
+ * Initialize the state for scanning a stream of data for filtered words.
+ * The scanner keeps using the matcher that is current at this point, even if the
+ * filter is reloaded in the meantime.
+ *
+ * @param scanner Scanner to initialize
+ */
+void initFilterScanner(FilterScanner *scanner)
+{
+        assert(scanner != NULL);
+
+        scanner->matcher = acquireFilterMatcher();
+        initTextNormalizer(&(scanner->normalizer), scanner->matcher->header->flags);
+        scanner->state = 0;
+        scanner->matched = 0;
+}
+
+
+/* scanNormalized
+ *
+ * Run normalized data through the matcher of a scanner
+ *
+ * @param scanner State of the scanned stream
+ * @param normalized Normalized data
+ * @param normalized_len Length of the data
+ */
+static void scanNormalized(FilterScanner *scanner, const char *normalized, size_t normalized_len)
+{
+        int word = findFilteredWord(scanner->matcher, &(scanner->state), normalized, normalized_len);
+        if(word != FILTER_NO_MATCH)
         {
-                if(containsWord(buffer, filtered_words[i]))
-                {
-                        printf("Found filtered word: %s\n", filtered_words[i]);
-                        return 1;
-                }
+                verbosePrintf("Found filtered word: %s\n", filteredWord(scanner->matcher, word));
+                scanner->matched = 1;
         }
-
-        return 0;
 }
 
-/* containsWord
+
+/* scanFilterStream
  *
- * Search buffer for occurences of a substring
- * Uses the GNU extension strcasestr for case insensitive comparison
+ * Scan the next piece of a data stream for filtered words. The data is normalized piece by
+ * piece into a stack buffer first, so percent-encoded, upper case and (optionally) accented
+ * variants of a word are found in a single pass. Words split between two pieces are found as well.
+ *
+ * @param scanner State of the scanned stream
+ * @param data Next piece of the stream
+ * @param data_len Length of the piece
+ * @ret True if a filtered word has been found in the stream so far
+ */
+int scanFilterStream(FilterScanner *scanner, const char *data, size_t data_len)
+{
+        assert(scanner != NULL);
+
+        if(scanner->matched)
+        {
+                return 1;
+        }
+
+        char normalized[FILTER_SCAN_BUFFER_SIZE];
+        size_t pos = 0;
+
+        while((pos < data_len) && !scanner->matched)
+        {
+                size_t consumed = 0;
+                size_t normalized_len = normalizeText(&(scanner->normalizer), data + pos, data_len - pos,
+                                                      &consumed, normalized, sizeof(normalized));
+                pos += consumed;
+
+                scanNormalized(scanner, normalized, normalized_len);
+        }
+
+        return scanner->matched;
+}
+
+
+/* finishFilterStream
  *
- * @param buffer String buffer to be searched for the given substring/word
- * @param word Substring to search for
- * @ret True if substring found in buffer
+ * Scan the bytes the normalization still holds back at the end of a stream
  *
+ * @param scanner State of the scanned stream
+ * @ret True if a filtered word has been found in the stream
  */
-int containsWord(const char *buffer, const char *word)
+int finishFilterStream(FilterScanner *scanner)
 {
-        return (strcasestr(buffer, word) != NULL);
+        assert(scanner != NULL);
+
+        char normalized[NORMALIZE_MAX_EXPANSION];
+
+        if(!scanner->matched)
+        {
+                size_t normalized_len = finishTextNormalizer(&(scanner->normalizer), normalized);
+                scanNormalized(scanner, normalized, normalized_len);
+        }
+
+        return scanner->matched;
 }
 
 
@@ -312,15 +978,33 @@ int containsWord(const char *buffer, const char *word)
  * Initialize a callback environment
  *
  * @param env Callback environment to initialize
- * @param socket_fd Socket file descriptor to use in the callback
+ * @param relay Relay of the session the response is returned through
  */
-void initMidlayerCallbackEnv(MidlayerCallbackEnv *env, Socket *socket_fd)
+void initMidlayerCallbackEnv(MidlayerCallbackEnv *env, Relay *relay)
 {
-        env->client_sockfd = socket_fd;
+        env->relay = relay;
         env->call_counter = 0;
         env->block_response = 0;
         env->apply_filter = 1;
         env->have_header = 0;
+        env->headers_sent = 0;
+        env->chunked = 0;
+        env->can_replace_body = 0;
+        env->body_offset = 0;
+        env->stream_body = 0;
+        env->body_streamed = 0;
+        env->decoder = NULL;
+        initChunkedDecoder(&(env->chunk_framing));
+        env->scanner = NULL;
+        env->request_url = NULL;
+        env->verdict_key = 0;
+        env->verdict_hit = 0;
+        env->filter_cpu_ns = 0;
+        env->content_length = -1;
+        env->header_time_ns = 0;
+        env->connected_ns = 0;
+        env->first_byte_ns = 0;
+        env->response_status = 0;
 
         env->cache_buffer_size = 0;
         env->cache_buffer = NULL;
@@ -341,4 +1025,14 @@ void destroyMidlayerCallbackEnv(MidlayerCallbackEnv *env)
         {
                 free(env->cache_buffer);
         }
+
+        if(env->decoder != NULL)
+        {
+                destroyContentDecoder(env->decoder);
+                free(env->decoder);
+                env->decoder = NULL;
+        }
+
+        free(env->scanner);
+        env->scanner = NULL;
 }
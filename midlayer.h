@@ -2,12 +2,34 @@
 #define MIDLAYER_H
 
 #include "http.h"
+#include "util_socket.h"
+#include "decoder.h"
+#include "filter.h"
+#include "relay.h"
+
+/* FilterScanner
+ *
+ * State for scanning a stream of data for filtered words piece by piece
+ *
+ * matcher    -> Filter matcher used for the whole stream
+ * normalizer -> Normalization of the stream before it is matched
+ * state      -> Matcher state after the data scanned so far
+ * matched    -> Indicates that a filtered word has been found in the stream
+ */
+typedef struct _filter_scanner_
+{
+  const FilterMatcher *matcher;
+  TextNormalizer normalizer;
+  uint32_t state;
+  int matched;
+} FilterScanner;
+
 
 /* MidlayerCallbackEnv
  *
  * Struct containing state for the midlayer callback to simulate a closure
  *
- * client_sockfd     -> Socket file descriptor to use for returning data to client
+ * relay             -> Relay of the session, queues the data returned to the client
  * call_counter      -> Number of times the callback has been called
  * cache_buffer      -> Buffer for caching incomplete responses while waiting for 
  *                      HTTP header/end of response to apply filter
@@ -15,31 +37,81 @@
  * have_header       -> Indicates that a HTTP header has already been found
  * block_response    -> Indicates that the response should be blocked
  * apply_filter      -> Indicates that the response should be checked for blocked words
+ * headers_sent      -> Indicates that the response header was already forwarded to the client
+ * chunked           -> Indicates that the response body uses chunked transfer encoding
+ * can_replace_body  -> Indicates that the forwarded header allows a replacement body
+ * body_offset       -> Offset of the response body in the cache buffer
+ * stream_body       -> Indicates that the body exceeded max_held_body and is forwarded as it is scanned
+ * body_streamed     -> Body bytes forwarded while the filter still scanned
+ * decoder           -> Decoder for an encoded response body, NULL for identity coding
+ * chunk_framing     -> Chunk framing of an identity coded chunked body whose verdict may be cached,
+ *                      tracked to tell whether its last chunk arrived
+ * scanner           -> Filter state for the decoded body, NULL for identity coding
+ * request_url       -> URL of a GET request without Range whose response verdict may be cached, NULL otherwise
+ * verdict_key       -> Verdict cache key of the response, 0 if its verdict can not be cached
+ * verdict_hit       -> Indicates that the response is forwarded unfiltered because of a cached verdict
+ * filter_cpu_ns     -> CPU time spent filtering the response so far
+ * content_length    -> Announced length of the response body, -1 if unknown
+ * header_time_ns    -> Monotonic time the response header was received at
+ * connected_ns      -> Monotonic time the server connection was established at
+ * first_byte_ns     -> Monotonic time the first response byte was received at, 0 before
+ * response_status   -> Status code of the response, 0 until its header was parsed
  */
 typedef struct _midlayer_callback_env_
 {
-  Socket *client_sockfd;
+  Relay *relay;
   int call_counter;
   char *cache_buffer;
   size_t cache_buffer_size;
   int have_header;
   int block_response;
   int apply_filter;
+  int headers_sent;
+  int chunked;
+  int can_replace_body;
+  size_t body_offset;
+  int stream_body;
+  size_t body_streamed;
+  ContentDecoder *decoder;
+  ChunkedDecoder chunk_framing;
+  FilterScanner *scanner;
+  const char *request_url;
+  uint64_t verdict_key;
+  int verdict_hit;
+  uint64_t filter_cpu_ns;
+  long long content_length;
+  uint64_t header_time_ns;
+  uint64_t connected_ns;
+  uint64_t first_byte_ns;
+  int response_status;
 } MidlayerCallbackEnv;
 
 
-void initMidlayerCallbackEnv(MidlayerCallbackEnv *env, Socket *socket_fd);
+void initMidlayerCallbackEnv(MidlayerCallbackEnv *env, Relay *relay);
 void destroyMidlayerCallbackEnv(MidlayerCallbackEnv *env);
 
 
 int forwardToServer(const char *buffer, size_t buffer_len, Socket *server_sockfd);
 int forwardToClient(const char *recv_buffer, size_t recv_buffer_len, void *env);
+int prepareBodyFilter(MidlayerCallbackEnv *mid_env, HTTPResponseHeader *resp_header);
+void checkVerdictCache(MidlayerCallbackEnv *mid_env, const HTTPResponseHeader *resp_header);
+void scanResponseBody(MidlayerCallbackEnv *mid_env, const char *data, size_t data_len);
+void scanEncodedBody(MidlayerCallbackEnv *mid_env, const char *data, size_t data_len);
+void recordResponseAbort(MidlayerCallbackEnv *mid_env);
+int responseBodyComplete(MidlayerCallbackEnv *mid_env);
+int forwardResponseHeader(MidlayerCallbackEnv *mid_env, HTTPResponseHeader *resp_header);
+int streamHeldBody(MidlayerCallbackEnv *mid_env);
+void blockForwardedResponse(MidlayerCallbackEnv *mid_env);
 
 
 int shouldApplyContentFilterHeader(const HTTPResponseHeader *resp_header);
 
 int applyFilter(const char *buffer);
-int containsWord(const char *buffer, const char *word);
+int applyFilterN(const char *buffer, size_t buffer_len);
+
+void initFilterScanner(FilterScanner *scanner);
+int scanFilterStream(FilterScanner *scanner, const char *data, size_t data_len);
+int finishFilterStream(FilterScanner *scanner);
 
 char * extendBuffer(char **buffer, size_t buffer_size, size_t extend_by);
 
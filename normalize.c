@@ -0,0 +1,235 @@
+#include <assert.h>
+
+#include "normalize.h"
+
+// UTF-8 lead byte of the Latin-1 supplement letters U+00C0 - U+00FF
+#define UTF8_LATIN1_LEAD 0xC3
+
+
+/* ASCII base letters of the lower case Latin-1 letters U+00E0 - U+00FF (continuation bytes
+ * 0xA0 - 0xBF), 0 for characters that are kept as they are (æ, ÷, þ)
+ */
+static const char latin1_base_letters[32] =
+        {
+                'a', 'a', 'a', 'a', 'a', 'a', 0,   'c', 'e', 'e', 'e', 'e', 'i', 'i', 'i', 'i',
+                'd', 'n', 'o', 'o', 'o', 'o', 'o', 0,   'o', 'u', 'u', 'u', 'u', 'y', 0,   'y'
+        };
+
+
+/* hexValue
+ *
+ * Get the value of a hex digit
+ *
+ * @param c Character to convert
+ * @ret Value of the digit, -1 if the character is no hex digit
+ */
+static inline int hexValue(uint8_t c)
+{
+        if((c >= '0') && (c <= '9'))
+        {
+                return c - '0';
+        }
+        if((c >= 'a') && (c <= 'f'))
+        {
+                return c - 'a' + 10;
+        }
+        if((c >= 'A') && (c <= 'F'))
+        {
+                return c - 'A' + 10;
+        }
+        return -1;
+}
+
+
+/* emitDecoded
+ *
+ * Case fold a percent-decoded byte and write it out. A UTF-8 lead byte of a Latin-1 letter is
+ * held back until its continuation byte is known.
+ *
+ * @param normalizer Normalization state
+ * @param c Decoded byte
+ * @param out Output position
+ * @ret Output position after the written bytes
+ */
+static inline char * emitDecoded(TextNormalizer *normalizer, uint8_t c, char *out)
+{
+        if(normalizer->utf8_lead != 0)
+        {
+                normalizer->utf8_lead = 0;
+
+                if((c >= 0x80) && (c <= 0xBF))
+                {
+                        // Latin-1 upper case letters (except the multiplication sign) fold to lower case
+                        if((c <= 0x9E) && (c != 0x97))
+                        {
+                                c += 0x20;
+                        }
+
+                        if((normalizer->flags & NORMALIZE_FOLD_DIACRITICS) && (c >= 0xA0) &&
+                           (latin1_base_letters[c - 0xA0] != 0))
+                        {
+                                *out++ = latin1_base_letters[c - 0xA0];
+                                return out;
+                        }
+
+                        *out++ = (char)UTF8_LATIN1_LEAD;
+                        *out++ = (char)c;
+                        return out;
+                }
+
+                // Not a continuation byte, the lead byte is passed on unchanged
+                *out++ = (char)UTF8_LATIN1_LEAD;
+        }
+
+        if(c == UTF8_LATIN1_LEAD)
+        {
+                normalizer->utf8_lead = c;
+                return out;
+        }
+
+        *out++ = ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+        return out;
+}
+
+
+/* initTextNormalizer
+ *
+ * Initialize the normalization state for a new stream
+ *
+ * @param normalizer Normalization state to initialize
+ * @param flags NORMALIZE_* flags
+ */
+void initTextNormalizer(TextNormalizer *normalizer, uint32_t flags)
+{
+        assert(normalizer != NULL);
+
+        normalizer->flags = flags;
+        normalizer->percent_state = 0;
+        normalizer->percent_high = 0;
+        normalizer->utf8_lead = 0;
+}
+
+
+/* normalizeText
+ *
+ * Normalize the next piece of a stream. Input is consumed until it is used up or the output
+ * buffer has less than NORMALIZE_MAX_EXPANSION bytes left, so a small fixed buffer is enough
+ * for input of any length.
+ *
+ * @param normalizer Normalization state of the stream
+ * @param in Next piece of the stream
+ * @param in_len Length of the piece
+ * @ret consumed Number of input bytes consumed
+ * @param out Buffer for the normalized text
+ * @param out_len Size of the buffer, at least NORMALIZE_MAX_EXPANSION
+ * @ret Number of bytes written to the buffer
+ */
+size_t normalizeText(TextNormalizer *normalizer, const char *in, size_t in_len, size_t *consumed,
+                     char *out, size_t out_len)
+{
+        assert(normalizer != NULL);
+        assert(consumed != NULL);
+        assert(out_len >= NORMALIZE_MAX_EXPANSION);
+
+        const uint8_t *bytes = (const uint8_t *)in;
+        char *out_pos = out;
+        char *out_end = out + out_len - NORMALIZE_MAX_EXPANSION;
+        size_t pos = 0;
+
+        while((pos < in_len) && (out_pos <= out_end))
+        {
+                // Fast path for runs of plain ASCII text
+                if((normalizer->percent_state == 0) && (normalizer->utf8_lead == 0))
+                {
+                        size_t run_end = pos + (size_t)(out_end - out_pos) + 1;
+                        run_end = (run_end < in_len) ? run_end : in_len;
+
+                        while((pos < run_end) && (bytes[pos] < 0x80) && (bytes[pos] != '%'))
+                        {
+                                uint8_t c = bytes[pos++];
+                                *out_pos++ = ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+                        }
+
+                        if((pos == in_len) || (out_pos > out_end))
+                        {
+                                break;
+                        }
+                }
+
+                uint8_t c = bytes[pos++];
+
+                if(normalizer->percent_state == 2)
+                {
+                        normalizer->percent_state = 0;
+                        int high = hexValue(normalizer->percent_high);
+                        int low = hexValue(c);
+                        if(low >= 0)
+                        {
+                                out_pos = emitDecoded(normalizer, (uint8_t)((high << 4) | low), out_pos);
+                                continue;
+                        }
+
+                        // Broken escape, pass it on as it is and handle the byte on its own
+                        out_pos = emitDecoded(normalizer, '%', out_pos);
+                        out_pos = emitDecoded(normalizer, normalizer->percent_high, out_pos);
+                }
+                else if(normalizer->percent_state == 1)
+                {
+                        if(hexValue(c) >= 0)
+                        {
+                                normalizer->percent_high = c;
+                                normalizer->percent_state = 2;
+                                continue;
+                        }
+
+                        normalizer->percent_state = 0;
+                        out_pos = emitDecoded(normalizer, '%', out_pos);
+                }
+
+                if(c == '%')
+                {
+                        normalizer->percent_state = 1;
+                        continue;
+                }
+
+                out_pos = emitDecoded(normalizer, c, out_pos);
+        }
+
+        *consumed = pos;
+        return out_pos - out;
+}
+
+
+/* finishTextNormalizer
+ *
+ * Write out the bytes still held back at the end of a stream (an incomplete escape or
+ * UTF-8 sequence)
+ *
+ * @param normalizer Normalization state of the stream
+ * @param out Buffer of at least NORMALIZE_MAX_EXPANSION bytes
+ * @ret Number of bytes written to the buffer
+ */
+size_t finishTextNormalizer(TextNormalizer *normalizer, char *out)
+{
+        assert(normalizer != NULL);
+
+        char *out_pos = out;
+
+        if(normalizer->percent_state >= 1)
+        {
+                out_pos = emitDecoded(normalizer, '%', out_pos);
+        }
+        if(normalizer->percent_state == 2)
+        {
+                out_pos = emitDecoded(normalizer, normalizer->percent_high, out_pos);
+        }
+        normalizer->percent_state = 0;
+
+        if(normalizer->utf8_lead != 0)
+        {
+                *out_pos++ = (char)normalizer->utf8_lead;
+                normalizer->utf8_lead = 0;
+        }
+
+        return out_pos - out;
+}
@@ -0,0 +1,39 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Normalization flag: fold Latin-1 letters with diacritics to their ASCII base letter
+#define NORMALIZE_FOLD_DIACRITICS 0x1
+
+// Most output bytes one input byte can produce (a broken escape plus a pending UTF-8 lead byte)
+#define NORMALIZE_MAX_EXPANSION 4
+
+
+/* TextNormalizer struct
+ *
+ * State of the streaming normalization in front of the filter matcher. Text is percent-decoded,
+ * case folded (ASCII and the Latin-1 letters of UTF-8) and optionally folded to ASCII base
+ * letters. Escapes and UTF-8 sequences may be split between pieces of a stream.
+ *
+ * flags         -> NORMALIZE_* flags
+ * percent_state -> Number of bytes of a percent escape seen so far (0 - 2)
+ * percent_high  -> First hex digit of the escape
+ * utf8_lead     -> Pending UTF-8 lead byte (0xC3) waiting for its continuation byte, 0 if none
+ */
+typedef struct _text_normalizer_
+{
+  uint32_t flags;
+  uint8_t percent_state;
+  uint8_t percent_high;
+  uint8_t utf8_lead;
+} TextNormalizer;
+
+
+void initTextNormalizer(TextNormalizer *normalizer, uint32_t flags);
+size_t normalizeText(TextNormalizer *normalizer, const char *in, size_t in_len, size_t *consumed,
+                     char *out, size_t out_len);
+size_t finishTextNormalizer(TextNormalizer *normalizer, char *out);
+
+#endif
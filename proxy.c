@@ -1,17 +1,43 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "proxy_clientside.h"
+#include "config.h"
+#include "filter.h"
+#include "blocklist.h"
+#include "verdict.h"
+#include "stats.h"
+#include "latency.h"
+#include "admin.h"
+#include "accesslog.h"
+#include "timeout.h"
+#include "admission.h"
+#include "clientlimit.h"
+#include "eyeballs.h"
+#include "breaker.h"
+#include "upstream.h"
+#include "hedge.h"
+#include "hostlimit.h"
+#include "handoff.h"
 
 
 /* startProxy
  *
- * Start the HTTP proxy listening on the given local port
+ * Start the HTTP proxy listening on the given local port. With a handoff socket the listening
+ * sockets of a running proxy are taken over, and the proxy returns once it handed them over to
+ * the next proxy process and drained its sessions.
  *
  * @param port Port number the proxy should listen on
  * @ret 0 on success
- *      1 if listening socket could not be opened
+ *      1 if the content filter could not be loaded or listening socket could not be opened
  */
 int startProxy(const char *port)
 {
@@ -19,23 +45,266 @@ int startProxy(const char *port)
 
         printf("Starting proxy\n");
 
-        Socket listen_socket;
-        initSocket(&listen_socket);
+        if((proxy_config.handoff_socket != NULL) && (takeOverListeners(proxy_config.handoff_socket) != 0))
+        {
+                fprintf(stderr, "Could not take over the listening sockets\n");
+                return 1;
+        }
 
-        if(openListeningSocket(port, &listen_socket) != 0)
+        uint32_t filter_flags = proxy_config.fold_diacritics ? NORMALIZE_FOLD_DIACRITICS : 0;
+        if(initFilter(proxy_config.filter_file, filter_flags) != 0)
         {
-                fprintf(stderr, "Could not open listening socket\n");
+                fprintf(stderr, "Could not load content filter\n");
+                return 1;
+        }
+
+        if(initBlocklist(proxy_config.blocklist_file) != 0)
+        {
+                fprintf(stderr, "Could not load blocklist\n");
+                return 1;
+        }
+
+        if(initProxyStats() != 0)
+        {
+                fprintf(stderr, "Could not create statistics\n");
+                return 1;
+        }
+
+        if(initLatencyStats() != 0)
+        {
+                fprintf(stderr, "Could not create latency statistics\n");
+                return 1;
+        }
+
+        if(initVerdictCache(proxy_config.verdict_cache_entries) != 0)
+        {
+                fprintf(stderr, "Could not create verdict cache\n");
+                return 1;
+        }
+
+        if(startControlThread() != 0)
+        {
+                fprintf(stderr, "Could not start control thread\n");
+                return 1;
+        }
+
+        if(initConnectFailures() != 0)
+        {
+                fprintf(stderr, "Could not create connect failure memory\n");
+                return 1;
+        }
+
+        if(initCircuitBreakers() != 0)
+        {
+                fprintf(stderr, "Could not create circuit breakers\n");
+                return 1;
+        }
+
+        if(initHostLimits() != 0)
+        {
+                fprintf(stderr, "Could not create host limits\n");
+                return 1;
+        }
+
+        if(initHedging() != 0)
+        {
+                fprintf(stderr, "Could not create hedging state\n");
+                return 1;
+        }
+
+        if(proxy_config.upstream_file != NULL)
+        {
+                if(loadUpstreams(proxy_config.upstream_file) != 0)
+                {
+                        fprintf(stderr, "Could not load upstreams\n");
+                        return 1;
+                }
+
+                if(startHealthChecks() != 0)
+                {
+                        fprintf(stderr, "Could not start health checks\n");
+                        return 1;
+                }
+        }
+
+        if(initClientLimits() != 0)
+        {
+                fprintf(stderr, "Could not create client limits\n");
+                return 1;
+        }
+
+        if(initSessionTimeouts() != 0)
+        {
+                fprintf(stderr, "Could not create session timeouts\n");
+                return 1;
+        }
+
+        if((proxy_config.access_log_file != NULL) && (initAccessLog(proxy_config.access_log_file) != 0))
+        {
+                fprintf(stderr, "Could not open access log\n");
+                return 1;
+        }
+
+        if((proxy_config.admin_port != NULL) && (startAdminThread(proxy_config.admin_port) != 0))
+        {
+                fprintf(stderr, "Could not open admin port\n");
                 return 1;
         }
 
+        // The proxy port forwards to the requested hosts, the upstream ports to their pools
+        ProxyListener listeners[1 + UPSTREAM_MAX_LISTENERS];
+        size_t num_listeners = 1 + upstreamListenerCount();
+        int ret_val = 0;
+        int handed_over = 0;
+
+        for(size_t i = 0; i < num_listeners; ++i)
+        {
+                initSocket(&(listeners[i].socket));
+        }
+
+        listeners[0].pool = -1;
+        if(openHandoffListeningSocket(NULL, port, &(listeners[0].socket)) != 0)
+        {
+                fprintf(stderr, "Could not open listening socket\n");
+                ret_val = 1;
+                goto error_listen;
+        }
+
+        for(size_t i = 1; i < num_listeners; ++i)
+        {
+                const UpstreamListener *upstream = upstreamListener(i - 1);
+                listeners[i].pool = upstream->pool;
+                if(openHandoffListeningSocket(NULL, upstream->port, &(listeners[i].socket)) != 0)
+                {
+                        fprintf(stderr, "Could not open listening socket on port %s\n", upstream->port);
+                        ret_val = 1;
+                        goto error_listen;
+                }
+                printf("Reverse proxy listening on port %s\n", upstream->port);
+        }
+
+        initAdmission(&(listeners[0].socket));
+
+        // The previous proxy process stops accepting once this one started its handoff thread
+        if((proxy_config.handoff_socket != NULL) && (startHandoffThread(proxy_config.handoff_socket) != 0))
+        {
+                fprintf(stderr, "Could not open handoff socket\n");
+                ret_val = 1;
+                goto error_listen;
+        }
         printf("Proxy listening on port %s\n", port);
+        fflush(stdout);
 
-        if(listenLoop(&listen_socket) != 0)
+        if(listenLoop(listeners, num_listeners) != 0)
         {
                 fprintf(stderr, "Accepting connection failed\n");
         }
+        else
+        {
+                handed_over = 1;
+        }
+
+error_listen:
+        for(size_t i = 0; i < num_listeners; ++i)
+        {
+                destroySocket(&(listeners[i].socket));
+        }
+
+        if(handed_over)
+        {
+                drainSessions(proxy_config.drain_time);
+        }
+
+        return ret_val;
+}
+
+
+
+
+
+/* controlThread
+ *
+ * Handle control signals of the proxy process off the accept path.
+ * SIGHUP, or a change of the word list file, reloads the content filter. The new matcher is built
+ * here and published atomically; sessions that are already running keep their matcher.
+ * SIGHUP reloads the blocklist and reopens the access log as well. SIGUSR1 prints the
+ * statistics of the proxy.
+ *
+ * @param arg Unused
+ */
+void* controlThread(void *arg)
+{
+        (void)arg;
+
+        sigset_t control_signals;
+        sigemptyset(&control_signals);
+        sigaddset(&control_signals, SIGHUP);
+        sigaddset(&control_signals, SIGUSR1);
 
-        destroySocket(&listen_socket);
+        while(1)
+        {
+                int sig;
+
+                if(proxy_config.filter_watch_interval > 0)
+                {
+                        struct timespec timeout;
+                        timeout.tv_sec = proxy_config.filter_watch_interval;
+                        timeout.tv_nsec = 0;
+                        sig = sigtimedwait(&control_signals, NULL, &timeout);
+                }
+                else
+                {
+                        sig = sigwaitinfo(&control_signals, NULL);
+                }
+
+                if((sig == SIGHUP) || filterFileChanged(proxy_config.filter_file))
+                {
+                        reloadFilter(proxy_config.filter_file);
+                }
+
+                if(sig == SIGHUP)
+                {
+                        reloadBlocklist(proxy_config.blocklist_file);
+                        reopenAccessLog();
+                }
+                else if(sig == SIGUSR1)
+                {
+                        printStatsReport(stdout);
+                        fflush(stdout);
+                }
+        }
+
+        return NULL;
+}
+
+
+/* startControlThread
+ *
+ * Block the control signals in all threads of the process and start the thread handling them.
+ * Forked sessions inherit the blocked signals, so only the control thread reacts to them.
+ *
+ * @ret 0 on success
+ *      -1 if the thread could not be started
+ */
+int startControlThread(void)
+{
+        sigset_t control_signals;
+        sigemptyset(&control_signals);
+        sigaddset(&control_signals, SIGHUP);
+        sigaddset(&control_signals, SIGUSR1);
+
+        if(pthread_sigmask(SIG_BLOCK, &control_signals, NULL) != 0)
+        {
+                return -1;
+        }
+
+        pthread_t control_thread_id;
+        if(pthread_create(&control_thread_id, NULL, controlThread, NULL) != 0)
+        {
+                return -1;
+        }
+
+        pthread_detach(control_thread_id);
 
         return 0;
 }
@@ -45,9 +314,10 @@ int startProxy(const char *port)
 
 
 /* listenLoop
- * @param listen_sockfd Socket file descriptor to listen on
+ * @param listeners Listening sockets of the proxy, the first one also measures the accept queue
+ * @param num_listeners Number of listening sockets
  *
- * Start listening for incoming connections on the given socket
+ * Start listening for incoming connections on the given sockets
  * For every incoming connection, spawn a new thread and read incoming data.
  * If the incoming data is a HTTP request, check if the request should be filtered
  * based on the requeste URL and if not, connect to the target server and forward the request.
@@ -55,36 +325,141 @@ int startProxy(const char *port)
  * requested URL as well as to use 'Connection: close'
  * Also spawns a listener on the server side socket that calls a callback for returning the
  * data from the server to the client
+ * Connections of upstream listeners are sent to a server of their pool instead.
+ * Returns once the listening sockets were handed over to the next proxy process.
  *
+ * @ret 0 once the listening sockets were handed over
+ *      -1 if accepting a connection failed
  */
-int listenLoop(Socket *listen_sockfd)
+int listenLoop(ProxyListener *listeners, size_t num_listeners)
 {
-        assert(listen_sockfd != NULL);
+        assert(listeners != NULL);
+        assert((num_listeners > 0) && (num_listeners <= 1 + UPSTREAM_MAX_LISTENERS));
+
+        // The last entry is the stop pipe of the handoff, -1 without a handoff socket
+        struct pollfd listen_fds[2 + UPSTREAM_MAX_LISTENERS];
+        for(size_t i = 0; i < num_listeners; ++i)
+        {
+                listen_fds[i].fd = listeners[i].socket.fd_;
+                listen_fds[i].events = POLLIN;
+        }
+        listen_fds[num_listeners].fd = handoffStopFd();
+        listen_fds[num_listeners].events = POLLIN;
+        size_t next_listener = 0;
 
         while(1)
         {
                 Socket client_sockfd;
                 initSocket(&client_sockfd);
+                struct sockaddr_storage client_addr;
+
+                waitForAdmission();
+
+                /* With several listeners, the ready ones take turns. With a handoff socket the
+                   listeners are non-blocking and the stop pipe is watched as well. */
+                ProxyListener *listener = listeners;
+                if((num_listeners > 1) || (listen_fds[num_listeners].fd != -1))
+                {
+                        if(poll(listen_fds, num_listeners + 1, -1) == -1)
+                        {
+                                if(errno == EINTR)
+                                {
+                                        continue;
+                                }
+                                return -1;
+                        }
+
+                        if(listen_fds[num_listeners].revents != 0)
+                        {
+                                return 0;
+                        }
+
+                        listener = NULL;
+                        for(size_t i = 0; i < num_listeners; ++i)
+                        {
+                                size_t ready = (next_listener + i) % num_listeners;
+                                if(listen_fds[ready].revents & POLLIN)
+                                {
+                                        listener = listeners + ready;
+                                        next_listener = ready + 1;
+                                        break;
+                                }
+                        }
+                        if(listener == NULL)
+                        {
+                                continue;
+                        }
+                }
 
-                if(acceptConnection(listen_sockfd, &client_sockfd) != 0)
+                if(acceptConnection(&(listener->socket), &client_sockfd, &client_addr) != 0)
                 {
+                        // The next proxy process took the connection during the handoff
+                        if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                        {
+                                continue;
+                        }
                         return -1;
                 }
+                uint64_t accept_ns = monotonicNs();
+
+                // Limits are enforced before anything is read from the connection
+                int client_entry;
+                if(acquireClientLimit(&client_addr, accept_ns, &client_entry) != CLIENT_LIMIT_ALLOWED)
+                {
+                        verbosePrintf("Refusing connection, client limit reached\n");
+                        rejectClientConnection(&client_sockfd);
+                        continue;
+                }
+
+                if(admitConnection(accept_ns) != ADMISSION_ADMIT)
+                {
+                        verbosePrintf("Shedding connection, proxy is overloaded\n");
+                        releaseClientLimit(client_entry);
+                        shedConnection(&client_sockfd);
+                        continue;
+                }
+
+                if(proxy_config.verbose)
+                {
+                        char client_str[INET6_ADDRSTRLEN];
+                        inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr),
+                                  client_str, sizeof(client_str));
+                        printf("Received connection from %s\n", client_str);
+                }
 
-                if(!fork())
+                int timeout_slot = claimSessionSlot(accept_ns);
+                pid_t pid = fork();
+                if(!pid)
                 {
                         // Child process
                         int exit_val = 0;
-                        destroySocket(listen_sockfd);
+                        selectStatsShard();
+                        enterSessionSlot(timeout_slot, client_sockfd.fd_);
+                        for(size_t i = 0; i < num_listeners; ++i)
+                        {
+                                destroySocket(&(listeners[i].socket));
+                        }
 
-                        exit_val = clientSession(&client_sockfd);
+                        exit_val = clientSession(&client_sockfd, &client_addr, accept_ns, listener->pool);
 
+                        leaveSessionSlot();
                         destroySocket(&client_sockfd);
                         exit(exit_val);
                 }
                 else
                 {
                         // Parent process
+                        if(pid > 0)
+                        {
+                                armSessionSlot(timeout_slot, pid);
+                                registerClientLimitSession(pid, client_entry);
+                        }
+                        else
+                        {
+                                releaseSessionSlot(timeout_slot);
+                                cancelAdmission();
+                                releaseClientLimit(client_entry);
+                        }
                         destroySocket(&client_sockfd);
                 }
         }
@@ -24,9 +24,26 @@ typedef struct _session_info_
 } SessionInfo;
 
 
+/* ProxyListener struct
+ *
+ * Listening socket of the proxy
+ *
+ * socket -> Socket accepting the connections
+ * pool   -> Upstream pool the requests are sent to, -1 to forward them to the requested host
+ */
+typedef struct _proxy_listener_
+{
+  Socket socket;
+  int pool;
+} ProxyListener;
+
+
 
 int startProxy(const char *port);
 
-int listenLoop(Socket *listen_sockfd);
+int listenLoop(ProxyListener *listeners, size_t num_listeners);
+
+void* controlThread(void *arg);
+int startControlThread(void);
 
 #endif
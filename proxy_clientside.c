@@ -2,24 +2,107 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <time.h>
 
 
 #include "proxy_clientside.h"
 #include "proxy.h"
 #include "util_socket.h"
+#include "config.h"
 #include "midlayer.h"
 #include "serverside.h"
 #include "http.h"
+#include "blocklist.h"
+#include "latency.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "timeout.h"
+#include "eyeballs.h"
+#include "breaker.h"
+#include "upstream.h"
+#include "hedge.h"
+#include "hostlimit.h"
 
 const char *filtered_redirect_url = "HTTP/1.1 301 Moved Permanently\r\nLocation: http://www.ida.liu.se/~TDTS04/labs/2011/ass2/error1.html\r\n\r\n";
+const char *blocked_host_response = "HTTP/1.1 403 Forbidden\r\nContent-Type: text/plain\r\nContent-Length: 27\r\nConnection: close\r\n\r\nHost blocked by the proxy.\n";
 const char *error_entity_too_large = "HTTP/1.1 413 Entity Too Large\r\n\r\n";
+const char *bad_gateway_response = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+const char *gateway_timeout_response = "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+const char *no_upstream_response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 char *conn_est = "HTTP/1.1 200 Connection Established\r\n\r\n";
 const char *HTTP_DEFAULT_PORT = "80";
 
 
 
 
+/* sendCounted
+ *
+ * Send data to a socket and add the number of sent bytes to a traffic counter
+ *
+ * @param socket Socket to send the data to
+ * @param buffer Data to send
+ * @param len Length of the data
+ * @param counter Traffic counter of the direction
+ * @param session_bytes Byte count of the session to add to as well, may be NULL
+ * @ret Length of sent data, -1 on error
+ */
+static ssize_t sendCounted(Socket *socket, const char *buffer, size_t len, ProxyCounter counter,
+                           uint64_t *session_bytes)
+{
+        ssize_t sent = sendData(socket, buffer, len);
+        if(sent > 0)
+        {
+                addProxyCounter(counter, sent);
+                if(session_bytes != NULL)
+                {
+                        *session_bytes += sent;
+                }
+        }
+
+        return sent;
+}
+
+
+/* logSessionAccess
+ *
+ * Complete the access log entry of a session and hand it to the access log
+ *
+ * @param entry Entry with the outcome, client and traffic of the session filled in
+ * @param request_header Request of the session
+ * @param hostname Host name of the request, NULL if no request was read
+ * @param port Port of the request
+ * @param conn_request Whether the request is a CONNECT request
+ * @param accept_ns Monotonic time the client connection was accepted at
+ */
+static void logSessionAccess(AccessLogEntry *entry, const HTTPRequestHeader *request_header,
+                             const char *hostname, const char *port, int conn_request,
+                             uint64_t accept_ns)
+{
+        struct timespec wall_time;
+        clock_gettime(CLOCK_REALTIME, &wall_time);
+
+        entry->duration_ns = monotonicNs() - accept_ns;
+        entry->time_ns = (uint64_t)wall_time.tv_sec * 1000000000ull + wall_time.tv_nsec - entry->duration_ns;
+        entry->pid = (uint32_t)getpid();
+
+        char text[ACCESS_LOG_MAX_TEXT + 1];
+        text[0] = '\0';
+        if(hostname != NULL)
+        {
+                // Requests are logged with the resource path, as they are sent to the server
+                const char *resource = request_header->request_info.resource;
+                if(!conn_request)
+                {
+                        resource = extractResource(resource, hostname, port);
+                }
+                snprintf(text, sizeof(text), "%s %s:%s %s", request_header->request_info.req_type,
+                         hostname, port, resource);
+        }
+
+        logAccess(entry, text);
+}
+
+
 /* checkHeaderExtractHost
  *
  * Check if the target buffer contains a HTTP header. If yes parse the header and extract the 
@@ -167,17 +250,33 @@ const char * extractResource(const char *resource, const char *hostname, const c
  *
  * Start a connection session. Read the HTTP request from the client and forward it to 
  * the server and vice versa.
+ * In reverse proxy mode the server is picked from an upstream pool instead of the Host field,
+ * which is passed on unchanged.
  *
  * @param client_socket Socket with opened client connection
+ * @param client_addr Address of the client
+ * @param accept_ns Monotonic time the client connection was accepted at
+ * @param upstream_pool Upstream pool to send the request to, -1 to forward it to the requested host
  * @ret -1 on error
  */
-int clientSession(Socket *client_socket)
+int clientSession(Socket *client_socket, const struct sockaddr_storage *client_addr, uint64_t accept_ns,
+                  int upstream_pool)
 {
         assert(client_socket != NULL);
         assert(client_socket->open_);
 
         int ret_val = 0;
 
+        uint64_t phase_start_ns = monotonicNs();
+        uint64_t phase_end_ns;
+        recordLatency(LATENCY_ACCEPT, accept_ns, phase_start_ns);
+        addProxyCounter(STAT_SESSIONS_STARTED, 1);
+
+        AccessLogEntry access_entry;
+        memset(&access_entry, 0, sizeof(access_entry));
+        access_entry.outcome = ACCESS_ERROR_CLIENT;
+        setAccessLogClient(&access_entry, client_addr);
+
         // Create and init session info struct
         SessionInfo session_info;
         session_info.client_socket = *client_socket;
@@ -198,9 +297,13 @@ int clientSession(Socket *client_socket)
 
         char *hostname = NULL;
         char *port = NULL;
+        char *request_url = NULL;
+        struct addrinfo *server_addresses = NULL;
 
         int block_request = 0;
         int conn_request = 0;
+        int upstream_server = -1;
+        int host_limit_entry = HOST_LIMIT_UNTRACKED;
 
         int modify_request = 1;
 
@@ -208,8 +311,12 @@ int clientSession(Socket *client_socket)
         {
                 if(!client_socket->open_)
                 {
-                        // Client socket closed before header found
-                        fprintf(stderr, "ERROR: Client socket closed before header was received\n");
+                        // Client socket closed before header found, or shut down by the header timeout
+                        if(sessionTimeout() == SESSION_TIMEOUT_NONE)
+                        {
+                                fprintf(stderr, "ERROR: Client socket closed before header was received\n");
+                                addProxyCounter(STAT_ERRORS_CLIENT, 1);
+                        }
                         ret_val = -1;
                         goto error_header_read;
                 }
@@ -219,7 +326,9 @@ int clientSession(Socket *client_socket)
                         // No space left and header not yet received
                         fprintf(stderr, 
                                 "ERROR: Exceeded max header size without finding HTTP header\n");
-                        sendData(client_socket, error_entity_too_large, strlen(error_entity_too_large));
+                        sendCounted(client_socket, error_entity_too_large, strlen(error_entity_too_large),
+                                    STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
+                        addProxyCounter(STAT_ERRORS_CLIENT, 1);
                         ret_val = -1;
                         goto error_header_read;
                 }
@@ -228,13 +337,19 @@ int clientSession(Socket *client_socket)
                                              header_buffer_len - received_bytes);
                 if(read_stat < 0)
                 {
-                        // Read error
-                        fprintf(stderr, "ERROR: Error while reading from client socket\n");
+                        // Read error, or the socket was shut down by the header timeout, which counted it already
+                        if(sessionTimeout() == SESSION_TIMEOUT_NONE)
+                        {
+                                fprintf(stderr, "ERROR: Error while reading from client socket\n");
+                                addProxyCounter(STAT_ERRORS_CLIENT, 1);
+                        }
                         ret_val = -1;
                         goto error_header_read;
                 }
 
                 received_bytes += read_stat;
+                access_entry.bytes_in += read_stat;
+                addProxyCounter(STAT_CLIENT_BYTES_IN, read_stat);
 
                 // Check for header
                 int header_status = checkHeaderExtractHost(header_buffer, &request_header, 
@@ -242,36 +357,138 @@ int clientSession(Socket *client_socket)
                 header_found = (header_status == 0);
         }
 
+        phase_end_ns = monotonicNs();
+        recordLatency(LATENCY_HEADER, phase_start_ns, phase_end_ns);
+        addProxyCounter(STAT_REQUESTS, 1);
+        access_entry.header_len = headerEndOffset(header_buffer);
+
+        // Check the host before anything else is done with the request, a reverse proxy serves its own hosts
+        if((upstream_pool < 0) && isHostBlocked(acquireBlocklist(), hostname))
+        {
+                verbosePrintf("Host %s is blocked\n", hostname);
+                addProxyCounter(STAT_BLOCKED_HOSTS, 1);
+                access_entry.outcome = ACCESS_BLOCKED_HOST;
+                sendCounted(client_socket, blocked_host_response, strlen(blocked_host_response),
+                            STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
+                ret_val = 0;
+                goto end_url_blocked;
+        }
+
         // Check if request should be blocked
         block_request = applyFilter(header_buffer);
         if(block_request)
         {
                 // Bad words found, block request
-                printf("Found bad words in client request, blocking\n");
-                sendData(client_socket, filtered_redirect_url, strlen(filtered_redirect_url));
+                verbosePrintf("Found bad words in client request, blocking\n");
+                addProxyCounter(STAT_BLOCKED_REQUESTS, 1);
+                access_entry.outcome = ACCESS_BLOCKED_REQUEST;
+                sendCounted(client_socket, filtered_redirect_url, strlen(filtered_redirect_url),
+                            STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
                 ret_val = 0;
                 goto end_url_blocked;
         }
 
+        // Pick the server of a reverse proxied request, the resource decides for the hash policy
+        if(upstream_pool >= 0)
+        {
+                const char *resource = extractResource(request_header.request_info.resource, hostname, port);
+                const char *upstream_host;
+                const char *upstream_port;
+                upstream_server = pickUpstreamServer(upstream_pool, resource, &upstream_host, &upstream_port);
+                if(upstream_server < 0)
+                {
+                        verbosePrintf("No healthy upstream server for %s\n", hostname);
+                        access_entry.outcome = ACCESS_NO_UPSTREAM;
+                        sendCounted(client_socket, no_upstream_response, strlen(no_upstream_response),
+                                    STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
+                        ret_val = -1;
+                        goto error_connection;
+                }
+
+                if((setString(&(request_header.request_info.resource), resource) != 0) ||
+                   (setString(&hostname, upstream_host) != 0) || (setString(&port, upstream_port) != 0))
+                {
+                        addProxyCounter(STAT_ERRORS_INTERNAL, 1);
+                        access_entry.outcome = ACCESS_ERROR_INTERNAL;
+                        ret_val = -1;
+                        goto error_connection;
+                }
+        }
+
+        // Fail fast while the host is known to be down
+        int breaker_timed_out;
+        if(!allowBreakerRequest(hostname, port, &breaker_timed_out))
+        {
+                verbosePrintf("Circuit breaker of host %s port %s is open\n", hostname, port);
+                const char *response = breaker_timed_out ? gateway_timeout_response : bad_gateway_response;
+                access_entry.outcome = ACCESS_BREAKER_OPEN;
+                sendCounted(client_socket, response, strlen(response), STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
+                ret_val = -1;
+                goto error_connection;
+        }
 
         // Have HTTP header and extracted hostname and port
         // Establish connection to server
-        printf("Connecting to host: %s port: %s\n", hostname, port);
+        verbosePrintf("Connecting to host: %s port: %s\n", hostname, port);
+        setSessionPhase(SESSION_PHASE_CONNECT);
+
+        // Wait for a connection slot of the host, the connect timeout answered the client if it ran out
+        if(acquireHostLimit(hostname, port, &host_limit_entry) != 0)
+        {
+                ret_val = -1;
+                goto error_connection;
+        }
+
+        phase_start_ns = monotonicNs();
+        if(resolveServerAddress(hostname, port, &server_addresses) != 0)
+        {
+                fprintf(stderr, "Failed to resolve server address\n");
+                server_addresses = NULL;
+                addProxyCounter(STAT_ERRORS_RESOLVE, 1);
+                reportBreakerResult(hostname, port, BREAKER_FAILURE);
+                access_entry.outcome = ACCESS_ERROR_RESOLVE;
+                sendCounted(client_socket, bad_gateway_response, strlen(bad_gateway_response),
+                            STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
+                ret_val = -1;
+                goto error_connection;
+        }
+        phase_end_ns = monotonicNs();
+        recordLatency(LATENCY_RESOLVE, phase_start_ns, phase_end_ns);
+
         Socket server_socket;
-        int con_stat = initServerConnection(hostname, port, &server_socket);
+        int con_stat = connectHappyEyeballs(server_addresses, &server_socket);
         if(con_stat == -1)
         {
-                fprintf(stderr, "Failed to open connection to server\n");
+                // The connect timeout answered the client already
+                if(sessionTimeout() == SESSION_TIMEOUT_NONE)
+                {
+                        fprintf(stderr, "Failed to open connection to server\n");
+                        addProxyCounter(STAT_ERRORS_CONNECT, 1);
+                        reportBreakerResult(hostname, port, BREAKER_FAILURE);
+                        sendCounted(client_socket, bad_gateway_response, strlen(bad_gateway_response),
+                                    STAT_CLIENT_BYTES_OUT, &(access_entry.bytes_out));
+                }
+                else
+                {
+                        reportBreakerResult(hostname, port, BREAKER_FAILURE_TIMEOUT);
+                }
+                access_entry.outcome = ACCESS_ERROR_CONNECT;
                 ret_val = -1;
                 goto error_connection;
         }
+        phase_start_ns = phase_end_ns;
+        phase_end_ns = monotonicNs();
+        recordLatency(LATENCY_CONNECT, phase_start_ns, phase_end_ns);
+        reportBreakerResult(hostname, port, BREAKER_SUCCESS);
+        setSessionServerSocket(server_socket.fd_);
+        setSessionPhase(SESSION_PHASE_RELAY);
 
 
         // Check if request type is CONNECT
         conn_request = (strstr(request_header.request_info.req_type, "CONNECT") != NULL);
         if(conn_request)
         {
-                printf("CONNECT request\n");
+                verbosePrintf("CONNECT request\n");
                 modify_request = 0;
         }
 
@@ -294,28 +511,65 @@ int clientSession(Socket *client_socket)
                 // Shorten to only contain requested resource
                 const char *extracted_resource = extractResource(request_header.request_info.resource,
                                                                  hostname, port);
-                printf("Requesting resource: %s%s\n", hostname, extracted_resource);
+                verbosePrintf("Requesting resource: %s%s\n", hostname, extracted_resource);
                 setString(&(request_header.request_info.resource), extracted_resource);
+
+                // Only GET responses are identified by their URL for the verdict cache
+                if(strcmp(request_header.request_info.req_type, "GET") == 0)
+                {
+                        size_t url_len = strlen(hostname) + strlen(port) +
+                                         strlen(request_header.request_info.resource) + 2;
+                        request_url = malloc(url_len);
+                        if(request_url != NULL)
+                        {
+                                snprintf(request_url, url_len, "%s:%s%s", hostname, port,
+                                         request_header.request_info.resource);
+                        }
+                }
+        }
+
+
+        /* An idempotent GET without body is sent before the response is read, so a slow server
+           can be hedged with a second connection that takes over the server socket */
+        int hedged_request = 0;
+        if(hedgingEnabled() && (request_url != NULL) && (received_bytes == header_len_pre_modifcation))
+        {
+                char *serialized_request = NULL;
+                size_t serialized_request_length = 0;
+                if(serializeRequestHeader(&request_header, &serialized_request, &serialized_request_length) == 0)
+                {
+                        sendHedgedRequest(&server_socket, server_addresses, hostname, port, serialized_request,
+                                          serialized_request_length);
+                        free(serialized_request);
+                        hedged_request = 1;
+                }
         }
 
 
         // Send connection establised response for CONNECT request
         if(conn_request)
         {
-                sendData(client_socket, conn_est , strlen(conn_est));
+                sendCounted(client_socket, conn_est , strlen(conn_est), STAT_CLIENT_BYTES_OUT,
+                            &(access_entry.bytes_out));
         }
 
 
-        // Create server listener thread
-        ServerListenerEnv s_env;
-        initServerListenerEnv(&s_env, client_socket, &server_socket, !conn_request);
+        access_entry.outcome = conn_request ? ACCESS_TUNNEL : ACCESS_FORWARDED;
 
-        pthread_t server_thread_id;
-        pthread_create(&server_thread_id, NULL, serverListener, &s_env);
+        // A partial response carries the validator of the whole resource, its verdict is not cached
+        const char *verdict_url = (getValue(&(request_header.fields), "Range") == NULL) ? request_url : NULL;
+
+        ServerListenerEnv s_env;
+        initServerListenerEnv(&s_env, client_socket, &server_socket, !conn_request, verdict_url,
+                              phase_end_ns);
 
 
         // Send header data
-        if((modify_request) && (!conn_request))
+        if(hedged_request)
+        {
+                // Sent already
+        }
+        else if((modify_request) && (!conn_request))
         {
                 // Send (modified) header
                 char *serialized_request = NULL;
@@ -324,68 +578,78 @@ int clientSession(Socket *client_socket)
                                           &serialized_request_length) != 0)
                 {
                         fprintf(stderr, "ERROR: Failed to serialize request\n");
+                        addProxyCounter(STAT_ERRORS_INTERNAL, 1);
+                        access_entry.outcome = ACCESS_ERROR_INTERNAL;
                         ret_val = -1;
                         goto error_serialization;
                 }
-                sendData(&server_socket, serialized_request, serialized_request_length);
+                sendCounted(&server_socket, serialized_request, serialized_request_length,
+                            STAT_SERVER_BYTES_OUT, NULL);
                 free(serialized_request);
 
                 // Send already received non-header bytes
-                sendData(&server_socket, header_buffer + header_len_pre_modifcation, 
-                         received_bytes - header_len_pre_modifcation);
+                sendCounted(&server_socket, header_buffer + header_len_pre_modifcation, 
+                            received_bytes - header_len_pre_modifcation, STAT_SERVER_BYTES_OUT, NULL);
         }
         else if(!conn_request)
         {
                 // Send all received bytes
-                sendData(&server_socket, header_buffer, received_bytes);
+                sendCounted(&server_socket, header_buffer, received_bytes, STAT_SERVER_BYTES_OUT, NULL);
         }
 
 
-        // Continuously forward data from client to server
-        while(1)
+        // Relay the response to the client and further request data to the server
+        if(relayServerResponse(&s_env) != 0)
         {
-                pthread_mutex_lock(&(server_socket.mutex_));
-                if(!server_socket.open_)
-                {
-                        pthread_mutex_unlock(&(server_socket.mutex_));
-                        break;
-                }
-                pthread_mutex_unlock(&(server_socket.mutex_));
+                ret_val = -1;
+        }
 
-                pthread_mutex_lock(&(client_socket->mutex_));
-                if(!client_socket->open_)
-                {
-                        pthread_mutex_unlock(&(client_socket->mutex_));
-                        break;
-                }
-                pthread_mutex_unlock(&(client_socket->mutex_));
 
-                char read_buffer[RECEIVE_BUFFER_SIZE];
-                ssize_t read_bytes = readData(client_socket, read_buffer, RECEIVE_BUFFER_SIZE);
-                if(read_bytes == -1)
-                {
-                        ret_val = -1;
-                        break;
-                }
-                if(sendData(&server_socket, read_buffer, read_bytes) == -1)
+        // Cleanup
+error_serialization:
+        access_entry.status = s_env.response_status_;
+        access_entry.bytes_in += s_env.request_bytes_;
+        access_entry.bytes_out += s_env.response_bytes_;
+        if(s_env.first_byte_ns_ != 0)
+        {
+                access_entry.first_byte_ns = s_env.first_byte_ns_ - s_env.connected_ns_;
+                if(request_url != NULL)
                 {
-                        ret_val = -1;
-                        break;
+                        recordFirstByteTime(hostname, port, access_entry.first_byte_ns);
                 }
         }
-
-        
-        
-        // Cleanup
-error_serialization:
-        pthread_join(server_thread_id, NULL);
+        if(s_env.response_blocked_)
+        {
+                access_entry.outcome = ACCESS_BLOCKED_RESPONSE;
+        }
+        else if(s_env.read_error_ && (access_entry.outcome != ACCESS_ERROR_INTERNAL))
+        {
+                access_entry.outcome = ACCESS_ERROR_SERVER;
+        }
         destroyServerListenerEnv(&s_env);
         destroySocket(&server_socket);
 end_url_blocked:
 error_connection:
+error_header_read:
+        if(sessionTimeout() != SESSION_TIMEOUT_NONE)
+        {
+                access_entry.outcome = ACCESS_TIMEOUT;
+        }
+        logSessionAccess(&access_entry, &request_header, hostname, port, conn_request, accept_ns);
+        releaseHostLimit(host_limit_entry);
+        if(upstream_server >= 0)
+        {
+                releaseUpstreamServer(upstream_pool, upstream_server);
+        }
+        free(request_url);
+        if(server_addresses != NULL)
+        {
+                freeaddrinfo(server_addresses);
+        }
         free(hostname);
         free(port);
-error_header_read:
         freeRequestHeader(&request_header);
+        recordLatency(LATENCY_SESSION, accept_ns, monotonicNs());
+        addProxyCounter(STAT_SESSIONS_ENDED, 1);
         return ret_val;
 }
@@ -2,6 +2,8 @@
 #define PROXY_CLIENTSIDE_H
 
 #include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
 
 #include "util_socket.h"
 #include "proxy.h"
@@ -13,6 +15,7 @@ int checkHeaderExtractHost(const char *buffer, HTTPRequestHeader *request_header
 
 const char * extractResource(const char *resource, const char *hostname, const char *port);
 
-int clientSession(Socket *client_sockfd);
+int clientSession(Socket *client_sockfd, const struct sockaddr_storage *client_addr, uint64_t accept_ns,
+                  int upstream_pool);
 
 #endif
@@ -0,0 +1,414 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "relay.h"
+#include "config.h"
+#include "stats.h"
+#include "timeout.h"
+
+
+/* initRelay
+ *
+ * Initialize a relay between the client and the server of a session
+ *
+ * @param relay Relay to initialize
+ * @param client_socket Connection to the client
+ * @param server_socket Connection to the server
+ */
+void initRelay(Relay *relay, Socket *client_socket, Socket *server_socket)
+{
+        assert(relay != NULL);
+        assert(client_socket != NULL);
+        assert(server_socket != NULL);
+
+        relay->client_socket = client_socket;
+        relay->server_socket = server_socket;
+        relay->to_server.start = 0;
+        relay->to_server.len = 0;
+        relay->to_client.start = 0;
+        relay->to_client.len = 0;
+        relay->client_done = 0;
+        relay->client_failed = 0;
+        relay->upload_failed = 0;
+        relay->bytes_in = 0;
+        relay->bytes_out = 0;
+}
+
+
+/* bufferSpace
+ *
+ * Get the free space of a ring buffer that directly follows the buffered data
+ *
+ * @param buffer Ring buffer
+ * @ret len Length of the contiguous free space, 0 if the buffer is full
+ * @ret Start of the free space
+ */
+static char* bufferSpace(RelayBuffer *buffer, size_t *len)
+{
+        size_t end = (buffer->start + buffer->len) % RELAY_BUFFER_SIZE;
+        size_t free_len = RELAY_BUFFER_SIZE - buffer->len;
+
+        *len = (end + free_len > RELAY_BUFFER_SIZE) ? RELAY_BUFFER_SIZE - end : free_len;
+        return buffer->data + end;
+}
+
+
+/* bufferData
+ *
+ * Get the buffered data of a ring buffer up to the end of the ring
+ *
+ * @param buffer Ring buffer
+ * @ret len Length of the contiguous data, 0 if the buffer is empty
+ * @ret Start of the data
+ */
+static const char* bufferData(const RelayBuffer *buffer, size_t *len)
+{
+        *len = (buffer->start + buffer->len > RELAY_BUFFER_SIZE) ? RELAY_BUFFER_SIZE - buffer->start : buffer->len;
+        return buffer->data + buffer->start;
+}
+
+
+/* consumeBuffer
+ *
+ * Drop sent data from the front of a ring buffer
+ *
+ * @param buffer Ring buffer
+ * @param len Number of bytes that were sent
+ */
+static void consumeBuffer(RelayBuffer *buffer, size_t len)
+{
+        buffer->start = (buffer->start + len) % RELAY_BUFFER_SIZE;
+        buffer->len -= len;
+        if(buffer->len == 0)
+        {
+                buffer->start = 0;
+        }
+}
+
+
+/* readClient
+ *
+ * Read request data from the client into the buffer to the server
+ *
+ * @param relay Relay of the session
+ */
+static void readClient(Relay *relay)
+{
+        size_t space_len;
+        char *space = bufferSpace(&(relay->to_server), &space_len);
+
+        ssize_t read_len = recv(relay->client_socket->fd_, space, space_len, MSG_DONTWAIT);
+        if(read_len > 0)
+        {
+                relay->to_server.len += read_len;
+                relay->bytes_in += read_len;
+                addProxyCounter(STAT_CLIENT_BYTES_IN, read_len);
+                touchSession();
+        }
+        else if(read_len == 0)
+        {
+                // The client may still wait for the response after it finished its request
+                relay->client_done = 1;
+        }
+        else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+                relay->client_done = 1;
+                relay->upload_failed = 1;
+        }
+}
+
+
+/* writeServer
+ *
+ * Send buffered request data to the server. Once that fails, the client is not read anymore.
+ *
+ * @param relay Relay of the session
+ */
+static void writeServer(Relay *relay)
+{
+        size_t data_len;
+        const char *data = bufferData(&(relay->to_server), &data_len);
+
+        ssize_t sent = send(relay->server_socket->fd_, data, data_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent > 0)
+        {
+                consumeBuffer(&(relay->to_server), sent);
+                addProxyCounter(STAT_SERVER_BYTES_OUT, sent);
+                touchSession();
+        }
+        else if((sent == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+                relay->to_server.len = 0;
+                relay->client_done = 1;
+                relay->upload_failed = 1;
+        }
+}
+
+
+/* writeClient
+ *
+ * Send buffered response data to the client
+ *
+ * @param relay Relay of the session
+ */
+static void writeClient(Relay *relay)
+{
+        size_t data_len;
+        const char *data = bufferData(&(relay->to_client), &data_len);
+
+        ssize_t sent = send(relay->client_socket->fd_, data, data_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent > 0)
+        {
+                consumeBuffer(&(relay->to_client), sent);
+                relay->bytes_out += sent;
+                addProxyCounter(STAT_CLIENT_BYTES_OUT, sent);
+                touchSession();
+        }
+        else if((sent == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+                relay->to_client.len = 0;
+                relay->client_failed = 1;
+        }
+}
+
+
+/* stepRelay
+ *
+ * Wait until a socket of the relay is ready and move the data it is ready for. The client is
+ * read while the buffer to the server has room, buffered data is sent when its receiver is
+ * writable. The server is only polled, the caller reads it.
+ *
+ * @param relay Relay of the session
+ * @param poll_server Whether to wait for response data from the server as well
+ * @ret server_ready Set if the server has response data or closed the connection
+ * @ret 0 on success
+ *      -1 if the client is gone or the session timed out
+ */
+static int stepRelay(Relay *relay, int poll_server, int *server_ready)
+{
+        *server_ready = 0;
+        if(relay->client_failed)
+        {
+                return -1;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = relay->client_socket->fd_;
+        fds[0].events = 0;
+        if(!relay->client_done && (relay->to_server.len < RELAY_BUFFER_SIZE))
+        {
+                fds[0].events |= POLLIN;
+        }
+        if(relay->to_client.len > 0)
+        {
+                fds[0].events |= POLLOUT;
+        }
+        fds[1].fd = relay->server_socket->fd_;
+        fds[1].events = poll_server ? POLLIN : 0;
+        if(relay->to_server.len > 0)
+        {
+                fds[1].events |= POLLOUT;
+        }
+
+        // A hung up socket is reported without being asked for, so only sockets with work are polled
+        for(int i = 0; i < 2; ++i)
+        {
+                if(fds[i].events == 0)
+                {
+                        fds[i].fd = -1;
+                }
+        }
+
+        if(poll(fds, 2, -1) == -1)
+        {
+                // Interrupted by a signal, a timed out session ends here
+                return ((errno == EINTR) && (sessionTimeout() == SESSION_TIMEOUT_NONE)) ? 0 : -1;
+        }
+
+        if((fds[0].events & POLLIN) && (fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+                readClient(relay);
+        }
+        if((fds[0].events & POLLOUT) && (fds[0].revents & (POLLOUT | POLLHUP | POLLERR)))
+        {
+                writeClient(relay);
+        }
+        if((fds[1].events & POLLOUT) && (fds[1].revents & (POLLOUT | POLLHUP | POLLERR)))
+        {
+                writeServer(relay);
+        }
+        if(poll_server && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+                *server_ready = 1;
+        }
+
+        return relay->client_failed ? -1 : 0;
+}
+
+
+/* flushRelay
+ *
+ * Send all response data queued for the client, relaying request data in the meantime
+ *
+ * @param relay Relay of the session
+ * @ret 0 on success
+ *      -1 if the client is gone or the session timed out
+ */
+static int flushRelay(Relay *relay)
+{
+        while(relay->to_client.len > 0)
+        {
+                int server_ready;
+                if(stepRelay(relay, 0, &server_ready) != 0)
+                {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+
+/* relayResponse
+ *
+ * Relay the session until the response ended: request data from the client goes to the
+ * server, and every piece of response data read from the server is passed to the callback,
+ * which queues what it forwards with relayToClient. The server is only read while the buffer
+ * to the client has room.
+ * The queued response data is sent to the client before the relay returns.
+ *
+ * @param relay Relay of the session
+ * @param callback Callback for response data, called with a length of 0 at the end of the response
+ * @param callback_env Callback environment to simulate closure
+ * @ret 0 when the server ended the response
+ *      -1 if reading the response or sending it to the client failed
+ *      Return value of the callback if it is not 0
+ */
+int relayResponse(Relay *relay, int (*callback)(const char *_response_buffer_, size_t _response_len_,
+                                                void *_callback_env_), void *callback_env)
+{
+        assert(relay != NULL);
+        assert(callback != NULL);
+        assert(callback_env != NULL);
+
+        char read_buffer[RELAY_READ_SIZE];
+
+        while(1)
+        {
+                int server_ready;
+                int poll_server = (relay->to_client.len < RELAY_BUFFER_SIZE);
+                if(stepRelay(relay, poll_server, &server_ready) != 0)
+                {
+                        return -1;
+                }
+                if(!server_ready)
+                {
+                        continue;
+                }
+
+                size_t read_size = RELAY_BUFFER_SIZE - relay->to_client.len;
+                if(read_size > RELAY_READ_SIZE)
+                {
+                        read_size = RELAY_READ_SIZE;
+                }
+
+                ssize_t read_len = recv(relay->server_socket->fd_, read_buffer, read_size, MSG_DONTWAIT);
+                if(read_len == -1)
+                {
+                        if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                        {
+                                continue;
+                        }
+                        fprintf(stderr, "Read error (-1)\n");
+                        return -1;
+                }
+
+                addProxyCounter(STAT_SERVER_BYTES_IN, read_len);
+                if(read_len > 0)
+                {
+                        touchSession();
+                }
+
+                int callback_stat = callback(read_buffer, read_len, callback_env);
+                if((callback_stat != 0) || (read_len == 0))
+                {
+                        if(flushRelay(relay) != 0)
+                        {
+                                return (callback_stat != 0) ? callback_stat : -1;
+                        }
+                        if(callback_stat != 0)
+                        {
+                                verbosePrintf("Aborting read from server because callback returned != 0\n");
+                        }
+                        return callback_stat;
+                }
+        }
+}
+
+
+/* relayToClient
+ *
+ * Queue response data for the client. While the buffer to the client is full, the relay
+ * waits for the client to take data, so the data to queue is never held beyond the buffer.
+ *
+ * @param relay Relay of the session
+ * @param data Data to send
+ * @param len Length of the data
+ * @ret len on success
+ *      -1 if the client is gone or the session timed out
+ */
+ssize_t relayToClient(Relay *relay, const char *data, size_t len)
+{
+        assert(relay != NULL);
+        assert((data != NULL) || (len == 0));
+
+        size_t queued = 0;
+        while(queued < len)
+        {
+                if(relay->client_failed)
+                {
+                        return -1;
+                }
+
+                size_t space_len;
+                char *space = bufferSpace(&(relay->to_client), &space_len);
+                if(space_len > len - queued)
+                {
+                        space_len = len - queued;
+                }
+                memcpy(space, data + queued, space_len);
+                relay->to_client.len += space_len;
+                queued += space_len;
+
+                int server_ready;
+                if((relay->to_client.len == RELAY_BUFFER_SIZE) && (queued < len) &&
+                   (stepRelay(relay, 0, &server_ready) != 0))
+                {
+                        return -1;
+                }
+        }
+
+        return len;
+}
+
+
+/* abortRelayClient
+ *
+ * Send the response data queued for the client and reset the client connection, so the
+ * client can tell the response is incomplete
+ *
+ * @param relay Relay of the session
+ */
+void abortRelayClient(Relay *relay)
+{
+        assert(relay != NULL);
+
+        flushRelay(relay);
+        abortSocket(relay->client_socket);
+        relay->to_client.len = 0;
+        relay->client_failed = 1;
+}
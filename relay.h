@@ -0,0 +1,70 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "util_socket.h"
+
+// Bytes one direction of a relayed connection buffers at most
+#define RELAY_BUFFER_SIZE 16384
+
+// Bytes read from the server at once, at most what fits into the buffer to the client
+#define RELAY_READ_SIZE 8192
+
+
+/* RelayBuffer struct
+ *
+ * Ring buffer of one direction of a relay
+ *
+ * data  -> Buffered bytes
+ * start -> Offset of the first buffered byte in data
+ * len   -> Number of buffered bytes
+ */
+typedef struct _relay_buffer_
+{
+  char data[RELAY_BUFFER_SIZE];
+  size_t start;
+  size_t len;
+} RelayBuffer;
+
+
+/* Relay struct
+ *
+ * Both directions of a session between the client and the server, moved by one thread
+ * polling both sockets. A side is only read while the buffer to the other side has room, and
+ * the buffered data is sent as soon as the other side is writable, so a slow reader holds back
+ * its writer through TCP flow control instead of growing the buffers.
+ *
+ * client_socket -> Connection to the client
+ * server_socket -> Connection to the server
+ * to_server     -> Request data read from the client and not yet sent to the server
+ * to_client     -> Response data queued for the client and not yet sent
+ * client_done   -> The client finished sending, or its data can not be sent to the server
+ * client_failed -> Sending to the client failed, the rest of the response is dropped
+ * upload_failed -> Reading from the client or sending to the server failed
+ * bytes_in      -> Bytes read from the client
+ * bytes_out     -> Bytes sent to the client
+ */
+typedef struct _relay_
+{
+  Socket *client_socket;
+  Socket *server_socket;
+  RelayBuffer to_server;
+  RelayBuffer to_client;
+  int client_done;
+  int client_failed;
+  int upload_failed;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} Relay;
+
+
+void initRelay(Relay *relay, Socket *client_socket, Socket *server_socket);
+
+int relayResponse(Relay *relay, int (*callback)(const char *_response_buffer_, size_t _response_len_,
+                                                void *_callback_env_), void *callback_env);
+ssize_t relayToClient(Relay *relay, const char *data, size_t len);
+void abortRelayClient(Relay *relay);
+
+#endif
@@ -10,62 +10,100 @@
 #include "serverside.h"
 #include "http.h"
 #include "util_socket.h"
+#include "config.h"
 #include "midlayer.h"
+#include "latency.h"
+#include "stats.h"
+#include "relay.h"
 
 
-/* serverListener
+/* relayServerResponse
  *
- * Read the server response and forward it to the client. To be executed in a separate thread.
- * Closes the server socket when response was blocked by the content filter.
+ * Relay the session until the server response ended: the response is forwarded to the client
+ * through the midlayer, and further request data from the client is sent to the server.
+ * Closes the server socket when the response ended or was blocked by the content filter.
  *
- * @param s_env ServerListenerEnv containing references to the client and server sockets as well 
- *              as indicating whether the content filter should be applied to the response
+ * @param env ServerListenerEnv containing references to the client and server sockets as well
+ *            as indicating whether the content filter should be applied to the response
+ * @ret 0 on success
+ *      -1 if reading from the client or sending to the server failed
  */
-void* serverListener(void *s_env)
+int relayServerResponse(ServerListenerEnv *env)
 {
-        assert(s_env != NULL);
-        ServerListenerEnv *env = (ServerListenerEnv *)s_env;
+        assert(env != NULL);
+
+        Relay relay;
+        initRelay(&relay, env->client_socket_, env->server_socket_);
 
-        /* Create callback environment to pass on the client socket and
+        /* Create callback environment to pass on the relay and
            allow the callback to save state between partial reads */
         MidlayerCallbackEnv mid_callback_env;
-        initMidlayerCallbackEnv(&mid_callback_env, env->client_socket_);
+        initMidlayerCallbackEnv(&mid_callback_env, &relay);
 
         if(!env->apply_filter_)
         {
                 mid_callback_env.apply_filter = 0;
         }
+        mid_callback_env.request_url = env->request_url_;
+        mid_callback_env.connected_ns = env->connected_ns_;
+
+        int read_stat = relayResponse(&relay, forwardToClient, &mid_callback_env);
+        if(read_stat == -1)
+        {
+                addProxyCounter(STAT_ERRORS_SERVER, 1);
+        }
 
-        int read_stat = readFromSocket(env->server_socket_, forwardToClient, &mid_callback_env);
-        if(read_stat != 0)
+        env->response_status_ = mid_callback_env.response_status;
+        env->response_bytes_ = relay.bytes_out;
+        env->request_bytes_ = relay.bytes_in;
+        env->first_byte_ns_ = mid_callback_env.first_byte_ns;
+        env->response_blocked_ = mid_callback_env.block_response;
+        env->read_error_ = (read_stat == -1);
+
+        /* Close server socket when the response ended or was blocked, so the client sees the
+           end of a close-delimited response. A blocked response is aborted with a reset, so the
+           server stops sending the rest of it. */
+        if(read_stat == 1)
+        {
+                abortSocket(env->server_socket_);
+        }
+        else
         {
-                // Close server socket
-                pthread_mutex_lock(&(env->server_socket_->mutex_));
                 closeSocket(env->server_socket_);
-                pthread_mutex_unlock(&(env->server_socket_->mutex_));
         }
 
-        // Clean up unneeded resourced from parent process
+        if(mid_callback_env.first_byte_ns != 0)
+        {
+                recordLatency(LATENCY_RELAY, mid_callback_env.first_byte_ns, monotonicNs());
+        }
+        if(mid_callback_env.scanner != NULL)
+        {
+                recordLatencyNs(LATENCY_FILTER, mid_callback_env.filter_cpu_ns);
+        }
 
         destroyMidlayerCallbackEnv(&mid_callback_env);
 
-        return NULL;
+        return relay.upload_failed ? -1 : 0;
 }
 
 
 /* initServerListenerEnv
  *
- * Initialize the environment that is passed to the server listener thread
+ * Initialize the environment of relaying the server response
  *
  * @param env Environment to initialize
  * @param client_socket Pointer to the client socket for the session
  * @param server_socket Pointer to the server socket for the session
  * @param filter Whether the content filter should be applied or not
+ * @param request_url URL of a GET request without Range whose response verdict may be cached, NULL otherwise
+ * @param connected_ns Monotonic time the server connection was established at
  */
 void initServerListenerEnv(ServerListenerEnv *env, 
                            Socket *client_socket, 
                            Socket *server_socket, 
-                           int filter)
+                           int filter,
+                           const char *request_url,
+                           uint64_t connected_ns)
 {
         assert(env != NULL);
         assert(client_socket != NULL);
@@ -74,6 +112,14 @@ void initServerListenerEnv(ServerListenerEnv *env,
         env->client_socket_ = client_socket;
         env->server_socket_ = server_socket;
         env->apply_filter_ = filter;
+        env->request_url_ = request_url;
+        env->connected_ns_ = connected_ns;
+        env->response_status_ = 0;
+        env->response_bytes_ = 0;
+        env->request_bytes_ = 0;
+        env->first_byte_ns_ = 0;
+        env->response_blocked_ = 0;
+        env->read_error_ = 0;
 }
 
 /* destroyServerListenerEnv
@@ -87,65 +133,3 @@ void destroyServerListenerEnv(ServerListenerEnv *env)
 {
         assert(env != NULL);
 }
-
-
-/* readFromSocket
- *
- * Read from the given socket in a loop until it is closed. Call provided callback for every 
- * partial read
- *
- * @param socket_fd Socket to read from
- * @param callback Callback to call when data has been read
- * @param callback_env Callback environment to simulate closure
- */
-int readFromSocket(const Socket *socket_fd, int (*callback)(const char *_response_buffer_, 
-                                                            size_t _response_len_, 
-                                                            void *_callback_env_), 
-                   void *callback_env)
-{
-        assert(socket_fd != NULL);
-        assert(callback != NULL);
-        assert(callback_env != NULL);
-
-        const size_t read_buffer_len = SERVERSIDE_RECEIVE_BUFFER_SIZE;
-        char read_buffer[read_buffer_len + 1];
-        memset(read_buffer, '\0', read_buffer_len + 1);
-        size_t free_len = read_buffer_len;
-        size_t total_len = 0;
-        int read_id = 0;
-
-
-        while(1)
-        {
-                ssize_t read_len = read(socket_fd->fd_, read_buffer + read_buffer_len - free_len , 
-                                        free_len);
-                if(read_len == -1)
-                {
-                        // Error
-                        fprintf(stderr, "Read error (-1)\n");
-                        return -1;
-                }
-
-                // Read successful
-                free_len -= read_len;
-                total_len += read_len;
-
-                // Forward data to client when buffer full or connection closed
-                int callback_stat = callback(read_buffer, read_buffer_len - free_len, callback_env);
-                if(callback_stat != 0)
-                {
-                        printf("Aborting read from server because callback returned != 0\n");
-                        return callback_stat;
-                }
-
-                ++read_id;
-                free_len = read_buffer_len;
-
-
-                if(read_len == 0)
-                {
-                        // Connection closed -> end of data
-                        return 0;
-                }
-        }
-}
@@ -1,21 +1,29 @@
 #ifndef SERVERSIDE_H
 #define SERVERSIDE_H
 
+#include <stdint.h>
+
 #include "http.h"
 #include "util_socket.h"
 
-// Size of the serverside receive buffer
-#define SERVERSIDE_RECEIVE_BUFFER_SIZE 8192
-
 /* ServerListenerEnv struct
  *
- * Struct holding the environment for the serverside listening thread
+ * Struct holding the environment for relaying the server response
  * Holds references to the client and server sockets as well as an indication whether
  * content filter should be applied to the response.
  *
- * client_socket_ -> Pointer to client socket
- * server_socker_ -> Pointer to server socket
- * apply_filter   -> Whether the content filter should be applied
+ * client_socket_   -> Pointer to client socket
+ * server_socker_   -> Pointer to server socket
+ * apply_filter     -> Whether the content filter should be applied
+ * request_url      -> URL of a GET request without Range for the verdict cache, NULL otherwise
+ * connected_ns     -> Monotonic time the server connection was established at
+ * response_status  -> Status code of the response, 0 if none was read (set by the listener)
+ * response_bytes   -> Bytes sent to the client (set by the listener)
+ * request_bytes    -> Bytes read from the client while relaying (set by the listener)
+ * first_byte_ns    -> Monotonic time the first response byte was received at, 0 if none
+ *                     (set by the listener)
+ * response_blocked -> Whether the content filter blocked the response (set by the listener)
+ * read_error       -> Whether reading the response failed (set by the listener)
  *
  */
 typedef struct _server_listener_env_
@@ -23,13 +31,20 @@ typedef struct _server_listener_env_
         Socket *client_socket_;
         Socket *server_socket_;
         int apply_filter_;
+        const char *request_url_;
+        uint64_t connected_ns_;
+        int response_status_;
+        uint64_t response_bytes_;
+        uint64_t request_bytes_;
+        uint64_t first_byte_ns_;
+        int response_blocked_;
+        int read_error_;
 } ServerListenerEnv;
 
-void initServerListenerEnv(ServerListenerEnv *env, Socket *client_socket, Socket *server_socket, int filter);
+void initServerListenerEnv(ServerListenerEnv *env, Socket *client_socket, Socket *server_socket, int filter,
+                           const char *request_url, uint64_t connected_ns);
 void destroyServerListenerEnv(ServerListenerEnv *env);
 
-void* serverListener(void *s_env);
-
-int readFromSocket(const Socket *socket_fd, int (*callback)(const char *_response_buffer_, size_t _response_len_, void *_callback_env_), void *callback_env);
+int relayServerResponse(ServerListenerEnv *env);
 
 #endif
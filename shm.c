@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "shm.h"
+
+
+/* createSharedMemory
+ *
+ * Create a zero filled memory region shared between the proxy process and all sessions
+ * forked from it afterwards
+ *
+ * @param size Size of the region
+ * @ret Start of the region, NULL if it could not be created
+ */
+void * createSharedMemory(size_t size)
+{
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED)
+        {
+                perror("mmap shared memory");
+                return NULL;
+        }
+
+        return memory;
+}
+
+
+/* destroySharedMemory
+ *
+ * Unmap a region created by createSharedMemory
+ *
+ * @param memory Start of the region (can be NULL)
+ * @param size Size of the region
+ */
+void destroySharedMemory(void *memory, size_t size)
+{
+        if(memory != NULL)
+        {
+                munmap(memory, size);
+        }
+}
+
+
+/* readPidMax
+ *
+ * Get the highest process id the kernel hands out
+ *
+ * @ret Highest process id + 1
+ */
+size_t readPidMax(void)
+{
+        // PID_MAX_LIMIT of 64 bit kernels
+        size_t pid_max = 4194304;
+
+        FILE *file = fopen("/proc/sys/kernel/pid_max", "r");
+        if(file != NULL)
+        {
+                unsigned long value;
+                if(fscanf(file, "%lu", &value) == 1)
+                {
+                        pid_max = value;
+                }
+                fclose(file);
+        }
+
+        return pid_max + 1;
+}
+
+
+/* hashHostPort
+ *
+ * Hash host name and port with 64 bit FNV-1a, the key of a host in the shared host tables
+ *
+ * @param hostname Host name of the server
+ * @param port Port of the server
+ * @ret Key of the host, never 0
+ */
+uint64_t hashHostPort(const char *hostname, const char *port)
+{
+        uint64_t hash = 14695981039346656037ull;
+
+        for(const char *c = hostname; *c != '\0'; ++c)
+        {
+                hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+        }
+        hash = (hash ^ ':') * 1099511628211ull;
+        for(const char *c = port; *c != '\0'; ++c)
+        {
+                hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+        }
+
+        return (hash != 0) ? hash : 1;
+}
@@ -0,0 +1,12 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+void * createSharedMemory(size_t size);
+void destroySharedMemory(void *memory, size_t size);
+size_t readPidMax(void);
+uint64_t hashHostPort(const char *hostname, const char *port);
+
+#endif
@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "shm.h"
+#include "latency.h"
+
+
+/* Counter shards of the proxy in shared memory, created before sessions are forked.
+ * NULL until initProxyStats was called, recording is a no-op then.
+ */
+static ProxyStatsShard *proxy_stats = NULL;
+
+// Shard the calling process adds to
+static unsigned int stats_shard = 0;
+
+/* Counter values and time of the previous report, for the rates since then.
+ * Reports may be requested by the control thread and the admin thread.
+ */
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t report_requests = 0;
+static uint64_t report_time_ns = 0;
+
+
+/* initProxyStats
+ *
+ * Create the shared counters of the proxy
+ *
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initProxyStats(void)
+{
+        proxy_stats = createSharedMemory(PROXY_STATS_SHARDS * sizeof(ProxyStatsShard));
+        report_time_ns = monotonicNs();
+
+        return (proxy_stats != NULL) ? 0 : -1;
+}
+
+
+/* selectStatsShard
+ *
+ * Pick the counter shard of the calling process. To be called by every session process
+ * after it was forked.
+ */
+void selectStatsShard(void)
+{
+        stats_shard = (unsigned int)getpid() % PROXY_STATS_SHARDS;
+}
+
+
+/* currentStatsShard
+ *
+ * Get the counter shard of the calling process
+ *
+ * @ret Index of the shard
+ */
+unsigned int currentStatsShard(void)
+{
+        return stats_shard;
+}
+
+
+/* addProxyCounter
+ *
+ * Add to a counter in the shard of the calling process
+ *
+ * @param counter Counter to add to
+ * @param value Value to add
+ */
+void addProxyCounter(ProxyCounter counter, uint64_t value)
+{
+        if(proxy_stats != NULL)
+        {
+                __atomic_fetch_add(&(proxy_stats[stats_shard].counters[counter]), value, __ATOMIC_RELAXED);
+        }
+}
+
+
+/* readProxyCounter
+ *
+ * Get the value of a counter summed over all shards
+ *
+ * @param counter Counter to read
+ * @ret Value of the counter, 0 if the counters were not created
+ */
+uint64_t readProxyCounter(ProxyCounter counter)
+{
+        if(proxy_stats == NULL)
+        {
+                return 0;
+        }
+
+        uint64_t value = 0;
+        for(unsigned int shard = 0; shard < PROXY_STATS_SHARDS; ++shard)
+        {
+                value += __atomic_load_n(&(proxy_stats[shard].counters[counter]), __ATOMIC_RELAXED);
+        }
+
+        return value;
+}
+
+
+/* recordEarlyAbort
+ *
+ * Count a blocked response whose download was stopped before the end
+ *
+ * @param bytes_saved Body bytes that were not downloaded, -1 if the length of the body is unknown
+ * @param ns_saved Estimated download time saved
+ */
+void recordEarlyAbort(ssize_t bytes_saved, uint64_t ns_saved)
+{
+        addProxyCounter(STAT_EARLY_ABORTS, 1);
+        if(bytes_saved < 0)
+        {
+                addProxyCounter(STAT_ABORT_UNKNOWN_LENGTH, 1);
+        }
+        else
+        {
+                addProxyCounter(STAT_ABORT_BYTES_SAVED, bytes_saved);
+                addProxyCounter(STAT_ABORT_NS_SAVED, ns_saved);
+        }
+}
+
+
+/* printProxyStats
+ *
+ * Print the counters of the proxy. The request rate is the one since the previous report.
+ *
+ * @param out Stream to print to
+ */
+void printProxyStats(FILE *out)
+{
+        if(proxy_stats == NULL)
+        {
+                return;
+        }
+
+        uint64_t requests = readProxyCounter(STAT_REQUESTS);
+        uint64_t started = readProxyCounter(STAT_SESSIONS_STARTED);
+        uint64_t ended = readProxyCounter(STAT_SESSIONS_ENDED);
+
+        pthread_mutex_lock(&report_mutex);
+        uint64_t now_ns = monotonicNs();
+        double interval_s = (now_ns - report_time_ns) / 1e9;
+        double request_rate = (interval_s > 0) ? (requests - report_requests) / interval_s : 0;
+        report_requests = requests;
+        report_time_ns = now_ns;
+        pthread_mutex_unlock(&report_mutex);
+
+        fprintf(out, "Sessions: %lu active, %lu total\n",
+                (started > ended) ? started - ended : 0, started);
+        fprintf(out, "Requests: %lu total, %.1f/s over the last %.1f s\n",
+                requests, request_rate, interval_s);
+        fprintf(out, "Traffic: client %lu bytes in, %lu bytes out; server %lu bytes in, %lu bytes out\n",
+                readProxyCounter(STAT_CLIENT_BYTES_IN), readProxyCounter(STAT_CLIENT_BYTES_OUT),
+                readProxyCounter(STAT_SERVER_BYTES_IN), readProxyCounter(STAT_SERVER_BYTES_OUT));
+        fprintf(out, "Errors: %lu client, %lu resolve, %lu connect, %lu server, %lu internal\n",
+                readProxyCounter(STAT_ERRORS_CLIENT), readProxyCounter(STAT_ERRORS_RESOLVE),
+                readProxyCounter(STAT_ERRORS_CONNECT), readProxyCounter(STAT_ERRORS_SERVER),
+                readProxyCounter(STAT_ERRORS_INTERNAL));
+        fprintf(out, "Connect: %lu attempts, %lu failed, %lu fallbacks to another address\n",
+                readProxyCounter(STAT_CONNECT_ATTEMPTS), readProxyCounter(STAT_CONNECT_ATTEMPTS_FAILED),
+                readProxyCounter(STAT_CONNECT_FALLBACKS));
+        fprintf(out, "Breakers: %lu opened, %lu half-opened, %lu closed, %lu requests failed fast\n",
+                readProxyCounter(STAT_BREAKER_OPENED), readProxyCounter(STAT_BREAKER_HALF_OPENED),
+                readProxyCounter(STAT_BREAKER_CLOSED), readProxyCounter(STAT_BREAKER_REJECTED));
+        fprintf(out, "Host limits: %lu sessions waited, %lu timed out waiting, %lu slots reclaimed, %lu untracked\n",
+                readProxyCounter(STAT_HOST_LIMIT_QUEUED), readProxyCounter(STAT_HOST_LIMIT_ABANDONED),
+                readProxyCounter(STAT_HOST_LIMIT_RECLAIMED), readProxyCounter(STAT_HOST_LIMIT_UNTRACKED));
+        uint64_t hedge_eligible = readProxyCounter(STAT_HEDGE_ELIGIBLE);
+        uint64_t hedges = readProxyCounter(STAT_HEDGES);
+        uint64_t hedge_wins = readProxyCounter(STAT_HEDGE_WINS);
+        fprintf(out, "Hedging: %lu requests, %lu hedged (%.2f%%), %lu won by the hedge (%.1f%%), %lu over budget\n",
+                hedge_eligible, hedges, hedge_eligible ? 100.0 * hedges / hedge_eligible : 0.0, hedge_wins,
+                hedges ? 100.0 * hedge_wins / hedges : 0.0, readProxyCounter(STAT_HEDGE_OVER_BUDGET));
+        fprintf(out, "Upstreams: %lu servers marked down, %lu marked up, %lu failed health checks, "
+                "%lu requests without healthy server, %lu connections reclaimed\n",
+                readProxyCounter(STAT_UPSTREAM_DOWN), readProxyCounter(STAT_UPSTREAM_UP),
+                readProxyCounter(STAT_UPSTREAM_CHECKS_FAILED), readProxyCounter(STAT_UPSTREAM_UNAVAILABLE),
+                readProxyCounter(STAT_UPSTREAM_RECLAIMED));
+        fprintf(out, "Filter: %lu hosts blocked, %lu requests blocked, %lu responses blocked, "
+                "%lu streamed over the hold-back limit\n",
+                readProxyCounter(STAT_BLOCKED_HOSTS), readProxyCounter(STAT_BLOCKED_REQUESTS),
+                readProxyCounter(STAT_BLOCKED_RESPONSES), readProxyCounter(STAT_STREAMED_RESPONSES));
+        fprintf(out, "Filter: %lu responses aborted early (%lu of unknown length), saved %lu bytes, "
+                "~%.2f ms of download\n",
+                readProxyCounter(STAT_EARLY_ABORTS), readProxyCounter(STAT_ABORT_UNKNOWN_LENGTH),
+                readProxyCounter(STAT_ABORT_BYTES_SAVED), readProxyCounter(STAT_ABORT_NS_SAVED) / 1e6);
+        fprintf(out, "Access log: %lu records written, %lu dropped\n",
+                readProxyCounter(STAT_ACCESS_LOG_RECORDS), readProxyCounter(STAT_ACCESS_LOG_DROPPED));
+        fprintf(out, "Timeouts: %lu header, %lu connect, %lu idle, %lu total, %lu killed, %lu untracked\n",
+                readProxyCounter(STAT_TIMEOUTS_HEADER), readProxyCounter(STAT_TIMEOUTS_CONNECT),
+                readProxyCounter(STAT_TIMEOUTS_IDLE), readProxyCounter(STAT_TIMEOUTS_TOTAL),
+                readProxyCounter(STAT_TIMEOUT_KILLS), readProxyCounter(STAT_TIMEOUT_UNTRACKED));
+        fprintf(out, "Shed: %lu at max sessions, %lu at max queue delay, %lu deferrals\n",
+                readProxyCounter(STAT_ADMISSION_SHED_FULL), readProxyCounter(STAT_ADMISSION_SHED_QUEUE),
+                readProxyCounter(STAT_ADMISSION_DEFERRED));
+        fprintf(out, "Client limits: %lu refused at max connections, %lu at max rate, %lu untracked\n",
+                readProxyCounter(STAT_CLIENT_LIMIT_CONNECTIONS), readProxyCounter(STAT_CLIENT_LIMIT_RATE),
+                readProxyCounter(STAT_CLIENT_LIMIT_UNTRACKED));
+}
@@ -0,0 +1,169 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Number of counter shards, sessions pick theirs by process id
+#define PROXY_STATS_SHARDS 16
+
+// Size of a cache line, shards never share one
+#define STATS_CACHE_LINE 64
+
+
+/* ProxyCounter
+ *
+ * Counters of the proxy, summed over all sessions
+ *
+ * STAT_SESSIONS_STARTED     -> Client connections whose session started
+ * STAT_SESSIONS_ENDED       -> Sessions that ended
+ * STAT_REQUESTS             -> Requests whose header was read completely
+ * STAT_CLIENT_BYTES_IN      -> Bytes received from clients
+ * STAT_CLIENT_BYTES_OUT     -> Bytes sent to clients
+ * STAT_SERVER_BYTES_IN      -> Bytes received from servers
+ * STAT_SERVER_BYTES_OUT     -> Bytes sent to servers
+ * STAT_BLOCKED_HOSTS        -> Requests refused because of the blocklist
+ * STAT_BLOCKED_REQUESTS     -> Requests blocked by the content filter
+ * STAT_BLOCKED_RESPONSES    -> Responses blocked by the content filter
+ * STAT_STREAMED_RESPONSES   -> Filtered responses forwarded while scanned because their body exceeded max_held_body
+ * STAT_EARLY_ABORTS         -> Blocked responses whose download was stopped before the end
+ * STAT_ABORT_BYTES_SAVED    -> Body bytes not downloaded because of early aborts (known lengths only)
+ * STAT_ABORT_UNKNOWN_LENGTH -> Early aborts of responses without a Content-Length
+ * STAT_ABORT_NS_SAVED       -> Estimated download time saved by early aborts
+ * STAT_VERDICT_LOOKUPS      -> Responses with a validator that were looked up in the verdict cache
+ * STAT_VERDICT_HITS         -> Lookups that found a clean verdict
+ * STAT_VERDICT_STORES       -> Clean verdicts stored
+ * STAT_BYPASSED_BYTES       -> Response bytes streamed through unfiltered because of a verdict hit
+ * STAT_FILTERED_BYTES       -> Response body bytes that went through the filter
+ * STAT_FILTER_CPU_NS        -> CPU time spent decoding and scanning the filtered bytes
+ * STAT_ERRORS_CLIENT        -> Sessions that failed reading a request from the client
+ * STAT_ERRORS_RESOLVE       -> Server names that could not be resolved
+ * STAT_ERRORS_CONNECT       -> Servers that could not be connected to
+ * STAT_CONNECT_ATTEMPTS     -> Connection attempts to server addresses
+ * STAT_CONNECT_ATTEMPTS_FAILED -> Connection attempts that were refused or timed out
+ * STAT_CONNECT_FALLBACKS    -> Server connections established to another than the first tried address
+ * STAT_BREAKER_OPENED       -> Circuit breakers that opened after failures or a failed probe
+ * STAT_BREAKER_HALF_OPENED  -> Circuit breakers that let a probe through after their open period
+ * STAT_BREAKER_CLOSED       -> Circuit breakers that closed after a successful connect
+ * STAT_BREAKER_REJECTED     -> Requests failed fast because the breaker of their host was open
+ * STAT_HOST_LIMIT_QUEUED    -> Sessions that waited for a connection slot of their server host
+ * STAT_HOST_LIMIT_ABANDONED -> Sessions that timed out waiting for a connection slot
+ * STAT_HOST_LIMIT_RECLAIMED -> Slots or tickets released for sessions that were killed
+ * STAT_HOST_LIMIT_UNTRACKED -> Sessions not limited because the host table was full
+ * STAT_HEDGE_ELIGIBLE       -> GET requests without body that could be hedged
+ * STAT_HEDGES               -> Requests sent a second time because the server was slow to answer
+ * STAT_HEDGE_WINS           -> Hedged requests whose second connection answered first
+ * STAT_HEDGE_OVER_BUDGET    -> Slow requests not hedged because the hedge budget was used up
+ * STAT_UPSTREAM_UNAVAILABLE -> Reverse proxy requests answered with 503 because their pool had no healthy server
+ * STAT_UPSTREAM_CHECKS_FAILED -> Health checks of upstream servers that failed
+ * STAT_UPSTREAM_DOWN        -> Upstream servers marked down after failed health checks
+ * STAT_UPSTREAM_UP          -> Upstream servers marked up again after passed health checks
+ * STAT_UPSTREAM_RECLAIMED   -> Upstream connections released for sessions that were killed
+ * STAT_ERRORS_SERVER        -> Responses that failed reading from the server or had no valid header
+ * STAT_ERRORS_INTERNAL      -> Sessions that failed inside the proxy (allocation, serialization)
+ * STAT_ACCESS_LOG_RECORDS   -> Access log records written to the log file
+ * STAT_ACCESS_LOG_DROPPED   -> Access log records dropped because no ring had room or the claim timed out
+ * STAT_TIMEOUTS_HEADER      -> Sessions whose client did not send the request header in time
+ * STAT_TIMEOUTS_CONNECT     -> Sessions that could not connect to the server in time
+ * STAT_TIMEOUTS_IDLE        -> Sessions that relayed no data for longer than the idle timeout
+ * STAT_TIMEOUTS_TOTAL       -> Sessions that took longer than the request timeout
+ * STAT_TIMEOUT_KILLS        -> Timed out sessions killed because they did not end in time
+ * STAT_TIMEOUT_UNTRACKED    -> Sessions started without timeouts because all slots were taken
+ * STAT_ADMISSION_SHED_FULL  -> Connections answered with 503 because max sessions were running
+ * STAT_ADMISSION_SHED_QUEUE -> Connections answered with 503 because the accept queue delay was too long
+ * STAT_ADMISSION_DEFERRED   -> Times the proxy stopped accepting until a session ended
+ * STAT_CLIENT_LIMIT_CONNECTIONS -> Connections refused because their client had too many open
+ * STAT_CLIENT_LIMIT_RATE    -> Connections refused because their client exceeded its request rate
+ * STAT_CLIENT_LIMIT_UNTRACKED -> Connections not counted for their client because the table was full
+ */
+typedef enum _proxy_counter_
+{
+  STAT_SESSIONS_STARTED,
+  STAT_SESSIONS_ENDED,
+  STAT_REQUESTS,
+  STAT_CLIENT_BYTES_IN,
+  STAT_CLIENT_BYTES_OUT,
+  STAT_SERVER_BYTES_IN,
+  STAT_SERVER_BYTES_OUT,
+  STAT_BLOCKED_HOSTS,
+  STAT_BLOCKED_REQUESTS,
+  STAT_BLOCKED_RESPONSES,
+  STAT_STREAMED_RESPONSES,
+  STAT_EARLY_ABORTS,
+  STAT_ABORT_BYTES_SAVED,
+  STAT_ABORT_UNKNOWN_LENGTH,
+  STAT_ABORT_NS_SAVED,
+  STAT_VERDICT_LOOKUPS,
+  STAT_VERDICT_HITS,
+  STAT_VERDICT_STORES,
+  STAT_BYPASSED_BYTES,
+  STAT_FILTERED_BYTES,
+  STAT_FILTER_CPU_NS,
+  STAT_ERRORS_CLIENT,
+  STAT_ERRORS_RESOLVE,
+  STAT_ERRORS_CONNECT,
+  STAT_CONNECT_ATTEMPTS,
+  STAT_CONNECT_ATTEMPTS_FAILED,
+  STAT_CONNECT_FALLBACKS,
+  STAT_BREAKER_OPENED,
+  STAT_BREAKER_HALF_OPENED,
+  STAT_BREAKER_CLOSED,
+  STAT_BREAKER_REJECTED,
+  STAT_HOST_LIMIT_QUEUED,
+  STAT_HOST_LIMIT_ABANDONED,
+  STAT_HOST_LIMIT_RECLAIMED,
+  STAT_HOST_LIMIT_UNTRACKED,
+  STAT_HEDGE_ELIGIBLE,
+  STAT_HEDGES,
+  STAT_HEDGE_WINS,
+  STAT_HEDGE_OVER_BUDGET,
+  STAT_UPSTREAM_UNAVAILABLE,
+  STAT_UPSTREAM_CHECKS_FAILED,
+  STAT_UPSTREAM_DOWN,
+  STAT_UPSTREAM_UP,
+  STAT_UPSTREAM_RECLAIMED,
+  STAT_ERRORS_SERVER,
+  STAT_ERRORS_INTERNAL,
+  STAT_ACCESS_LOG_RECORDS,
+  STAT_ACCESS_LOG_DROPPED,
+  STAT_TIMEOUTS_HEADER,
+  STAT_TIMEOUTS_CONNECT,
+  STAT_TIMEOUTS_IDLE,
+  STAT_TIMEOUTS_TOTAL,
+  STAT_TIMEOUT_KILLS,
+  STAT_TIMEOUT_UNTRACKED,
+  STAT_ADMISSION_SHED_FULL,
+  STAT_ADMISSION_SHED_QUEUE,
+  STAT_ADMISSION_DEFERRED,
+  STAT_CLIENT_LIMIT_CONNECTIONS,
+  STAT_CLIENT_LIMIT_RATE,
+  STAT_CLIENT_LIMIT_UNTRACKED,
+  STAT_NUM_COUNTERS
+} ProxyCounter;
+
+
+/* ProxyStatsShard struct
+ *
+ * One shard of the proxy counters. Every session only adds to its own shard, so concurrent
+ * sessions rarely write to the same cache line. Readers sum up all shards.
+ *
+ * counters -> Counter values, indexed by ProxyCounter
+ */
+typedef struct __attribute__((aligned(STATS_CACHE_LINE))) _proxy_stats_shard_
+{
+  uint64_t counters[STAT_NUM_COUNTERS];
+} ProxyStatsShard;
+
+
+int initProxyStats(void);
+void selectStatsShard(void);
+unsigned int currentStatsShard(void);
+
+void addProxyCounter(ProxyCounter counter, uint64_t value);
+uint64_t readProxyCounter(ProxyCounter counter);
+
+void recordEarlyAbort(ssize_t bytes_saved, uint64_t ns_saved);
+void printProxyStats(FILE *out);
+
+#endif
@@ -0,0 +1,726 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "timeout.h"
+#include "timerwheel.h"
+#include "config.h"
+#include "latency.h"
+#include "shm.h"
+
+
+/* Slots of all sessions in shared memory, created before sessions are forked.
+ * NULL while all timeouts are disabled, the session functions are no-ops then.
+ */
+static SessionSlot *session_slots = NULL;
+
+// Timers of the slots and the free slots, only used by the proxy process under the mutex
+static TimerWheel session_wheel;
+static pthread_mutex_t session_wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *free_slots = NULL;
+static uint32_t num_free_slots = 0;
+static uint32_t num_used_slots = 0;
+
+/* Slot + 1 of every running session, indexed by process id, only used by the proxy process.
+ * The SIGCHLD handler swaps the value of a reaped session for 0, or for SESSION_PID_REAPED if
+ * the session ended before it was registered. While a thread signals a session, the value
+ * carries SESSION_PID_SIGNALLING and the handler waits with reaping until the signal was sent,
+ * so a process id is never signalled after it was reaped and possibly handed out again.
+ */
+static int32_t *session_pids = NULL;
+static size_t max_session_pid = 0;
+
+// Marks a session that ended before it was registered
+#define SESSION_PID_REAPED -1
+
+// Marks a session that is registered without a slot
+#define SESSION_PID_NO_SLOT (1 << 29)
+
+// Set in the value of a session while a thread sends it a signal
+#define SESSION_PID_SIGNALLING (1 << 30)
+
+/* Longest time a slot goes unchecked. Shorter than every timeout, so a deadline of a phase
+ * that starts after a check is never missed.
+ */
+static uint64_t check_interval_ms = 0;
+
+// Slot and sockets of the calling session process, used by the signal handler
+static int session_slot = -1;
+static volatile int session_client_fd = -1;
+static volatile int session_server_fd = -1;
+
+// Responses sent to the client when its session times out before a response was forwarded
+static const char header_timeout_response[] =
+        "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char connect_timeout_response[] =
+        "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+
+/* monotonicMs
+ *
+ * Get the current time of the monotonic clock in milliseconds
+ */
+static uint64_t monotonicMs(void)
+{
+        return monotonicNs() / 1000000;
+}
+
+
+/* msToTick
+ *
+ * Get the first tick at or after a time
+ *
+ * @param ms Monotonic time in milliseconds
+ * @ret Tick of the session wheel
+ */
+static uint64_t msToTick(uint64_t ms)
+{
+        return (ms + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS;
+}
+
+
+/* sessionTimeoutHandler
+ *
+ * Handler of SIGUSR2, sent by the timer thread to a timed out session. Shuts the sockets of the
+ * session down, so blocked reads return and the session ends through its regular paths. A
+ * session that has not forwarded a response yet answers the client with 408 or 504 first.
+ *
+ * @param sig Unused
+ */
+static void sessionTimeoutHandler(int sig)
+{
+        (void)sig;
+
+        int saved_errno = errno;
+        int client_fd = session_client_fd;
+        int server_fd = session_server_fd;
+
+        if((session_slots != NULL) && (session_slot != -1) && (client_fd != -1))
+        {
+                uint32_t phase = __atomic_load_n(&(session_slots[session_slot].phase), __ATOMIC_RELAXED);
+                if(phase == SESSION_PHASE_HEADER)
+                {
+                        send(client_fd, header_timeout_response, sizeof(header_timeout_response) - 1,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+                }
+                else if(phase == SESSION_PHASE_CONNECT)
+                {
+                        send(client_fd, connect_timeout_response, sizeof(connect_timeout_response) - 1,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+                }
+        }
+
+        if(server_fd != -1)
+        {
+                shutdown(server_fd, SHUT_RDWR);
+        }
+        if(client_fd != -1)
+        {
+                shutdown(client_fd, SHUT_RDWR);
+        }
+
+        errno = saved_errno;
+}
+
+
+/* sessionDeadline
+ *
+ * Get the deadline of a session from the timestamps in its slot
+ *
+ * @param slot Slot of the session
+ * @ret timeout SessionTimeout that expires at the deadline
+ * @ret Monotonic deadline in milliseconds, UINT64_MAX if no timeout applies
+ */
+static uint64_t sessionDeadline(const SessionSlot *slot, SessionTimeout *timeout)
+{
+        uint32_t phase = __atomic_load_n(&(slot->phase), __ATOMIC_ACQUIRE);
+        uint64_t phase_ms = __atomic_load_n(&(slot->phase_ms), __ATOMIC_RELAXED);
+        uint64_t deadline = UINT64_MAX;
+        *timeout = SESSION_TIMEOUT_NONE;
+
+        if((phase == SESSION_PHASE_HEADER) && (proxy_config.header_timeout != 0))
+        {
+                deadline = phase_ms + proxy_config.header_timeout * 1000ull;
+                *timeout = SESSION_TIMEOUT_HEADER;
+        }
+        else if((phase == SESSION_PHASE_CONNECT) && (proxy_config.connect_timeout != 0))
+        {
+                deadline = phase_ms + proxy_config.connect_timeout * 1000ull;
+                *timeout = SESSION_TIMEOUT_CONNECT;
+        }
+        else if((phase == SESSION_PHASE_RELAY) && (proxy_config.idle_timeout != 0))
+        {
+                deadline = __atomic_load_n(&(slot->activity_ms), __ATOMIC_RELAXED) +
+                           proxy_config.idle_timeout * 1000ull;
+                *timeout = SESSION_TIMEOUT_IDLE;
+        }
+
+        if(proxy_config.request_timeout != 0)
+        {
+                uint64_t total_deadline = slot->start_ms + proxy_config.request_timeout * 1000ull;
+                if(total_deadline < deadline)
+                {
+                        deadline = total_deadline;
+                        *timeout = SESSION_TIMEOUT_TOTAL;
+                }
+        }
+
+        return deadline;
+}
+
+
+/* freeSessionSlot
+ *
+ * Stop the timer of a slot and put the slot back on the free list.
+ * Called with the wheel mutex held.
+ *
+ * @param id Index of the slot
+ */
+static void freeSessionSlot(uint32_t id)
+{
+        cancelTimer(&session_wheel, id);
+        __atomic_store_n(&(session_slots[id].pid), 0, __ATOMIC_RELAXED);
+        free_slots[num_free_slots++] = id;
+}
+
+
+/* signalSession
+ *
+ * Send a signal to a session, unless the session was already reaped.
+ * The calling thread has to block SIGCHLD, the handler would wait for it forever otherwise.
+ *
+ * @param pid Process id of the session
+ * @param value Value of the session in the map, its slot + 1 or SESSION_PID_NO_SLOT
+ * @param sig Signal to send
+ * @ret 0 if the signal was sent
+ *      -1 if the session already ended
+ */
+static int signalSession(int32_t pid, int32_t value, int sig)
+{
+        if((pid <= 0) || ((size_t)pid >= max_session_pid))
+        {
+                return -1;
+        }
+
+        int32_t *session = session_pids + pid;
+        int32_t expected = value;
+        while(!__atomic_compare_exchange_n(session, &expected, value | SESSION_PID_SIGNALLING, 1,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+                // Another thread is signalling the session, anything else means it was reaped
+                if((expected != value) && (expected != (value | SESSION_PID_SIGNALLING)))
+                {
+                        return -1;
+                }
+                expected = value;
+        }
+
+        int retval = kill(pid, sig);
+        __atomic_store_n(session, value, __ATOMIC_SEQ_CST);
+
+        return retval;
+}
+
+
+/* scheduleSessionCheck
+ *
+ * Schedule the next check of a slot at its deadline, but no later than the check interval.
+ * Called with the wheel mutex held.
+ *
+ * @param id Index of the slot
+ * @param now_ms Current monotonic time in milliseconds
+ */
+static void scheduleSessionCheck(uint32_t id, uint64_t now_ms)
+{
+        SessionTimeout timeout;
+        uint64_t deadline = sessionDeadline(session_slots + id, &timeout);
+        uint64_t check_ms = now_ms + check_interval_ms;
+
+        scheduleTimer(&session_wheel, id, msToTick((deadline < check_ms) ? deadline : check_ms));
+}
+
+
+/* checkSessionSlot
+ *
+ * Timer callback of a slot. Frees the slot of an ended session, signals a session whose
+ * deadline passed and kills a session that did not end within the grace period after that.
+ * Sessions that are still within their deadline, and untracked sessions without pid, are
+ * checked again later.
+ *
+ * @param wheel Session wheel
+ * @param id Index of the slot
+ * @param env Unused
+ */
+static void checkSessionSlot(TimerWheel *wheel, uint32_t id, void *env)
+{
+        (void)wheel;
+        (void)env;
+
+        SessionSlot *slot = session_slots + id;
+        int32_t pid = __atomic_load_n(&(slot->pid), __ATOMIC_RELAXED);
+        uint64_t now_ms = monotonicMs();
+
+        if(__atomic_load_n(&(slot->phase), __ATOMIC_ACQUIRE) == SESSION_PHASE_DONE)
+        {
+                freeSessionSlot(id);
+                return;
+        }
+
+        if(pid == 0)
+        {
+                // Untracked session, only wait for it to end its slot
+                scheduleTimer(&session_wheel, id, msToTick(now_ms + check_interval_ms));
+                return;
+        }
+
+        if(__atomic_load_n(&(slot->timeout), __ATOMIC_RELAXED) != SESSION_TIMEOUT_NONE)
+        {
+                // Grace period is over
+                if(signalSession(pid, id + 1, SIGKILL) == 0)
+                {
+                        addProxyCounter(STAT_TIMEOUT_KILLS, 1);
+                }
+                freeSessionSlot(id);
+                return;
+        }
+
+        SessionTimeout timeout;
+        uint64_t deadline = sessionDeadline(slot, &timeout);
+        if(now_ms < deadline)
+        {
+                scheduleSessionCheck(id, now_ms);
+                return;
+        }
+
+        __atomic_store_n(&(slot->timeout), timeout, __ATOMIC_RELAXED);
+        if(signalSession(pid, id + 1, SIGUSR2) != 0)
+        {
+                // The session died without ending its slot
+                freeSessionSlot(id);
+                return;
+        }
+        addProxyCounter(STAT_TIMEOUTS_HEADER + timeout - SESSION_TIMEOUT_HEADER, 1);
+        scheduleTimer(&session_wheel, id, msToTick(now_ms + TIMEOUT_KILL_GRACE_MS));
+}
+
+
+/* blockSessionReaping
+ *
+ * Block or unblock SIGCHLD in the calling thread, around signalling sessions
+ *
+ * @param block True to block
+ */
+static void blockSessionReaping(int block)
+{
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+
+/* sessionTimerThread
+ *
+ * Advance the session wheel every tick
+ *
+ * @param arg Unused
+ */
+void* sessionTimerThread(void *arg)
+{
+        (void)arg;
+
+        // Sessions are only reaped by other threads, while this one is not signalling them
+        blockSessionReaping(1);
+
+        uint64_t tick = monotonicMs() / TIMEOUT_TICK_MS;
+
+        while(1)
+        {
+                ++tick;
+                struct timespec wake_time;
+                wake_time.tv_sec = tick * TIMEOUT_TICK_MS / 1000;
+                wake_time.tv_nsec = (tick * TIMEOUT_TICK_MS % 1000) * 1000000L;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, NULL);
+
+                pthread_mutex_lock(&session_wheel_mutex);
+                advanceTimerWheel(&session_wheel, monotonicMs() / TIMEOUT_TICK_MS, checkSessionSlot, NULL);
+                pthread_mutex_unlock(&session_wheel_mutex);
+        }
+
+        return NULL;
+}
+
+
+/* initSessionTimeouts
+ *
+ * Create the map of running sessions, and unless all timeouts are disabled the session slots
+ * in shared memory. Installs the timeout signal handler that sessions inherit and starts the
+ * timer thread.
+ *
+ * @ret 0 on success
+ *      -1 if the slots could not be created or the thread could not be started
+ */
+int initSessionTimeouts(void)
+{
+        unsigned int timeouts[4] = {proxy_config.header_timeout, proxy_config.connect_timeout,
+                                    proxy_config.idle_timeout, proxy_config.request_timeout};
+
+        // The sessions are known without timeouts as well, to kill them at the end of a handoff
+        max_session_pid = readPidMax();
+        session_pids = mmap(NULL, max_session_pid * sizeof(int32_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(session_pids == MAP_FAILED)
+        {
+                perror("mmap session pids");
+                session_pids = NULL;
+                return -1;
+        }
+
+        check_interval_ms = 0;
+        for(int i = 0; i < 4; ++i)
+        {
+                if((timeouts[i] != 0) && ((check_interval_ms == 0) || (timeouts[i] * 1000ull < check_interval_ms)))
+                {
+                        check_interval_ms = timeouts[i] * 1000ull;
+                }
+        }
+        if(check_interval_ms == 0)
+        {
+                return 0;
+        }
+
+        free_slots = malloc(TIMEOUT_SESSION_SLOTS * sizeof(uint32_t));
+        if(free_slots == NULL)
+        {
+                goto error_free_slots;
+        }
+        if(initTimerWheel(&session_wheel, TIMEOUT_SESSION_SLOTS, monotonicMs() / TIMEOUT_TICK_MS) != 0)
+        {
+                goto error_wheel;
+        }
+
+        session_slots = createSharedMemory(TIMEOUT_SESSION_SLOTS * sizeof(SessionSlot));
+        if(session_slots == NULL)
+        {
+                goto error_slots;
+        }
+
+        // Without SA_RESTART, so a blocking connect of the session is interrupted
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = sessionTimeoutHandler;
+        sigemptyset(&action.sa_mask);
+        if(sigaction(SIGUSR2, &action, NULL) != 0)
+        {
+                goto error_thread;
+        }
+
+        pthread_t timer_thread_id;
+        if(pthread_create(&timer_thread_id, NULL, sessionTimerThread, NULL) != 0)
+        {
+                goto error_thread;
+        }
+        pthread_detach(timer_thread_id);
+
+        return 0;
+
+error_thread:
+        destroySharedMemory(session_slots, TIMEOUT_SESSION_SLOTS * sizeof(SessionSlot));
+        session_slots = NULL;
+error_slots:
+        destroyTimerWheel(&session_wheel);
+error_wheel:
+        free(free_slots);
+        free_slots = NULL;
+error_free_slots:
+        munmap(session_pids, max_session_pid * sizeof(int32_t));
+        session_pids = NULL;
+        return -1;
+}
+
+
+/* claimSessionSlot
+ *
+ * Take a free slot for a connection about to be handed to a session, called by the proxy
+ * process before the session is forked
+ *
+ * @param accept_ns Monotonic time the connection was accepted at
+ * @ret Index of the slot, -1 if timeouts are disabled or all slots are taken
+ */
+int claimSessionSlot(uint64_t accept_ns)
+{
+        if(session_slots == NULL)
+        {
+                return -1;
+        }
+
+        int slot = -1;
+        pthread_mutex_lock(&session_wheel_mutex);
+        if(num_free_slots != 0)
+        {
+                slot = free_slots[--num_free_slots];
+        }
+        else if(num_used_slots < TIMEOUT_SESSION_SLOTS)
+        {
+                slot = num_used_slots++;
+        }
+        pthread_mutex_unlock(&session_wheel_mutex);
+
+        if(slot == -1)
+        {
+                addProxyCounter(STAT_TIMEOUT_UNTRACKED, 1);
+                return -1;
+        }
+
+        SessionSlot *session = session_slots + slot;
+        session->start_ms = accept_ns / 1000000;
+        session->phase_ms = session->start_ms;
+        session->activity_ms = session->start_ms;
+        session->timeout = SESSION_TIMEOUT_NONE;
+        __atomic_store_n(&(session->phase), SESSION_PHASE_HEADER, __ATOMIC_RELEASE);
+
+        return slot;
+}
+
+
+/* armSessionSlot
+ *
+ * Start watching the slot of a forked session. Every forked session has to be registered,
+ * with or without a slot.
+ *
+ * @param slot Index of the slot, -1 for none
+ * @param pid Process id of the session
+ */
+void armSessionSlot(int slot, int32_t pid)
+{
+        if(session_pids == NULL)
+        {
+                return;
+        }
+        if((size_t)pid >= max_session_pid)
+        {
+                /* The session can not be told apart from a later one, it is never signalled and runs
+                   without timeouts. It still uses its slot, which is freed once the session ends it. */
+                if(slot != -1)
+                {
+                        addProxyCounter(STAT_TIMEOUT_UNTRACKED, 1);
+                        pthread_mutex_lock(&session_wheel_mutex);
+                        scheduleTimer(&session_wheel, slot, msToTick(monotonicMs() + check_interval_ms));
+                        pthread_mutex_unlock(&session_wheel_mutex);
+                }
+                return;
+        }
+
+        if(slot != -1)
+        {
+                __atomic_store_n(&(session_slots[slot].pid), pid, __ATOMIC_RELAXED);
+        }
+
+        int32_t expected = 0;
+        int32_t value = (slot == -1) ? SESSION_PID_NO_SLOT : slot + 1;
+        if(!__atomic_compare_exchange_n(session_pids + pid, &expected, value, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+                // Already reaped, the slot is only freed
+                __atomic_store_n(session_pids + pid, 0, __ATOMIC_SEQ_CST);
+                if(slot != -1)
+                {
+                        __atomic_store_n(&(session_slots[slot].phase), SESSION_PHASE_DONE, __ATOMIC_RELEASE);
+                }
+        }
+
+        if(slot == -1)
+        {
+                return;
+        }
+
+        pthread_mutex_lock(&session_wheel_mutex);
+        scheduleSessionCheck(slot, monotonicMs());
+        pthread_mutex_unlock(&session_wheel_mutex);
+}
+
+
+/* releaseSessionSlot
+ *
+ * Give back a slot whose session could not be forked
+ *
+ * @param slot Index of the slot, -1 for none
+ */
+void releaseSessionSlot(int slot)
+{
+        if(slot == -1)
+        {
+                return;
+        }
+
+        pthread_mutex_lock(&session_wheel_mutex);
+        freeSessionSlot(slot);
+        pthread_mutex_unlock(&session_wheel_mutex);
+}
+
+
+/* timeoutSessionEnded
+ *
+ * End the slot of a reaped session, so its process id is never signalled again. Waits while
+ * another thread is signalling the session, so the session has to be reaped afterwards.
+ * Async-signal-safe, called by the SIGCHLD handler.
+ *
+ * @param pid Process id of the session, not reaped yet
+ */
+void timeoutSessionEnded(pid_t pid)
+{
+        if((session_pids == NULL) || ((size_t)pid >= max_session_pid))
+        {
+                return;
+        }
+
+        int32_t *session = session_pids + pid;
+        int32_t value = __atomic_load_n(session, __ATOMIC_SEQ_CST);
+        while(1)
+        {
+                if((value > 0) && (value & SESSION_PID_SIGNALLING))
+                {
+                        // The signalling thread never runs this handler, it finishes soon
+                        value = __atomic_load_n(session, __ATOMIC_SEQ_CST);
+                        continue;
+                }
+
+                int32_t replacement = (value == 0) ? SESSION_PID_REAPED : 0;
+                if(__atomic_compare_exchange_n(session, &value, replacement, 1,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                {
+                        break;
+                }
+        }
+
+        if((value > 0) && (value != SESSION_PID_NO_SLOT))
+        {
+                __atomic_store_n(&(session_slots[value - 1].phase), SESSION_PHASE_DONE, __ATOMIC_RELEASE);
+        }
+}
+
+
+/* killSessions
+ *
+ * Kill all sessions that are still running
+ */
+void killSessions(void)
+{
+        if(session_pids == NULL)
+        {
+                return;
+        }
+
+        // Only the pages of process ids that were in use are backed, the rest reads as zero
+        blockSessionReaping(1);
+        for(size_t pid = 1; pid < max_session_pid; ++pid)
+        {
+                int32_t value = __atomic_load_n(session_pids + pid, __ATOMIC_SEQ_CST) & ~SESSION_PID_SIGNALLING;
+                if(value > 0)
+                {
+                        signalSession(pid, value, SIGKILL);
+                }
+        }
+        blockSessionReaping(0);
+}
+
+
+/* enterSessionSlot
+ *
+ * Take over the slot claimed for the calling session process
+ *
+ * @param slot Index of the slot, -1 for none
+ * @param client_fd Socket of the client connection
+ */
+void enterSessionSlot(int slot, int client_fd)
+{
+        session_slot = slot;
+        session_client_fd = client_fd;
+        session_server_fd = -1;
+}
+
+
+/* leaveSessionSlot
+ *
+ * End the slot of the calling session process, the timer thread frees it
+ */
+void leaveSessionSlot(void)
+{
+        session_client_fd = -1;
+        session_server_fd = -1;
+
+        if((session_slots != NULL) && (session_slot != -1))
+        {
+                __atomic_store_n(&(session_slots[session_slot].phase), SESSION_PHASE_DONE, __ATOMIC_RELEASE);
+        }
+        session_slot = -1;
+}
+
+
+/* setSessionPhase
+ *
+ * Enter the next phase of the calling session, its timeout starts now
+ *
+ * @param phase SessionPhase that starts
+ */
+void setSessionPhase(SessionPhase phase)
+{
+        if((session_slots == NULL) || (session_slot == -1))
+        {
+                return;
+        }
+
+        SessionSlot *slot = session_slots + session_slot;
+        uint64_t now_ms = monotonicMs();
+        __atomic_store_n(&(slot->phase_ms), now_ms, __ATOMIC_RELAXED);
+        __atomic_store_n(&(slot->activity_ms), now_ms, __ATOMIC_RELAXED);
+        __atomic_store_n(&(slot->phase), phase, __ATOMIC_RELEASE);
+}
+
+
+/* setSessionServerSocket
+ *
+ * Register the server socket of the calling session, it is shut down on a timeout as well
+ *
+ * @param server_fd Socket of the server connection, -1 for none
+ */
+void setSessionServerSocket(int server_fd)
+{
+        session_server_fd = server_fd;
+}
+
+
+/* touchSession
+ *
+ * Note that the calling session relayed data, which restarts its idle timeout.
+ * Only stores the time, the timer thread picks it up when it checks the slot.
+ */
+void touchSession(void)
+{
+        if((session_slots != NULL) && (session_slot != -1))
+        {
+                __atomic_store_n(&(session_slots[session_slot].activity_ms), monotonicMs(), __ATOMIC_RELAXED);
+        }
+}
+
+
+/* sessionTimeout
+ *
+ * Get the timeout that expired for the calling session
+ *
+ * @ret SessionTimeout of the session, SESSION_TIMEOUT_NONE if it did not time out
+ */
+SessionTimeout sessionTimeout(void)
+{
+        if((session_slots == NULL) || (session_slot == -1))
+        {
+                return SESSION_TIMEOUT_NONE;
+        }
+
+        return __atomic_load_n(&(session_slots[session_slot].timeout), __ATOMIC_RELAXED);
+}
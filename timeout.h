@@ -0,0 +1,97 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+// Number of session slots, sessions beyond it run without timeouts
+#define TIMEOUT_SESSION_SLOTS 262144
+
+// Resolution of the timeouts in milliseconds
+#define TIMEOUT_TICK_MS 100
+
+// Milliseconds a timed out session gets to end itself before it is killed
+#define TIMEOUT_KILL_GRACE_MS 2000
+
+
+/* SessionPhase
+ *
+ * Phase of a session, every phase has its own timeout
+ *
+ * SESSION_PHASE_HEADER  -> Reading the request header (header timeout)
+ * SESSION_PHASE_CONNECT -> Resolving and connecting to the server (connect timeout)
+ * SESSION_PHASE_RELAY   -> Relaying data between client and server (idle timeout)
+ * SESSION_PHASE_DONE    -> Session ended, the slot can be reused
+ */
+typedef enum _session_phase_
+{
+  SESSION_PHASE_HEADER,
+  SESSION_PHASE_CONNECT,
+  SESSION_PHASE_RELAY,
+  SESSION_PHASE_DONE
+} SessionPhase;
+
+
+/* SessionTimeout
+ *
+ * Timeout that ended a session
+ *
+ * SESSION_TIMEOUT_NONE    -> No timeout expired
+ * SESSION_TIMEOUT_HEADER  -> The request header was not complete in time
+ * SESSION_TIMEOUT_CONNECT -> The server could not be connected to in time
+ * SESSION_TIMEOUT_IDLE    -> No data was relayed for too long
+ * SESSION_TIMEOUT_TOTAL   -> The whole session took too long
+ */
+typedef enum _session_timeout_
+{
+  SESSION_TIMEOUT_NONE,
+  SESSION_TIMEOUT_HEADER,
+  SESSION_TIMEOUT_CONNECT,
+  SESSION_TIMEOUT_IDLE,
+  SESSION_TIMEOUT_TOTAL
+} SessionTimeout;
+
+
+/* SessionSlot struct
+ *
+ * State of a session in shared memory. The session only stores timestamps, the timer thread
+ * of the proxy process derives the deadline from them when the timer of the slot expires.
+ *
+ * pid         -> Process id of the session, 0 if the slot is free
+ * phase       -> SessionPhase of the session
+ * timeout     -> SessionTimeout that expired, set by the timer thread
+ * start_ms    -> Monotonic time the connection was accepted at
+ * phase_ms    -> Monotonic time the current phase started at
+ * activity_ms -> Monotonic time data was last relayed at
+ */
+typedef struct _session_slot_
+{
+  int32_t pid;
+  uint32_t phase;
+  uint32_t timeout;
+  uint64_t start_ms;
+  uint64_t phase_ms;
+  uint64_t activity_ms;
+} __attribute__((aligned(STATS_CACHE_LINE))) SessionSlot;
+
+
+int initSessionTimeouts(void);
+
+int claimSessionSlot(uint64_t accept_ns);
+void armSessionSlot(int slot, int32_t pid);
+void releaseSessionSlot(int slot);
+void timeoutSessionEnded(pid_t pid);
+void killSessions(void);
+
+void enterSessionSlot(int slot, int client_fd);
+void leaveSessionSlot(void);
+void setSessionPhase(SessionPhase phase);
+void setSessionServerSocket(int server_fd);
+void touchSession(void);
+SessionTimeout sessionTimeout(void);
+
+void* sessionTimerThread(void *arg);
+
+#endif
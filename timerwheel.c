@@ -0,0 +1,257 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+
+/* initTimerWheel
+ *
+ * Initialize a timer wheel without pending timers
+ *
+ * @param wheel Wheel to initialize
+ * @param capacity Number of timers, ids go from 0 to capacity - 1
+ * @param tick Current tick
+ * @ret 0 on success, -1 if the timers could not be allocated
+ */
+int initTimerWheel(TimerWheel *wheel, uint32_t capacity, uint64_t tick)
+{
+        assert(wheel != NULL);
+
+        wheel->timers = calloc(capacity, sizeof(TimerNode));
+        if(wheel->timers == NULL)
+        {
+                return -1;
+        }
+
+        wheel->capacity = capacity;
+        memset(wheel->buckets, 0, sizeof(wheel->buckets));
+        wheel->tick = tick;
+
+        return 0;
+}
+
+
+/* destroyTimerWheel
+ *
+ * Free the timers of a wheel
+ *
+ * @param wheel Wheel to destroy
+ */
+void destroyTimerWheel(TimerWheel *wheel)
+{
+        assert(wheel != NULL);
+
+        free(wheel->timers);
+        wheel->timers = NULL;
+        wheel->capacity = 0;
+}
+
+
+/* linkTimer
+ *
+ * Put a timer into the bucket for its expiry, relative to the current tick of the wheel
+ *
+ * @param wheel Wheel to put the timer into
+ * @param id Id of the timer, must not be pending
+ */
+static void linkTimer(TimerWheel *wheel, uint32_t id)
+{
+        TimerNode *timer = wheel->timers + id;
+
+        // Expired timers go into the bucket processed next
+        if(timer->expires < wheel->tick)
+        {
+                timer->expires = wheel->tick;
+        }
+        uint64_t delay = timer->expires - wheel->tick;
+        if(delay > TIMER_WHEEL_MAX_DELAY)
+        {
+                delay = TIMER_WHEEL_MAX_DELAY;
+                timer->expires = wheel->tick + delay;
+        }
+
+        unsigned int level = 0;
+        while(delay >= (1ull << ((level + 1) * TIMER_WHEEL_BITS)))
+        {
+                ++level;
+        }
+
+        uint32_t bucket = level * TIMER_WHEEL_SLOTS +
+                          ((timer->expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+
+        timer->bucket = bucket + 1;
+        timer->prev = 0;
+        timer->next = wheel->buckets[bucket];
+        if(timer->next != 0)
+        {
+                wheel->timers[timer->next - 1].prev = id + 1;
+        }
+        wheel->buckets[bucket] = id + 1;
+}
+
+
+/* unlinkTimer
+ *
+ * Take a pending timer out of its bucket
+ *
+ * @param wheel Wheel of the timer
+ * @param id Id of the timer
+ */
+static void unlinkTimer(TimerWheel *wheel, uint32_t id)
+{
+        TimerNode *timer = wheel->timers + id;
+
+        if(timer->prev != 0)
+        {
+                wheel->timers[timer->prev - 1].next = timer->next;
+        }
+        else
+        {
+                wheel->buckets[timer->bucket - 1] = timer->next;
+        }
+        if(timer->next != 0)
+        {
+                wheel->timers[timer->next - 1].prev = timer->prev;
+        }
+
+        timer->next = 0;
+        timer->prev = 0;
+        timer->bucket = 0;
+}
+
+
+/* scheduleTimer
+ *
+ * Let a timer expire at the given tick, replacing its previous expiry if it is pending.
+ * Ticks in the past expire with the next processed tick.
+ *
+ * @param wheel Wheel of the timer
+ * @param id Id of the timer
+ * @param expires Tick the timer expires at
+ */
+void scheduleTimer(TimerWheel *wheel, uint32_t id, uint64_t expires)
+{
+        assert(wheel != NULL);
+        assert(id < wheel->capacity);
+
+        if(wheel->timers[id].bucket != 0)
+        {
+                unlinkTimer(wheel, id);
+        }
+
+        wheel->timers[id].expires = expires;
+        linkTimer(wheel, id);
+}
+
+
+/* cancelTimer
+ *
+ * Stop a timer if it is pending
+ *
+ * @param wheel Wheel of the timer
+ * @param id Id of the timer
+ */
+void cancelTimer(TimerWheel *wheel, uint32_t id)
+{
+        assert(wheel != NULL);
+        assert(id < wheel->capacity);
+
+        if(wheel->timers[id].bucket != 0)
+        {
+                unlinkTimer(wheel, id);
+        }
+}
+
+
+/* isTimerPending
+ *
+ * Check if a timer is scheduled and did not expire yet
+ *
+ * @param wheel Wheel of the timer
+ * @param id Id of the timer
+ * @ret True if the timer is pending
+ */
+int isTimerPending(const TimerWheel *wheel, uint32_t id)
+{
+        assert(wheel != NULL);
+        assert(id < wheel->capacity);
+
+        return wheel->timers[id].bucket != 0;
+}
+
+
+/* cascadeBucket
+ *
+ * Move the timers of a bucket of a higher level to the buckets matching their remaining delay
+ *
+ * @param wheel Wheel of the bucket
+ * @param bucket Index of the bucket
+ */
+static void cascadeBucket(TimerWheel *wheel, uint32_t bucket)
+{
+        uint32_t next = wheel->buckets[bucket];
+        wheel->buckets[bucket] = 0;
+
+        while(next != 0)
+        {
+                uint32_t id = next - 1;
+                next = wheel->timers[id].next;
+                linkTimer(wheel, id);
+        }
+}
+
+
+/* advanceTimerWheel
+ *
+ * Process all ticks up to and including the given one and call the callback for every
+ * timer that expired. Every processed tick costs O(1) plus the expired and cascaded timers.
+ *
+ * @param wheel Wheel to advance
+ * @param now Current tick
+ * @param callback Function called for every expired timer
+ * @param env Environment passed to the callback
+ */
+void advanceTimerWheel(TimerWheel *wheel, uint64_t now, TimerCallback callback, void *env)
+{
+        assert(wheel != NULL);
+        assert(callback != NULL);
+
+        while(wheel->tick <= now)
+        {
+                uint32_t index = wheel->tick & TIMER_WHEEL_MASK;
+
+                // Level 0 wrapped around, bring the timers of the next level slot down
+                if(index == 0)
+                {
+                        for(unsigned int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+                        {
+                                uint32_t level_index = (wheel->tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+                                cascadeBucket(wheel, level * TIMER_WHEEL_SLOTS + level_index);
+                                if(level_index != 0)
+                                {
+                                        break;
+                                }
+                        }
+                }
+
+                /* Move the expired timers to their own list before the tick is advanced, so timers
+                   scheduled by the callbacks never end up in the list that is being processed. */
+                uint32_t next = wheel->buckets[index];
+                wheel->buckets[index] = 0;
+                wheel->buckets[TIMER_WHEEL_EXPIRED] = next;
+                while(next != 0)
+                {
+                        wheel->timers[next - 1].bucket = TIMER_WHEEL_EXPIRED + 1;
+                        next = wheel->timers[next - 1].next;
+                }
+                ++wheel->tick;
+
+                while(wheel->buckets[TIMER_WHEEL_EXPIRED] != 0)
+                {
+                        uint32_t id = wheel->buckets[TIMER_WHEEL_EXPIRED] - 1;
+                        unlinkTimer(wheel, id);
+                        callback(wheel, id, env);
+                }
+        }
+}
@@ -0,0 +1,79 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+// Levels of the wheel, every level covers TIMER_WHEEL_SLOTS times the range of the one below
+#define TIMER_WHEEL_LEVELS 4
+
+// Slots per level (power of two)
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Longest delay in ticks, timers further in the future are clamped to it
+#define TIMER_WHEEL_MAX_DELAY ((1ull << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+// Bucket holding the timers that expired in the tick being processed
+#define TIMER_WHEEL_EXPIRED (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+
+
+/* TimerNode struct
+ *
+ * Timer of the wheel. Timers are identified by their index, links are stored as index + 1
+ * so a zeroed node is a timer that is not pending.
+ *
+ * next    -> Index + 1 of the next timer in the bucket, 0 at the end
+ * prev    -> Index + 1 of the previous timer in the bucket, 0 for the first
+ * bucket  -> Index + 1 of the bucket the timer is in, 0 if it is not pending
+ * expires -> Tick the timer expires at
+ */
+typedef struct _timer_node_
+{
+  uint32_t next;
+  uint32_t prev;
+  uint32_t bucket;
+  uint64_t expires;
+} TimerNode;
+
+
+/* TimerWheel struct
+ *
+ * Hierarchical timer wheel with O(1) scheduling and cancelling. Level 0 has a bucket per tick,
+ * timers on higher levels are cascaded down when level 0 wraps around.
+ *
+ * timers   -> Timers, indexed by their id
+ * capacity -> Number of timers
+ * buckets  -> Index + 1 of the first timer of every bucket, 0 if the bucket is empty
+ * tick     -> Next tick to be processed
+ */
+typedef struct _timer_wheel_
+{
+  TimerNode *timers;
+  uint32_t capacity;
+  uint32_t buckets[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS + 1];
+  uint64_t tick;
+} TimerWheel;
+
+
+/* TimerCallback
+ *
+ * Called for every expired timer. The callback may schedule the timer again.
+ *
+ * @param wheel Wheel of the timer
+ * @param id Id of the expired timer
+ * @param env Environment passed to advanceTimerWheel
+ */
+typedef void (*TimerCallback)(TimerWheel *wheel, uint32_t id, void *env);
+
+
+int initTimerWheel(TimerWheel *wheel, uint32_t capacity, uint64_t tick);
+void destroyTimerWheel(TimerWheel *wheel);
+
+void scheduleTimer(TimerWheel *wheel, uint32_t id, uint64_t expires);
+void cancelTimer(TimerWheel *wheel, uint32_t id);
+int isTimerPending(const TimerWheel *wheel, uint32_t id);
+
+void advanceTimerWheel(TimerWheel *wheel, uint64_t now, TimerCallback callback, void *env);
+
+#endif
@@ -0,0 +1,858 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "upstream.h"
+#include "latency.h"
+#include "shm.h"
+#include "stats.h"
+
+// Longest line of the upstream configuration file
+#define UPSTREAM_LINE_SIZE 512
+
+
+/* Pools in shared memory, created before sessions are forked.
+ * NULL while no upstream configuration is loaded.
+ */
+static UpstreamPool *upstream_pools = NULL;
+static size_t num_upstream_pools = 0;
+
+/* Pool * UPSTREAM_MAX_SERVERS + server + 1 of the connection a session counts, indexed by process
+ * id, in shared memory. Sessions set and clear their own value, the SIGCHLD handler releases
+ * what a killed session left behind. Only the pages of process ids in use are ever touched.
+ */
+static int32_t *session_upstream_servers = NULL;
+static size_t max_session_pid = 0;
+
+// Listeners of the pools, only used by the proxy process
+static UpstreamListener upstream_listeners[UPSTREAM_MAX_LISTENERS];
+static size_t num_upstream_listeners = 0;
+
+// State of the random numbers of the least connections policy, seeded per session process
+static uint64_t random_state = 0;
+
+// Names of the policies, in the order of UpstreamPolicy
+static const char *upstream_policy_names[] = {"round-robin", "least-conn", "hash"};
+
+
+/* hashString
+ *
+ * Hash a string with 64 bit FNV-1a
+ *
+ * @param str String to hash
+ * @param seed Start value, different seeds give independent hashes
+ * @ret Hash of the string
+ */
+static uint64_t hashString(const char *str, uint64_t seed)
+{
+        uint64_t hash = seed;
+
+        for(const char *c = str; *c != '\0'; ++c)
+        {
+                hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+        }
+
+        // FNV mixes the last bytes poorly into the high bits
+        hash ^= hash >> 32;
+        hash *= 0xd6e8feb86659fd93ull;
+        hash ^= hash >> 32;
+
+        return hash;
+}
+
+
+/* nextRandom
+ *
+ * Get the next random number of the session process (xorshift64*)
+ *
+ * @ret Random number
+ */
+static uint64_t nextRandom(void)
+{
+        if(random_state == 0)
+        {
+                random_state = (monotonicNs() ^ ((uint64_t)getpid() << 32)) | 1;
+        }
+
+        random_state ^= random_state >> 12;
+        random_state ^= random_state << 25;
+        random_state ^= random_state >> 27;
+
+        return random_state * 2685821657736338717ull;
+}
+
+
+/* buildMaglevTable
+ *
+ * Fill a consistent hash table with the healthy servers of a pool. Every server walks the table
+ * in its own permutation, derived from its address, and the servers take turns claiming their
+ * next free entry. Every server ends up with nearly the same share of entries, and a server
+ * going down only moves the entries it owned plus a few others.
+ *
+ * @param pool Pool whose servers are placed
+ * @param healthy_servers Indexes of the healthy servers
+ * @param num_healthy Number of healthy servers, at least 1
+ * @ret table Table with UPSTREAM_MAGLEV_SIZE entries to fill
+ */
+static void buildMaglevTable(const UpstreamPool *pool, const uint8_t *healthy_servers, uint32_t num_healthy,
+                             uint8_t *table)
+{
+        uint32_t offset[UPSTREAM_MAX_SERVERS];
+        uint32_t skip[UPSTREAM_MAX_SERVERS];
+        uint32_t next[UPSTREAM_MAX_SERVERS];
+
+        for(uint32_t i = 0; i < num_healthy; ++i)
+        {
+                const UpstreamServer *server = pool->servers + healthy_servers[i];
+                uint64_t hash = hashString(server->port, hashString(server->host, 14695981039346656037ull));
+                offset[i] = (hash >> 32) % UPSTREAM_MAGLEV_SIZE;
+                skip[i] = (hash & 0xffffffffu) % (UPSTREAM_MAGLEV_SIZE - 1) + 1;
+                next[i] = 0;
+        }
+
+        memset(table, UPSTREAM_MAGLEV_EMPTY, UPSTREAM_MAGLEV_SIZE);
+
+        uint32_t filled = 0;
+        while(1)
+        {
+                for(uint32_t i = 0; i < num_healthy; ++i)
+                {
+                        uint32_t entry;
+                        do
+                        {
+                                entry = (offset[i] + (uint64_t)next[i] * skip[i]) % UPSTREAM_MAGLEV_SIZE;
+                                ++next[i];
+                        } while(table[entry] != UPSTREAM_MAGLEV_EMPTY);
+
+                        table[entry] = healthy_servers[i];
+                        if(++filled == UPSTREAM_MAGLEV_SIZE)
+                        {
+                                return;
+                        }
+                }
+        }
+}
+
+
+/* publishHealthyServers
+ *
+ * Rebuild the healthy list and the hash table of a pool from the health of its servers.
+ * Sessions picking a server meanwhile see the odd sequence and retry.
+ *
+ * @param pool Pool to rebuild
+ */
+static void publishHealthyServers(UpstreamPool *pool)
+{
+        static uint8_t table[UPSTREAM_MAGLEV_SIZE];
+        uint8_t healthy_servers[UPSTREAM_MAX_SERVERS];
+        uint32_t num_healthy = 0;
+
+        for(uint32_t i = 0; i < pool->num_servers; ++i)
+        {
+                if(__atomic_load_n(&(pool->servers[i].healthy), __ATOMIC_RELAXED))
+                {
+                        healthy_servers[num_healthy++] = i;
+                }
+        }
+
+        if((pool->policy == UPSTREAM_HASH) && (num_healthy > 0))
+        {
+                buildMaglevTable(pool, healthy_servers, num_healthy, table);
+        }
+
+        uint32_t sequence = __atomic_load_n(&(pool->sequence), __ATOMIC_RELAXED);
+        __atomic_store_n(&(pool->sequence), sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        __atomic_store_n(&(pool->num_healthy), num_healthy, __ATOMIC_RELAXED);
+        for(uint32_t i = 0; i < num_healthy; ++i)
+        {
+                __atomic_store_n(pool->healthy_servers + i, healthy_servers[i], __ATOMIC_RELAXED);
+        }
+        if((pool->policy == UPSTREAM_HASH) && (num_healthy > 0))
+        {
+                memcpy(pool->maglev, table, UPSTREAM_MAGLEV_SIZE);
+        }
+
+        __atomic_store_n(&(pool->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+/* findPool
+ *
+ * Find a pool by name among the pools parsed so far
+ *
+ * @ret Index of the pool, -1 if there is none of that name
+ */
+static int findPool(const UpstreamPool *pools, size_t num_pools, const char *name)
+{
+        for(size_t i = 0; i < num_pools; ++i)
+        {
+                if(strcmp(pools[i].name, name) == 0)
+                {
+                        return i;
+                }
+        }
+
+        return -1;
+}
+
+
+/* isPortNumber
+ *
+ * Check if a string is a port number that fits the configuration
+ */
+static int isPortNumber(const char *str)
+{
+        size_t len = strlen(str);
+        if((len == 0) || (len >= UPSTREAM_PORT_SIZE))
+        {
+                return 0;
+        }
+
+        return strspn(str, "0123456789") == len;
+}
+
+
+/* parseUpstreamLine
+ *
+ * Parse one line of the upstream configuration into the pools and listeners
+ *
+ * @param line Line without comment, modified by the function
+ * @param pools Pools parsed so far
+ * @param num_pools Number of pools parsed so far, updated by the function
+ * @ret 0 on success, -1 with an error printed if the line is invalid
+ */
+static int parseUpstreamLine(char *line, UpstreamPool *pools, size_t *num_pools)
+{
+        char *save;
+        char *words[5];
+        size_t num_words = 0;
+
+        for(char *word = strtok_r(line, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save))
+        {
+                if(num_words == 5)
+                {
+                        fprintf(stderr, "ERROR: Too many words\n");
+                        return -1;
+                }
+                words[num_words++] = word;
+        }
+
+        if(num_words == 0)
+        {
+                return 0;
+        }
+
+        if(strcmp(words[0], "pool") == 0)
+        {
+                if((num_words < 3) || (strlen(words[1]) >= UPSTREAM_NAME_SIZE))
+                {
+                        fprintf(stderr, "ERROR: Expected pool <name> <policy> [health-path [interval]]\n");
+                        return -1;
+                }
+                if(findPool(pools, *num_pools, words[1]) != -1)
+                {
+                        fprintf(stderr, "ERROR: Pool %s defined twice\n", words[1]);
+                        return -1;
+                }
+                if(*num_pools == UPSTREAM_MAX_POOLS)
+                {
+                        fprintf(stderr, "ERROR: At most %d pools\n", UPSTREAM_MAX_POOLS);
+                        return -1;
+                }
+
+                UpstreamPool *pool = pools + *num_pools;
+                strcpy(pool->name, words[1]);
+
+                int policy;
+                for(policy = UPSTREAM_HASH; policy >= 0; --policy)
+                {
+                        if(strcmp(words[2], upstream_policy_names[policy]) == 0)
+                        {
+                                break;
+                        }
+                }
+                if(policy < 0)
+                {
+                        fprintf(stderr, "ERROR: Unknown policy '%s', use round-robin, least-conn or hash\n", words[2]);
+                        return -1;
+                }
+                pool->policy = policy;
+
+                pool->health_interval = UPSTREAM_HEALTH_INTERVAL;
+                if(num_words >= 4)
+                {
+                        if((words[3][0] != '/') || (strlen(words[3]) >= UPSTREAM_PATH_SIZE))
+                        {
+                                fprintf(stderr, "ERROR: Health check path must start with '/'\n");
+                                return -1;
+                        }
+                        strcpy(pool->health_path, words[3]);
+                }
+                if(num_words == 5)
+                {
+                        pool->health_interval = strtoul(words[4], NULL, 10);
+                        if(pool->health_interval == 0)
+                        {
+                                fprintf(stderr, "ERROR: Health check interval must be a number of seconds\n");
+                                return -1;
+                        }
+                }
+
+                ++*num_pools;
+                return 0;
+        }
+
+        if(strcmp(words[0], "server") == 0)
+        {
+                char *port_delim = (num_words == 3) ? strrchr(words[2], ':') : NULL;
+                if(port_delim == NULL)
+                {
+                        fprintf(stderr, "ERROR: Expected server <pool> <host>:<port>\n");
+                        return -1;
+                }
+                *port_delim = '\0';
+
+                int pool = findPool(pools, *num_pools, words[1]);
+                if(pool == -1)
+                {
+                        fprintf(stderr, "ERROR: Unknown pool %s\n", words[1]);
+                        return -1;
+                }
+                if((strlen(words[2]) == 0) || (strlen(words[2]) >= UPSTREAM_HOST_SIZE) || !isPortNumber(port_delim + 1))
+                {
+                        fprintf(stderr, "ERROR: Invalid server address\n");
+                        return -1;
+                }
+                if(pools[pool].num_servers == UPSTREAM_MAX_SERVERS)
+                {
+                        fprintf(stderr, "ERROR: At most %d servers per pool\n", UPSTREAM_MAX_SERVERS);
+                        return -1;
+                }
+
+                UpstreamServer *server = pools[pool].servers + pools[pool].num_servers++;
+                strcpy(server->host, words[2]);
+                strcpy(server->port, port_delim + 1);
+                server->healthy = 1;
+                return 0;
+        }
+
+        if(strcmp(words[0], "listen") == 0)
+        {
+                if((num_words != 3) || !isPortNumber(words[1]))
+                {
+                        fprintf(stderr, "ERROR: Expected listen <port> <pool>\n");
+                        return -1;
+                }
+
+                int pool = findPool(pools, *num_pools, words[2]);
+                if(pool == -1)
+                {
+                        fprintf(stderr, "ERROR: Unknown pool %s\n", words[2]);
+                        return -1;
+                }
+                if(num_upstream_listeners == UPSTREAM_MAX_LISTENERS)
+                {
+                        fprintf(stderr, "ERROR: At most %d listeners\n", UPSTREAM_MAX_LISTENERS);
+                        return -1;
+                }
+
+                UpstreamListener *listener = upstream_listeners + num_upstream_listeners++;
+                strcpy(listener->port, words[1]);
+                listener->pool = pool;
+                return 0;
+        }
+
+        fprintf(stderr, "ERROR: Unknown directive '%s'\n", words[0]);
+        return -1;
+}
+
+
+/* loadUpstreams
+ *
+ * Load the upstream configuration and create its pools in shared memory. Lines of the file:
+ *
+ *   pool <name> <round-robin|least-conn|hash> [health-path [interval]]
+ *   server <pool> <host>:<port>
+ *   listen <port> <pool>
+ *
+ * Everything after a '#' is a comment. All servers start out healthy.
+ *
+ * @param path Path of the configuration file
+ * @ret 0 on success
+ *      -1 if the file could not be read, is invalid or the shared memory could not be created
+ */
+int loadUpstreams(const char *path)
+{
+        assert(path != NULL);
+
+        int ret_val = -1;
+
+        FILE *file = fopen(path, "r");
+        if(file == NULL)
+        {
+                perror("ERROR: Could not open upstream configuration");
+                return -1;
+        }
+
+        UpstreamPool *pools = calloc(UPSTREAM_MAX_POOLS, sizeof(UpstreamPool));
+        if(pools == NULL)
+        {
+                goto error_alloc;
+        }
+
+        size_t num_pools = 0;
+        char line[UPSTREAM_LINE_SIZE];
+        for(unsigned int line_number = 1; fgets(line, sizeof(line), file) != NULL; ++line_number)
+        {
+                char *comment = strchr(line, '#');
+                if(comment != NULL)
+                {
+                        *comment = '\0';
+                }
+
+                if(parseUpstreamLine(line, pools, &num_pools) != 0)
+                {
+                        fprintf(stderr, "ERROR: Invalid upstream configuration, %s line %u\n", path, line_number);
+                        goto error_parse;
+                }
+        }
+
+        for(size_t i = 0; i < num_pools; ++i)
+        {
+                if(pools[i].num_servers == 0)
+                {
+                        fprintf(stderr, "ERROR: Pool %s has no servers\n", pools[i].name);
+                        goto error_parse;
+                }
+        }
+
+        max_session_pid = readPidMax();
+        session_upstream_servers = createSharedMemory(max_session_pid * sizeof(int32_t));
+        if(session_upstream_servers == NULL)
+        {
+                goto error_parse;
+        }
+
+        upstream_pools = createSharedMemory(num_pools * sizeof(UpstreamPool));
+        if(upstream_pools == NULL)
+        {
+                destroySharedMemory(session_upstream_servers, max_session_pid * sizeof(int32_t));
+                session_upstream_servers = NULL;
+                goto error_parse;
+        }
+
+        memcpy(upstream_pools, pools, num_pools * sizeof(UpstreamPool));
+        num_upstream_pools = num_pools;
+        for(size_t i = 0; i < num_pools; ++i)
+        {
+                publishHealthyServers(upstream_pools + i);
+        }
+
+        printf("Upstreams loaded: %zu pools, %zu listeners\n", num_upstream_pools, num_upstream_listeners);
+        ret_val = 0;
+
+error_parse:
+        free(pools);
+error_alloc:
+        fclose(file);
+        if(ret_val != 0)
+        {
+                num_upstream_listeners = 0;
+        }
+        return ret_val;
+}
+
+
+/* upstreamListenerCount
+ *
+ * @ret Number of listeners in the upstream configuration
+ */
+size_t upstreamListenerCount(void)
+{
+        return num_upstream_listeners;
+}
+
+
+/* upstreamListener
+ *
+ * @param index Index of the listener, below upstreamListenerCount
+ * @ret Listener of the upstream configuration
+ */
+const UpstreamListener * upstreamListener(size_t index)
+{
+        assert(index < num_upstream_listeners);
+
+        return upstream_listeners + index;
+}
+
+
+/* checkServerHealth
+ *
+ * Request the health check path from a server and check for a 2xx or 3xx status.
+ * Connecting and receiving time out after UPSTREAM_HEALTH_TIMEOUT_MS each.
+ *
+ * @param server Server to check
+ * @param path Path to request
+ * @ret True if the server answered with a good status
+ */
+static int checkServerHealth(const UpstreamServer *server, const char *path)
+{
+        struct addrinfo hints;
+        struct addrinfo *addresses;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        if(getaddrinfo(server->host, server->port, &hints, &addresses) != 0)
+        {
+                return 0;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = UPSTREAM_HEALTH_TIMEOUT_MS / 1000;
+        timeout.tv_usec = (UPSTREAM_HEALTH_TIMEOUT_MS % 1000) * 1000;
+
+        int fd = -1;
+        for(struct addrinfo *address = addresses; address != NULL; address = address->ai_next)
+        {
+                fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+                if(fd == -1)
+                {
+                        continue;
+                }
+
+                // The send timeout limits connect as well
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                if(connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+                {
+                        break;
+                }
+
+                close(fd);
+                fd = -1;
+        }
+        freeaddrinfo(addresses);
+
+        if(fd == -1)
+        {
+                return 0;
+        }
+
+        char buffer[UPSTREAM_LINE_SIZE];
+        int request_len = snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                                   path, server->host);
+        int healthy = 0;
+        if((request_len < (int)sizeof(buffer)) && (send(fd, buffer, request_len, MSG_NOSIGNAL) == request_len))
+        {
+                // The status line starts with "HTTP/1.x NNN"
+                size_t received = 0;
+                while(received < 12)
+                {
+                        ssize_t read_stat = recv(fd, buffer + received, sizeof(buffer) - 1 - received, 0);
+                        if(read_stat <= 0)
+                        {
+                                break;
+                        }
+                        received += read_stat;
+                }
+                buffer[received] = '\0';
+
+                unsigned int status;
+                if((received >= 12) && (sscanf(buffer, "HTTP/1.%*c %3u", &status) == 1))
+                {
+                        healthy = (status >= 200) && (status < 400);
+                }
+        }
+
+        close(fd);
+
+        return healthy;
+}
+
+
+/* checkPoolHealth
+ *
+ * Check all servers of a pool and publish the healthy servers again if one went up or down
+ *
+ * @param pool Pool to check
+ */
+static void checkPoolHealth(UpstreamPool *pool)
+{
+        int changed = 0;
+
+        for(uint32_t i = 0; i < pool->num_servers; ++i)
+        {
+                UpstreamServer *server = pool->servers + i;
+                int healthy = checkServerHealth(server, pool->health_path);
+                if(!healthy)
+                {
+                        addProxyCounter(STAT_UPSTREAM_CHECKS_FAILED, 1);
+                }
+
+                if(healthy == (int)server->healthy)
+                {
+                        server->health_streak = 0;
+                        continue;
+                }
+
+                if(++server->health_streak >= (healthy ? UPSTREAM_HEALTH_RISE : UPSTREAM_HEALTH_FALL))
+                {
+                        printf("Upstream %s:%s of pool %s is %s\n", server->host, server->port, pool->name,
+                               healthy ? "up" : "down");
+                        fflush(stdout);
+                        __atomic_store_n(&(server->healthy), healthy, __ATOMIC_RELAXED);
+                        server->health_streak = 0;
+                        addProxyCounter(healthy ? STAT_UPSTREAM_UP : STAT_UPSTREAM_DOWN, 1);
+                        changed = 1;
+                }
+        }
+
+        if(changed)
+        {
+                publishHealthyServers(pool);
+        }
+}
+
+
+/* healthCheckThread
+ *
+ * Check the servers of every pool with a health check path at the interval of the pool
+ *
+ * @param arg Unused
+ */
+static void* healthCheckThread(void *arg)
+{
+        (void)arg;
+
+        uint64_t next_check_ns[UPSTREAM_MAX_POOLS] = {0};
+
+        while(1)
+        {
+                for(size_t i = 0; i < num_upstream_pools; ++i)
+                {
+                        UpstreamPool *pool = upstream_pools + i;
+                        uint64_t now_ns = monotonicNs();
+                        if((pool->health_path[0] == '\0') || (now_ns < next_check_ns[i]))
+                        {
+                                continue;
+                        }
+
+                        checkPoolHealth(pool);
+                        next_check_ns[i] = now_ns + pool->health_interval * 1000000000ull;
+                }
+
+                struct timespec wait_time = {1, 0};
+                nanosleep(&wait_time, NULL);
+        }
+
+        return NULL;
+}
+
+
+/* startHealthChecks
+ *
+ * Start the thread checking the health of the upstream servers. Does nothing if no pool has
+ * a health check path.
+ *
+ * @ret 0 on success
+ *      -1 if the thread could not be started
+ */
+int startHealthChecks(void)
+{
+        int checked = 0;
+        for(size_t i = 0; i < num_upstream_pools; ++i)
+        {
+                checked |= (upstream_pools[i].health_path[0] != '\0');
+        }
+
+        if(!checked)
+        {
+                return 0;
+        }
+
+        pthread_t thread_id;
+        if(pthread_create(&thread_id, NULL, healthCheckThread, NULL) != 0)
+        {
+                return -1;
+        }
+
+        pthread_detach(thread_id);
+
+        return 0;
+}
+
+
+/* setSessionUpstream
+ *
+ * Remember the upstream connection of the running session for the SIGCHLD handler
+ *
+ * @param value Pool * UPSTREAM_MAX_SERVERS + server + 1, 0 for none
+ */
+static void setSessionUpstream(int32_t value)
+{
+        pid_t pid = getpid();
+        if((size_t)pid < max_session_pid)
+        {
+                __atomic_store_n(session_upstream_servers + pid, value, __ATOMIC_RELEASE);
+        }
+}
+
+
+/* pickUpstreamServer
+ *
+ * Pick a healthy server of a pool for a request and count the connection to it. The decision
+ * takes constant time for every policy.
+ *
+ * @param pool_index Index of the pool
+ * @param resource Requested resource, the key of the hash policy
+ * @ret host Host name of the server, valid for the lifetime of the process
+ * @ret port Port of the server, valid for the lifetime of the process
+ * @ret Index of the server, to be passed to releaseUpstreamServer
+ *      -1 if the pool has no healthy server
+ */
+int pickUpstreamServer(int pool_index, const char *resource, const char **host, const char **port)
+{
+        assert((pool_index >= 0) && ((size_t)pool_index < num_upstream_pools));
+        assert(resource != NULL);
+        assert(host != NULL);
+        assert(port != NULL);
+
+        UpstreamPool *pool = upstream_pools + pool_index;
+        uint64_t key = 0;
+        if(pool->policy == UPSTREAM_HASH)
+        {
+                key = hashString(resource, 14695981039346656037ull) % UPSTREAM_MAGLEV_SIZE;
+        }
+        else if(pool->policy == UPSTREAM_LEAST_CONN)
+        {
+                key = nextRandom();
+        }
+
+        int server;
+        uint32_t sequence;
+        do
+        {
+                sequence = __atomic_load_n(&(pool->sequence), __ATOMIC_ACQUIRE);
+                uint32_t num_healthy = __atomic_load_n(&(pool->num_healthy), __ATOMIC_RELAXED);
+                server = -1;
+
+                if(num_healthy == 0)
+                {
+                        // No server, answered right away
+                }
+                else if(pool->policy == UPSTREAM_ROUND_ROBIN)
+                {
+                        uint64_t turn = __atomic_fetch_add(&(pool->next_server), 1, __ATOMIC_RELAXED);
+                        server = __atomic_load_n(pool->healthy_servers + turn % num_healthy, __ATOMIC_RELAXED);
+                }
+                else if(pool->policy == UPSTREAM_LEAST_CONN)
+                {
+                        // Power of two choices: the less loaded of two random servers
+                        int first = __atomic_load_n(pool->healthy_servers + (key & 0xffffffffu) % num_healthy,
+                                                    __ATOMIC_RELAXED);
+                        int second = __atomic_load_n(pool->healthy_servers + (key >> 32) % num_healthy,
+                                                     __ATOMIC_RELAXED);
+                        server = (__atomic_load_n(&(pool->servers[first].connections), __ATOMIC_RELAXED) <=
+                                  __atomic_load_n(&(pool->servers[second].connections), __ATOMIC_RELAXED)) ?
+                                 first : second;
+                }
+                else
+                {
+                        server = __atomic_load_n(pool->maglev + key, __ATOMIC_RELAXED);
+                }
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while((sequence & 1) || (__atomic_load_n(&(pool->sequence), __ATOMIC_RELAXED) != sequence));
+
+        if(server == -1)
+        {
+                addProxyCounter(STAT_UPSTREAM_UNAVAILABLE, 1);
+                return -1;
+        }
+
+        __atomic_fetch_add(&(pool->servers[server].connections), 1, __ATOMIC_RELAXED);
+        setSessionUpstream(pool_index * UPSTREAM_MAX_SERVERS + server + 1);
+        *host = pool->servers[server].host;
+        *port = pool->servers[server].port;
+
+        return server;
+}
+
+
+/* releaseUpstreamServer
+ *
+ * Stop counting a connection picked with pickUpstreamServer
+ *
+ * @param pool Index of the pool
+ * @param server Index of the server
+ */
+void releaseUpstreamServer(int pool, int server)
+{
+        assert((pool >= 0) && ((size_t)pool < num_upstream_pools));
+        assert((server >= 0) && ((uint32_t)server < upstream_pools[pool].num_servers));
+
+        setSessionUpstream(0);
+        __atomic_fetch_sub(&(upstream_pools[pool].servers[server].connections), 1, __ATOMIC_RELAXED);
+}
+
+
+/* upstreamSessionEnded
+ *
+ * Release the upstream connection a reaped session left behind because it was killed.
+ * Async-signal-safe, called by the SIGCHLD handler.
+ *
+ * @param pid Process id of the session
+ */
+void upstreamSessionEnded(pid_t pid)
+{
+        if((session_upstream_servers == NULL) || ((size_t)pid >= max_session_pid))
+        {
+                return;
+        }
+
+        int32_t value = __atomic_exchange_n(session_upstream_servers + pid, 0, __ATOMIC_ACQ_REL);
+        if(value == 0)
+        {
+                return;
+        }
+
+        UpstreamPool *pool = upstream_pools + (value - 1) / UPSTREAM_MAX_SERVERS;
+        __atomic_fetch_sub(&(pool->servers[(value - 1) % UPSTREAM_MAX_SERVERS].connections), 1, __ATOMIC_RELAXED);
+        addProxyCounter(STAT_UPSTREAM_RECLAIMED, 1);
+}
+
+
+/* printUpstreamStats
+ *
+ * Print the health and open connections of the servers of every pool
+ *
+ * @param out Stream to print to
+ */
+void printUpstreamStats(FILE *out)
+{
+        assert(out != NULL);
+
+        for(size_t i = 0; i < num_upstream_pools; ++i)
+        {
+                const UpstreamPool *pool = upstream_pools + i;
+                fprintf(out, "Upstream pool %s (%s): %u of %u servers healthy\n", pool->name,
+                        upstream_policy_names[pool->policy], __atomic_load_n(&(pool->num_healthy), __ATOMIC_RELAXED),
+                        pool->num_servers);
+
+                for(uint32_t j = 0; j < pool->num_servers; ++j)
+                {
+                        const UpstreamServer *server = pool->servers + j;
+                        fprintf(out, "  %s:%s %s, %u connections\n", server->host, server->port,
+                                __atomic_load_n(&(server->healthy), __ATOMIC_RELAXED) ? "up" : "down",
+                                __atomic_load_n(&(server->connections), __ATOMIC_RELAXED));
+                }
+        }
+}
@@ -0,0 +1,130 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Limits of the upstream configuration
+#define UPSTREAM_MAX_POOLS 16
+#define UPSTREAM_MAX_SERVERS 32
+#define UPSTREAM_MAX_LISTENERS 16
+#define UPSTREAM_NAME_SIZE 32
+#define UPSTREAM_HOST_SIZE 256
+#define UPSTREAM_PORT_SIZE 8
+#define UPSTREAM_PATH_SIZE 128
+
+// Entries of the consistent hash table of a pool (prime, much larger than UPSTREAM_MAX_SERVERS)
+#define UPSTREAM_MAGLEV_SIZE 65537
+
+// Marks an empty entry of the consistent hash table while it is built
+#define UPSTREAM_MAGLEV_EMPTY 0xff
+
+// Seconds between health checks of a pool if the configuration does not set an interval
+#define UPSTREAM_HEALTH_INTERVAL 5
+
+// Milliseconds a health check may take to connect and to get the response
+#define UPSTREAM_HEALTH_TIMEOUT_MS 1000
+
+// Checks in a row it takes to mark a server up or down
+#define UPSTREAM_HEALTH_RISE 2
+#define UPSTREAM_HEALTH_FALL 2
+
+
+/* UpstreamPolicy
+ *
+ * How a pool balances requests over its healthy servers, every policy decides in O(1)
+ *
+ * UPSTREAM_ROUND_ROBIN -> The next server in turn
+ * UPSTREAM_LEAST_CONN  -> The server with fewer open connections of two picked at random
+ * UPSTREAM_HASH        -> The server the URL maps to in a Maglev consistent hash table, so a URL
+ *                         stays on its server while the healthy servers change
+ */
+typedef enum _upstream_policy_
+{
+  UPSTREAM_ROUND_ROBIN,
+  UPSTREAM_LEAST_CONN,
+  UPSTREAM_HASH
+} UpstreamPolicy;
+
+
+/* UpstreamServer struct
+ *
+ * Backend server of a pool
+ *
+ * host          -> Host name or address of the server
+ * port          -> Port of the server
+ * connections   -> Sessions connected to the server, changed atomically by the sessions
+ * healthy       -> True if the server passes its health checks
+ * health_streak -> Checks in a row whose result differs from healthy
+ */
+typedef struct _upstream_server_
+{
+  char host[UPSTREAM_HOST_SIZE];
+  char port[UPSTREAM_PORT_SIZE];
+  uint32_t connections;
+  uint32_t healthy;
+  uint32_t health_streak;
+} UpstreamServer;
+
+
+/* UpstreamPool struct
+ *
+ * Named group of servers in shared memory. The health check thread of the proxy process
+ * rewrites the healthy list and the hash table under the sequence counter, sessions retry
+ * their lookup if the counter was odd or changed while they read.
+ *
+ * name            -> Name of the pool
+ * policy          -> UpstreamPolicy of the pool
+ * health_path     -> Path requested by health checks, empty to not check the servers
+ * health_interval -> Seconds between health checks
+ * num_servers     -> Number of servers
+ * servers         -> Servers of the pool
+ * sequence        -> Odd while the healthy list and the hash table are rewritten
+ * num_healthy     -> Number of healthy servers
+ * healthy_servers -> Indexes of the healthy servers
+ * next_server     -> Requests balanced round-robin so far
+ * maglev          -> Index of the server every hash table entry maps to
+ */
+typedef struct _upstream_pool_
+{
+  char name[UPSTREAM_NAME_SIZE];
+  UpstreamPolicy policy;
+  char health_path[UPSTREAM_PATH_SIZE];
+  unsigned int health_interval;
+  uint32_t num_servers;
+  UpstreamServer servers[UPSTREAM_MAX_SERVERS];
+  uint32_t sequence;
+  uint32_t num_healthy;
+  uint8_t healthy_servers[UPSTREAM_MAX_SERVERS];
+  uint64_t next_server;
+  uint8_t maglev[UPSTREAM_MAGLEV_SIZE];
+} UpstreamPool;
+
+
+/* UpstreamListener struct
+ *
+ * Local port whose connections are sent to a pool
+ *
+ * port -> Port to listen on
+ * pool -> Index of the pool
+ */
+typedef struct _upstream_listener_
+{
+  char port[UPSTREAM_PORT_SIZE];
+  int pool;
+} UpstreamListener;
+
+
+int loadUpstreams(const char *path);
+size_t upstreamListenerCount(void);
+const UpstreamListener * upstreamListener(size_t index);
+int startHealthChecks(void);
+
+int pickUpstreamServer(int pool_index, const char *resource, const char **host, const char **port);
+void releaseUpstreamServer(int pool, int server);
+void upstreamSessionEnded(pid_t pid);
+
+void printUpstreamStats(FILE *out);
+
+#endif
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
 #include "util.h"
@@ -194,6 +195,7 @@ error_alloc:
 /* getValue
  *
  * Retrieve the value string associated with the given key from the key-value array
+ * Keys are compared case insensitive, like HTTP header field names
  *
  * @param array The array to search in
  * @param key Key to search for
@@ -206,7 +208,7 @@ const char * getValue(const KeyValueArray *array, const char *key)
 
         for(size_t i = 0; i < array->size; ++i)
         {
-                if(strcmp(array->data[i].key, key) == 0)
+                if(strcasecmp(array->data[i].key, key) == 0)
                 {
                         // Key-value pair found
 
@@ -236,7 +238,7 @@ int setValue(KeyValueArray *array, const char *key, const char *new_value, size_
 
         for(size_t i = 0; i < array->size; ++i)
         {
-                if(strcmp(array->data[i].key, key) == 0)
+                if(strcasecmp(array->data[i].key, key) == 0)
                 {
                         // Key-value pair found
                         
@@ -259,3 +261,48 @@ int setValue(KeyValueArray *array, const char *key, const char *new_value, size_
 
         return -1;
 }
+
+
+/* removeField
+ *
+ * Remove all key-value pairs with the given key from the array
+ *
+ * @param array Key-Value array that should be modified
+ * @param key Key to search for
+ * @ret Number of removed key-value pairs
+ */
+int removeField(KeyValueArray *array, const char *key)
+{
+        assert(array != NULL);
+        assert(key != NULL);
+
+        int removed = 0;
+        size_t i = 0;
+
+        while(i < array->size)
+        {
+                if(strcasecmp(array->data[i].key, key) == 0)
+                {
+                        // Key-value pair found, move following pairs forward
+                        free(array->data[i].key);
+                        free(array->data[i].value);
+
+                        memmove(array->data + i, array->data + i + 1,
+                                (array->size - i - 1) * sizeof(KeyValue));
+                        array->size -= 1;
+                        ++removed;
+                }
+                else
+                {
+                        ++i;
+                }
+        }
+
+        if(array->size == 0 && array->data != NULL)
+        {
+                free(array->data);
+                array->data = NULL;
+        }
+
+        return removed;
+}
@@ -45,6 +45,7 @@ void freeKeyValueArray(KeyValueArray *array);
 int addField(KeyValueArray *array, const char *key, size_t keylen, const char *value, size_t valuelen);
 const char * getValue(const KeyValueArray *array, const char *key);
 int setValue(KeyValueArray *array, const char *key, const char *new_value, size_t new_value_len);
+int removeField(KeyValueArray *array, const char *key);
 
 
 int setString(char **destination, const char *source);
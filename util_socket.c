@@ -33,12 +33,6 @@ void initSocket(Socket *socket)
         assert(socket != NULL);
         socket->fd_ = -1;
         socket->open_ = 0;
-
-        if(pthread_mutex_init(&(socket->mutex_), NULL) != 0)
-        {
-                fprintf(stderr, "Socket mutex init failed\n");
-                exit(-1);
-        }
 }
 
 
@@ -54,8 +48,6 @@ void destroySocket(Socket *socket)
 
         closeSocket(socket);
         socket->fd_ = -1;
-
-        pthread_mutex_destroy(&(socket->mutex_));
 }
 
 /* closeSocket
@@ -76,6 +68,29 @@ void closeSocket(Socket *socket)
 }
 
 
+/* abortSocket
+ *
+ * Close a socket with a TCP reset instead of the regular shutdown handshake,
+ * so the peer can tell the transfer was aborted
+ *
+ * @param socket The socket to abort
+ */
+void abortSocket(Socket *socket)
+{
+        assert(socket != NULL);
+
+        if(socket->open_)
+        {
+                struct linger linger_opt;
+                linger_opt.l_onoff = 1;
+                linger_opt.l_linger = 0;
+                setsockopt(socket->fd_, SOL_SOCKET, SO_LINGER, &linger_opt, sizeof(linger_opt));
+
+                closeSocket(socket);
+        }
+}
+
+
 /* sendData
  *
  * Send all provided data to the socket
@@ -101,7 +116,6 @@ ssize_t sendData(Socket *socket, const char *buffer, size_t len)
         int left = len;
         int n;
 
-        pthread_mutex_lock(&(socket->mutex_));
         while(total < len)
         {
                 errno = 0;
@@ -121,8 +135,6 @@ ssize_t sendData(Socket *socket, const char *buffer, size_t len)
                 total += n;
                 left -= n;
         }
-        pthread_mutex_unlock(&(socket->mutex_));
-
 
         retval = total;
 error_send:
@@ -147,20 +159,16 @@ ssize_t readData(Socket *socket, char *read_buffer, size_t buffer_size)
                 return -1;
         }
 
-        pthread_mutex_lock(&(socket->mutex_));
         errno = 0;
-        ssize_t read_len = recv(socket->fd_, read_buffer , buffer_size, MSG_DONTWAIT);
-        int errno_saved = errno;
+        ssize_t read_len = recv(socket->fd_, read_buffer , buffer_size, 0);
         if(read_len == 0)
         {
                 // Connection closed -> end of data
                 closeSocket(socket);
         }
-        pthread_mutex_unlock(&(socket->mutex_));
-
-        if(read_len == -1)
+        else if(read_len == -1)
         {
-                if((errno_saved == EAGAIN) || (errno_saved == EWOULDBLOCK))
+                if((errno == EAGAIN) || (errno == EWOULDBLOCK))
                 {
                         read_len = 0;
                 }
@@ -179,6 +187,7 @@ ssize_t readData(Socket *socket, char *read_buffer, size_t buffer_size)
  *
  * Open a local TCP socket for listening
  *
+ * @param address Local address to listen on, NULL for all addresses
  * @param port Local port that should be opened for listening
  * @ret socket_ret Pointer to socket file descriptor that will hold the opened port
  * @ret 0 if the socket could be opened without errors, -1 otherwise
@@ -186,7 +195,7 @@ ssize_t readData(Socket *socket, char *read_buffer, size_t buffer_size)
  * to hold the newly opened socket
  *
  */
-int openListeningSocket(const char *port, Socket *socket_ret)
+int openListeningSocket(const char *address, const char *port, Socket *socket_ret)
 {
         assert(port != NULL);
 
@@ -204,7 +213,7 @@ int openListeningSocket(const char *port, Socket *socket_ret)
         hints.ai_socktype = SOCK_STREAM;
         hints.ai_flags = AI_PASSIVE; // use my IP
 
-        getaddrinfo_status = getaddrinfo(NULL, port, &hints, &servinfo);
+        getaddrinfo_status = getaddrinfo(address, port, &hints, &servinfo);
         if(getaddrinfo_status != 0)
         {
                 fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(getaddrinfo_status));
@@ -264,18 +273,50 @@ err_getaddrinfo:
 }
 
 
+/* sendResponseAndClose
+ *
+ * Send a short response on a freshly accepted connection without waiting and close it.
+ * The request is read and discarded first, closing with unread data would reset the
+ * connection before the client sees the response.
+ *
+ * @param socket Connection to answer
+ * @param response Complete response
+ * @param len Length of the response
+ */
+void sendResponseAndClose(Socket *socket, const char *response, size_t len)
+{
+        assert(socket != NULL);
+
+        send(socket->fd_, response, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        shutdown(socket->fd_, SHUT_WR);
+
+        char discard[4096];
+        for(int i = 0; i < 16; ++i)
+        {
+                if(recv(socket->fd_, discard, sizeof(discard), MSG_DONTWAIT) <= 0)
+                {
+                        break;
+                }
+        }
+
+        destroySocket(socket);
+}
+
+
 /* acceptConnection
  *
  * Accept an incoming connection on a listening socket
  *
  * @param listen_sockfd Listening socket with incoming connection
  * @ret client_sockfd Socket file dexcriptor that will hold the socket for the accepted connection
+ * @ret client_addr Address of the client, may be NULL
  * @ret 0 if no errors were encountered while accepting the conection, -1 otherwise
  * If no errors were encountered, the socket file descriptor pointed to by client_sockfd
  * will be set to the socket for the accepted incoming connection
  *
  */
-int acceptConnection(const Socket *listen_socket, Socket *client_socket)
+int acceptConnection(const Socket *listen_socket, Socket *client_socket,
+                     struct sockaddr_storage *client_addr)
 {
         assert(listen_socket != NULL);
         assert(client_socket != NULL);
@@ -287,49 +328,45 @@ int acceptConnection(const Socket *listen_socket, Socket *client_socket)
 
         sin_size = sizeof(their_addr);
 
-        //pthread_mutex_lock(&(listen_socket->mutex_));
         temp_socket.fd_ = accept(listen_socket->fd_, (struct sockaddr *)&their_addr, &sin_size);
-        //pthread_mutex_unlock(&(listen_socket->mutex_));
         if (temp_socket.fd_ == -1)
         {
-                perror("accept");
+                // Non-blocking listening sockets another process accepted from are not an error
+                if((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                {
+                        perror("accept");
+                }
                 return -1;
         }
 
         temp_socket.open_ = 1;
         *client_socket = temp_socket;
 
-
-        // Print status on incoming connection
-        char s[INET6_ADDRSTRLEN];
-
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), s, sizeof(s));
-        printf("Received connection from %s\n", s);
+        if(client_addr != NULL)
+        {
+                *client_addr = their_addr;
+        }
 
         return 0;
 }
 
 
-/* initServerConnection
+/* resolveServerAddress
  *
- * Initiate a TCP connection to the server with the given hostname and port
+ * Look up the addresses of a server
  *
  * @param hostname Host name of the server
  * @param port Target port
- * @ret File descriptor of the socket on success, -1 on failure
+ * @ret addresses List of addresses to be freed with freeaddrinfo
+ * @ret 0 on success, -1 if the lookup failed
  */
-int initServerConnection(const char *hostname, const char *port, Socket *ret_socket)
+int resolveServerAddress(const char *hostname, const char *port, struct addrinfo **addresses)
 {
         assert(hostname != NULL);
         assert(port != NULL);
+        assert(addresses != NULL);
 
-        Socket server_socket;
-        initSocket(&server_socket);
-
-        int getaddr_status;
         struct addrinfo conntype;
-        struct addrinfo *result_list;
-        struct addrinfo *addrnode;
 
         // Fill conntype struct with information about the type of connection we want
         memset(&conntype, 0, sizeof(struct addrinfo));
@@ -338,15 +375,35 @@ int initServerConnection(const char *hostname, const char *port, Socket *ret_soc
         conntype.ai_flags = 0;
         conntype.ai_protocol = 0; // Don't care about the protocol
 
-        getaddr_status = getaddrinfo(hostname, port, &conntype, &result_list);
-        if(getaddr_status != 0)
+        if(getaddrinfo(hostname, port, &conntype, addresses) != 0)
         {
                 // Lookup failed
                 return -1;
         }
 
+        return 0;
+}
+
+
+/* connectServerAddress
+ *
+ * Initiate a TCP connection to the first reachable address of a server
+ *
+ * @param addresses Addresses of the server as returned by resolveServerAddress
+ * @ret ret_socket Socket of the established connection
+ * @ret 0 on success, -1 if no address could be connected to
+ */
+int connectServerAddress(const struct addrinfo *addresses, Socket *ret_socket)
+{
+        assert(ret_socket != NULL);
+
+        Socket server_socket;
+        initSocket(&server_socket);
+
+        const struct addrinfo *addrnode;
+
         // Try connecting to addresses provided by getaddrinfo
-        for(addrnode = result_list; addrnode != NULL; addrnode = addrnode->ai_next)
+        for(addrnode = addresses; addrnode != NULL; addrnode = addrnode->ai_next)
         {
                 server_socket.fd_ = socket(addrnode->ai_family, addrnode->ai_socktype, 
                                            addrnode->ai_protocol);
@@ -369,10 +426,33 @@ int initServerConnection(const char *hostname, const char *port, Socket *ret_soc
                 return -1;
         }
 
-        // Address information is no longer needed, connection already established
-        freeaddrinfo(result_list);
-
         server_socket.open_ = 1;
         *ret_socket = server_socket;
         return 0;
 }
+
+
+/* initServerConnection
+ *
+ * Initiate a TCP connection to the server with the given hostname and port
+ *
+ * @param hostname Host name of the server
+ * @param port Target port
+ * @ret File descriptor of the socket on success, -1 on failure
+ */
+int initServerConnection(const char *hostname, const char *port, Socket *ret_socket)
+{
+        struct addrinfo *addresses;
+
+        if(resolveServerAddress(hostname, port, &addresses) != 0)
+        {
+                return -1;
+        }
+
+        int con_stat = connectServerAddress(addresses, ret_socket);
+
+        // Address information is no longer needed, connection already established or failed
+        freeaddrinfo(addresses);
+
+        return con_stat;
+}
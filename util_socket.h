@@ -2,24 +2,27 @@
 #define UTIL_SOCKET_H
 
 #include <netinet/in.h>
-#include <pthread.h>
+#include <netdb.h>
 
-#define CONNECTION_BACKLOG 10
+#define CONNECTION_BACKLOG 1024
 
 /* Socket wrapper struct
  *
- * Adds indication of socket status
+ * Adds indication of socket status. A socket is owned by the one thread that runs its session
+ * and is only read, written and closed there, so it needs no lock. Other threads and signal
+ * handlers end its use with shutdown(2) on the descriptor, which makes the owner's blocked
+ * calls return and lets the owner close it.
  */
 typedef struct _socket_
 {
         int fd_;
         int open_;
-        pthread_mutex_t mutex_;
 } Socket;
 
 void initSocket(Socket *socket);
 void destroySocket(Socket *socket);
 void closeSocket(Socket *socket);
+void abortSocket(Socket *socket);
 
 ssize_t readData(Socket *socket, char *target_buffer, size_t buffer_size);
 
@@ -27,10 +30,15 @@ ssize_t sendData(Socket *socket, const char *buffer, size_t len);
 
 void *get_in_addr(struct sockaddr *sa);
 
-int openListeningSocket(const char *port, Socket *socket_ret);
+int openListeningSocket(const char *address, const char *port, Socket *socket_ret);
 
-int acceptConnection(const Socket *listen_sockfd, Socket *client_sockfd);
+void sendResponseAndClose(Socket *socket, const char *response, size_t len);
 
+int acceptConnection(const Socket *listen_sockfd, Socket *client_sockfd,
+                     struct sockaddr_storage *client_addr);
+
+int resolveServerAddress(const char *hostname, const char *port, struct addrinfo **addresses);
+int connectServerAddress(const struct addrinfo *addresses, Socket *ret_socket);
 int initServerConnection(const char *hostname, const char *port, Socket *ret_socket);
 
 #endif
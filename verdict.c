@@ -0,0 +1,230 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "verdict.h"
+#include "shm.h"
+#include "stats.h"
+
+
+/* Verdict cache of the proxy, created in the proxy process before sessions are forked.
+ * Disabled while entries is NULL.
+ */
+static VerdictCache verdict_cache = {NULL, 0};
+
+
+/* hashBytes
+ *
+ * Continue a 64 bit FNV-1a hash over a string including its terminating null byte, so
+ * consecutive strings can not run into each other
+ */
+static uint64_t hashBytes(uint64_t hash, const char *str)
+{
+        const uint8_t *bytes = (const uint8_t *)str;
+
+        do
+        {
+                hash = (hash ^ *bytes) * 1099511628211ull;
+        } while(*bytes++ != '\0');
+
+        return hash;
+}
+
+
+/* initVerdictCache
+ *
+ * Create the verdict cache in shared memory
+ *
+ * @param num_entries Number of entries, rounded up to whole buckets of a power of two.
+ *                    0 disables the cache.
+ * @ret 0 on success
+ *      -1 if the shared memory could not be created
+ */
+int initVerdictCache(size_t num_entries)
+{
+        if(num_entries == 0)
+        {
+                return 0;
+        }
+
+        size_t num_buckets = 1;
+        while(num_buckets * VERDICT_CACHE_WAYS < num_entries)
+        {
+                num_buckets *= 2;
+        }
+
+        size_t entries_size = num_buckets * VERDICT_CACHE_WAYS * sizeof(uint64_t);
+        uint64_t *entries = createSharedMemory(entries_size);
+        if(entries == NULL)
+        {
+                return -1;
+        }
+
+        verdict_cache.entries = entries;
+        verdict_cache.bucket_mask = num_buckets - 1;
+
+        printf("Verdict cache: %zu entries, %zu bytes\n", num_buckets * VERDICT_CACHE_WAYS, entries_size);
+
+        return 0;
+}
+
+
+/* verdictKey
+ *
+ * Get the cache key of a response
+ *
+ * @param url URL of the request
+ * @param validator ETag or Last-Modified value of the response
+ * @param matcher_checksum Checksum of the filter matcher the verdict is made with
+ * @ret Cache key, never 0
+ */
+uint64_t verdictKey(const char *url, const char *validator, uint32_t matcher_checksum)
+{
+        assert(url != NULL);
+        assert(validator != NULL);
+
+        uint64_t hash = 14695981039346656037ull ^ matcher_checksum;
+        hash = hashBytes(hash, url);
+        hash = hashBytes(hash, validator);
+
+        return (hash != 0) ? hash : 1;
+}
+
+
+/* lookupCleanVerdict
+ *
+ * Check if a response is known to pass the content filter
+ *
+ * @param key Cache key of the response
+ * @ret True if the response is known to be clean
+ */
+int lookupCleanVerdict(uint64_t key)
+{
+        if(verdict_cache.entries == NULL)
+        {
+                return 0;
+        }
+
+        const uint64_t *bucket = verdict_cache.entries + (key & verdict_cache.bucket_mask) * VERDICT_CACHE_WAYS;
+        int hit = 0;
+
+        for(int way = 0; way < VERDICT_CACHE_WAYS; ++way)
+        {
+                if(__atomic_load_n(bucket + way, __ATOMIC_RELAXED) == key)
+                {
+                        hit = 1;
+                        break;
+                }
+        }
+
+        addProxyCounter(STAT_VERDICT_LOOKUPS, 1);
+        if(hit)
+        {
+                addProxyCounter(STAT_VERDICT_HITS, 1);
+        }
+
+        return hit;
+}
+
+
+/* storeCleanVerdict
+ *
+ * Remember that a response passed the content filter. An empty entry of the bucket is used if
+ * there is one, otherwise an entry picked by the key is replaced. Concurrent stores to the same
+ * bucket can overwrite each other, which only costs a later rescan.
+ *
+ * @param key Cache key of the response
+ */
+void storeCleanVerdict(uint64_t key)
+{
+        if(verdict_cache.entries == NULL)
+        {
+                return;
+        }
+
+        uint64_t *bucket = verdict_cache.entries + (key & verdict_cache.bucket_mask) * VERDICT_CACHE_WAYS;
+        int victim = (key >> 62) % VERDICT_CACHE_WAYS;
+
+        for(int way = 0; way < VERDICT_CACHE_WAYS; ++way)
+        {
+                uint64_t entry = __atomic_load_n(bucket + way, __ATOMIC_RELAXED);
+                if(entry == key)
+                {
+                        return;
+                }
+                if(entry == 0)
+                {
+                        victim = way;
+                        break;
+                }
+        }
+
+        __atomic_store_n(bucket + victim, key, __ATOMIC_RELAXED);
+        addProxyCounter(STAT_VERDICT_STORES, 1);
+}
+
+
+/* recordFilteredBody
+ *
+ * Account for a response body that went through the content filter
+ *
+ * @param bytes Size of the body as received from the server
+ * @param cpu_ns CPU time spent decoding and scanning it
+ */
+void recordFilteredBody(size_t bytes, uint64_t cpu_ns)
+{
+        if(verdict_cache.entries == NULL)
+        {
+                return;
+        }
+
+        addProxyCounter(STAT_FILTERED_BYTES, bytes);
+        addProxyCounter(STAT_FILTER_CPU_NS, cpu_ns);
+}
+
+
+/* recordBypassedBody
+ *
+ * Account for response bytes that were streamed through because of a cached verdict
+ *
+ * @param bytes Number of bytes
+ */
+void recordBypassedBody(size_t bytes)
+{
+        if(verdict_cache.entries == NULL)
+        {
+                return;
+        }
+
+        addProxyCounter(STAT_BYPASSED_BYTES, bytes);
+}
+
+
+/* printVerdictCacheStats
+ *
+ * Print the counters of the verdict cache. The CPU time saved is estimated from the
+ * average filter cost per byte.
+ *
+ * @param out Stream to print to
+ */
+void printVerdictCacheStats(FILE *out)
+{
+        if(verdict_cache.entries == NULL)
+        {
+                return;
+        }
+
+        uint64_t lookups = readProxyCounter(STAT_VERDICT_LOOKUPS);
+        uint64_t hits = readProxyCounter(STAT_VERDICT_HITS);
+        uint64_t bypassed_bytes = readProxyCounter(STAT_BYPASSED_BYTES);
+        uint64_t filtered_bytes = readProxyCounter(STAT_FILTERED_BYTES);
+        uint64_t filter_cpu_ns = readProxyCounter(STAT_FILTER_CPU_NS);
+
+        double hit_rate = (lookups != 0) ? 100.0 * hits / lookups : 0;
+        double ns_per_byte = (filtered_bytes != 0) ? (double)filter_cpu_ns / filtered_bytes : 0;
+
+        fprintf(out, "Verdict cache: %lu lookups, %lu hits (%.1f%%), %lu stores\n",
+                lookups, hits, hit_rate, readProxyCounter(STAT_VERDICT_STORES));
+        fprintf(out, "Verdict cache: %lu bytes filtered in %.2f ms CPU, %lu bytes bypassed, ~%.2f ms CPU saved\n",
+                filtered_bytes, filter_cpu_ns / 1e6, bypassed_bytes, bypassed_bytes * ns_per_byte / 1e6);
+}
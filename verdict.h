@@ -0,0 +1,40 @@
+#ifndef VERDICT_H
+#define VERDICT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Entries per bucket of the verdict cache
+#define VERDICT_CACHE_WAYS 4
+
+
+/* VerdictCache struct
+ *
+ * Set of responses known to pass the content filter, shared by all sessions. An entry is the
+ * 64 bit hash of the URL, the validator of the response and the checksum of the filter matcher,
+ * so changed content or a reloaded filter never hit an old verdict. Buckets hold
+ * VERDICT_CACHE_WAYS entries that are read and written atomically, a full bucket replaces
+ * one of its entries.
+ *
+ * entries     -> Entries in shared memory, 0 marks an empty entry
+ * bucket_mask -> Number of buckets - 1 (power of two)
+ */
+typedef struct _verdict_cache_
+{
+  uint64_t *entries;
+  size_t bucket_mask;
+} VerdictCache;
+
+
+int initVerdictCache(size_t num_entries);
+
+uint64_t verdictKey(const char *url, const char *validator, uint32_t matcher_checksum);
+int lookupCleanVerdict(uint64_t key);
+void storeCleanVerdict(uint64_t key);
+
+void recordFilteredBody(size_t bytes, uint64_t cpu_ns);
+void recordBypassedBody(size_t bytes);
+void printVerdictCacheStats(FILE *out);
+
+#endif